@@ -19,4 +19,19 @@ echo "Building code"
 gcc -Wall -o cprt_test $OPTS cprt.c cprt_test.c
 if [ $? -ne 0 ]; then exit 1; fi
 
+gcc -Wall -o cprt_netbench $OPTS cprt.c cprt_netbench.c
+if [ $? -ne 0 ]; then exit 1; fi
+
+gcc -Wall -O2 -o cprt_bench $OPTS cprt.c cprt_bench.c
+if [ $? -ne 0 ]; then exit 1; fi
+
+gcc -Wall -O2 -o cprt_c2clat $OPTS cprt.c cprt_c2clat.c
+if [ $? -ne 0 ]; then exit 1; fi
+
+gcc -Wall -O2 -o cprt_clkchk $OPTS cprt.c cprt_clkchk.c
+if [ $? -ne 0 ]; then exit 1; fi
+
+gcc -Wall -O2 -o cprt_jitter $OPTS cprt.c cprt_jitter.c
+if [ $? -ne 0 ]; then exit 1; fi
+
 echo "Success"
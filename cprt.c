@@ -25,6 +25,35 @@
 #include <time.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <fcntl.h>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#include <io.h>
+#include <psapi.h>
+#include <sys/stat.h>
+#pragma comment(lib, "psapi.lib")
+#else  /* Unix */
+#include <alloca.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#endif
+#if ! defined(_WIN32)
+#include <poll.h>
+#endif
 
 #if defined(_WIN32)
 LARGE_INTEGER cprt_frequency;
@@ -105,6 +134,120 @@ void cprt_sleep_ns(uint64_t duration_ns)
 }  /* cprt_sleep_ns */
 
 
+/* Set up a wait strategy (CPRT_WAIT_...) with default limits. */
+void cprt_wait_init(struct cprt_wait *wait, int strategy)
+{
+  wait->strategy = strategy;
+  wait->spin_limit = 1000;
+  wait->max_backoff = 1024;
+  wait->count = 0;
+}  /* cprt_wait_init */
+
+
+/* Set up a wait strategy from a name ("spin", "pause", "yield", "backoff"
+ * or "park"), e.g. from a command-line option or config file.
+ * Return 0 on success, -1 on error (sets errno to EINVAL). */
+int cprt_wait_parse(struct cprt_wait *wait, const char *str)
+{
+  static const char *names[] = {"spin", "pause", "yield", "backoff", "park"};
+  int i;
+
+  for (i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+    if (strcmp(str, names[i]) == 0) {
+      cprt_wait_init(wait, i);
+      return 0;
+    }
+  }
+  errno = EINVAL;
+  return -1;
+}  /* cprt_wait_parse */
+
+
+/* Call when the waited-for condition makes progress, so that the next wait
+ * starts with the cheapest (lowest latency) idle again. */
+void cprt_wait_reset(struct cprt_wait *wait)
+{
+  wait->count = 0;
+}  /* cprt_wait_reset */
+
+
+/* Pass one idle iteration of a polling loop according to the strategy. */
+void cprt_wait_idle(struct cprt_wait *wait)
+{
+  uint32_t pauses;
+
+  switch (wait->strategy) {
+    case CPRT_WAIT_SPIN:
+      break;
+
+    case CPRT_WAIT_PAUSE:
+      CPRT_CPU_PAUSE();
+      break;
+
+    case CPRT_WAIT_YIELD:
+      if (wait->count < wait->spin_limit) {
+        CPRT_CPU_PAUSE();
+      } else {
+        CPRT_THREAD_YIELD();
+      }
+      break;
+
+    case CPRT_WAIT_BACKOFF:
+      if (wait->count < 31 && (UINT32_C(1) << wait->count) < wait->max_backoff) {
+        for (pauses = UINT32_C(1) << wait->count; pauses > 0; pauses--) {
+          CPRT_CPU_PAUSE();
+        }
+      } else {
+        /* Backed off all the way; let others run. */
+        for (pauses = wait->max_backoff; pauses > 0; pauses--) {
+          CPRT_CPU_PAUSE();
+        }
+        CPRT_THREAD_YIELD();
+      }
+      break;
+
+    default:  /* CPRT_WAIT_PARK */
+      if (wait->count < wait->spin_limit) {
+        CPRT_CPU_PAUSE();
+      } else {
+#if defined(_WIN32)
+        Sleep(1);
+#else
+        struct timespec park_ts;
+        park_ts.tv_sec = 0;
+        park_ts.tv_nsec = 50000;  /* Kernel timer slack adds ~50 us more. */
+        nanosleep(&park_ts, NULL);
+#endif
+      }
+      break;
+  }
+
+  if (wait->count < 0xffffffff) {
+    wait->count++;
+  }
+}  /* cprt_wait_idle */
+
+
+/* Like cprt_sleep_ns(), but passes the time with a wait strategy instead of
+ * always busy spinning. */
+void cprt_sleep_ns_strategy(uint64_t duration_ns, struct cprt_wait *wait)
+{
+  uint64_t ns_so_far;
+  struct cprt_timespec cur_ts;
+  struct cprt_timespec start_ts;
+
+  cprt_wait_reset(wait);
+  CPRT_GETTIME(&start_ts);
+  cur_ts = start_ts;
+  CPRT_DIFF_TS(ns_so_far, cur_ts, start_ts);
+  while (ns_so_far < duration_ns) {
+    cprt_wait_idle(wait);
+    CPRT_GETTIME(&cur_ts);
+    CPRT_DIFF_TS(ns_so_far, cur_ts, start_ts);
+  }
+}  /* cprt_sleep_ns_strategy */
+
+
 void cprt_localtime_r(time_t *timep, struct tm *result)
 {
 #if defined(_WIN32)
@@ -127,7 +270,7 @@ char *cprt_strerror(int errnum, char *buffer, size_t buf_sz)
   /* Note that this uses the GNU-variant of strerror_r. */
   err_str = strerror_r(errnum, work_buffer, sizeof(work_buffer));
   if (err_str != NULL) {
-    strncpy(buffer, err_str, buf_sz);
+    strncpy(buffer, err_str, buf_sz - 1);
     buffer[buf_sz-1] = '\0';  /* make sure it has a null term. */
   }
 
@@ -183,40 +326,239 @@ void cprt_perrno(char *in_str, char *file, int line)
 }  /* cprt_perrno */
 
 
+/* Failure path of CPRT_EOK0, CPRT_EOK1, CPRT_ENULL and CPRT_EM1: print
+ * the expression and errno, then exit. Kept out of line so the checks
+ * at the call sites stay small. */
+void cprt_fail_errno(const char *expr_str, const char *what, const char *file, int line)
+{
+  int save_errno = errno;
+  char errstr[1024];
+
+  CPRT_SNPRINTF(errstr, sizeof(errstr), "'%s' %s", expr_str, what);
+  errno = save_errno;
+  cprt_perrno(errstr, (char *)file, line);
+  CPRT_ERR_EXIT;
+}  /* cprt_fail_errno */
+
+
+/* Failure path of CPRT_ASSERT. */
+void cprt_fail_assert(const char *cond_str, const char *file, int line)
+{
+  cprt_ts_eprintf("ERROR (%s:%d): ERROR: '%s' not true\n",
+    CPRT_BASENAME(file), line, cond_str);
+  if (cprt_num_events > 0) { cprt_dump_events(stderr); }
+  fflush(stderr);
+  CPRT_ERR_EXIT;
+}  /* cprt_fail_assert */
+
+
+/* printf-free formatting. Each writes into buf, NUL-terminates it and
+ * returns the length (not counting the NUL). Integers need at most
+ * width + 1 bytes, or CPRT_FMT_INT_SZ if width is smaller than that. */
+static const char cprt_digit_pairs[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+
+static int cprt_u64_num_digits(uint64_t val)
+{
+  int num_digits = 1;
+
+  while (val >= 10000) {
+    val /= 10000;
+    num_digits += 4;
+  }
+  if (val >= 1000) {
+    return num_digits + 3;
+  }
+  if (val >= 100) {
+    return num_digits + 2;
+  }
+  if (val >= 10) {
+    return num_digits + 1;
+  }
+  return num_digits;
+}  /* cprt_u64_num_digits */
+
+
+/* Decimal, zero-padded to width (0 = no padding); like "%0*"PRIu64. */
+size_t cprt_fmt_u64(char *buf, uint64_t val, int width)
+{
+  int num_digits = cprt_u64_num_digits(val);
+  int len = (width > num_digits) ? width : num_digits;
+  char *p = buf + len;
+  unsigned int pair;
+
+  *p = '\0';
+  while (val >= 100) {  /* Two digits per divide. */
+    pair = (unsigned int)(val % 100) * 2;
+    val /= 100;
+    *--p = cprt_digit_pairs[pair + 1];
+    *--p = cprt_digit_pairs[pair];
+  }
+  if (val >= 10) {
+    pair = (unsigned int)val * 2;
+    *--p = cprt_digit_pairs[pair + 1];
+    *--p = cprt_digit_pairs[pair];
+  }
+  else {
+    *--p = (char)('0' + val);
+  }
+  while (p > buf) {
+    *--p = '0';
+  }
+
+  return (size_t)len;
+}  /* cprt_fmt_u64 */
+
+
+/* Like "%0*"PRId64; width includes the '-'. */
+size_t cprt_fmt_i64(char *buf, int64_t val, int width)
+{
+  if (val < 0) {
+    buf[0] = '-';
+    return 1 + cprt_fmt_u64(&buf[1], 0 - (uint64_t)val, (width > 1) ? width - 1 : 0);
+  }
+  return cprt_fmt_u64(buf, (uint64_t)val, width);
+}  /* cprt_fmt_i64 */
+
+
+/* Lower-case hex, zero-padded to width; like "%0*"PRIx64. */
+size_t cprt_fmt_hex(char *buf, uint64_t val, int width)
+{
+  static const char hex_digits[] = "0123456789abcdef";
+  int num_digits = 1;
+  int len;
+  char *p;
+
+  while (num_digits < 16 && (val >> (num_digits * 4)) != 0) {
+    num_digits++;
+  }
+  len = (width > num_digits) ? width : num_digits;
+  p = buf + len;
+  *p = '\0';
+  while (p > buf) {
+    *--p = hex_digits[val & 0xf];
+    val >>= 4;
+  }
+
+  return (size_t)len;
+}  /* cprt_fmt_hex */
+
+
+/* "YYYY-MM-DD<sep>hh:mm:ss[.fraction]" (date optional). */
+static size_t cprt_fmt_datetime(char *buf, int year, int mon, int mday, int hour, int min, int sec,
+    uint32_t nsec, int precision, int do_date, char sep)
+{
+  static const uint32_t pow_10[10] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+  size_t len = 0;
+
+  if (do_date) {
+    len += cprt_fmt_u64(&buf[len], (uint64_t)year, 4);
+    buf[len++] = '-';
+    len += cprt_fmt_u64(&buf[len], (uint64_t)mon, 2);
+    buf[len++] = '-';
+    len += cprt_fmt_u64(&buf[len], (uint64_t)mday, 2);
+    buf[len++] = sep;
+  }
+  len += cprt_fmt_u64(&buf[len], (uint64_t)hour, 2);
+  buf[len++] = ':';
+  len += cprt_fmt_u64(&buf[len], (uint64_t)min, 2);
+  buf[len++] = ':';
+  len += cprt_fmt_u64(&buf[len], (uint64_t)sec, 2);
+  if (precision > 9) {
+    precision = 9;
+  }
+  if (precision > 0) {
+    buf[len++] = '.';
+    len += cprt_fmt_u64(&buf[len], nsec / pow_10[9 - precision], precision);
+  }
+  buf[len] = '\0';
+
+  return len;
+}  /* cprt_fmt_datetime */
+
+
+/* Broken-down time plus nanoseconds, as "YYYY-MM-DD hh:mm:ss.fff"
+ * (do_date = 0 omits the date), with precision (0-9) fraction digits.
+ * buf needs CPRT_FMT_TIME_SZ bytes. */
+size_t cprt_fmt_tm(char *buf, const struct tm *tm, uint32_t nsec, int precision, int do_date)
+{
+  return cprt_fmt_datetime(buf, tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+      tm->tm_hour, tm->tm_min, tm->tm_sec, nsec, precision, do_date, ' ');
+}  /* cprt_fmt_tm */
+
+
+/* Nanoseconds since the Unix epoch as ISO 8601 UTC,
+ * "YYYY-MM-DDThh:mm:ss.fffZ", without gmtime(). buf needs
+ * CPRT_FMT_TIME_SZ bytes. */
+size_t cprt_fmt_epoch_ns(char *buf, uint64_t epoch_ns, int precision)
+{
+  uint64_t secs = epoch_ns / 1000000000;
+  uint32_t nsec = (uint32_t)(epoch_ns % 1000000000);
+  uint32_t sec_of_day = (uint32_t)(secs % 86400);
+  int64_t days = (int64_t)(secs / 86400);
+  int64_t era, year;
+  uint32_t day_of_era, year_of_era, day_of_year, mp, mday, mon;
+  size_t len;
+
+  /* Civil date from days since 1970-01-01 (H. Hinnant's algorithm). */
+  days += 719468;
+  era = days / 146097;
+  day_of_era = (uint32_t)(days - era * 146097);
+  year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+  year = (int64_t)year_of_era + era * 400;
+  day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  mp = (5 * day_of_year + 2) / 153;
+  mday = day_of_year - (153 * mp + 2) / 5 + 1;
+  mon = (mp < 10) ? mp + 3 : mp - 9;
+  if (mon <= 2) {
+    year++;
+  }
+
+  len = cprt_fmt_datetime(buf, (int)year, (int)mon, (int)mday, (int)(sec_of_day / 3600),
+      (int)(sec_of_day / 60 % 60), (int)(sec_of_day % 60), nsec, precision, 1, 'T');
+  buf[len++] = 'Z';
+  buf[len] = '\0';
+
+  return len;
+}  /* cprt_fmt_epoch_ns */
+
+
 /* Get date/time stamp (date optional) with up to microsecond precision.
  * Returns passed-in string pointer for convenience. */
 char *cprt_timestamp(char *str, int bufsz, int do_date, int precision)
 {
-  static unsigned long long pow_10[7] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
   struct cprt_timeval cur_time_tv;
   struct tm tm_buf;
-  char *rtn_str = str;
+  char ts_buf[CPRT_FMT_TIME_SZ];
+  size_t len;
 
   CPRT_TIMEOFDAY(&cur_time_tv, NULL);
   CPRT_LOCALTIME_R(&cur_time_tv.tv_sec, &tm_buf);  /* Break down current time. */
 
-  if (do_date && precision > 0) {
-    CPRT_SNPRINTF(str, bufsz, "%04d-%02d-%02d %02d:%02d:%02d.%0*d",
-        (int)tm_buf.tm_year + 1900, (int)tm_buf.tm_mon + 1, (int)tm_buf.tm_mday,
-        (int)tm_buf.tm_hour, (int)tm_buf.tm_min, (int)tm_buf.tm_sec,
-        precision, (int)(cur_time_tv.tv_usec / pow_10[6 - precision]));
+  if (precision > 6) {
+    precision = 6;
   }
-  else if (do_date && precision == 0) {
-    CPRT_SNPRINTF(str, bufsz, "%04d-%02d-%02d %02d:%02d:%02d",
-        (int)tm_buf.tm_year + 1900, (int)tm_buf.tm_mon + 1, (int)tm_buf.tm_mday,
-        (int)tm_buf.tm_hour, (int)tm_buf.tm_min, (int)tm_buf.tm_sec);
-  }
-  else if (!do_date && precision > 0) {
-    CPRT_SNPRINTF(str, bufsz, "%02d:%02d:%02d.%0*d",
-        (int)tm_buf.tm_hour, (int)tm_buf.tm_min, (int)tm_buf.tm_sec,
-        precision, (int)(cur_time_tv.tv_usec / pow_10[6 - precision]));
-  }
-  else {  /* !do_date && precision==0 */
-    CPRT_SNPRINTF(str, bufsz, "%02d:%02d:%02d",
-        (int)tm_buf.tm_hour, (int)tm_buf.tm_min, (int)tm_buf.tm_sec);
+  len = cprt_fmt_tm(ts_buf, &tm_buf, (uint32_t)cur_time_tv.tv_usec * 1000, precision, do_date);
+  if (bufsz > 0) {
+    if (len >= (size_t)bufsz) {
+      len = (size_t)bufsz - 1;
+    }
+    memcpy(str, ts_buf, len);
+    str[len] = '\0';
   }
 
-  return rtn_str;
+  return str;
 }  /* cprt_timestamp */
 
 
@@ -224,15 +566,17 @@ char *cprt_timestamp(char *str, int bufsz, int do_date, int precision)
  * Also flushes file. */
 void cprt_vts_fprintf(FILE *fp, const char *format, va_list argp)
 {
-  size_t fmt_len, ts_len;
+  size_t format_len, ts_len;
   char *fmt_buf;
 
   /* Create new format string with timestamp prepended to it. */
-  fmt_len = strlen(format) + 32;  /* Allows yyyy-mmm-dd hh:mm:ss.uuuuuuuu: */
-  fmt_buf = malloc(fmt_len);
-  cprt_timestamp(fmt_buf, 32, 1, 3);  /* Include date and 3 decimals for seconds. */
+  format_len = strlen(format);
+  fmt_buf = malloc(format_len + CPRT_FMT_TIME_SZ + 2);
+  cprt_timestamp(fmt_buf, CPRT_FMT_TIME_SZ, 1, 3);  /* Include date and 3 decimals for seconds. */
   ts_len = strlen(fmt_buf);
-  snprintf(&fmt_buf[ts_len], fmt_len - ts_len, ": %s", format);
+  fmt_buf[ts_len++] = ':';
+  fmt_buf[ts_len++] = ' ';
+  memcpy(&fmt_buf[ts_len], format, format_len + 1);
 
   vfprintf(fp, fmt_buf, argp);   /* Pass in new format string. */
   fflush(fp);
@@ -259,6 +603,48 @@ void cprt_ts_eprintf(const char *format, ...)
 }  /* cprt_ts_eprintf */
 
 
+/* Like cprt_vts_fprintf(), but to a cprt_aio sink. The line is buffered
+ * (not flushed), so the caller never waits for the disk. */
+void cprt_vts_sink_printf(cprt_aio_sink_t *sink, const char *format, va_list argp)
+{
+  char buf[1024];
+  char *line = buf;
+  size_t ts_len;
+  int len;
+  va_list argp_copy;
+
+  cprt_timestamp(buf, 32, 1, 3);  /* Include date and 3 decimals for seconds. */
+  ts_len = strlen(buf);
+  buf[ts_len++] = ':';
+  buf[ts_len++] = ' ';
+
+  va_copy(argp_copy, argp);
+  len = vsnprintf(&buf[ts_len], sizeof(buf) - ts_len, format, argp);
+  if (len >= 0 && (size_t)len >= sizeof(buf) - ts_len) {  /* Too big for buf. */
+    CPRT_ENULL(line = (char *)malloc(ts_len + len + 1));
+    memcpy(line, buf, ts_len);
+    vsnprintf(&line[ts_len], len + 1, format, argp_copy);
+  }
+  va_end(argp_copy);
+
+  if (len > 0) {
+    cprt_aio_sink_write(sink, line, ts_len + len);
+  }
+  if (line != buf) {
+    free(line);
+  }
+}  /* cprt_vts_sink_printf */
+
+
+void cprt_ts_sink_printf(cprt_aio_sink_t *sink, const char *format, ...)
+{
+  va_list argp;
+  va_start(argp, format);  /* Tell va_* where the start of argp is. */
+  cprt_vts_sink_printf(sink, format, argp);
+  va_end(argp);
+}  /* cprt_ts_sink_printf */
+
+
 /* This produces wall clock seconds after Unix epoc to ms precision. */
 uint64_t cprt_get_ms_time()
 {
@@ -273,15 +659,19 @@ uint64_t cprt_get_ms_time()
  * Also flushes stdout. */
 void cprt_vms_fprintf(FILE *fp, uint64_t start_ms, const char *format, va_list argp)
 {
-  size_t fmt_len;
+  size_t format_len, len;
   char *fmt_buf;
   uint64_t cur_ms = cprt_get_ms_time();
 
   /* Create new format string with timestamp prepended to it. */
-  fmt_len = strlen(format) + 30;  /* Allows up to 24 digits of seconds. */
-  fmt_buf = malloc(fmt_len);
-  snprintf(fmt_buf, fmt_len, "%"PRIu64".%03"PRIu64": %s",
-      (cur_ms - start_ms)/1000, (cur_ms - start_ms) % 1000, format);
+  format_len = strlen(format);
+  fmt_buf = malloc(format_len + 30);  /* Allows up to 24 digits of seconds. */
+  len = cprt_fmt_u64(fmt_buf, (cur_ms - start_ms) / 1000, 0);
+  fmt_buf[len++] = '.';
+  len += cprt_fmt_u64(&fmt_buf[len], (cur_ms - start_ms) % 1000, 3);
+  fmt_buf[len++] = ':';
+  fmt_buf[len++] = ' ';
+  memcpy(&fmt_buf[len], format, format_len + 1);
 
   /* Do the printf. */
   vfprintf(fp, fmt_buf, argp);   /* Pass in new format string. */
@@ -309,58 +699,315 @@ void cprt_ms_eprintf(uint64_t start_ms, const char *format, ...)
 }  /* cprt_ms_eprintf */
 
 
-void cprt_set_affinity(uint64_t in_mask)
+struct cprt_cpuset_s {
+  int max_cpus;  /* Always a multiple of 64. */
+  uint64_t *bits;  /* Points just past the struct. */
+};
+
+
+/* Number of CPUs a cprt_cpuset_t needs to be able to hold on this host. */
+static int cprt_cpuset_host_cpus()
 {
+  int num_cpus = 0;
+
 #if defined(_WIN32)
-  DWORD_PTR rc;
-  rc = SetThreadAffinityMask(GetCurrentThread(), in_mask);
-  if (rc == 0) {
-    errno = GetLastError();
-    CPRT_PERRNO("SetThreadAffinityMask");
-  }
+  num_cpus = (int)GetMaximumProcessorGroupCount() * 64;
 
 #elif defined(__linux__)
-  cpu_set_t cpuset;
+  FILE *fp;
+  char line[256];
+
+  /* The kernel's "possible" list can exceed the configured count, and
+   * sched_getaffinity() needs room for all of them. */
+  fp = fopen("/sys/devices/system/cpu/possible", "r");
+  if (fp != NULL) {
+    if (fgets(line, sizeof(line), fp) != NULL) {
+      char *p = line;
+      while (*p != '\0') {
+        if (isdigit(*p)) {
+          int cpu = (int)strtol(p, &p, 10);
+          if (cpu + 1 > num_cpus) {
+            num_cpus = cpu + 1;
+          }
+        } else {
+          p++;
+        }
+      }
+    }
+    fclose(fp);
+  }
+  if (num_cpus < (int)sysconf(_SC_NPROCESSORS_CONF)) {
+    num_cpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+  }
+
+#else  /* Non-Linux Unix. */
+  num_cpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+#endif
+
+  if (num_cpus < 64) {
+    num_cpus = 64;
+  }
+  return (num_cpus + 63) & ~63;
+}  /* cprt_cpuset_host_cpus */
+
+
+/* Create an empty CPU set big enough for every CPU on the host. */
+cprt_cpuset_t *cprt_cpuset_create()
+{
+  cprt_cpuset_t *cpuset;
+  int max_cpus = cprt_cpuset_host_cpus();
+
+  CPRT_ENULL(cpuset = (cprt_cpuset_t *)malloc(sizeof(cprt_cpuset_t) + (max_cpus / 8)));
+  cpuset->max_cpus = max_cpus;
+  cpuset->bits = (uint64_t *)(cpuset + 1);
+  cprt_cpuset_zero(cpuset);
+
+  return cpuset;
+}  /* cprt_cpuset_create */
+
+
+void cprt_cpuset_delete(cprt_cpuset_t *cpuset)
+{
+  free(cpuset);
+}  /* cprt_cpuset_delete */
+
+
+int cprt_cpuset_max_cpus(const cprt_cpuset_t *cpuset)
+{
+  return cpuset->max_cpus;
+}  /* cprt_cpuset_max_cpus */
+
+
+void cprt_cpuset_zero(cprt_cpuset_t *cpuset)
+{
+  memset(cpuset->bits, 0, cpuset->max_cpus / 8);
+}  /* cprt_cpuset_zero */
+
+
+/* Return 0 on success, -1 on error (sets errno to EINVAL). */
+int cprt_cpuset_set(cprt_cpuset_t *cpuset, int cpu)
+{
+  if (cpu < 0 || cpu >= cpuset->max_cpus) {
+    errno = EINVAL;
+    return -1;
+  }
+  cpuset->bits[cpu / 64] |= 1ull << (cpu % 64);
+  return 0;
+}  /* cprt_cpuset_set */
+
+
+/* Return 0 on success, -1 on error (sets errno to EINVAL). */
+int cprt_cpuset_clear(cprt_cpuset_t *cpuset, int cpu)
+{
+  if (cpu < 0 || cpu >= cpuset->max_cpus) {
+    errno = EINVAL;
+    return -1;
+  }
+  cpuset->bits[cpu / 64] &= ~(1ull << (cpu % 64));
+  return 0;
+}  /* cprt_cpuset_clear */
+
+
+/* Return 1 if set, 0 if not (or out of range). */
+int cprt_cpuset_test(const cprt_cpuset_t *cpuset, int cpu)
+{
+  if (cpu < 0 || cpu >= cpuset->max_cpus) {
+    return 0;
+  }
+  return (cpuset->bits[cpu / 64] >> (cpu % 64)) & 1;
+}  /* cprt_cpuset_test */
+
+
+int cprt_cpuset_count(const cprt_cpuset_t *cpuset)
+{
+  int i, count = 0;
+  uint64_t word;
+
+  for (i = 0; i < cpuset->max_cpus / 64; i++) {
+    for (word = cpuset->bits[i]; word != 0; word &= word - 1) {
+      count++;
+    }
+  }
+  return count;
+}  /* cprt_cpuset_count */
+
+
+/* Return lowest CPU in set that is >= "cpu", or -1 if none. To iterate:
+ *   for (cpu = cprt_cpuset_next(s, 0); cpu >= 0; cpu = cprt_cpuset_next(s, cpu+1)) */
+int cprt_cpuset_next(const cprt_cpuset_t *cpuset, int cpu)
+{
+  if (cpu < 0) {
+    cpu = 0;
+  }
+  for (; cpu < cpuset->max_cpus; cpu++) {
+    uint64_t word = cpuset->bits[cpu / 64] >> (cpu % 64);
+    if (word == 0) {
+      cpu |= 63;  /* Skip rest of word. */
+    } else if (word & 1) {
+      return cpu;
+    }
+  }
+  return -1;
+}  /* cprt_cpuset_next */
+
+
+/* Parse a list string like "0-3,64-71" (Linux cpulist format, including
+ * "start-end:stride") into cpuset, replacing its contents.
+ * Return 0 on success, -1 on error (sets errno to EINVAL). */
+int cprt_cpuset_parse(cprt_cpuset_t *cpuset, const char *list_str)
+{
+  const char *p = list_str;
+  char *end;
+  long first, last, stride, cpu;
+
+  cprt_cpuset_zero(cpuset);
+  while (*p != '\0') {
+    while (isspace(*p)) p++;
+    if (! isdigit(*p)) {
+      errno = EINVAL;
+      return -1;
+    }
+    first = last = strtol(p, &end, 10);
+    stride = 1;
+    p = end;
+    if (*p == '-') {
+      p++;
+      if (! isdigit(*p)) {
+        errno = EINVAL;
+        return -1;
+      }
+      last = strtol(p, &end, 10);
+      p = end;
+      if (*p == ':') {
+        p++;
+        if (! isdigit(*p)) {
+          errno = EINVAL;
+          return -1;
+        }
+        stride = strtol(p, &end, 10);
+        p = end;
+      }
+    }
+    if (last < first || stride < 1 || last >= cpuset->max_cpus) {
+      errno = EINVAL;
+      return -1;
+    }
+    for (cpu = first; cpu <= last; cpu += stride) {
+      cprt_cpuset_set(cpuset, (int)cpu);
+    }
+    while (isspace(*p)) p++;
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0') {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  return 0;
+}  /* cprt_cpuset_parse */
+
+
+/* Format cpuset as a list string like "0-3,64-71" (truncated to whole
+ * entries that fit).
+ * Returns passed-in string pointer for convenience. */
+char *cprt_cpuset_format(const cprt_cpuset_t *cpuset, char *buf, size_t buf_sz)
+{
+  size_t len = 0;
+  int first, last, n;
+
+  if (buf_sz == 0) {
+    return buf;
+  }
+  buf[0] = '\0';
+  first = cprt_cpuset_next(cpuset, 0);
+  while (first >= 0) {
+    last = first;
+    while (cprt_cpuset_test(cpuset, last + 1)) {
+      last++;
+    }
+    if (last == first) {
+      n = CPRT_SNPRINTF(&buf[len], buf_sz - len, "%s%d", (len > 0) ? "," : "", first);
+    } else {
+      n = CPRT_SNPRINTF(&buf[len], buf_sz - len, "%s%d-%d", (len > 0) ? "," : "", first, last);
+    }
+    /* Truncated: snprintf returns the full length, _snprintf -1. */
+    if (n < 0 || (size_t)n >= buf_sz - len) {
+      buf[len] = '\0';  /* Only whole entries. */
+      break;
+    }
+    len += n;
+    first = cprt_cpuset_next(cpuset, last + 1);
+  }
+  buf[buf_sz - 1] = '\0';  /* _snprintf doesn't always null terminate. */
+
+  return buf;
+}  /* cprt_cpuset_format */
+
+
+#if defined(_WIN32)
+/* Windows can only pin a thread to CPUs in a single processor group.
+ * Return 0 on success, -1 on error (sets errno to EINVAL). */
+static int cprt_cpuset_to_group(const cprt_cpuset_t *cpuset, GROUP_AFFINITY *group_aff)
+{
   int i;
-  uint64_t bit = 1;
-  CPU_ZERO(&cpuset);
-  for (i = 0; i < 64; i++) {
-    if ((in_mask & bit) == bit) {
-      CPU_SET(i, &cpuset);
+
+  memset(group_aff, 0, sizeof(*group_aff));
+  for (i = 0; i < cpuset->max_cpus / 64; i++) {
+    if (cpuset->bits[i] != 0) {
+      if (group_aff->Mask != 0) {
+        errno = EINVAL;  /* Spans groups. */
+        return -1;
+      }
+      group_aff->Group = (WORD)i;
+      group_aff->Mask = (KAFFINITY)cpuset->bits[i];
     }
-    bit = bit << 1;
   }
-  CPRT_EOK0(errno = pthread_setaffinity_np(
-      pthread_self(), sizeof(cpuset), &cpuset));
+  if (group_aff->Mask == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}  /* cprt_cpuset_to_group */
 
-#else /* Non-Linux Unix. */
+#elif defined(__linux__)
+/* Return CPU_ALLOC()ed copy of cpuset (caller must CPU_FREE()). */
+static cpu_set_t *cprt_cpuset_to_linux(const cprt_cpuset_t *cpuset, size_t *set_size)
+{
+  cpu_set_t *linux_set;
+  int cpu;
+
+  CPRT_ENULL(linux_set = CPU_ALLOC(cpuset->max_cpus));
+  *set_size = CPU_ALLOC_SIZE(cpuset->max_cpus);
+  CPU_ZERO_S(*set_size, linux_set);
+  for (cpu = cprt_cpuset_next(cpuset, 0); cpu >= 0; cpu = cprt_cpuset_next(cpuset, cpu + 1)) {
+    CPU_SET_S(cpu, *set_size, linux_set);
+  }
+  return linux_set;
+}  /* cprt_cpuset_to_linux */
 #endif
-}  /* cprt_set_affinity */
 
 
-/* Return 0 on success, -1 on error (sets errno). */
-int cprt_try_affinity(uint64_t in_mask)
+/* Pin the calling thread to the CPUs in cpuset.
+ * Return 0 on success, -1 on error (sets errno). */
+int cprt_try_affinity_cpuset(const cprt_cpuset_t *cpuset)
 {
 #if defined(_WIN32)
-  DWORD_PTR rc;
-  rc = SetThreadAffinityMask(GetCurrentThread(), in_mask);
-  if (rc == 0) {
+  GROUP_AFFINITY group_aff;
+  if (cprt_cpuset_to_group(cpuset, &group_aff) != 0) {
+    return -1;
+  }
+  if (! SetThreadGroupAffinity(GetCurrentThread(), &group_aff, NULL)) {
     errno = GetLastError();
     return -1;
   }
 
 #elif defined(__linux__)
-  cpu_set_t cpuset;
-  int i;
-  uint64_t bit = 1;
-  CPU_ZERO(&cpuset);
-  for (i = 0; i < 64; i++) {
-    if ((in_mask & bit) == bit) {
-      CPU_SET(i, &cpuset);
-    }
-    bit = bit << 1;
-  }
-  errno = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+  cpu_set_t *linux_set;
+  size_t set_size;
+  linux_set = cprt_cpuset_to_linux(cpuset, &set_size);
+  errno = pthread_setaffinity_np(pthread_self(), set_size, linux_set);
+  CPU_FREE(linux_set);
   if (errno != 0) {
     return -1;
   }
@@ -368,7 +1015,4916 @@ int cprt_try_affinity(uint64_t in_mask)
 #else /* Non-Linux Unix. */
 #endif
   return 0;
-}  /* cprt_try_affinity */
+}  /* cprt_try_affinity_cpuset */
+
+
+/* Like cprt_try_affinity_cpuset() but errors are fatal. */
+void cprt_set_affinity_cpuset(const cprt_cpuset_t *cpuset)
+{
+  if (cprt_try_affinity_cpuset(cpuset) != 0) {
+    CPRT_PERRNO("cprt_set_affinity_cpuset");
+    CPRT_ERR_EXIT;
+  }
+}  /* cprt_set_affinity_cpuset */
+
+
+/* Get the calling thread's current affinity into cpuset.
+ * Return 0 on success, -1 on error (sets errno). */
+int cprt_get_affinity_cpuset(cprt_cpuset_t *cpuset)
+{
+#if defined(_WIN32)
+  GROUP_AFFINITY group_aff;
+  cprt_cpuset_zero(cpuset);
+  if (! GetThreadGroupAffinity(GetCurrentThread(), &group_aff)) {
+    errno = GetLastError();
+    return -1;
+  }
+  cpuset->bits[group_aff.Group] = (uint64_t)group_aff.Mask;
+
+#elif defined(__linux__)
+  cpu_set_t *linux_set;
+  size_t set_size;
+  int cpu;
+  CPRT_ENULL(linux_set = CPU_ALLOC(cpuset->max_cpus));
+  set_size = CPU_ALLOC_SIZE(cpuset->max_cpus);
+  errno = pthread_getaffinity_np(pthread_self(), set_size, linux_set);
+  if (errno != 0) {
+    CPU_FREE(linux_set);
+    return -1;
+  }
+  cprt_cpuset_zero(cpuset);
+  for (cpu = 0; cpu < cpuset->max_cpus; cpu++) {
+    if (CPU_ISSET_S(cpu, set_size, linux_set)) {
+      cprt_cpuset_set(cpuset, cpu);
+    }
+  }
+  CPU_FREE(linux_set);
+
+#else /* Non-Linux Unix; no affinity, so all CPUs. */
+  int cpu;
+  int num_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  cprt_cpuset_zero(cpuset);
+  for (cpu = 0; cpu < num_cpus; cpu++) {
+    cprt_cpuset_set(cpuset, cpu);
+  }
+#endif
+  return 0;
+}  /* cprt_get_affinity_cpuset */
+
+
+/* Wrapper for CPUs 0-63; see cprt_set_affinity_cpuset(). Errors are
+ * fatal, except on Windows, where they are only printed (as always). */
+void cprt_set_affinity(uint64_t in_mask)
+{
+  if (cprt_try_affinity(in_mask) != 0) {
+#if defined(_WIN32)
+    CPRT_PERRNO("SetThreadAffinityMask");
+#else
+    CPRT_PERRNO("cprt_set_affinity");
+    CPRT_ERR_EXIT;
+#endif
+  }
+}  /* cprt_set_affinity */
+
+
+/* Wrapper for CPUs 0-63; see cprt_try_affinity_cpuset().
+ * Return 0 on success, -1 on error (sets errno). */
+int cprt_try_affinity(uint64_t in_mask)
+{
+  cprt_cpuset_t *cpuset = cprt_cpuset_create();
+  int rc;
+  int save_errno;
+
+  cpuset->bits[0] = in_mask;
+  rc = cprt_try_affinity_cpuset(cpuset);
+  save_errno = errno;
+  cprt_cpuset_delete(cpuset);
+  errno = save_errno;
+
+  return rc;
+}  /* cprt_try_affinity */
+
+
+#if ! defined(_WIN32)
+/* Names the new thread before calling the user's entry point. */
+struct cprt_thread_start {
+  cprt_thread_fn_t start_fn;
+  void *arg;
+  char name[16];  /* Linux limit, including null. */
+};
+
+static void *cprt_thread_start_named(void *in_arg)
+{
+  struct cprt_thread_start start = *(struct cprt_thread_start *)in_arg;
+
+  free(in_arg);
+#if defined(__APPLE__)
+  pthread_setname_np(start.name);  /* Best effort. */
+#elif defined(__linux__)
+  pthread_setname_np(pthread_self(), start.name);  /* Best effort. */
+#endif
+  return (*start.start_fn)(start.arg);
+}  /* cprt_thread_start_named */
+#endif
+
+
+/* Set all fields of attr to "default". */
+void cprt_thread_attr_init(struct cprt_thread_attr *attr)
+{
+  memset(attr, 0, sizeof(*attr));
+}  /* cprt_thread_attr_init */
+
+
+/* Create a thread with the given attributes (NULL attr = defaults). The
+ * stack size, priority and affinity are applied before the thread starts
+ * running, so a pinned thread never runs on the wrong CPU.
+ * Return 0 on success, -1 on error (sets errno). */
+int cprt_thread_create_ex(CPRT_THREAD_T *tid, cprt_thread_fn_t start_fn, void *arg,
+    const struct cprt_thread_attr *attr)
+{
+#if defined(_WIN32)
+  DWORD ignore;
+  HANDLE handle;
+  GROUP_AFFINITY group_aff;
+  wchar_t wname[64];
+
+  if (attr != NULL && attr->cpuset != NULL) {
+    if (cprt_cpuset_to_group(attr->cpuset, &group_aff) != 0) {
+      return -1;
+    }
+  }
+  /* Create suspended, adjust, then let it run. */
+  handle = CreateThread(NULL, (attr != NULL) ? attr->stack_size : 0, start_fn, arg,
+      CREATE_SUSPENDED | STACK_SIZE_PARAM_IS_A_RESERVATION, &ignore);
+  if (handle == NULL) {
+    errno = GetLastError();
+    return -1;
+  }
+  if (attr != NULL) {
+    if (attr->cpuset != NULL && ! SetThreadGroupAffinity(handle, &group_aff, NULL)) {
+      errno = GetLastError();
+      TerminateThread(handle, 0);
+      CloseHandle(handle);
+      return -1;
+    }
+    if (attr->priority > 0 && ! SetThreadPriority(handle, THREAD_PRIORITY_TIME_CRITICAL)) {
+      errno = GetLastError();
+      TerminateThread(handle, 0);
+      CloseHandle(handle);
+      return -1;
+    }
+    if (attr->name != NULL &&
+        MultiByteToWideChar(CP_UTF8, 0, attr->name, -1, wname, 64) > 0) {
+      SetThreadDescription(handle, wname);  /* Best effort. */
+    }
+  }
+  ResumeThread(handle);
+  *tid = handle;
+
+#else  /* Unix */
+  pthread_attr_t pattr;
+  struct sched_param sched;
+  struct cprt_thread_start *start = NULL;
+#if defined(__linux__)
+  cpu_set_t *linux_set;
+  size_t set_size;
+#endif
+
+  errno = pthread_attr_init(&pattr);
+  if (errno != 0) {
+    return -1;
+  }
+  if (attr != NULL && attr->stack_size > 0) {
+    size_t stack_size = attr->stack_size;
+    if (stack_size < (size_t)PTHREAD_STACK_MIN) {
+      stack_size = PTHREAD_STACK_MIN;
+    }
+    errno = pthread_attr_setstacksize(&pattr, stack_size);
+    if (errno != 0) {
+      pthread_attr_destroy(&pattr);
+      return -1;
+    }
+  }
+  if (attr != NULL && attr->priority > 0) {
+    memset(&sched, 0, sizeof(sched));
+    sched.sched_priority = attr->priority;
+    errno = pthread_attr_setinheritsched(&pattr, PTHREAD_EXPLICIT_SCHED);
+    if (errno == 0) {
+      errno = pthread_attr_setschedpolicy(&pattr, SCHED_FIFO);
+    }
+    if (errno == 0) {
+      errno = pthread_attr_setschedparam(&pattr, &sched);
+    }
+    if (errno != 0) {
+      pthread_attr_destroy(&pattr);
+      return -1;
+    }
+  }
+  if (attr != NULL && attr->cpuset != NULL) {
+#if defined(__linux__)
+    linux_set = cprt_cpuset_to_linux(attr->cpuset, &set_size);
+    errno = pthread_attr_setaffinity_np(&pattr, set_size, linux_set);
+    CPU_FREE(linux_set);
+    if (errno != 0) {
+      pthread_attr_destroy(&pattr);
+      return -1;
+    }
+#else  /* Non-Linux Unix; no affinity (see cprt_try_affinity_cpuset()). */
+#endif
+  }
+
+  if (attr != NULL && attr->name != NULL) {
+    /* Mac can only name the calling thread, so the new thread names itself. */
+    CPRT_ENULL(start = (struct cprt_thread_start *)malloc(sizeof(struct cprt_thread_start)));
+    start->start_fn = start_fn;
+    start->arg = arg;
+    CPRT_SNPRINTF(start->name, sizeof(start->name), "%s", attr->name);
+    start_fn = cprt_thread_start_named;
+    arg = start;
+  }
+
+  /* Fails with EPERM if SCHED_FIFO is requested without privilege. */
+  errno = pthread_create(tid, &pattr, start_fn, arg);
+  pthread_attr_destroy(&pattr);
+  if (errno != 0) {
+    if (start != NULL) {
+      free(start);
+    }
+    return -1;
+  }
+#endif
+
+  return 0;
+}  /* cprt_thread_create_ex */
+
+
+/* Return NUMA node of a logical CPU, or -1 if not known. */
+int cprt_cpu_numa_node(int cpu)
+{
+#if defined(_WIN32)
+  USHORT node;
+  PROCESSOR_NUMBER proc_num;
+  proc_num.Group = (WORD)(cpu / 64);
+  proc_num.Number = (BYTE)(cpu % 64);
+  proc_num.Reserved = 0;
+  if (! GetNumaProcessorNodeEx(&proc_num, &node) || node == 0xffff) {
+    return -1;
+  }
+  return (int)node;
+
+#elif defined(__linux__)
+  char path[128];
+  DIR *dir;
+  struct dirent *ent;
+  int node = -1;
+
+  CPRT_SNPRINTF(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  dir = opendir(path);
+  if (dir == NULL) {
+    return -1;
+  }
+  while ((ent = readdir(dir)) != NULL) {
+    if (strncmp(ent->d_name, "node", 4) == 0 && isdigit(ent->d_name[4])) {
+      node = atoi(&ent->d_name[4]);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+
+#else /* Non-Linux Unix. */
+  return -1;
+#endif
+}  /* cprt_cpu_numa_node */
+
+
+/* Return NUMA node of the CPU the caller is currently running on, or -1.
+ * Only stable if the caller has pinned itself with cprt_set_affinity(). */
+int cprt_current_numa_node()
+{
+#if defined(_WIN32)
+  PROCESSOR_NUMBER proc_num;
+  USHORT node;
+  GetCurrentProcessorNumberEx(&proc_num);
+  if (! GetNumaProcessorNodeEx(&proc_num, &node) || node == 0xffff) {
+    return -1;
+  }
+  return (int)node;
+
+#elif defined(__linux__)
+  unsigned int cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+    return -1;
+  }
+  return (int)node;
+
+#else /* Non-Linux Unix. */
+  return -1;
+#endif
+}  /* cprt_current_numa_node */
+
+
+#if defined(__linux__)
+/* Read a small sysfs file into buf (newline stripped).
+ * Return 0 on success, -1 on error (sets errno). */
+static int cprt_read_sys_str(const char *path, char *buf, size_t buf_sz)
+{
+  FILE *fp;
+  size_t len;
+
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  if (fgets(buf, (int)buf_sz, fp) == NULL) {
+    fclose(fp);
+    errno = EIO;
+    return -1;
+  }
+  fclose(fp);
+  len = strlen(buf);
+  while (len > 0 && isspace(buf[len - 1])) {
+    buf[--len] = '\0';
+  }
+  return 0;
+}  /* cprt_read_sys_str */
+#endif
+
+
+/* Discover the CPU topology of the host: cores, SMT siblings, caches,
+ * packages and NUMA nodes. Returns NULL on error (sets errno).
+ * Use cprt_topology_delete() to free. */
+struct cprt_topology *cprt_topology_load()
+{
+  struct cprt_topology *topo;
+  cprt_cpuset_t *work_set;
+  int cpu, other;
+
+  CPRT_ENULL(topo = (struct cprt_topology *)malloc(sizeof(struct cprt_topology)));
+  work_set = cprt_cpuset_create();
+  topo->max_cpus = cprt_cpuset_max_cpus(work_set);
+  CPRT_ENULL(topo->cpus = (struct cprt_topo_cpu *)calloc(topo->max_cpus, sizeof(struct cprt_topo_cpu)));
+
+#if defined(_WIN32)
+  {
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *info_buf, *info;
+    DWORD buf_len = 0;
+    char *p, *end;
+    WORD g;
+    int package_num = 0;
+
+    GetLogicalProcessorInformationEx(RelationAll, NULL, &buf_len);
+    CPRT_ENULL(info_buf = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *)malloc(buf_len));
+    if (! GetLogicalProcessorInformationEx(RelationAll, info_buf, &buf_len)) {
+      errno = GetLastError();
+      free(info_buf);
+      cprt_cpuset_delete(work_set);
+      cprt_topology_delete(topo);
+      return NULL;
+    }
+
+    /* Cores first, so that every CPU is marked online before the other
+     * relationships are applied. */
+    end = (char *)info_buf + buf_len;
+    for (p = (char *)info_buf; p < end; p += info->Size) {
+      info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *)p;
+      if (info->Relationship == RelationProcessorCore) {
+        int core = -1;
+        int rank = 0;
+        for (g = 0; g < info->Processor.GroupCount; g++) {
+          for (cpu = 0; cpu < 64; cpu++) {
+            if (info->Processor.GroupMask[g].Mask & ((KAFFINITY)1 << cpu)) {
+              int c = (info->Processor.GroupMask[g].Group * 64) + cpu;
+              if (core == -1) {
+                core = c;
+              }
+              topo->cpus[c].online = 1;
+              topo->cpus[c].core = core;
+              topo->cpus[c].smt_rank = rank++;
+              topo->cpus[c].numa_node = -1;
+            }
+          }
+        }
+      }
+    }
+    for (p = (char *)info_buf; p < end; p += info->Size) {
+      GROUP_AFFINITY *group_aff = NULL;
+      int num_groups = 1;
+      info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *)p;
+      if (info->Relationship == RelationProcessorPackage) {
+        for (g = 0; g < info->Processor.GroupCount; g++) {
+          for (cpu = 0; cpu < 64; cpu++) {
+            if (info->Processor.GroupMask[g].Mask & ((KAFFINITY)1 << cpu)) {
+              topo->cpus[(info->Processor.GroupMask[g].Group * 64) + cpu].package = package_num;
+            }
+          }
+        }
+        package_num++;
+      }
+      else if (info->Relationship == RelationNumaNode) {
+        group_aff = &info->NumaNode.GroupMask;
+        for (cpu = 0; cpu < 64; cpu++) {
+          if (group_aff->Mask & ((KAFFINITY)1 << cpu)) {
+            topo->cpus[(group_aff->Group * 64) + cpu].numa_node = (int)info->NumaNode.NodeNumber;
+          }
+        }
+      }
+      else if (info->Relationship == RelationCache) {
+        int first_cpu = -1;
+        group_aff = &info->Cache.GroupMask;
+        for (cpu = 0; cpu < 64; cpu++) {
+          if (group_aff->Mask & ((KAFFINITY)1 << cpu)) {
+            int c = (group_aff->Group * 64) + cpu;
+            struct cprt_topo_cache *cache;
+            if (first_cpu == -1) {
+              first_cpu = c;
+            }
+            if (topo->cpus[c].num_caches < CPRT_TOPO_MAX_CACHES) {
+              cache = &topo->cpus[c].caches[topo->cpus[c].num_caches++];
+              cache->level = info->Cache.Level;
+              cache->type = (info->Cache.Type == CacheData) ? 'D' :
+                  (info->Cache.Type == CacheInstruction) ? 'I' : 'U';
+              cache->line_size = info->Cache.LineSize;
+              cache->size = info->Cache.CacheSize;
+              cache->id = first_cpu;
+            }
+          }
+        }
+      }
+    }
+    free(info_buf);
+  }
+
+#elif defined(__linux__)
+  {
+    char path[256];
+    char str[1024];
+    int idx;
+
+    if (cprt_read_sys_str("/sys/devices/system/cpu/online", str, sizeof(str)) != 0 ||
+        cprt_cpuset_parse(work_set, str) != 0) {
+      int save_errno = errno;
+      cprt_cpuset_delete(work_set);
+      cprt_topology_delete(topo);
+      errno = save_errno;
+      return NULL;
+    }
+    for (cpu = cprt_cpuset_next(work_set, 0); cpu >= 0; cpu = cprt_cpuset_next(work_set, cpu + 1)) {
+      struct cprt_topo_cpu *tcpu = &topo->cpus[cpu];
+      tcpu->online = 1;
+      tcpu->core = cpu;
+      tcpu->numa_node = cprt_cpu_numa_node(cpu);
+
+      CPRT_SNPRINTF(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+      if (cprt_read_sys_str(path, str, sizeof(str)) == 0) {
+        tcpu->package = atoi(str);
+      }
+
+      /* A core's id is its lowest-numbered hardware thread. */
+      CPRT_SNPRINTF(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+      if (cprt_read_sys_str(path, str, sizeof(str)) == 0) {
+        cprt_cpuset_t *siblings = cprt_cpuset_create();
+        if (cprt_cpuset_parse(siblings, str) == 0 && cprt_cpuset_count(siblings) > 0) {
+          tcpu->core = cprt_cpuset_next(siblings, 0);
+          for (other = tcpu->core; other >= 0 && other < cpu; other = cprt_cpuset_next(siblings, other + 1)) {
+            tcpu->smt_rank++;
+          }
+        }
+        cprt_cpuset_delete(siblings);
+      }
+
+      for (idx = 0; idx < CPRT_TOPO_MAX_CACHES; idx++) {
+        struct cprt_topo_cache *cache = &tcpu->caches[tcpu->num_caches];
+        char *unit;
+
+        CPRT_SNPRINTF(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, idx);
+        if (cprt_read_sys_str(path, str, sizeof(str)) != 0) {
+          break;  /* No more caches. */
+        }
+        cache->level = atoi(str);
+        CPRT_SNPRINTF(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/type", cpu, idx);
+        cache->type = (cprt_read_sys_str(path, str, sizeof(str)) == 0) ? str[0] : 'U';
+        CPRT_SNPRINTF(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/coherency_line_size", cpu, idx);
+        cache->line_size = (cprt_read_sys_str(path, str, sizeof(str)) == 0) ? atoi(str) : 64;
+        CPRT_SNPRINTF(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/size", cpu, idx);
+        cache->size = 0;
+        if (cprt_read_sys_str(path, str, sizeof(str)) == 0) {
+          cache->size = strtoull(str, &unit, 10);
+          if (*unit == 'K') cache->size *= 1024;
+          else if (*unit == 'M') cache->size *= 1024 * 1024;
+          else if (*unit == 'G') cache->size *= 1024 * 1024 * 1024;
+        }
+        /* Identify the cache instance by the lowest CPU sharing it. */
+        cache->id = cpu;
+        CPRT_SNPRINTF(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, idx);
+        if (cprt_read_sys_str(path, str, sizeof(str)) == 0) {
+          cprt_cpuset_t *sharers = cprt_cpuset_create();
+          if (cprt_cpuset_parse(sharers, str) == 0 && cprt_cpuset_count(sharers) > 0) {
+            cache->id = cprt_cpuset_next(sharers, 0);
+          }
+          cprt_cpuset_delete(sharers);
+        }
+        tcpu->num_caches++;
+      }
+    }
+  }
+
+#else  /* Non-Linux Unix: no topology info, so assume one core per CPU. */
+  {
+    int num_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    for (cpu = 0; cpu < num_cpus && cpu < topo->max_cpus; cpu++) {
+      topo->cpus[cpu].online = 1;
+      topo->cpus[cpu].core = cpu;
+      topo->cpus[cpu].numa_node = -1;
+    }
+  }
+#endif
+
+  /* Summary counts. */
+  topo->num_online = topo->num_cores = topo->num_packages = topo->num_nodes = 0;
+  for (cpu = 0; cpu < topo->max_cpus; cpu++) {
+    int new_package = 1, new_node = 1;
+    if (! topo->cpus[cpu].online) {
+      continue;
+    }
+    topo->num_online++;
+    if (topo->cpus[cpu].smt_rank == 0) {
+      topo->num_cores++;
+    }
+    for (other = 0; other < cpu; other++) {
+      if (topo->cpus[other].online) {
+        if (topo->cpus[other].package == topo->cpus[cpu].package) new_package = 0;
+        if (topo->cpus[other].numa_node == topo->cpus[cpu].numa_node) new_node = 0;
+      }
+    }
+    topo->num_packages += new_package;
+    if (topo->cpus[cpu].numa_node >= 0) {
+      topo->num_nodes += new_node;
+    }
+  }
+
+  cprt_cpuset_delete(work_set);
+  return topo;
+}  /* cprt_topology_load */
+
+
+void cprt_topology_delete(struct cprt_topology *topo)
+{
+  free(topo->cpus);
+  free(topo);
+}  /* cprt_topology_delete */
+
+
+/* Print one line per online CPU. */
+void cprt_topology_print(const struct cprt_topology *topo, FILE *fp)
+{
+  int cpu, i;
+
+  fprintf(fp, "online=%d, cores=%d, packages=%d, nodes=%d\n",
+      topo->num_online, topo->num_cores, topo->num_packages, topo->num_nodes);
+  for (cpu = 0; cpu < topo->max_cpus; cpu++) {
+    const struct cprt_topo_cpu *tcpu = &topo->cpus[cpu];
+    if (! tcpu->online) {
+      continue;
+    }
+    fprintf(fp, "cpu %d: package=%d, core=%d, smt_rank=%d, node=%d",
+        cpu, tcpu->package, tcpu->core, tcpu->smt_rank, tcpu->numa_node);
+    for (i = 0; i < tcpu->num_caches; i++) {
+      fprintf(fp, ", L%d%c=%"PRIu64"K(id %d)", tcpu->caches[i].level, tcpu->caches[i].type,
+          tcpu->caches[i].size / 1024, tcpu->caches[i].id);
+    }
+    fprintf(fp, "\n");
+  }
+}  /* cprt_topology_print */
+
+
+/* Set result to the hardware threads sharing cpu's core (including cpu).
+ * Return 0 on success, -1 on error (sets errno to EINVAL). */
+int cprt_topology_siblings(const struct cprt_topology *topo, int cpu, cprt_cpuset_t *result)
+{
+  int other;
+
+  if (cpu < 0 || cpu >= topo->max_cpus || ! topo->cpus[cpu].online) {
+    errno = EINVAL;
+    return -1;
+  }
+  cprt_cpuset_zero(result);
+  for (other = 0; other < topo->max_cpus; other++) {
+    if (topo->cpus[other].online && topo->cpus[other].core == topo->cpus[cpu].core) {
+      cprt_cpuset_set(result, other);
+    }
+  }
+  return 0;
+}  /* cprt_topology_siblings */
+
+
+/* Set result to the CPUs sharing cpu's unified or data cache at "level".
+ * Return 0 on success, -1 on error (sets errno to EINVAL). */
+int cprt_topology_cache_sharers(const struct cprt_topology *topo, int cpu, int level, cprt_cpuset_t *result)
+{
+  const struct cprt_topo_cache *cache = NULL;
+  int other, i;
+
+  if (cpu < 0 || cpu >= topo->max_cpus || ! topo->cpus[cpu].online) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < topo->cpus[cpu].num_caches; i++) {
+    if (topo->cpus[cpu].caches[i].level == level && topo->cpus[cpu].caches[i].type != 'I') {
+      cache = &topo->cpus[cpu].caches[i];
+    }
+  }
+  if (cache == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  cprt_cpuset_zero(result);
+  for (other = 0; other < topo->max_cpus; other++) {
+    for (i = 0; i < topo->cpus[other].num_caches; i++) {
+      if (topo->cpus[other].online && topo->cpus[other].caches[i].level == level &&
+          topo->cpus[other].caches[i].type == cache->type &&
+          topo->cpus[other].caches[i].id == cache->id) {
+        cprt_cpuset_set(result, other);
+      }
+    }
+  }
+  return 0;
+}  /* cprt_topology_cache_sharers */
+
+
+/* Set result to the online CPUs in a package.
+ * Return 0 on success, -1 on error (sets errno to EINVAL if none). */
+int cprt_topology_package_cpus(const struct cprt_topology *topo, int package, cprt_cpuset_t *result)
+{
+  int cpu;
+
+  cprt_cpuset_zero(result);
+  for (cpu = 0; cpu < topo->max_cpus; cpu++) {
+    if (topo->cpus[cpu].online && topo->cpus[cpu].package == package) {
+      cprt_cpuset_set(result, cpu);
+    }
+  }
+  if (cprt_cpuset_count(result) == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}  /* cprt_topology_package_cpus */
+
+
+/* Set result to the online CPUs in a NUMA node.
+ * Return 0 on success, -1 on error (sets errno to EINVAL if none). */
+int cprt_topology_node_cpus(const struct cprt_topology *topo, int node, cprt_cpuset_t *result)
+{
+  int cpu;
+
+  cprt_cpuset_zero(result);
+  for (cpu = 0; cpu < topo->max_cpus; cpu++) {
+    if (topo->cpus[cpu].online && topo->cpus[cpu].numa_node == node) {
+      cprt_cpuset_set(result, cpu);
+    }
+  }
+  if (cprt_cpuset_count(result) == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}  /* cprt_topology_node_cpus */
+
+
+/* Pick up to num_cores CPUs from "package" (or any, if package is
+ * CPRT_TOPO_ANY_PACKAGE), one per physical core, from "allowed" (NULL for
+ * all). Returns number picked. */
+static int cprt_topology_pick_in(const struct cprt_topology *topo, int num_cores, int package,
+    const cprt_cpuset_t *allowed, cprt_cpuset_t *result)
+{
+  cprt_cpuset_t *used_cores = cprt_cpuset_create();
+  int cpu, picked = 0;
+
+  cprt_cpuset_zero(result);
+  for (cpu = 0; cpu < topo->max_cpus && picked < num_cores; cpu++) {
+    const struct cprt_topo_cpu *tcpu = &topo->cpus[cpu];
+    if (tcpu->online && (package == CPRT_TOPO_ANY_PACKAGE || tcpu->package == package) &&
+        (allowed == NULL || cprt_cpuset_test(allowed, cpu)) &&
+        ! cprt_cpuset_test(used_cores, tcpu->core)) {
+      cprt_cpuset_set(used_cores, tcpu->core);
+      cprt_cpuset_set(result, cpu);
+      picked++;
+    }
+  }
+  cprt_cpuset_delete(used_cores);
+  return picked;
+}  /* cprt_topology_pick_in */
+
+
+/* Pick num_cores CPUs, each on a different physical core (so no two are
+ * SMT siblings), from "allowed" (NULL for all online CPUs). "package" is
+ * a package number, CPRT_TOPO_ONE_PACKAGE or CPRT_TOPO_ANY_PACKAGE.
+ * The result can be passed to cprt_set_affinity_cpuset(), or iterated with
+ * cprt_cpuset_next() to pin one thread per CPU.
+ * Return 0 on success, -1 on error (sets errno to EINVAL if not enough). */
+int cprt_topology_pick_cores(const struct cprt_topology *topo, int num_cores, int package,
+    const cprt_cpuset_t *allowed, cprt_cpuset_t *result)
+{
+  int pkg;
+
+  if (package == CPRT_TOPO_ONE_PACKAGE) {
+    for (pkg = 0; pkg < topo->max_cpus; pkg++) {
+      if (cprt_topology_pick_in(topo, num_cores, pkg, allowed, result) == num_cores) {
+        return 0;
+      }
+    }
+  }
+  else if (cprt_topology_pick_in(topo, num_cores, package, allowed, result) == num_cores) {
+    return 0;
+  }
+
+  cprt_cpuset_zero(result);
+  errno = EINVAL;
+  return -1;
+}  /* cprt_topology_pick_cores */
+
+
+#if defined(__linux__)
+/* Size of explicit huge pages, from /proc/meminfo (default 2MB). */
+static size_t cprt_huge_page_size()
+{
+  FILE *fp;
+  char line[256];
+  unsigned long huge_kb = 2048;
+
+  fp = fopen("/proc/meminfo", "r");
+  if (fp != NULL) {
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      if (sscanf(line, "Hugepagesize: %lu kB", &huge_kb) == 1) {
+        break;
+      }
+    }
+    fclose(fp);
+  }
+  return (size_t)huge_kb * 1024;
+}  /* cprt_huge_page_size */
+#endif
+
+
+/* Allocate a large, page-aligned, zeroed region. Tries explicit huge pages,
+ * then transparent huge pages, then normal pages (as permitted by flags).
+ * If numa_node >= 0 (or CPRT_NUMA_NODE_CURRENT), the memory is bound to
+ * that node (best effort; see info->numa_node).
+ * Returns NULL on error (sets errno). Fills in "info" with what was actually
+ * gotten; pass it to cprt_free_large(). */
+void *cprt_alloc_large(size_t size, int flags, int numa_node, struct cprt_alloc_info *info)
+{
+  void *ptr = NULL;
+
+  if (numa_node == CPRT_NUMA_NODE_CURRENT) {
+    numa_node = cprt_current_numa_node();
+  }
+  info->got_flags = 0;
+  info->numa_node = -1;
+
+#if defined(_WIN32)
+  {
+    size_t large_sz = GetLargePageMinimum();
+    SYSTEM_INFO sys_info;
+    DWORD alloc_type = MEM_RESERVE | MEM_COMMIT;
+
+    if ((flags & CPRT_ALLOC_HUGE_EXPLICIT) && large_sz > 0) {
+      /* Requires the "Lock pages in memory" privilege. */
+      info->size = (size + large_sz - 1) & ~(large_sz - 1);
+      if (numa_node >= 0) {
+        ptr = VirtualAllocExNuma(GetCurrentProcess(), NULL, info->size,
+            alloc_type | MEM_LARGE_PAGES, PAGE_READWRITE, (DWORD)numa_node);
+      } else {
+        ptr = VirtualAlloc(NULL, info->size, alloc_type | MEM_LARGE_PAGES, PAGE_READWRITE);
+      }
+      if (ptr != NULL) {
+        info->page_size = large_sz;
+        info->got_flags = CPRT_ALLOC_HUGE_EXPLICIT;
+      }
+    }
+    if (ptr == NULL) {
+      GetSystemInfo(&sys_info);
+      info->page_size = sys_info.dwPageSize;
+      info->size = (size + info->page_size - 1) & ~(info->page_size - 1);
+      if (numa_node >= 0) {
+        ptr = VirtualAllocExNuma(GetCurrentProcess(), NULL, info->size,
+            alloc_type, PAGE_READWRITE, (DWORD)numa_node);
+      } else {
+        ptr = VirtualAlloc(NULL, info->size, alloc_type, PAGE_READWRITE);
+      }
+      if (ptr == NULL) {
+        errno = GetLastError();
+        return NULL;
+      }
+    }
+    if (numa_node >= 0) {
+      info->numa_node = numa_node;
+    }
+  }
+
+#else  /* Unix */
+  {
+    size_t page_sz = (size_t)sysconf(_SC_PAGESIZE);
+    size_t huge_sz = page_sz;
+
+#if defined(__linux__)
+    huge_sz = cprt_huge_page_size();
+    if (flags & CPRT_ALLOC_HUGE_EXPLICIT) {
+      info->size = (size + huge_sz - 1) & ~(huge_sz - 1);
+      ptr = mmap(NULL, info->size, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (ptr != MAP_FAILED) {
+        info->page_size = huge_sz;
+        info->got_flags = CPRT_ALLOC_HUGE_EXPLICIT;
+      } else {
+        ptr = NULL;
+      }
+    }
+#endif
+
+    if (ptr == NULL) {
+      info->page_size = page_sz;
+      info->size = (size + page_sz - 1) & ~(page_sz - 1);
+      if ((flags & CPRT_ALLOC_HUGE_THP) && huge_sz > page_sz) {
+        /* Over-allocate so the region can be huge-page aligned, then
+         * trim the excess; THP only backs aligned huge-page extents. */
+        char *raw;
+        size_t raw_sz = info->size + huge_sz;
+        size_t head;
+        raw = mmap(NULL, raw_sz, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+          return NULL;
+        }
+        head = (huge_sz - ((uintptr_t)raw & (huge_sz - 1))) & (huge_sz - 1);
+        if (head > 0) {
+          munmap(raw, head);
+        }
+        if (raw_sz - head - info->size > 0) {
+          munmap(raw + head + info->size, raw_sz - head - info->size);
+        }
+        ptr = raw + head;
+#if defined(MADV_HUGEPAGE)
+        if (madvise(ptr, info->size, MADV_HUGEPAGE) == 0) {
+          info->got_flags = CPRT_ALLOC_HUGE_THP;
+        }
+#endif
+      } else {
+        ptr = mmap(NULL, info->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+          return NULL;
+        }
+      }
+    }
+
+#if defined(__linux__)
+    if (numa_node >= 0) {
+      /* Use the raw syscall to avoid a dependency on libnuma. Nothing has
+       * been touched yet, so no page migration is needed. */
+      unsigned long nodemask[16];
+      int save_errno = errno;
+      memset(nodemask, 0, sizeof(nodemask));
+      if (numa_node < (int)(sizeof(nodemask) * 8)) {
+        nodemask[numa_node / (8 * sizeof(unsigned long))] |=
+            1ul << (numa_node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_mbind, ptr, info->size, 2 /* MPOL_BIND */,
+            nodemask, sizeof(nodemask) * 8 + 1, 0) == 0) {
+          info->numa_node = numa_node;
+        }
+      }
+      errno = save_errno;  /* Binding is best effort. */
+    }
+#endif
+  }
+#endif
+
+  return ptr;
+}  /* cprt_alloc_large */
+
+
+/* Return 0 on success, -1 on error (sets errno). */
+int cprt_free_large(void *ptr, struct cprt_alloc_info *info)
+{
+#if defined(_WIN32)
+  if (! VirtualFree(ptr, 0, MEM_RELEASE)) {
+    errno = GetLastError();
+    return -1;
+  }
+  return 0;
+
+#else  /* Unix */
+  return munmap(ptr, info->size);
+#endif
+}  /* cprt_free_large */
+
+
+/* Touch every page of a buffer (for writing) so that later accesses don't
+ * take page faults. Contents are preserved, but don't call it while other
+ * threads are writing the buffer.
+ * Return 0 on success, -1 on error (sets errno). */
+int cprt_prefault(void *buf, size_t size)
+{
+  volatile char *p = (volatile char *)buf;
+  size_t page_sz;
+  size_t i;
+
+#if defined(_WIN32)
+  SYSTEM_INFO sys_info;
+  GetSystemInfo(&sys_info);
+  page_sz = sys_info.dwPageSize;
+#else  /* Unix */
+  page_sz = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+
+#if defined(MADV_POPULATE_WRITE)
+  {
+    /* Let the kernel do it in one call (Linux 5.14+). Needs page-aligned
+     * start; fall through to touching on any failure. */
+    uintptr_t start = (uintptr_t)buf & ~(uintptr_t)(page_sz - 1);
+    int save_errno = errno;
+    if (madvise((void *)start, size + ((uintptr_t)buf - start),
+        MADV_POPULATE_WRITE) == 0) {
+      return 0;
+    }
+    errno = save_errno;
+  }
+#endif
+
+  if (size == 0) {
+    return 0;
+  }
+  for (i = 0; i < size; i += page_sz) {
+    p[i] = p[i];
+  }
+  p[size - 1] = p[size - 1];  /* In case buf is not page-aligned. */
+
+  return 0;
+}  /* cprt_prefault */
+
+
+/* Lock all current and future memory of the process into RAM.
+ * Return 0 on success, -1 on error (sets errno). */
+int cprt_lock_all()
+{
+#if defined(_WIN32)
+  /* Windows has no mlockall(); use cprt_lock_region() per buffer. */
+  errno = ENOSYS;
+  return -1;
+
+#else  /* Unix */
+  return mlockall(MCL_CURRENT | MCL_FUTURE);
+#endif
+}  /* cprt_lock_all */
+
+
+/* Lock a buffer into RAM.
+ * Return 0 on success, -1 on error (sets errno). */
+int cprt_lock_region(void *buf, size_t size)
+{
+#if defined(_WIN32)
+  SIZE_T min_ws, max_ws;
+
+  /* VirtualLock() is limited by the working set size, so grow it. */
+  if (! GetProcessWorkingSetSize(GetCurrentProcess(), &min_ws, &max_ws) ||
+      ! SetProcessWorkingSetSize(GetCurrentProcess(), min_ws + size, max_ws + size) ||
+      ! VirtualLock(buf, size)) {
+    errno = GetLastError();
+    return -1;
+  }
+  return 0;
+
+#else  /* Unix */
+  return mlock(buf, size);
+#endif
+}  /* cprt_lock_region */
+
+
+/* Touch "size" bytes of the calling thread's stack so that later deep calls
+ * don't take page faults. Call it at the top of a thread's entrypoint.
+ * The size must be well below the thread's stack size. */
+void cprt_stack_pretouch(size_t size)
+{
+  volatile char *p;
+  size_t i;
+
+#if defined(_WIN32)
+  p = (volatile char *)_alloca(size);
+#else  /* Unix */
+  p = (volatile char *)alloca(size);
+#endif
+  for (i = 0; i < size; i += 1024) {
+    p[i] = 0;
+  }
+}  /* cprt_stack_pretouch */
+
+
+#if ! defined(_WIN32)
+/* getrusage() for the calling thread where the OS supports it, else for
+ * the process. Fills in counts from it. */
+static int cprt_getrusage(struct rusage *usage, struct cprt_fault_counts *counts)
+{
+#if defined(RUSAGE_THREAD)
+  if (getrusage(RUSAGE_THREAD, usage) != 0) {
+    return -1;
+  }
+#else
+  if (getrusage(RUSAGE_SELF, usage) != 0) {
+    return -1;
+  }
+#endif
+  counts->minor_faults = (uint64_t)usage->ru_minflt;
+  counts->major_faults = (uint64_t)usage->ru_majflt;
+  return 0;
+}  /* cprt_getrusage */
+#endif
+
+
+static void cprt_fault_sub(const struct cprt_fault_counts *now, const struct cprt_fault_counts *start,
+    struct cprt_fault_counts *delta)
+{
+  delta->minor_faults = now->minor_faults - start->minor_faults;
+  delta->major_faults = now->major_faults - start->major_faults;
+}  /* cprt_fault_sub */
+
+
+/* Get page fault counts. On Linux these are for the calling thread; on
+ * other Unixes and Windows they are for the whole process (Windows does
+ * not distinguish minor and major faults; all are counted as minor).
+ * Return 0 on success, -1 on error (sets errno). */
+int cprt_fault_counts(struct cprt_fault_counts *counts)
+{
+#if defined(_WIN32)
+  PROCESS_MEMORY_COUNTERS pmc;
+  if (! GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+    errno = GetLastError();
+    return -1;
+  }
+  counts->minor_faults = pmc.PageFaultCount;
+  counts->major_faults = 0;
+
+#else  /* Unix */
+  struct rusage usage;
+  if (cprt_getrusage(&usage, counts) != 0) {
+    return -1;
+  }
+#endif
+
+  return 0;
+}  /* cprt_fault_counts */
+
+
+/* Get faults taken since "start" was filled in by cprt_fault_counts().
+ * Return 0 on success, -1 on error (sets errno). */
+int cprt_fault_delta(const struct cprt_fault_counts *start, struct cprt_fault_counts *delta)
+{
+  struct cprt_fault_counts now;
+
+  if (cprt_fault_counts(&now) != 0) {
+    return -1;
+  }
+  cprt_fault_sub(&now, start, delta);
+
+  return 0;
+}  /* cprt_fault_delta */
+
+
+/* Return the OS's id for the calling thread (Linux gettid(), Windows
+ * GetCurrentThreadId()), as used by cprt_thread_stats_tid(), ps, top -H,
+ * perf, etc. */
+uint64_t cprt_thread_os_tid()
+{
+#if defined(_WIN32)
+  return (uint64_t)GetCurrentThreadId();
+#elif defined(__linux__)
+  return (uint64_t)syscall(SYS_gettid);
+#elif defined(__APPLE__)
+  uint64_t tid;
+  pthread_threadid_np(NULL, &tid);
+  return tid;
+#else  /* Non-Linux Unix. */
+  return (uint64_t)pthread_self();
+#endif
+}  /* cprt_thread_os_tid */
+
+
+/* Get the calling thread's CPU times, context switches and page faults.
+ * Windows has no per-thread context switch or fault counts without
+ * undocumented APIs: switches are 0 and faults are process-wide (see
+ * cprt_fault_counts()). Non-Linux Unix counts are process-wide.
+ * Return 0 on success, -1 on error (sets errno). */
+int cprt_thread_stats(struct cprt_thread_stats *stats)
+{
+#if defined(_WIN32)
+  FILETIME create_time, exit_time, kernel_time, user_time;
+
+  memset(stats, 0, sizeof(*stats));
+  if (! GetThreadTimes(GetCurrentThread(), &create_time, &exit_time, &kernel_time, &user_time)) {
+    errno = GetLastError();
+    return -1;
+  }
+  /* FILETIMEs are in 100 ns units. */
+  stats->user_ns = ((((uint64_t)user_time.dwHighDateTime) << 32) | user_time.dwLowDateTime) * 100;
+  stats->sys_ns = ((((uint64_t)kernel_time.dwHighDateTime) << 32) | kernel_time.dwLowDateTime) * 100;
+  if (cprt_fault_counts(&stats->faults) != 0) {
+    return -1;
+  }
+
+#else  /* Unix */
+  struct rusage usage;
+  if (cprt_getrusage(&usage, &stats->faults) != 0) {
+    return -1;
+  }
+  stats->user_ns = (uint64_t)usage.ru_utime.tv_sec * UINT64_C(1000000000) +
+      (uint64_t)usage.ru_utime.tv_usec * 1000;
+  stats->sys_ns = (uint64_t)usage.ru_stime.tv_sec * UINT64_C(1000000000) +
+      (uint64_t)usage.ru_stime.tv_usec * 1000;
+  stats->vol_ctx_switches = (uint64_t)usage.ru_nvcsw;
+  stats->invol_ctx_switches = (uint64_t)usage.ru_nivcsw;
+#endif
+
+  return 0;
+}  /* cprt_thread_stats */
+
+
+/* Get stats for any thread in this process, given its cprt_thread_os_tid().
+ * On Linux this reads /proc/self/task/<tid>/stat and status, so CPU times
+ * have clock-tick (usually 10 ms) resolution. Windows only fills in CPU
+ * times. Return 0 on success, -1 on error (sets errno; ENOSYS on non-Linux
+ * Unix). */
+int cprt_thread_stats_tid(uint64_t os_tid, struct cprt_thread_stats *stats)
+{
+#if defined(_WIN32)
+  FILETIME create_time, exit_time, kernel_time, user_time;
+  HANDLE handle;
+
+  memset(stats, 0, sizeof(*stats));
+  handle = OpenThread(THREAD_QUERY_LIMITED_INFORMATION, FALSE, (DWORD)os_tid);
+  if (handle == NULL) {
+    errno = GetLastError();
+    return -1;
+  }
+  if (! GetThreadTimes(handle, &create_time, &exit_time, &kernel_time, &user_time)) {
+    errno = GetLastError();
+    CloseHandle(handle);
+    return -1;
+  }
+  CloseHandle(handle);
+  stats->user_ns = ((((uint64_t)user_time.dwHighDateTime) << 32) | user_time.dwLowDateTime) * 100;
+  stats->sys_ns = ((((uint64_t)kernel_time.dwHighDateTime) << 32) | kernel_time.dwLowDateTime) * 100;
+  return 0;
+
+#elif defined(__linux__)
+  char path[128];
+  char buf[1024];
+  char *p;
+  FILE *fp;
+  unsigned long long minflt, majflt, utime, stime;
+  uint64_t ns_per_tick = UINT64_C(1000000000) / (uint64_t)sysconf(_SC_CLK_TCK);
+
+  memset(stats, 0, sizeof(*stats));
+  CPRT_SNPRINTF(path, sizeof(path), "/proc/self/task/%"PRIu64"/stat", os_tid);
+  if (cprt_read_sys_str(path, buf, sizeof(buf)) != 0) {
+    return -1;
+  }
+  /* The name (field 2) is in parens and can contain spaces; skip it. */
+  p = strrchr(buf, ')');
+  if (p == NULL || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %llu %*u %llu %*u %llu %llu",
+      &minflt, &majflt, &utime, &stime) != 4) {
+    errno = EINVAL;
+    return -1;
+  }
+  stats->faults.minor_faults = minflt;
+  stats->faults.major_faults = majflt;
+  stats->user_ns = utime * ns_per_tick;
+  stats->sys_ns = stime * ns_per_tick;
+
+  CPRT_SNPRINTF(path, sizeof(path), "/proc/self/task/%"PRIu64"/status", os_tid);
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  while (fgets(buf, sizeof(buf), fp) != NULL) {
+    if (strncmp(buf, "voluntary_ctxt_switches:", 24) == 0) {
+      stats->vol_ctx_switches = strtoull(buf + 24, NULL, 10);
+    }
+    else if (strncmp(buf, "nonvoluntary_ctxt_switches:", 27) == 0) {
+      stats->invol_ctx_switches = strtoull(buf + 27, NULL, 10);
+    }
+  }
+  fclose(fp);
+  return 0;
+
+#else  /* Non-Linux Unix. */
+  memset(stats, 0, sizeof(*stats));
+  errno = ENOSYS;
+  return -1;
+#endif
+}  /* cprt_thread_stats_tid */
+
+
+/* Get the calling thread's stats since "start" was filled in by
+ * cprt_thread_stats(), e.g. to see if a measured region was preempted.
+ * Return 0 on success, -1 on error (sets errno). */
+int cprt_thread_stats_delta(const struct cprt_thread_stats *start, struct cprt_thread_stats *delta)
+{
+  struct cprt_thread_stats now;
+
+  if (cprt_thread_stats(&now) != 0) {
+    return -1;
+  }
+  delta->user_ns = now.user_ns - start->user_ns;
+  delta->sys_ns = now.sys_ns - start->sys_ns;
+  delta->vol_ctx_switches = now.vol_ctx_switches - start->vol_ctx_switches;
+  delta->invol_ctx_switches = now.invol_ctx_switches - start->invol_ctx_switches;
+  cprt_fault_sub(&now.faults, &start->faults, &delta->faults);
+
+  return 0;
+}  /* cprt_thread_stats_delta */
+
+
+/* Thread-local storage class. */
+#if defined(_WIN32)
+  #define CPRT_TLS __declspec(thread)
+#else
+  #define CPRT_TLS __thread
+#endif
+
+/* Acquire/release ordering is free on x86 (only compiler reordering needs
+ * to be prevented); elsewhere use a full fence. */
+#if defined(_WIN32)
+  #if defined(_M_IX86) || defined(_M_X64)
+    #define CPRT_ACQ_REL_FENCE() _ReadWriteBarrier()
+  #else
+    #define CPRT_ACQ_REL_FENCE() MemoryBarrier()
+  #endif
+#else
+  #if defined(__i386__) || defined(__x86_64__)
+    #define CPRT_ACQ_REL_FENCE() __asm__ __volatile__("" ::: "memory")
+  #else
+    #define CPRT_ACQ_REL_FENCE() __sync_synchronize()
+  #endif
+#endif
+
+#define CPRT_CACHE_LINE 64
+#define CPRT_POOL_DEQUE_SIZE 4096  /* Must be a power of 2. */
+
+struct cprt_pool_task {
+  cprt_pool_fn_t fn;
+  void *arg;
+  struct cprt_pool_wg *wg;
+};
+
+/* Deque indexes are "long" for the atomics (32 bits on Windows), so all
+ * index math is done unsigned to wrap safely. */
+#define CPRT_POOL_IDX_DIFF(_a, _b) ((long)((unsigned long)(_a) - (unsigned long)(_b)))
+#define CPRT_POOL_IDX_ADD(_a, _n) ((long)((unsigned long)(_a) + (unsigned long)(_n)))
+
+struct cprt_pool_worker {
+  /* Chase-Lev deque. "top" is written by thieves, "bottom" only by the
+   * owner; keep them on separate cache lines. */
+  volatile long top;
+  char pad1[CPRT_CACHE_LINE - sizeof(long)];
+  volatile long bottom;
+  char pad2[CPRT_CACHE_LINE - sizeof(long)];
+  struct cprt_pool_task tasks[CPRT_POOL_DEQUE_SIZE];
+  cprt_pool_t *pool;
+  int index;
+  int pin_cpu;  /* -1 for not pinned. */
+  uint32_t rand_state;
+  CPRT_THREAD_T thread_id;
+  struct cprt_pool_stats stats;  /* Only written by the owner. */
+};
+
+struct cprt_pool_s {
+  int num_workers;
+  struct cprt_pool_worker **workers;
+  uint64_t spin_ns;
+  volatile long pending;  /* Tasks queued but not yet started. */
+  volatile long num_parked;
+  volatile long num_waiters;  /* Non-workers parked in cprt_pool_wait(). */
+  volatile long shutdown;
+  CPRT_MUTEX_T lock;  /* Protects the injection queue and parking. */
+  CPRT_COND_T wake_cond;
+  CPRT_COND_T done_cond;  /* A wait group reached zero. */
+  /* Injection queue (ring) for tasks submitted by non-worker threads. */
+  struct cprt_pool_task *inject;
+  long inject_size;
+  long inject_head;
+  volatile long inject_count;
+};
+
+/* Which pool/worker the current thread is (NULL if not a worker). */
+static CPRT_TLS struct cprt_pool_worker *cprt_pool_self = NULL;
+static CPRT_TLS uint32_t cprt_pool_ext_rand = 0;
+
+
+static uint32_t cprt_pool_rand(uint32_t *state)
+{
+  uint32_t x = *state;  /* xorshift32 */
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}  /* cprt_pool_rand */
+
+
+/* Owner only. Return 0 on success, -1 if the deque is full. */
+static int cprt_pool_push(struct cprt_pool_worker *w, struct cprt_pool_task *task)
+{
+  long b = w->bottom;
+  long t = w->top;
+
+  if (CPRT_POOL_IDX_DIFF(b, t) >= CPRT_POOL_DEQUE_SIZE) {
+    return -1;
+  }
+  w->tasks[b & (CPRT_POOL_DEQUE_SIZE - 1)] = *task;
+  CPRT_ACQ_REL_FENCE();  /* Task must be visible before bottom moves. */
+  w->bottom = CPRT_POOL_IDX_ADD(b, 1);
+
+  return 0;
+}  /* cprt_pool_push */
+
+
+/* Owner only; takes newest task. Return 1 if got a task, 0 if empty. */
+static int cprt_pool_take(struct cprt_pool_worker *w, struct cprt_pool_task *task)
+{
+  long b = CPRT_POOL_IDX_ADD(w->bottom, -1);
+  long t;
+  int got = 1;
+
+  w->bottom = b;
+  CPRT_MEMORY_FENCE();  /* Bottom store must precede top load. */
+  t = w->top;
+  if (CPRT_POOL_IDX_DIFF(b, t) < 0) {  /* Empty. */
+    w->bottom = CPRT_POOL_IDX_ADD(b, 1);
+    return 0;
+  }
+  *task = w->tasks[b & (CPRT_POOL_DEQUE_SIZE - 1)];
+  if (b == t) {  /* Last task; race thieves for it. */
+    if (! CPRT_ATOMIC_CAS(&w->top, t, CPRT_POOL_IDX_ADD(t, 1))) {
+      got = 0;
+    }
+    w->bottom = CPRT_POOL_IDX_ADD(b, 1);
+  }
+  return got;
+}  /* cprt_pool_take */
+
+
+/* Any thread; takes oldest task. Return 1 if got a task, 0 if empty or
+ * lost a race. */
+static int cprt_pool_steal(struct cprt_pool_worker *w, struct cprt_pool_task *task)
+{
+  long t = w->top;
+  long b;
+
+  CPRT_MEMORY_FENCE();  /* Top load must precede bottom load. */
+  b = w->bottom;
+  if (CPRT_POOL_IDX_DIFF(b, t) <= 0) {
+    return 0;
+  }
+  /* Pairs with the fence in cprt_pool_push(): the slot must not be read
+   * before the bottom that published it. */
+  CPRT_ACQ_REL_FENCE();
+  /* The slot can't be reused by the owner until top moves past it; if
+   * another thief or the owner took it first, top moved, the CAS fails
+   * and the copy is dropped. */
+  *task = w->tasks[t & (CPRT_POOL_DEQUE_SIZE - 1)];
+  return CPRT_ATOMIC_CAS(&w->top, t, CPRT_POOL_IDX_ADD(t, 1)) ? 1 : 0;
+}  /* cprt_pool_steal */
+
+
+/* Find a task from (in order) own deque, injection queue, other deques.
+ * "self" is NULL for non-worker threads. Return 1 if got a task. */
+static int cprt_pool_find_task(cprt_pool_t *pool, struct cprt_pool_worker *self,
+    struct cprt_pool_task *task)
+{
+  uint32_t *rand_state;
+  int i, victim;
+
+  if (self != NULL && cprt_pool_take(self, task)) {
+    CPRT_ATOMIC_DEC_VAL(&pool->pending);
+    return 1;
+  }
+
+  if (pool->inject_count > 0) {
+    int got = 0;
+    CPRT_MUTEX_LOCK(pool->lock);
+    if (pool->inject_count > 0) {
+      *task = pool->inject[pool->inject_head];
+      pool->inject_head = (pool->inject_head + 1) % pool->inject_size;
+      pool->inject_count--;
+      got = 1;
+    }
+    CPRT_MUTEX_UNLOCK(pool->lock);
+    if (got) {
+      CPRT_ATOMIC_DEC_VAL(&pool->pending);
+      return 1;
+    }
+  }
+
+  if (self != NULL) {
+    rand_state = &self->rand_state;
+  } else {
+    if (cprt_pool_ext_rand == 0) {
+      cprt_pool_ext_rand = (uint32_t)(uintptr_t)&i | 1;
+    }
+    rand_state = &cprt_pool_ext_rand;
+  }
+  victim = (int)(cprt_pool_rand(rand_state) % (uint32_t)pool->num_workers);
+  for (i = 0; i < pool->num_workers; i++) {
+    struct cprt_pool_worker *w = pool->workers[(victim + i) % pool->num_workers];
+    if (w != self && cprt_pool_steal(w, task)) {
+      CPRT_ATOMIC_DEC_VAL(&pool->pending);
+      if (self != NULL) {
+        self->stats.steals++;
+      }
+      return 1;
+    }
+  }
+
+  return 0;
+}  /* cprt_pool_find_task */
+
+
+static void cprt_pool_run_task(cprt_pool_t *pool, struct cprt_pool_worker *self, struct cprt_pool_task *task)
+{
+  (*task->fn)(task->arg);
+  if (self != NULL) {
+    self->stats.tasks_run++;  /* Before the wg release, so it is exact after a wait. */
+  }
+  /* Full barrier: publishes results, and precedes the num_waiters read
+   * (a parking waiter increments num_waiters before reading pending). */
+  if (task->wg != NULL && CPRT_ATOMIC_DEC_VAL(&task->wg->pending) == 0 && pool->num_waiters > 0) {
+    CPRT_MUTEX_LOCK(pool->lock);
+    CPRT_COND_BROADCAST(pool->done_cond);
+    CPRT_MUTEX_UNLOCK(pool->lock);
+  }
+}  /* cprt_pool_run_task */
+
+
+static CPRT_THREAD_ENTRYPOINT cprt_pool_worker_thread(void *in_arg)
+{
+  struct cprt_pool_worker *self = (struct cprt_pool_worker *)in_arg;
+  cprt_pool_t *pool = self->pool;
+  struct cprt_pool_task task;
+  struct cprt_timespec idle_start_ts, cur_ts;
+  uint64_t idle_ns;
+  int got;
+
+  cprt_pool_self = self;
+  if (self->pin_cpu >= 0) {
+    cprt_cpuset_t *cpuset = cprt_cpuset_create();
+    cprt_cpuset_set(cpuset, self->pin_cpu);
+    cprt_set_affinity_cpuset(cpuset);
+    cprt_cpuset_delete(cpuset);
+  }
+
+  while (1) {
+    if (cprt_pool_find_task(pool, self, &task)) {
+      cprt_pool_run_task(pool, self, &task);
+      continue;
+    }
+    if (pool->shutdown && pool->pending <= 0) {
+      break;
+    }
+
+    /* Idle: spin for a while, then park. */
+    got = 0;
+    CPRT_GETTIME(&idle_start_ts);
+    do {
+      CPRT_CPU_PAUSE();
+      if (cprt_pool_find_task(pool, self, &task)) {
+        got = 1;
+        break;
+      }
+      CPRT_GETTIME(&cur_ts);
+      CPRT_DIFF_TS(idle_ns, cur_ts, idle_start_ts);
+    } while (idle_ns < pool->spin_ns && ! pool->shutdown);
+
+    if (! got && ! pool->shutdown) {
+      CPRT_MUTEX_LOCK(pool->lock);
+      CPRT_ATOMIC_INC_VAL(&pool->num_parked);  /* Full barrier. */
+      while (pool->pending <= 0 && ! pool->shutdown) {
+        self->stats.parks++;
+        CPRT_COND_WAIT(pool->wake_cond, pool->lock);
+      }
+      CPRT_ATOMIC_DEC_VAL(&pool->num_parked);
+      CPRT_MUTEX_UNLOCK(pool->lock);
+    }
+
+    CPRT_GETTIME(&cur_ts);
+    CPRT_DIFF_TS(idle_ns, cur_ts, idle_start_ts);
+    self->stats.idle_ns += idle_ns;
+    if (got) {
+      cprt_pool_run_task(pool, self, &task);
+    }
+  }
+
+  CPRT_THREAD_EXIT;
+  return 0;
+}  /* cprt_pool_worker_thread */
+
+
+/* Create a pool of num_workers threads, each with its own work-stealing
+ * deque. If pin_cpus is not NULL, worker i is pinned to the i'th CPU in
+ * it (wrapping around). Idle workers spin for spin_ns before parking
+ * (0 = park immediately). Errors are fatal. */
+cprt_pool_t *cprt_pool_create(int num_workers, const cprt_cpuset_t *pin_cpus, uint64_t spin_ns)
+{
+  cprt_pool_t *pool;
+  int i, cpu = -1;
+
+  CPRT_ASSERT(num_workers > 0);
+  CPRT_ENULL(pool = (cprt_pool_t *)calloc(1, sizeof(cprt_pool_t)));
+  pool->num_workers = num_workers;
+  pool->spin_ns = spin_ns;
+  CPRT_MUTEX_INIT(pool->lock);
+  CPRT_COND_INIT(pool->wake_cond);
+  CPRT_COND_INIT(pool->done_cond);
+  pool->inject_size = 1024;
+  CPRT_ENULL(pool->inject = (struct cprt_pool_task *)malloc(
+      pool->inject_size * sizeof(struct cprt_pool_task)));
+
+  CPRT_ENULL(pool->workers = (struct cprt_pool_worker **)calloc(
+      num_workers, sizeof(struct cprt_pool_worker *)));
+  for (i = 0; i < num_workers; i++) {
+    struct cprt_pool_worker *w;
+    CPRT_ENULL(w = (struct cprt_pool_worker *)calloc(1, sizeof(struct cprt_pool_worker)));
+    w->pool = pool;
+    w->index = i;
+    w->rand_state = 0x9e3779b9u * (uint32_t)(i + 1);
+    w->pin_cpu = -1;
+    if (pin_cpus != NULL && cprt_cpuset_count(pin_cpus) > 0) {
+      cpu = cprt_cpuset_next(pin_cpus, cpu + 1);
+      if (cpu < 0) {
+        cpu = cprt_cpuset_next(pin_cpus, 0);  /* Wrap. */
+      }
+      w->pin_cpu = cpu;
+    }
+    pool->workers[i] = w;
+  }
+  /* Start threads only after all workers exist (they steal from each other). */
+  for (i = 0; i < num_workers; i++) {
+    CPRT_THREAD_CREATE(pool->workers[i]->thread_id, cprt_pool_worker_thread, pool->workers[i]);
+  }
+
+  return pool;
+}  /* cprt_pool_create */
+
+
+/* Stop and join the workers (after they drain any queued tasks). */
+void cprt_pool_delete(cprt_pool_t *pool)
+{
+  int i;
+
+  CPRT_MUTEX_LOCK(pool->lock);
+  pool->shutdown = 1;
+  CPRT_COND_BROADCAST(pool->wake_cond);
+  CPRT_MUTEX_UNLOCK(pool->lock);
+
+  for (i = 0; i < pool->num_workers; i++) {
+    CPRT_THREAD_JOIN(pool->workers[i]->thread_id);
+    free(pool->workers[i]);
+  }
+  free(pool->workers);
+  free(pool->inject);
+  CPRT_COND_DELETE(pool->wake_cond);
+  CPRT_COND_DELETE(pool->done_cond);
+  CPRT_MUTEX_DELETE(pool->lock);
+  free(pool);
+}  /* cprt_pool_delete */
+
+
+int cprt_pool_num_workers(const cprt_pool_t *pool)
+{
+  return pool->num_workers;
+}  /* cprt_pool_num_workers */
+
+
+/* Return the calling thread's worker index in pool, or -1 if the caller
+ * is not one of its workers. */
+int cprt_pool_worker_index(const cprt_pool_t *pool)
+{
+  if (cprt_pool_self == NULL || cprt_pool_self->pool != pool) {
+    return -1;
+  }
+  return cprt_pool_self->index;
+}  /* cprt_pool_worker_index */
+
+
+void cprt_pool_wg_init(struct cprt_pool_wg *wg)
+{
+  wg->pending = 0;
+}  /* cprt_pool_wg_init */
+
+
+/* Queue fn(arg) to run on the pool. If wg is not NULL, it counts the
+ * task until it completes (see cprt_pool_wait()). Tasks submitted from a
+ * worker go on its own deque (LIFO, stealable); others go on a shared
+ * injection queue. */
+void cprt_pool_submit(cprt_pool_t *pool, struct cprt_pool_wg *wg, cprt_pool_fn_t fn, void *arg)
+{
+  struct cprt_pool_task task;
+  struct cprt_pool_worker *self = cprt_pool_self;
+
+  task.fn = fn;
+  task.arg = arg;
+  task.wg = wg;
+  if (wg != NULL) {
+    CPRT_ATOMIC_INC_VAL(&wg->pending);
+  }
+  CPRT_ATOMIC_INC_VAL(&pool->pending);
+
+  if (self != NULL && self->pool == pool) {
+    if (cprt_pool_push(self, &task) != 0) {
+      /* Deque full; run it here rather than block. */
+      CPRT_ATOMIC_DEC_VAL(&pool->pending);
+      cprt_pool_run_task(pool, self, &task);
+      return;
+    }
+  }
+  else {
+    CPRT_MUTEX_LOCK(pool->lock);
+    if (pool->inject_count == pool->inject_size) {  /* Grow the ring. */
+      struct cprt_pool_task *new_inject;
+      long i;
+      CPRT_ENULL(new_inject = (struct cprt_pool_task *)malloc(
+          2 * pool->inject_size * sizeof(struct cprt_pool_task)));
+      for (i = 0; i < pool->inject_count; i++) {
+        new_inject[i] = pool->inject[(pool->inject_head + i) % pool->inject_size];
+      }
+      free(pool->inject);
+      pool->inject = new_inject;
+      pool->inject_head = 0;
+      pool->inject_size *= 2;
+    }
+    pool->inject[(pool->inject_head + pool->inject_count) % pool->inject_size] = task;
+    pool->inject_count++;
+    CPRT_MUTEX_UNLOCK(pool->lock);
+  }
+
+  /* Pending was incremented (full barrier) before num_parked is read, and
+   * a parking worker increments num_parked before reading pending, so at
+   * least one side sees the other. */
+  CPRT_MEMORY_FENCE();
+  if (pool->num_parked > 0) {
+    CPRT_MUTEX_LOCK(pool->lock);
+    CPRT_COND_SIGNAL(pool->wake_cond);
+    CPRT_MUTEX_UNLOCK(pool->lock);
+  }
+}  /* cprt_pool_submit */
+
+
+/* Wait for all tasks counted by wg to complete. The caller runs queued
+ * tasks while it waits, so it is safe to call from inside a task. When
+ * there is nothing to run, a non-worker caller spins for the pool's
+ * spin_ns and then parks until wg is done; a worker keeps looking (its
+ * own deque may get more tasks). */
+void cprt_pool_wait(cprt_pool_t *pool, struct cprt_pool_wg *wg)
+{
+  struct cprt_pool_worker *self = cprt_pool_self;
+  struct cprt_pool_task task;
+  struct cprt_timespec idle_start_ts, cur_ts;
+  uint64_t idle_ns;
+  int idle_loops = 0;
+
+  if (self != NULL && self->pool != pool) {
+    self = NULL;
+  }
+  while (wg->pending > 0) {
+    if (cprt_pool_find_task(pool, self, &task)) {
+      cprt_pool_run_task(pool, self, &task);
+      idle_loops = 0;
+      continue;
+    }
+    if (idle_loops++ == 0) {
+      CPRT_GETTIME(&idle_start_ts);
+    }
+    if (idle_loops < 1000) {
+      CPRT_CPU_PAUSE();
+      continue;
+    }
+    if (self != NULL) {
+      CPRT_THREAD_YIELD();
+      continue;
+    }
+    CPRT_GETTIME(&cur_ts);
+    CPRT_DIFF_TS(idle_ns, cur_ts, idle_start_ts);
+    if (idle_ns < pool->spin_ns) {
+      CPRT_CPU_PAUSE();
+      continue;
+    }
+    CPRT_MUTEX_LOCK(pool->lock);
+    CPRT_ATOMIC_INC_VAL(&pool->num_waiters);  /* Full barrier. */
+    while (wg->pending > 0) {
+      CPRT_COND_WAIT(pool->done_cond, pool->lock);
+    }
+    CPRT_ATOMIC_DEC_VAL(&pool->num_waiters);
+    CPRT_MUTEX_UNLOCK(pool->lock);
+  }
+  CPRT_ACQ_REL_FENCE();  /* See task results. */
+}  /* cprt_pool_wait */
+
+
+/* Copy a worker's statistics (approximate while the pool is running). */
+void cprt_pool_get_stats(const cprt_pool_t *pool, int worker, struct cprt_pool_stats *stats)
+{
+  *stats = pool->workers[worker]->stats;
+}  /* cprt_pool_get_stats */
+
+
+/* Persistent pool for cprt_parallel_for() and cprt_parallel_reduce(). */
+static cprt_pool_t *cprt_parallel_pool_p = NULL;
+static volatile long cprt_parallel_state = 0;  /* 0=none, 1=starting, 2=ready. */
+
+struct cprt_parallel_job {
+  uint64_t begin;
+  uint64_t end;
+  uint64_t grain;  /* 0 = static chunking. */
+  long num_slots;
+  long num_chunks;
+  volatile long next_chunk;  /* Dynamic chunking cursor. */
+  volatile long *slot_claimed;  /* Static chunking. */
+  cprt_parallel_fn_t fn;
+  cprt_reduce_fn_t reduce_fn;
+  char *partials;
+  size_t result_size;
+  void *ctx;
+};
+
+struct cprt_parallel_task {
+  struct cprt_parallel_job *job;
+  long task_num;
+};
+
+
+/* Start the persistent pool (once). num_threads of 0 means one worker per
+ * physical core in the caller's affinity, each pinned to its own core
+ * (one hardware thread per core). Calling it is optional; the first
+ * cprt_parallel_for() or cprt_parallel_reduce() does it with 0. */
+void cprt_parallel_init(int num_threads)
+{
+  if (CPRT_ATOMIC_CAS(&cprt_parallel_state, 0, 1)) {
+    cprt_cpuset_t *allowed = cprt_cpuset_create();
+    cprt_cpuset_t *pin_cpus = cprt_cpuset_create();
+    struct cprt_topology *topo;
+    int have_pins = 0;
+
+    if (cprt_get_affinity_cpuset(allowed) == 0) {
+      topo = cprt_topology_load();
+      if (topo != NULL) {
+        if (num_threads <= 0) {
+          /* One per distinct core. */
+          cprt_cpuset_t *cores = cprt_cpuset_create();
+          int cpu;
+          for (cpu = cprt_cpuset_next(allowed, 0); cpu >= 0; cpu = cprt_cpuset_next(allowed, cpu + 1)) {
+            if (cpu < topo->max_cpus && topo->cpus[cpu].online) {
+              cprt_cpuset_set(cores, topo->cpus[cpu].core);
+            }
+          }
+          num_threads = cprt_cpuset_count(cores);
+          cprt_cpuset_delete(cores);
+        }
+        if (num_threads > 0 && cprt_topology_pick_cores(topo, num_threads,
+            CPRT_TOPO_ANY_PACKAGE, allowed, pin_cpus) == 0) {
+          have_pins = 1;
+        }
+        cprt_topology_delete(topo);
+      }
+      if (! have_pins && cprt_cpuset_count(allowed) > 0) {
+        /* More threads than cores; spread over the allowed CPUs. */
+        cprt_cpuset_delete(pin_cpus);
+        pin_cpus = allowed;
+        allowed = NULL;
+        have_pins = 1;
+      }
+      if (num_threads <= 0) {
+        num_threads = cprt_cpuset_count(pin_cpus);
+      }
+    }
+    if (num_threads <= 0) {
+      num_threads = 1;
+    }
+
+    /* Spin a while before parking so back-to-back loops stay cheap. */
+    cprt_parallel_pool_p = cprt_pool_create(num_threads, have_pins ? pin_cpus : NULL, 100000);
+    if (allowed != NULL) {
+      cprt_cpuset_delete(allowed);
+    }
+    cprt_cpuset_delete(pin_cpus);
+    CPRT_MEMORY_FENCE();
+    cprt_parallel_state = 2;
+  }
+  else {
+    while (cprt_parallel_state != 2) {
+      CPRT_THREAD_YIELD();
+    }
+    CPRT_ACQ_REL_FENCE();
+  }
+}  /* cprt_parallel_init */
+
+
+/* Use an application-created pool instead of the default one. Must be
+ * called before the first parallel call. */
+void cprt_parallel_set_pool(cprt_pool_t *pool)
+{
+  CPRT_ASSERT(CPRT_ATOMIC_CAS(&cprt_parallel_state, 0, 1));
+  cprt_parallel_pool_p = pool;
+  CPRT_MEMORY_FENCE();
+  cprt_parallel_state = 2;
+}  /* cprt_parallel_set_pool */
+
+
+cprt_pool_t *cprt_parallel_pool()
+{
+  if (cprt_parallel_state != 2) {
+    cprt_parallel_init(0);
+  }
+  return cprt_parallel_pool_p;
+}  /* cprt_parallel_pool */
+
+
+static void cprt_parallel_task_fn(void *arg)
+{
+  struct cprt_parallel_task *task = (struct cprt_parallel_task *)arg;
+  struct cprt_parallel_job *job = task->job;
+  void *partial = NULL;
+
+  if (job->grain == 0) {
+    /* Static: slot i is the i'th contiguous part of the range. A worker
+     * prefers the slot matching its index, so repeated loops over the same
+     * data land on the same (pinned) worker, keeping first-touch NUMA
+     * placement and cache contents. */
+    long slot = cprt_pool_worker_index(cprt_parallel_pool_p);
+    long i;
+    uint64_t len = job->end - job->begin;
+    if (slot < 0 || slot >= job->num_slots ||
+        ! CPRT_ATOMIC_CAS(&job->slot_claimed[slot], 0, 1)) {
+      for (i = 0; i < job->num_slots; i++) {
+        slot = (task->task_num + i) % job->num_slots;
+        if (CPRT_ATOMIC_CAS(&job->slot_claimed[slot], 0, 1)) {
+          break;
+        }
+      }
+    }
+    if (job->reduce_fn != NULL) {
+      partial = job->partials + (slot * job->result_size);
+      (*job->reduce_fn)(job->begin + (len * slot) / job->num_slots,
+          job->begin + (len * (slot + 1)) / job->num_slots, partial, job->ctx);
+    } else {
+      (*job->fn)(job->begin + (len * slot) / job->num_slots,
+          job->begin + (len * (slot + 1)) / job->num_slots, job->ctx);
+    }
+  }
+  else {
+    /* Dynamic: claim grain-sized chunks from a shared cursor. */
+    long chunk;
+    if (job->reduce_fn != NULL) {
+      partial = job->partials + (task->task_num * job->result_size);
+    }
+    while ((chunk = CPRT_ATOMIC_INC_VAL(&job->next_chunk) - 1) < job->num_chunks) {
+      uint64_t chunk_begin = job->begin + (uint64_t)chunk * job->grain;
+      uint64_t chunk_end = chunk_begin + job->grain;
+      if (chunk_end > job->end) {
+        chunk_end = job->end;
+      }
+      if (job->reduce_fn != NULL) {
+        (*job->reduce_fn)(chunk_begin, chunk_end, partial, job->ctx);
+      } else {
+        (*job->fn)(chunk_begin, chunk_end, job->ctx);
+      }
+    }
+  }
+}  /* cprt_parallel_task_fn */
+
+
+/* Common code for for/reduce. */
+static void cprt_parallel_run(struct cprt_parallel_job *job)
+{
+  cprt_pool_t *pool = cprt_parallel_pool();
+  struct cprt_parallel_task *tasks;
+  struct cprt_pool_wg wg;
+  long num_tasks = cprt_pool_num_workers(pool);
+  long i;
+
+  if (job->grain > 0) {
+    uint64_t num_chunks = (job->end - job->begin + job->grain - 1) / job->grain;
+    CPRT_ASSERT(num_chunks < 0x7fffffff);  /* Cursor is a 32-bit long on Windows. */
+    job->num_chunks = (long)num_chunks;
+    if (num_tasks > job->num_chunks) {
+      num_tasks = job->num_chunks;
+    }
+  }
+  job->num_slots = num_tasks;
+  CPRT_ENULL(job->slot_claimed = (volatile long *)calloc(num_tasks, sizeof(long)));
+  CPRT_ENULL(tasks = (struct cprt_parallel_task *)malloc(num_tasks * sizeof(struct cprt_parallel_task)));
+
+  cprt_pool_wg_init(&wg);
+  for (i = 0; i < num_tasks; i++) {
+    tasks[i].job = job;
+    tasks[i].task_num = i;
+    cprt_pool_submit(pool, &wg, cprt_parallel_task_fn, &tasks[i]);
+  }
+  cprt_pool_wait(pool, &wg);
+
+  free(tasks);
+  free((void *)job->slot_claimed);
+}  /* cprt_parallel_run */
+
+
+/* Call fn(chunk_begin, chunk_end, ctx) over [begin, end) on the persistent
+ * pool and wait for completion. grain of 0 splits the range statically
+ * into one contiguous part per worker (best for uniform work); otherwise
+ * workers claim "grain"-sized chunks dynamically from an atomic cursor
+ * (best for uneven work). Safe to call from inside a pool task. */
+void cprt_parallel_for(uint64_t begin, uint64_t end, uint64_t grain, cprt_parallel_fn_t fn, void *ctx)
+{
+  struct cprt_parallel_job job;
+
+  if (end <= begin) {
+    return;
+  }
+  if (grain >= end - begin) {  /* Too small to split. */
+    (*fn)(begin, end, ctx);
+    return;
+  }
+  memset(&job, 0, sizeof(job));
+  job.begin = begin;
+  job.end = end;
+  job.grain = grain;
+  job.fn = fn;
+  job.ctx = ctx;
+  cprt_parallel_run(&job);
+}  /* cprt_parallel_for */
+
+
+/* Like cprt_parallel_for(), but each worker accumulates into its own
+ * partial result with reduce_fn(chunk_begin, chunk_end, partial, ctx), and
+ * the partials are then merged into "result" with combine_fn(result,
+ * partial, ctx) in a fixed order. On entry, "result" must hold the
+ * identity value (e.g. 0 for a sum); each partial starts as a copy of it. */
+void cprt_parallel_reduce(uint64_t begin, uint64_t end, uint64_t grain,
+    void *result, size_t result_size, cprt_reduce_fn_t reduce_fn, cprt_combine_fn_t combine_fn, void *ctx)
+{
+  struct cprt_parallel_job job;
+  long num_partials = cprt_pool_num_workers(cprt_parallel_pool());
+  long i;
+
+  if (end <= begin) {
+    return;
+  }
+  if (grain >= end - begin) {  /* Too small to split. */
+    (*reduce_fn)(begin, end, result, ctx);
+    return;
+  }
+  memset(&job, 0, sizeof(job));
+  job.begin = begin;
+  job.end = end;
+  job.grain = grain;
+  job.reduce_fn = reduce_fn;
+  job.result_size = result_size;
+  job.ctx = ctx;
+  CPRT_ENULL(job.partials = (char *)malloc(num_partials * result_size));
+  for (i = 0; i < num_partials; i++) {
+    memcpy(job.partials + (i * result_size), result, result_size);
+  }
+
+  cprt_parallel_run(&job);
+
+  for (i = 0; i < job.num_slots; i++) {
+    (*combine_fn)(result, job.partials + (i * result_size), ctx);
+  }
+  free(job.partials);
+}  /* cprt_parallel_reduce */
+
+
+/* Max datagrams per recvmmsg()/sendmmsg() call (iovecs are on the stack). */
+#define CPRT_UDP_BATCH_MAX 64
+/* Room for a receive timestamp control message. */
+union cprt_udp_control {
+  struct cmsghdr align;
+  char buf[128];
+};
+
+#if defined(_WIN32)
+/* Return 1 if a datagram is waiting, 0 if not, -1 on error. */
+static int cprt_udp_readable(CPRT_SOCKET sock)
+{
+  u_long avail = 0;
+  if (ioctlsocket(sock, FIONREAD, &avail) != 0) {
+    errno = WSAGetLastError();
+    return -1;
+  }
+  return (avail > 0) ? 1 : 0;
+}  /* cprt_udp_readable */
+
+#else  /* Unix */
+/* control is only used for receives. */
+static void cprt_udp_pkt_to_msg(struct cprt_udp_pkt *pkt, struct iovec *iov,
+    struct msghdr *msg, union cprt_udp_control *control, int is_recv)
+{
+  iov->iov_base = pkt->buf;
+  iov->iov_len = is_recv ? pkt->buf_size : pkt->len;
+  memset(msg, 0, sizeof(*msg));
+  msg->msg_iov = iov;
+  msg->msg_iovlen = 1;
+  if (is_recv) {
+    msg->msg_name = &pkt->addr;
+    msg->msg_namelen = sizeof(pkt->addr);
+    msg->msg_control = control->buf;
+    msg->msg_controllen = sizeof(control->buf);
+  }
+  else if (pkt->addr_len > 0) {  /* Else socket must be connected. */
+    msg->msg_name = &pkt->addr;
+    msg->msg_namelen = pkt->addr_len;
+  }
+}  /* cprt_udp_pkt_to_msg */
+
+
+/* Return kernel receive timestamp from a received msg, in realtime ns, or
+ * 0 if none (see cprt_rx_timestamp_enable()). */
+static uint64_t cprt_udp_msg_ts(struct msghdr *msg)
+{
+  struct cmsghdr *cmsg;
+
+  if (msg->msg_controllen == 0) {
+    return 0;
+  }
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET) {
+      continue;
+    }
+#if defined(SO_TIMESTAMPING)
+    if (cmsg->cmsg_type == SO_TIMESTAMPING) {
+      /* ts[0] is software, ts[2] is raw hardware (NIC clock). */
+      struct timespec ts[3];
+      memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+      if (ts[2].tv_sec != 0 || ts[2].tv_nsec != 0) {
+        return (uint64_t)ts[2].tv_sec * UINT64_C(1000000000) + (uint64_t)ts[2].tv_nsec;
+      }
+      return (uint64_t)ts[0].tv_sec * UINT64_C(1000000000) + (uint64_t)ts[0].tv_nsec;
+    }
+#endif
+#if defined(SO_TIMESTAMPNS)
+    if (cmsg->cmsg_type == SO_TIMESTAMPNS) {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+    }
+#endif
+#if defined(SO_TIMESTAMP)
+    if (cmsg->cmsg_type == SO_TIMESTAMP) {
+      struct timeval tv;
+      memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+      return (uint64_t)tv.tv_sec * UINT64_C(1000000000) + (uint64_t)tv.tv_usec * 1000;
+    }
+#endif
+  }
+  return 0;
+}  /* cprt_udp_msg_ts */
+#endif
+
+
+/* Receive up to num_pkts datagrams into the caller's buffers with as few
+ * system calls as possible (Linux recvmmsg(); elsewhere a loop). Waits for
+ * the first datagram only if the socket is blocking, then takes whatever
+ * else is already queued. For each received pkt, sets len, addr, addr_len,
+ * truncated and rx_ts_ns. Returns number of datagrams received (0 if a non-blocking
+ * socket had none; datagrams received before an error are still returned),
+ * or -1 on error if none were received (sets errno). */
+int cprt_udp_recv_batch(CPRT_SOCKET sock, struct cprt_udp_pkt *pkts, int num_pkts)
+{
+  int num_rcvd = 0;
+
+#if defined(_WIN32)
+  int addr_len;
+  int rc;
+
+  while (num_rcvd < num_pkts) {
+    if (num_rcvd > 0) {
+      rc = cprt_udp_readable(sock);
+      if (rc <= 0) {
+        break;  /* Return what we have. */
+      }
+    }
+    addr_len = sizeof(pkts[num_rcvd].addr);
+    rc = recvfrom(sock, (char *)pkts[num_rcvd].buf, (int)pkts[num_rcvd].buf_size, 0,
+        (struct sockaddr *)&pkts[num_rcvd].addr, &addr_len);
+    pkts[num_rcvd].truncated = 0;
+    pkts[num_rcvd].rx_ts_ns = 0;
+    if (rc == SOCKET_ERROR) {
+      errno = WSAGetLastError();
+      if (errno == WSAEMSGSIZE) {
+        rc = (int)pkts[num_rcvd].buf_size;
+        pkts[num_rcvd].truncated = 1;
+      }
+      else if (errno == WSAEWOULDBLOCK && num_rcvd == 0) {
+        return 0;
+      }
+      else if (num_rcvd > 0) {
+        break;  /* Return what we have. */
+      }
+      else {
+        return -1;
+      }
+    }
+    pkts[num_rcvd].len = (size_t)rc;
+    pkts[num_rcvd].addr_len = addr_len;
+    num_rcvd++;
+  }
+
+#elif defined(__linux__)
+  struct mmsghdr msgs[CPRT_UDP_BATCH_MAX];
+  struct iovec iovs[CPRT_UDP_BATCH_MAX];
+  union cprt_udp_control controls[CPRT_UDP_BATCH_MAX];
+  int batch, i, rc;
+
+  while (num_rcvd < num_pkts) {
+    batch = num_pkts - num_rcvd;
+    if (batch > CPRT_UDP_BATCH_MAX) {
+      batch = CPRT_UDP_BATCH_MAX;
+    }
+    for (i = 0; i < batch; i++) {
+      cprt_udp_pkt_to_msg(&pkts[num_rcvd + i], &iovs[i], &msgs[i].msg_hdr, &controls[i], 1);
+    }
+    /* Only the very first datagram may block. */
+    rc = recvmmsg(sock, msgs, batch, (num_rcvd == 0) ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+    if (rc < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || num_rcvd > 0) {
+        break;  /* Return what we have. */
+      }
+      return -1;
+    }
+    for (i = 0; i < rc; i++) {
+      pkts[num_rcvd + i].len = msgs[i].msg_len;
+      pkts[num_rcvd + i].addr_len = msgs[i].msg_hdr.msg_namelen;
+      pkts[num_rcvd + i].truncated = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ? 1 : 0;
+      pkts[num_rcvd + i].rx_ts_ns = cprt_udp_msg_ts(&msgs[i].msg_hdr);
+    }
+    num_rcvd += rc;
+    if (rc < batch) {
+      break;  /* Queue drained. */
+    }
+  }
+
+#else  /* Non-Linux Unix. */
+  struct msghdr msg;
+  struct iovec iov;
+  union cprt_udp_control control;
+  ssize_t rc;
+
+  while (num_rcvd < num_pkts) {
+    cprt_udp_pkt_to_msg(&pkts[num_rcvd], &iov, &msg, &control, 1);
+    rc = recvmsg(sock, &msg, (num_rcvd == 0) ? 0 : MSG_DONTWAIT);
+    if (rc < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || num_rcvd > 0) {
+        break;  /* Return what we have. */
+      }
+      return -1;
+    }
+    pkts[num_rcvd].len = (size_t)rc;
+    pkts[num_rcvd].addr_len = msg.msg_namelen;
+    pkts[num_rcvd].truncated = (msg.msg_flags & MSG_TRUNC) ? 1 : 0;
+    pkts[num_rcvd].rx_ts_ns = cprt_udp_msg_ts(&msg);
+    num_rcvd++;
+  }
+#endif
+
+  return num_rcvd;
+}  /* cprt_udp_recv_batch */
+
+
+/* Send num_pkts datagrams (pkts[i].len bytes of pkts[i].buf, to pkts[i].addr,
+ * or to the connected peer if addr_len is 0) with as few system calls as
+ * possible (Linux sendmmsg(); elsewhere a loop). Returns number of datagrams
+ * sent, which is less than num_pkts only if a non-blocking socket filled up
+ * or an error happened after some were sent; or -1 on error if none were
+ * sent (sets errno). */
+int cprt_udp_send_batch(CPRT_SOCKET sock, struct cprt_udp_pkt *pkts, int num_pkts)
+{
+  int num_sent = 0;
+
+#if defined(_WIN32)
+  int rc;
+
+  while (num_sent < num_pkts) {
+    rc = sendto(sock, (const char *)pkts[num_sent].buf, (int)pkts[num_sent].len, 0,
+        (pkts[num_sent].addr_len > 0) ? (struct sockaddr *)&pkts[num_sent].addr : NULL,
+        (int)pkts[num_sent].addr_len);
+    if (rc == SOCKET_ERROR) {
+      errno = WSAGetLastError();
+      break;
+    }
+    num_sent++;
+  }
+
+#elif defined(__linux__)
+  struct mmsghdr msgs[CPRT_UDP_BATCH_MAX];
+  struct iovec iovs[CPRT_UDP_BATCH_MAX];
+  int batch, i, rc;
+
+  while (num_sent < num_pkts) {
+    batch = num_pkts - num_sent;
+    if (batch > CPRT_UDP_BATCH_MAX) {
+      batch = CPRT_UDP_BATCH_MAX;
+    }
+    for (i = 0; i < batch; i++) {
+      cprt_udp_pkt_to_msg(&pkts[num_sent + i], &iovs[i], &msgs[i].msg_hdr, NULL, 0);
+    }
+    rc = sendmmsg(sock, msgs, batch, 0);
+    if (rc < 0) {
+      break;
+    }
+    num_sent += rc;
+  }
+
+#else  /* Non-Linux Unix. */
+  struct msghdr msg;
+  struct iovec iov;
+
+  while (num_sent < num_pkts) {
+    cprt_udp_pkt_to_msg(&pkts[num_sent], &iov, &msg, NULL, 0);
+    if (sendmsg(sock, &msg, 0) < 0) {
+      break;
+    }
+    num_sent++;
+  }
+#endif
+
+  if (num_sent == 0 && num_pkts > 0) {
+    return -1;  /* errno already set. */
+  }
+  return num_sent;
+}  /* cprt_udp_send_batch */
+
+
+/* Ask the kernel to timestamp each datagram as it arrives; the stamp is
+ * returned in cprt_udp_pkt.rx_ts_ns by cprt_udp_recv_batch(). flags:
+ * CPRT_RX_TS_SOFTWARE (Linux SO_TIMESTAMPNS, other Unixes SO_TIMESTAMP)
+ * and/or CPRT_RX_TS_HARDWARE (Linux SO_TIMESTAMPING; the NIC must also be
+ * set up for RX stamping, e.g. with "hwstamp_ctl -r 1", and its clock is
+ * only comparable to realtime if it's synced with phc2sys). Stamps are
+ * realtime (wall clock); see cprt_realtime_to_mono_ns().
+ * Return 0 on success, -1 on error (sets errno; ENOSYS where unsupported). */
+int cprt_rx_timestamp_enable(CPRT_SOCKET sock, int flags)
+{
+#if defined(_WIN32)
+  errno = ENOSYS;
+  return -1;
+
+#elif defined(__linux__)
+  int on = 1;
+  if (flags & CPRT_RX_TS_HARDWARE) {
+    int ts_flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+        SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &ts_flags, sizeof(ts_flags));
+  }
+  return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+
+#else  /* Non-Linux Unix. */
+  int on = 1;
+  if (flags & CPRT_RX_TS_HARDWARE) {
+    errno = ENOSYS;
+    return -1;
+  }
+  return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on));
+#endif
+}  /* cprt_rx_timestamp_enable */
+
+
+/* Return the realtime (wall) clock in ns since 1970 (the clock of kernel
+ * receive timestamps). */
+uint64_t cprt_realtime_ns()
+{
+#if defined(_WIN32)
+  FILETIME ft;
+  GetSystemTimePreciseAsFileTime(&ft);
+  /* 100 ns units since 1601. */
+  return (((((uint64_t)ft.dwHighDateTime) << 32) | ft.dwLowDateTime) -
+      UINT64_C(116444736000000000)) * 100;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+#endif
+}  /* cprt_realtime_ns */
+
+
+/* Return CPRT_GETTIME as ns. */
+uint64_t cprt_mono_ns()
+{
+  struct cprt_timespec ts;
+  CPRT_GETTIME(&ts);
+  return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}  /* cprt_mono_ns */
+
+
+/* Return realtime minus CPRT_GETTIME, in ns. The realtime clock is slewed
+ * (and can be stepped) by NTP, so re-sample rather than caching for long.
+ * Takes the tightest of a few bracketing reads; costs well under a us. */
+uint64_t cprt_clock_offset_ns()
+{
+  uint64_t mono_before, mono_after, real_ns;
+  uint64_t best_window = (uint64_t)-1;
+  uint64_t best_offset = 0;
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    mono_before = cprt_mono_ns();
+    real_ns = cprt_realtime_ns();
+    mono_after = cprt_mono_ns();
+    if (mono_after - mono_before < best_window) {
+      best_window = mono_after - mono_before;
+      best_offset = real_ns - (mono_before + best_window / 2);
+    }
+  }
+  return best_offset;
+}  /* cprt_clock_offset_ns */
+
+
+/* Convert a realtime ns value (e.g. a kernel RX timestamp) to the
+ * CPRT_GETTIME clock, so it can be compared with cprt_mono_ns(). */
+uint64_t cprt_realtime_to_mono_ns(uint64_t realtime_ns)
+{
+  return realtime_ns - cprt_clock_offset_ns();
+}  /* cprt_realtime_to_mono_ns */
+
+
+uint64_t cprt_mono_to_realtime_ns(uint64_t mono_ns)
+{
+  return mono_ns + cprt_clock_offset_ns();
+}  /* cprt_mono_to_realtime_ns */
+
+
+/* Readiness event loop; see cprt_evloop_create(). Linux uses epoll
+ * (edge-triggered); Windows uses WSAPoll() and other Unixes poll(), both
+ * level-triggered. Callbacks should read/write until EAGAIN / EWOULDBLOCK,
+ * which is correct for both. */
+#if defined(_WIN32)
+  #define CPRT_POLLFD WSAPOLLFD
+  #define CPRT_POLL WSAPoll
+  #define CPRT_POLL_IN POLLRDNORM
+  #define CPRT_POLL_OUT POLLWRNORM
+#elif ! defined(__linux__)
+  #define CPRT_POLLFD struct pollfd
+  #define CPRT_POLL poll
+  #define CPRT_POLL_IN POLLIN
+  #define CPRT_POLL_OUT POLLOUT
+#endif
+#define CPRT_EVLOOP_BATCH 256  /* Max events per epoll_wait(). */
+
+struct cprt_evloop_reg {
+  CPRT_SOCKET sock;
+  int events;  /* CPRT_EV_READ, CPRT_EV_WRITE. */
+  cprt_evloop_sock_fn_t fn;
+  void *arg;
+  int removed;  /* Freed after the current dispatch pass. */
+};
+
+struct cprt_evloop_timer {
+  int active;
+  uint64_t deadline_ns;
+  uint64_t period_ns;  /* 0 = one-shot. */
+  cprt_evloop_timer_fn_t fn;
+  void *arg;
+};
+
+struct cprt_evloop_s {
+  int busy_poll;
+  volatile int stop;
+  int num_regs;
+  int regs_size;
+  struct cprt_evloop_reg **regs;
+  int num_removed;
+#if defined(__linux__)
+  int epoll_fd;
+  struct epoll_event ep_events[CPRT_EVLOOP_BATCH];
+#else
+  CPRT_POLLFD *pollfds;  /* Parallel to regs. */
+#endif
+  int timers_size;
+  struct cprt_evloop_timer *timers;  /* Index is the timer id. */
+  struct cprt_evloop_stats stats;
+};
+
+
+/* Create an event loop. If busy_poll is non-zero, cprt_evloop_run_once()
+ * never sleeps in the kernel (zero timeout), trading a core for latency.
+ * Returns NULL on error (sets errno). */
+cprt_evloop_t *cprt_evloop_create(int busy_poll)
+{
+  cprt_evloop_t *loop;
+
+  CPRT_ENULL(loop = (cprt_evloop_t *)calloc(1, sizeof(cprt_evloop_t)));
+  loop->busy_poll = busy_poll;
+#if defined(__linux__)
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd == -1) {
+    free(loop);
+    return NULL;
+  }
+#endif
+
+  return loop;
+}  /* cprt_evloop_create */
+
+
+/* Sockets are not closed. */
+void cprt_evloop_delete(cprt_evloop_t *loop)
+{
+  int i;
+
+#if defined(__linux__)
+  close(loop->epoll_fd);
+#else
+  if (loop->pollfds != NULL) {
+    free(loop->pollfds);
+  }
+#endif
+  for (i = 0; i < loop->num_regs; i++) {
+    free(loop->regs[i]);
+  }
+  if (loop->regs != NULL) {
+    free(loop->regs);
+  }
+  if (loop->timers != NULL) {
+    free(loop->timers);
+  }
+  free(loop);
+}  /* cprt_evloop_delete */
+
+
+/* Return index of sock's registration, or -1. Linear, so add/modify/remove
+ * are O(sockets); dispatch is not. */
+static int cprt_evloop_find(cprt_evloop_t *loop, CPRT_SOCKET sock)
+{
+  int i;
+
+  for (i = 0; i < loop->num_regs; i++) {
+    if (loop->regs[i]->sock == sock && ! loop->regs[i]->removed) {
+      return i;
+    }
+  }
+  return -1;
+}  /* cprt_evloop_find */
+
+
+#if defined(__linux__)
+static uint32_t cprt_evloop_to_epoll(int events)
+{
+  uint32_t ep = EPOLLET;
+  if (events & CPRT_EV_READ) {
+    ep |= EPOLLIN;
+  }
+  if (events & CPRT_EV_WRITE) {
+    ep |= EPOLLOUT;
+  }
+  return ep;
+}  /* cprt_evloop_to_epoll */
+#endif
+
+
+/* Watch sock (which should be non-blocking) for "events" (CPRT_EV_READ
+ * and/or CPRT_EV_WRITE), calling fn when ready. CPRT_EV_ERROR is always
+ * reported. Return 0 on success, -1 on error (sets errno; EEXIST if sock is
+ * already registered). */
+int cprt_evloop_add(cprt_evloop_t *loop, CPRT_SOCKET sock, int events, cprt_evloop_sock_fn_t fn, void *arg)
+{
+  struct cprt_evloop_reg *reg;
+#if defined(__linux__)
+  struct epoll_event ep_event;
+#endif
+
+  if (cprt_evloop_find(loop, sock) != -1) {
+    errno = EEXIST;
+    return -1;
+  }
+  if (loop->num_regs == loop->regs_size) {
+    loop->regs_size = (loop->regs_size == 0) ? 64 : loop->regs_size * 2;
+    CPRT_ENULL(loop->regs = (struct cprt_evloop_reg **)realloc(loop->regs,
+        loop->regs_size * sizeof(struct cprt_evloop_reg *)));
+#if ! defined(__linux__)
+    CPRT_ENULL(loop->pollfds = (CPRT_POLLFD *)realloc(loop->pollfds,
+        loop->regs_size * sizeof(CPRT_POLLFD)));
+#endif
+  }
+  CPRT_ENULL(reg = (struct cprt_evloop_reg *)calloc(1, sizeof(struct cprt_evloop_reg)));
+  reg->sock = sock;
+  reg->events = events;
+  reg->fn = fn;
+  reg->arg = arg;
+
+#if defined(__linux__)
+  memset(&ep_event, 0, sizeof(ep_event));
+  ep_event.events = cprt_evloop_to_epoll(events);
+  ep_event.data.ptr = reg;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, sock, &ep_event) != 0) {
+    free(reg);
+    return -1;
+  }
+#else
+  loop->pollfds[loop->num_regs].fd = sock;
+  loop->pollfds[loop->num_regs].events = ((events & CPRT_EV_READ) ? CPRT_POLL_IN : 0) |
+      ((events & CPRT_EV_WRITE) ? CPRT_POLL_OUT : 0);
+  loop->pollfds[loop->num_regs].revents = 0;
+#endif
+  loop->regs[loop->num_regs] = reg;
+  loop->num_regs++;
+
+  return 0;
+}  /* cprt_evloop_add */
+
+
+/* Change the events watched for a registered sock.
+ * Return 0 on success, -1 on error (sets errno; ENOENT if not registered). */
+int cprt_evloop_modify(cprt_evloop_t *loop, CPRT_SOCKET sock, int events)
+{
+  int i = cprt_evloop_find(loop, sock);
+#if defined(__linux__)
+  struct epoll_event ep_event;
+#endif
+
+  if (i == -1) {
+    errno = ENOENT;
+    return -1;
+  }
+#if defined(__linux__)
+  memset(&ep_event, 0, sizeof(ep_event));
+  ep_event.events = cprt_evloop_to_epoll(events);
+  ep_event.data.ptr = loop->regs[i];
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, sock, &ep_event) != 0) {
+    return -1;
+  }
+#else
+  loop->pollfds[i].events = ((events & CPRT_EV_READ) ? CPRT_POLL_IN : 0) |
+      ((events & CPRT_EV_WRITE) ? CPRT_POLL_OUT : 0);
+#endif
+  loop->regs[i]->events = events;
+
+  return 0;
+}  /* cprt_evloop_modify */
+
+
+/* Stop watching sock (call before closing it). Safe from inside callbacks.
+ * Return 0 on success, -1 on error (sets errno; ENOENT if not registered). */
+int cprt_evloop_remove(cprt_evloop_t *loop, CPRT_SOCKET sock)
+{
+  int i = cprt_evloop_find(loop, sock);
+
+  if (i == -1) {
+    errno = ENOENT;
+    return -1;
+  }
+#if defined(__linux__)
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, sock, NULL) != 0) {
+    return -1;
+  }
+#else
+  loop->pollfds[i].fd = (CPRT_SOCKET)-1;  /* Ignored by poll. */
+  loop->pollfds[i].events = 0;
+  loop->pollfds[i].revents = 0;
+#endif
+  /* Events for it may still be pending in this pass; free it afterward. */
+  loop->regs[i]->removed = 1;
+  loop->num_removed++;
+
+  return 0;
+}  /* cprt_evloop_remove */
+
+
+/* Free removed registrations, keeping regs (and pollfds) dense. */
+static void cprt_evloop_compact(cprt_evloop_t *loop)
+{
+  int i = 0;
+
+  while (loop->num_removed > 0 && i < loop->num_regs) {
+    if (loop->regs[i]->removed) {
+      free(loop->regs[i]);
+      loop->num_regs--;
+      loop->regs[i] = loop->regs[loop->num_regs];
+#if ! defined(__linux__)
+      loop->pollfds[i] = loop->pollfds[loop->num_regs];
+#endif
+      loop->num_removed--;
+    } else {
+      i++;
+    }
+  }
+}  /* cprt_evloop_compact */
+
+
+/* Call fn after delay_ns, and then every period_ns if period_ns is non-zero.
+ * Deadlines use CPRT_GETTIME. Returns timer id (>= 0). Timers are kept in
+ * a small array, so this is meant for tens of timers, not thousands. */
+int cprt_evloop_timer_add(cprt_evloop_t *loop, uint64_t delay_ns, uint64_t period_ns,
+    cprt_evloop_timer_fn_t fn, void *arg)
+{
+  int id;
+
+  for (id = 0; id < loop->timers_size; id++) {
+    if (! loop->timers[id].active) {
+      break;
+    }
+  }
+  if (id == loop->timers_size) {
+    loop->timers_size = (loop->timers_size == 0) ? 16 : loop->timers_size * 2;
+    CPRT_ENULL(loop->timers = (struct cprt_evloop_timer *)realloc(loop->timers,
+        loop->timers_size * sizeof(struct cprt_evloop_timer)));
+    memset(&loop->timers[id], 0, (loop->timers_size - id) * sizeof(struct cprt_evloop_timer));
+  }
+  loop->timers[id].active = 1;
+  loop->timers[id].deadline_ns = cprt_mono_ns() + delay_ns;
+  loop->timers[id].period_ns = period_ns;
+  loop->timers[id].fn = fn;
+  loop->timers[id].arg = arg;
+
+  return id;
+}  /* cprt_evloop_timer_add */
+
+
+/* Safe from inside callbacks (including the timer's own).
+ * Return 0 on success, -1 on error (sets errno to ENOENT). */
+int cprt_evloop_timer_cancel(cprt_evloop_t *loop, int timer_id)
+{
+  if (timer_id < 0 || timer_id >= loop->timers_size || ! loop->timers[timer_id].active) {
+    errno = ENOENT;
+    return -1;
+  }
+  loop->timers[timer_id].active = 0;
+  return 0;
+}  /* cprt_evloop_timer_cancel */
+
+
+/* Run expired timers; return how many fired. */
+static int cprt_evloop_run_timers(cprt_evloop_t *loop)
+{
+  uint64_t now_ns = cprt_mono_ns();
+  struct cprt_evloop_timer *timer;
+  int num_fired = 0;
+  int id;
+
+  /* Callbacks can add timers (realloc), so index each time. */
+  for (id = 0; id < loop->timers_size; id++) {
+    timer = &loop->timers[id];
+    if (timer->active && timer->deadline_ns <= now_ns) {
+      if (timer->period_ns > 0) {
+        timer->deadline_ns += timer->period_ns;
+        if (timer->deadline_ns <= now_ns) {  /* Fell behind; don't burst. */
+          timer->deadline_ns = now_ns + timer->period_ns;
+        }
+      } else {
+        timer->active = 0;
+      }
+      (*timer->fn)(loop, id, timer->arg);
+      num_fired++;
+    }
+  }
+  loop->stats.timers_fired += num_fired;
+
+  return num_fired;
+}  /* cprt_evloop_run_timers */
+
+
+/* Wait up to max_wait_ns (CPRT_EVLOOP_FOREVER = until something happens)
+ * for socket events or the next timer, and dispatch them. In busy-poll
+ * mode, never waits. Returns number of callbacks made, or -1 on error
+ * (sets errno). */
+int cprt_evloop_run_once(cprt_evloop_t *loop, uint64_t max_wait_ns)
+{
+  uint64_t now_ns;
+  uint64_t wait_ns = max_wait_ns;
+  int timeout_ms;
+  int num_ready, num_events = 0;
+  int id, i, events;
+
+  /* Sleep no longer than the next timer. */
+  now_ns = cprt_mono_ns();
+  for (id = 0; id < loop->timers_size; id++) {
+    if (loop->timers[id].active) {
+      uint64_t until_ns = (loop->timers[id].deadline_ns > now_ns) ?
+          (loop->timers[id].deadline_ns - now_ns) : 0;
+      if (until_ns < wait_ns) {
+        wait_ns = until_ns;
+      }
+    }
+  }
+  if (loop->busy_poll) {
+    timeout_ms = 0;
+  } else if (wait_ns == CPRT_EVLOOP_FOREVER) {
+    timeout_ms = -1;
+  } else if (wait_ns >= UINT64_C(1000000) * 0x7fffffff) {
+    timeout_ms = 0x7fffffff;
+  } else {  /* Round up so timers aren't polled early. */
+    timeout_ms = (int)((wait_ns + 999999) / 1000000);
+  }
+
+#if defined(__linux__)
+  num_ready = epoll_wait(loop->epoll_fd, loop->ep_events, CPRT_EVLOOP_BATCH, timeout_ms);
+  if (num_ready < 0) {
+    if (errno != EINTR) {
+      return -1;
+    }
+    num_ready = 0;
+  }
+  for (i = 0; i < num_ready; i++) {
+    struct cprt_evloop_reg *reg = (struct cprt_evloop_reg *)loop->ep_events[i].data.ptr;
+    uint32_t ep = loop->ep_events[i].events;
+    if (reg->removed) {
+      continue;
+    }
+    events = ((ep & EPOLLIN) ? CPRT_EV_READ : 0) | ((ep & EPOLLOUT) ? CPRT_EV_WRITE : 0) |
+        ((ep & (EPOLLERR | EPOLLHUP)) ? CPRT_EV_ERROR : 0);
+    (*reg->fn)(loop, reg->sock, events, reg->arg);
+    num_events++;
+  }
+
+#else
+#if defined(_WIN32)
+  if (loop->num_regs == 0) {  /* WSAPoll() rejects an empty set. */
+    if (timeout_ms != 0) {
+      Sleep((timeout_ms < 0) ? INFINITE : (DWORD)timeout_ms);
+    }
+    num_ready = 0;
+  } else {
+    num_ready = CPRT_POLL(loop->pollfds, (ULONG)loop->num_regs, timeout_ms);
+    if (num_ready == SOCKET_ERROR) {
+      errno = WSAGetLastError();
+      return -1;
+    }
+  }
+#else
+  num_ready = CPRT_POLL(loop->pollfds, (nfds_t)loop->num_regs, timeout_ms);
+  if (num_ready < 0) {
+    if (errno != EINTR) {
+      return -1;
+    }
+    num_ready = 0;
+  }
+#endif
+  /* Callbacks may add (realloc) or remove (mark) entries; index each time. */
+  for (i = 0; i < loop->num_regs && num_events < num_ready; i++) {
+    short revents = loop->pollfds[i].revents;
+    struct cprt_evloop_reg *reg = loop->regs[i];
+    if (revents == 0) {
+      continue;
+    }
+    loop->pollfds[i].revents = 0;
+    if (reg->removed) {
+      continue;
+    }
+    events = ((revents & CPRT_POLL_IN) ? CPRT_EV_READ : 0) |
+        ((revents & CPRT_POLL_OUT) ? CPRT_EV_WRITE : 0) |
+        ((revents & (POLLERR | POLLHUP | POLLNVAL)) ? CPRT_EV_ERROR : 0);
+    (*reg->fn)(loop, reg->sock, events, reg->arg);
+    num_events++;
+  }
+#endif
+
+  loop->stats.wakeups++;
+  if (num_ready == 0) {
+    loop->stats.empty_wakeups++;
+  }
+  loop->stats.events += num_events;
+  if ((uint64_t)num_ready > loop->stats.max_events_per_wakeup) {
+    loop->stats.max_events_per_wakeup = num_ready;
+  }
+  cprt_evloop_compact(loop);
+
+  return num_events + cprt_evloop_run_timers(loop);
+}  /* cprt_evloop_run_once */
+
+
+/* Dispatch until cprt_evloop_stop(). Return 0 after stop, -1 on error
+ * (sets errno). */
+int cprt_evloop_run(cprt_evloop_t *loop)
+{
+  loop->stop = 0;
+  while (! loop->stop) {
+    if (cprt_evloop_run_once(loop, CPRT_EVLOOP_FOREVER) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}  /* cprt_evloop_run */
+
+
+/* Make cprt_evloop_run() return. Call from a callback; from another thread
+ * it takes effect when the current wait ends. */
+void cprt_evloop_stop(cprt_evloop_t *loop)
+{
+  loop->stop = 1;
+}  /* cprt_evloop_stop */
+
+
+void cprt_evloop_get_stats(const cprt_evloop_t *loop, struct cprt_evloop_stats *stats)
+{
+  *stats = loop->stats;
+}  /* cprt_evloop_get_stats */
+
+
+/* Set up zero-copy sending on a connected TCP socket. Sends of at least
+ * min_zc_size bytes use MSG_ZEROCOPY where the kernel supports it (Linux
+ * 4.14+); smaller sends, and all sends elsewhere, are ordinary copying
+ * sends. (Zero-copy has a per-send page-pinning and notification cost that
+ * only pays off for large sends; 0 = 16K.)
+ * Return 0 on success, -1 on error (sets errno). */
+int cprt_zc_init(struct cprt_zc *zc, CPRT_SOCKET sock, size_t min_zc_size)
+{
+  memset(zc, 0, sizeof(*zc));
+  zc->sock = sock;
+  zc->min_zc_size = (min_zc_size > 0) ? min_zc_size : 16384;
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+  {
+    int one = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+      zc->zerocopy = 1;
+    }  /* Else fall back to copying. */
+  }
+#endif
+
+  return 0;
+}  /* cprt_zc_init */
+
+
+/* Send up to len bytes of buf; *sent is set to the bytes accepted (can be
+ * partial, like send()). *seq identifies the buffer: don't modify or free
+ * it until cprt_zc_done(zc, *seq) is true (immediately if it was copied).
+ * Return 0 on success, -1 on error (sets errno; EAGAIN if a non-blocking
+ * socket is full). */
+int cprt_zc_send(struct cprt_zc *zc, const void *buf, size_t len, size_t *sent, uint32_t *seq)
+{
+#if defined(_WIN32)
+  int rc;
+#else
+  ssize_t rc;
+#endif
+
+  *sent = 0;
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+  if (zc->zerocopy && len >= zc->min_zc_size) {
+    rc = send(zc->sock, buf, len, MSG_ZEROCOPY);
+    if (rc >= 0) {
+      /* Kernel numbers each successful zero-copy send. */
+      *sent = (size_t)rc;
+      *seq = zc->next_seq++;
+      zc->zc_sends++;
+      return 0;
+    }
+    if (errno != ENOBUFS) {  /* ENOBUFS: over optmem limit; just copy. */
+      return -1;
+    }
+  }
+#endif
+
+#if defined(_WIN32)
+  rc = send(zc->sock, (const char *)buf, (int)((len > 0x7fffffff) ? 0x7fffffff : len), 0);
+  if (rc == SOCKET_ERROR) {
+    errno = WSAGetLastError();
+    return -1;
+  }
+#else
+  rc = send(zc->sock, buf, len, 0);
+  if (rc < 0) {
+    return -1;
+  }
+#endif
+  *sent = (size_t)rc;
+  *seq = zc->done_seq - 1;  /* Already "done". */
+  zc->copy_sends++;
+
+  return 0;
+}  /* cprt_zc_send */
+
+
+/* Read zero-copy completion notifications from the socket's error queue
+ * without blocking. Returns number of notifications, or -1 on error (sets
+ * errno). */
+int cprt_zc_reap(struct cprt_zc *zc)
+{
+  int num_reaped = 0;
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+  struct msghdr msg;
+  char control[128];
+  struct cmsghdr *cmsg;
+  struct sock_extended_err *serr;
+
+  if (! zc->zerocopy) {
+    return 0;
+  }
+  while (1) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(zc->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (! ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+             (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+        continue;
+      }
+      serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+      if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+        continue;
+      }
+      /* Sends [ee_info, ee_data] are complete; TCP completes them in order. */
+      if ((int32_t)(serr->ee_data + 1 - zc->done_seq) > 0) {
+        zc->done_seq = serr->ee_data + 1;
+      }
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        zc->kernel_copied++;  /* E.g. loopback, or NIC can't scatter-gather. */
+      }
+      num_reaped++;
+    }
+  }
+#endif
+
+  return num_reaped;
+}  /* cprt_zc_reap */
+
+
+/* Return 1 if the buffer of send "seq" can be reused, else 0. Call
+ * cprt_zc_reap() (or cprt_zc_wait()) to collect completions. */
+int cprt_zc_done(const struct cprt_zc *zc, uint32_t seq)
+{
+  return ((int32_t)(zc->done_seq - seq) > 0) ? 1 : 0;
+}  /* cprt_zc_done */
+
+
+/* Block until the buffer of send "seq" can be reused.
+ * Return 0 on success, -1 on error (sets errno). */
+int cprt_zc_wait(struct cprt_zc *zc, uint32_t seq)
+{
+  while (! cprt_zc_done(zc, seq)) {
+    if (cprt_zc_reap(zc) == -1) {
+      return -1;
+    }
+#if ! defined(_WIN32)
+    if (! cprt_zc_done(zc, seq)) {
+      struct pollfd pfd;
+      pfd.fd = zc->sock;
+      pfd.events = 0;  /* Error-queue data shows up as POLLERR. */
+      pfd.revents = 0;
+      (void)poll(&pfd, 1, 10);
+    }
+#endif
+  }
+
+  return 0;
+}  /* cprt_zc_wait */
+
+
+/* Send count bytes of an open file, starting at *offset (which is
+ * advanced), without copying through user space where possible (Linux
+ * sendfile(); elsewhere a read/send loop). *sent is set to the bytes sent,
+ * which is less than count only at end of file or if a non-blocking socket
+ * fills up. Return 0 on success, -1 on error (sets errno). */
+int cprt_sendfile(CPRT_SOCKET sock, int file_fd, uint64_t *offset, size_t count, size_t *sent)
+{
+  int use_fallback = 1;
+
+  *sent = 0;
+
+#if defined(__linux__)
+  use_fallback = 0;
+  while (*sent < count) {
+    off_t off = (off_t)*offset;
+    ssize_t rc = sendfile(sock, file_fd, &off, count - *sent);
+    if (rc < 0) {
+      if (*sent > 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+      }
+      if (*sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+        use_fallback = 1;  /* E.g. file system can't splice. */
+        break;
+      }
+      return -1;
+    }
+    if (rc == 0) {
+      break;  /* End of file. */
+    }
+    *offset += (uint64_t)rc;
+    *sent += (size_t)rc;
+  }
+#endif
+
+  if (use_fallback) {  /* Read into a buffer and send. */
+    char buf[65536];
+    size_t chunk, done;
+#if defined(_WIN32)
+    int got, rc;
+#else
+    ssize_t got, rc;
+#endif
+    while (*sent < count) {
+      chunk = count - *sent;
+      if (chunk > sizeof(buf)) {
+        chunk = sizeof(buf);
+      }
+#if defined(_WIN32)
+      if (_lseeki64(file_fd, (__int64)*offset, SEEK_SET) == -1) {
+        return -1;
+      }
+      got = _read(file_fd, buf, (unsigned int)chunk);
+#else
+      got = pread(file_fd, buf, chunk, (off_t)*offset);
+#endif
+      if (got < 0) {
+        return -1;
+      }
+      if (got == 0) {
+        break;  /* End of file. */
+      }
+      for (done = 0; done < (size_t)got; done += (size_t)rc) {
+#if defined(_WIN32)
+        rc = send(sock, buf + done, (int)(got - done), 0);
+        if (rc == SOCKET_ERROR) {
+          errno = (WSAGetLastError() == WSAEWOULDBLOCK) ? EWOULDBLOCK : WSAGetLastError();
+          rc = -1;
+        }
+#else
+        rc = send(sock, buf + done, (size_t)got - done, 0);
+#endif
+        if (rc < 0) {
+          if (*sent + done > 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            *offset += done;
+            *sent += done;
+            return 0;
+          }
+          return -1;
+        }
+      }
+      *offset += (uint64_t)got;
+      *sent += (size_t)got;
+    }
+  }
+
+  return 0;
+}  /* cprt_sendfile */
+
+
+/* Asynchronous file I/O. On Linux, io_uring (raw syscalls, no liburing)
+ * if the kernel has it and allows it; otherwise a few I/O threads doing
+ * pread()/pwrite(). Requests live in a table of queue_depth slots; the
+ * slot index is what travels through the kernel or the thread queues. */
+#define CPRT_AIO_THREADS 2  /* Fallback I/O threads. */
+
+struct cprt_aio_req {
+  int op;
+  int fd;
+  char *buf;
+  size_t len;
+  uint64_t offset;
+  void *user_data;
+  int err;  /* Results (thread backend). */
+  size_t done_len;
+};
+
+struct cprt_aio_s {
+  int backend;
+  int queue_depth;
+  int inflight;  /* Slots in use. */
+  struct cprt_aio_req *reqs;
+  int *free_slots;  /* Stack of unused slot indexes. */
+  int num_free;
+  int num_bufs;  /* Registered buffers. */
+  char **buf_addrs;
+  size_t *buf_sizes;
+#if defined(__linux__)
+  int ring_fd;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;  /* Same as sq_ring with IORING_FEAT_SINGLE_MMAP. */
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned to_submit;  /* SQEs queued but not yet passed to io_uring_enter(). */
+  int fixed_bufs;  /* Buffers registered with the kernel. */
+#endif
+  /* Thread backend: rings of slot indexes. */
+  CPRT_MUTEX_T lock;
+  CPRT_SEM_T work_sem;  /* Counts pending requests (plus exit wakeups). */
+  CPRT_SEM_T done_sem;  /* Counts finished requests not yet reaped. */
+  int *pending;
+  int pending_head, pending_count;
+  int *done;
+  int done_head, done_count;
+  CPRT_THREAD_T threads[CPRT_AIO_THREADS];
+};
+
+
+#if defined(__linux__)
+/* Set up the rings. Return 0, or -1 if io_uring is unavailable (old
+ * kernel, seccomp, io_uring_disabled sysctl). */
+static int cprt_aio_uring_init(cprt_aio_t *aio)
+{
+  struct io_uring_params params;
+  int fd;
+
+  memset(&params, 0, sizeof(params));
+  fd = (int)syscall(__NR_io_uring_setup, (unsigned)aio->queue_depth, &params);
+  if (fd < 0) {
+    return -1;
+  }
+  if (! (params.features & IORING_FEAT_RW_CUR_POS)) {
+    close(fd);  /* Pre-5.6 kernel; no IORING_OP_READ / WRITE. */
+    errno = ENOSYS;
+    return -1;
+  }
+
+  aio->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  aio->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (aio->cq_ring_size > aio->sq_ring_size) {
+      aio->sq_ring_size = aio->cq_ring_size;
+    }
+    aio->cq_ring_size = aio->sq_ring_size;
+  }
+  aio->sq_ring = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (aio->sq_ring == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    aio->cq_ring = aio->sq_ring;
+  }
+  else {
+    aio->cq_ring = mmap(NULL, aio->cq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (aio->cq_ring == MAP_FAILED) {
+      munmap(aio->sq_ring, aio->sq_ring_size);
+      close(fd);
+      return -1;
+    }
+  }
+  aio->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  aio->sqes = (struct io_uring_sqe *)mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (aio->sqes == MAP_FAILED) {
+    if (aio->cq_ring != aio->sq_ring) {
+      munmap(aio->cq_ring, aio->cq_ring_size);
+    }
+    munmap(aio->sq_ring, aio->sq_ring_size);
+    close(fd);
+    return -1;
+  }
+
+  aio->sq_tail = (unsigned *)((char *)aio->sq_ring + params.sq_off.tail);
+  aio->sq_mask = (unsigned *)((char *)aio->sq_ring + params.sq_off.ring_mask);
+  aio->sq_array = (unsigned *)((char *)aio->sq_ring + params.sq_off.array);
+  aio->cq_head = (unsigned *)((char *)aio->cq_ring + params.cq_off.head);
+  aio->cq_tail = (unsigned *)((char *)aio->cq_ring + params.cq_off.tail);
+  aio->cq_mask = (unsigned *)((char *)aio->cq_ring + params.cq_off.ring_mask);
+  aio->cqes = (struct io_uring_cqe *)((char *)aio->cq_ring + params.cq_off.cqes);
+  aio->ring_fd = fd;
+
+  return 0;
+}  /* cprt_aio_uring_init */
+
+
+/* Move finished CQEs into comps[]. */
+static int cprt_aio_uring_reap(cprt_aio_t *aio, struct cprt_aio_completion *comps, int max_comps)
+{
+  unsigned head = *aio->cq_head;
+  unsigned tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+  int n = 0;
+
+  while (head != tail && n < max_comps) {
+    struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+    int slot = (int)cqe->user_data;
+    comps[n].user_data = aio->reqs[slot].user_data;
+    comps[n].op = aio->reqs[slot].op;
+    comps[n].err = (cqe->res < 0) ? -cqe->res : 0;
+    comps[n].len = (cqe->res < 0) ? 0 : (size_t)cqe->res;
+    aio->free_slots[aio->num_free++] = slot;
+    aio->inflight--;
+    head++;
+    n++;
+  }
+  __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+
+  return n;
+}  /* cprt_aio_uring_reap */
+#endif
+
+
+/* Do one request synchronously (thread backend). */
+static void cprt_aio_do_req(struct cprt_aio_req *req)
+{
+#if defined(_WIN32)
+  HANDLE handle = (HANDLE)_get_osfhandle(req->fd);  /* Sets errno (EBADF) on error. */
+  OVERLAPPED ov;
+  DWORD done = 0;
+  BOOL ok;
+  int rc = -1;
+
+  /* No pread()/pwrite() for CRT descriptors, but a synchronous ReadFile()
+   * or WriteFile() with an OVERLAPPED offset is positional, so the worker
+   * threads don't have to share (and lock) the file pointer. Bypasses the
+   * CRT, so no text-mode translation: open the fd with _O_BINARY. */
+  if (handle != INVALID_HANDLE_VALUE) {
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)(req->offset & 0xffffffff);
+    ov.OffsetHigh = (DWORD)(req->offset >> 32);
+    if (req->op == CPRT_AIO_OP_READ) {
+      ok = ReadFile(handle, req->buf, (DWORD)req->len, &done, &ov);
+    }
+    else {
+      ok = WriteFile(handle, req->buf, (DWORD)req->len, &done, &ov);
+    }
+    if (ok || GetLastError() == ERROR_HANDLE_EOF) {  /* Read at or past EOF. */
+      rc = (int)done;
+    }
+    else {
+      errno = GetLastError();
+    }
+  }
+#else
+  ssize_t rc;
+
+  do {
+    if (req->op == CPRT_AIO_OP_READ) {
+      rc = pread(req->fd, req->buf, req->len, (off_t)req->offset);
+    }
+    else {
+      rc = pwrite(req->fd, req->buf, req->len, (off_t)req->offset);
+    }
+  } while (rc < 0 && errno == EINTR);
+#endif
+
+  req->err = (rc < 0) ? errno : 0;
+  req->done_len = (rc < 0) ? 0 : (size_t)rc;
+}  /* cprt_aio_do_req */
+
+
+static CPRT_THREAD_ENTRYPOINT cprt_aio_thread(void *in_arg)
+{
+  cprt_aio_t *aio = (cprt_aio_t *)in_arg;
+  int slot;
+
+  while (1) {
+    CPRT_SEM_WAIT(aio->work_sem);
+    CPRT_MUTEX_LOCK(aio->lock);
+    if (aio->pending_count == 0) {  /* Only happens at shutdown. */
+      CPRT_MUTEX_UNLOCK(aio->lock);
+      break;
+    }
+    slot = aio->pending[aio->pending_head];
+    aio->pending_head = (aio->pending_head + 1) % aio->queue_depth;
+    aio->pending_count--;
+    CPRT_MUTEX_UNLOCK(aio->lock);
+
+    cprt_aio_do_req(&aio->reqs[slot]);
+
+    CPRT_MUTEX_LOCK(aio->lock);
+    aio->done[(aio->done_head + aio->done_count) % aio->queue_depth] = slot;
+    aio->done_count++;
+    CPRT_MUTEX_UNLOCK(aio->lock);
+    CPRT_SEM_POST(aio->done_sem);
+  }
+
+  CPRT_THREAD_EXIT;
+  return 0;
+}  /* cprt_aio_thread */
+
+
+/* Create an async I/O context allowing up to queue_depth requests in
+ * flight. Uses io_uring where available unless flags has
+ * CPRT_AIO_NO_URING; see cprt_aio_backend(). A context must only be used
+ * by one thread at a time. Errors are fatal. */
+cprt_aio_t *cprt_aio_create(int queue_depth, int flags)
+{
+  cprt_aio_t *aio;
+  int i;
+
+  CPRT_ASSERT(queue_depth > 0);
+  CPRT_ENULL(aio = (cprt_aio_t *)calloc(1, sizeof(cprt_aio_t)));
+  aio->queue_depth = queue_depth;
+  CPRT_ENULL(aio->reqs = (struct cprt_aio_req *)calloc(queue_depth, sizeof(struct cprt_aio_req)));
+  CPRT_ENULL(aio->free_slots = (int *)malloc(queue_depth * sizeof(int)));
+  for (i = 0; i < queue_depth; i++) {
+    aio->free_slots[i] = queue_depth - 1 - i;
+  }
+  aio->num_free = queue_depth;
+
+  aio->backend = CPRT_AIO_BACKEND_THREADS;
+#if defined(__linux__)
+  aio->ring_fd = -1;
+  if (! (flags & CPRT_AIO_NO_URING) && cprt_aio_uring_init(aio) == 0) {
+    aio->backend = CPRT_AIO_BACKEND_URING;
+  }
+#endif
+
+  if (aio->backend == CPRT_AIO_BACKEND_THREADS) {
+    CPRT_MUTEX_INIT(aio->lock);
+    CPRT_SEM_INIT(aio->work_sem, 0);
+    CPRT_SEM_INIT(aio->done_sem, 0);
+    CPRT_ENULL(aio->pending = (int *)malloc(queue_depth * sizeof(int)));
+    CPRT_ENULL(aio->done = (int *)malloc(queue_depth * sizeof(int)));
+    for (i = 0; i < CPRT_AIO_THREADS; i++) {
+      CPRT_THREAD_CREATE(aio->threads[i], cprt_aio_thread, aio);
+    }
+  }
+
+  return aio;
+}  /* cprt_aio_create */
+
+
+/* Wait for everything in flight (completions are discarded), then free. */
+void cprt_aio_delete(cprt_aio_t *aio)
+{
+  struct cprt_aio_completion comp;
+  int i;
+
+  while (aio->inflight > 0) {
+    CPRT_EM1(cprt_aio_wait(aio, &comp, 1, 1));
+  }
+
+#if defined(__linux__)
+  if (aio->backend == CPRT_AIO_BACKEND_URING) {
+    munmap(aio->sqes, aio->sqes_size);
+    if (aio->cq_ring != aio->sq_ring) {
+      munmap(aio->cq_ring, aio->cq_ring_size);
+    }
+    munmap(aio->sq_ring, aio->sq_ring_size);
+    close(aio->ring_fd);  /* Also unregisters buffers. */
+  }
+#endif
+  if (aio->backend == CPRT_AIO_BACKEND_THREADS) {
+    for (i = 0; i < CPRT_AIO_THREADS; i++) {  /* Wake with nothing pending: exit. */
+      CPRT_SEM_POST(aio->work_sem);
+    }
+    for (i = 0; i < CPRT_AIO_THREADS; i++) {
+      CPRT_THREAD_JOIN(aio->threads[i]);
+    }
+    free(aio->pending);
+    free(aio->done);
+    CPRT_SEM_DELETE(aio->work_sem);
+    CPRT_SEM_DELETE(aio->done_sem);
+    CPRT_MUTEX_DELETE(aio->lock);
+  }
+
+  free(aio->buf_addrs);
+  free(aio->buf_sizes);
+  free(aio->free_slots);
+  free(aio->reqs);
+  free(aio);
+}  /* cprt_aio_delete */
+
+
+/* CPRT_AIO_BACKEND_URING or CPRT_AIO_BACKEND_THREADS. */
+int cprt_aio_backend(const cprt_aio_t *aio)
+{
+  return aio->backend;
+}  /* cprt_aio_backend */
+
+
+/* Register buffers that will be used for many requests; pass the index
+ * as buf_index to cprt_aio_read() / cprt_aio_write(). With io_uring, the
+ * kernel pins and maps them once instead of on every request (counts
+ * against RLIMIT_MEMLOCK on older kernels). Can be called once per
+ * context. Return 0 on success, -1 on error (sets errno). */
+int cprt_aio_register_buffers(cprt_aio_t *aio, void **bufs, const size_t *sizes, int num_bufs)
+{
+  int i;
+
+  if (aio->num_bufs > 0) {
+    errno = EBUSY;
+    return -1;
+  }
+  if (num_bufs <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#if defined(__linux__)
+  if (aio->backend == CPRT_AIO_BACKEND_URING) {
+    struct iovec *iovs;
+    int rc;
+    CPRT_ENULL(iovs = (struct iovec *)malloc(num_bufs * sizeof(struct iovec)));
+    for (i = 0; i < num_bufs; i++) {
+      iovs[i].iov_base = bufs[i];
+      iovs[i].iov_len = sizes[i];
+    }
+    rc = (int)syscall(__NR_io_uring_register, aio->ring_fd, IORING_REGISTER_BUFFERS,
+        iovs, (unsigned)num_bufs);
+    free(iovs);
+    if (rc < 0) {
+      return -1;
+    }
+    aio->fixed_bufs = 1;
+  }
+#endif
+
+  CPRT_ENULL(aio->buf_addrs = (char **)malloc(num_bufs * sizeof(char *)));
+  CPRT_ENULL(aio->buf_sizes = (size_t *)malloc(num_bufs * sizeof(size_t)));
+  for (i = 0; i < num_bufs; i++) {
+    aio->buf_addrs[i] = (char *)bufs[i];
+    aio->buf_sizes[i] = sizes[i];
+  }
+  aio->num_bufs = num_bufs;
+
+  return 0;
+}  /* cprt_aio_register_buffers */
+
+
+static int cprt_aio_queue(cprt_aio_t *aio, int op, int fd, char *buf, size_t len, uint64_t offset,
+    int buf_index, void *user_data)
+{
+  struct cprt_aio_req *req;
+  int slot;
+
+  if (buf_index != CPRT_AIO_NO_BUF && (buf_index < 0 || buf_index >= aio->num_bufs
+      || buf < aio->buf_addrs[buf_index]
+      || buf + len > aio->buf_addrs[buf_index] + aio->buf_sizes[buf_index])) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (aio->num_free == 0) {
+    errno = EAGAIN;  /* Reap some completions first. */
+    return -1;
+  }
+  slot = aio->free_slots[--aio->num_free];
+  aio->inflight++;
+  req = &aio->reqs[slot];
+  req->op = op;
+  req->fd = fd;
+  req->buf = buf;
+  req->len = len;
+  req->offset = offset;
+  req->user_data = user_data;
+
+#if defined(__linux__)
+  if (aio->backend == CPRT_AIO_BACKEND_URING) {
+    unsigned tail = *aio->sq_tail;
+    unsigned idx = tail & *aio->sq_mask;
+    struct io_uring_sqe *sqe = &aio->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    if (buf_index != CPRT_AIO_NO_BUF && aio->fixed_bufs) {
+      sqe->opcode = (op == CPRT_AIO_OP_READ) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+      sqe->buf_index = (uint16_t)buf_index;
+    }
+    else {
+      sqe->opcode = (op == CPRT_AIO_OP_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+    }
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->user_data = (uint64_t)slot;
+    aio->sq_array[idx] = idx;
+    __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    aio->to_submit++;
+    return 0;
+  }
+#endif
+
+  CPRT_MUTEX_LOCK(aio->lock);
+  aio->pending[(aio->pending_head + aio->pending_count) % aio->queue_depth] = slot;
+  aio->pending_count++;
+  CPRT_MUTEX_UNLOCK(aio->lock);
+  CPRT_SEM_POST(aio->work_sem);
+
+  return 0;
+}  /* cprt_aio_queue */
+
+
+/* Queue a read of len bytes at file offset into buf. buf_index is
+ * CPRT_AIO_NO_BUF, or the registered buffer that buf is inside of.
+ * user_data is returned in the completion. With io_uring the request is
+ * passed to the kernel by the next cprt_aio_submit(), cprt_aio_poll() or
+ * cprt_aio_wait(); the thread backend starts it right away. Return 0 on
+ * success, -1 on error (sets errno; EAGAIN if queue_depth requests are
+ * already in flight). */
+int cprt_aio_read(cprt_aio_t *aio, int fd, void *buf, size_t len, uint64_t offset,
+    int buf_index, void *user_data)
+{
+  return cprt_aio_queue(aio, CPRT_AIO_OP_READ, fd, (char *)buf, len, offset, buf_index, user_data);
+}  /* cprt_aio_read */
+
+
+/* Like cprt_aio_read(), but writes. buf must not change until the
+ * request completes. */
+int cprt_aio_write(cprt_aio_t *aio, int fd, const void *buf, size_t len, uint64_t offset,
+    int buf_index, void *user_data)
+{
+  return cprt_aio_queue(aio, CPRT_AIO_OP_WRITE, fd, (char *)buf, len, offset, buf_index, user_data);
+}  /* cprt_aio_write */
+
+
+/* Pass queued requests to the kernel in one system call. Return 0 on
+ * success, -1 on error (sets errno). */
+int cprt_aio_submit(cprt_aio_t *aio)
+{
+#if defined(__linux__)
+  while (aio->to_submit > 0) {
+    int rc = (int)syscall(__NR_io_uring_enter, aio->ring_fd, aio->to_submit, 0, 0, NULL, 0);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    aio->to_submit -= (unsigned)rc;
+  }
+#endif
+  return 0;
+}  /* cprt_aio_submit */
+
+
+/* Copy up to max_comps finished requests into comps[] without blocking.
+ * Return the number copied (0 if none), or -1 on error (sets errno). */
+int cprt_aio_poll(cprt_aio_t *aio, struct cprt_aio_completion *comps, int max_comps)
+{
+  return cprt_aio_wait(aio, comps, max_comps, 0);
+}  /* cprt_aio_poll */
+
+
+/* Like cprt_aio_poll(), but block until at least min_comps (limited to
+ * the number in flight) have been copied. */
+int cprt_aio_wait(cprt_aio_t *aio, struct cprt_aio_completion *comps, int max_comps, int min_comps)
+{
+  int n = 0;
+
+  if (min_comps > max_comps) {
+    min_comps = max_comps;
+  }
+  if (min_comps > aio->inflight) {
+    min_comps = aio->inflight;
+  }
+
+#if defined(__linux__)
+  if (aio->backend == CPRT_AIO_BACKEND_URING) {
+    n = cprt_aio_uring_reap(aio, comps, max_comps);
+    while (n < min_comps || aio->to_submit > 0) {
+      unsigned want = (n < min_comps) ? (unsigned)(min_comps - n) : 0;
+      int rc = (int)syscall(__NR_io_uring_enter, aio->ring_fd, aio->to_submit, want,
+          (want > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      if (rc < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return -1;
+      }
+      aio->to_submit -= (unsigned)rc;
+      n += cprt_aio_uring_reap(aio, &comps[n], max_comps - n);
+    }
+    return n;
+  }
+#endif
+
+  while (n < max_comps) {
+    struct cprt_aio_req *req;
+    int got_it, slot;
+    if (n < min_comps) {
+      CPRT_SEM_WAIT(aio->done_sem);
+    }
+    else {
+      CPRT_SEM_TRYWAIT(got_it, aio->done_sem);
+      if (! got_it) {
+        break;
+      }
+    }
+    CPRT_MUTEX_LOCK(aio->lock);
+    slot = aio->done[aio->done_head];
+    aio->done_head = (aio->done_head + 1) % aio->queue_depth;
+    aio->done_count--;
+    CPRT_MUTEX_UNLOCK(aio->lock);
+
+    req = &aio->reqs[slot];
+    comps[n].user_data = req->user_data;
+    comps[n].op = req->op;
+    comps[n].err = req->err;
+    comps[n].len = req->done_len;
+    aio->free_slots[aio->num_free++] = slot;
+    aio->inflight--;
+    n++;
+  }
+
+  return n;
+}  /* cprt_aio_wait */
+
+
+/* Requests queued or running whose completions have not been reaped. */
+int cprt_aio_inflight(const cprt_aio_t *aio)
+{
+  return aio->inflight;
+}  /* cprt_aio_inflight */
+
+
+/* Open a file for cprt_aio: read-only, or (for_write) write-only,
+ * created and truncated. direct bypasses the page cache (O_DIRECT; on
+ * Mac, F_NOCACHE); buffers, offsets and lengths must then be multiples of
+ * the device block size (page-aligned buffers from cprt_alloc_large()
+ * are always safe). Return the descriptor, or -1 on error (sets errno;
+ * ENOSYS if direct is not supported here). */
+int cprt_aio_open(const char *path, int for_write, int direct)
+{
+  int oflags = for_write ? (O_WRONLY | O_CREAT | O_TRUNC) : O_RDONLY;
+  int fd;
+
+#if defined(_WIN32)
+  if (direct) {
+    errno = ENOSYS;  /* Needs CreateFile(FILE_FLAG_NO_BUFFERING). */
+    return -1;
+  }
+  fd = _open(path, oflags | _O_BINARY, _S_IREAD | _S_IWRITE);
+#elif defined(O_DIRECT)
+  fd = open(path, oflags | (direct ? O_DIRECT : 0), 0666);
+#elif defined(__APPLE__)
+  fd = open(path, oflags, 0666);
+  if (fd != -1 && direct && fcntl(fd, F_NOCACHE, 1) == -1) {
+    int save_errno = errno;
+    close(fd);
+    errno = save_errno;
+    return -1;
+  }
+#else
+  if (direct) {
+    errno = ENOSYS;
+    return -1;
+  }
+  fd = open(path, oflags, 0666);
+#endif
+
+  return fd;
+}  /* cprt_aio_open */
+
+
+/* Write-behind sink: the writer fills one buffer while earlier ones are
+ * being written by cprt_aio. */
+struct cprt_aio_sink_s {
+  cprt_aio_t *aio;
+  int fd;
+  uint64_t offset;  /* File offset of the next buffer written. */
+  size_t buf_size;
+  int num_bufs;
+  char **bufs;
+  size_t *write_len;  /* Bytes being written from each buffer; 0 = free. */
+  int use_fixed;  /* Buffers are registered. */
+  int cur;  /* Buffer being filled. */
+  size_t cur_len;
+  int err;  /* First write error (sticky). */
+  struct cprt_aio_sink_stats stats;
+};
+
+
+/* Free the buffers of finished writes, waiting for at least min_comps. */
+static void cprt_aio_sink_reap(cprt_aio_sink_t *sink, int min_comps)
+{
+  struct cprt_aio_completion comps[16];
+  int n, i, buf_i;
+
+  do {
+    CPRT_EM1(n = cprt_aio_wait(sink->aio, comps, 16, min_comps));
+    for (i = 0; i < n; i++) {
+      buf_i = (int)(uintptr_t)comps[i].user_data;
+      if (sink->err == 0 && comps[i].err != 0) {
+        sink->err = comps[i].err;
+      }
+      else if (sink->err == 0 && comps[i].len != sink->write_len[buf_i]) {
+        sink->err = EIO;  /* Short write (disk full?). */
+      }
+      sink->write_len[buf_i] = 0;
+    }
+    min_comps -= n;
+  } while (n == 16);
+}  /* cprt_aio_sink_reap */
+
+
+/* Start writing the current buffer and move to the next one, waiting
+ * for it if it is still being written. */
+static void cprt_aio_sink_issue(cprt_aio_sink_t *sink)
+{
+  int next;
+
+  CPRT_EM1(cprt_aio_write(sink->aio, sink->fd, sink->bufs[sink->cur], sink->cur_len, sink->offset,
+      sink->use_fixed ? sink->cur : CPRT_AIO_NO_BUF, (void *)(uintptr_t)sink->cur));
+  CPRT_EM1(cprt_aio_submit(sink->aio));
+  sink->write_len[sink->cur] = sink->cur_len;
+  sink->offset += sink->cur_len;
+  sink->stats.bytes += sink->cur_len;
+  sink->stats.writes++;
+
+  next = (sink->cur + 1) % sink->num_bufs;
+  cprt_aio_sink_reap(sink, 0);
+  if (sink->write_len[next] != 0) {
+    sink->stats.stalls++;
+    while (sink->write_len[next] != 0) {
+      cprt_aio_sink_reap(sink, 1);
+    }
+  }
+  sink->cur = next;
+  sink->cur_len = 0;
+}  /* cprt_aio_sink_issue */
+
+
+/* Create a sink that appends to fd (a regular file, starting at its
+ * current offset) through num_bufs buffers of buf_size bytes each.
+ * Writes copy into the current buffer; a full buffer is handed to
+ * cprt_aio and the writer moves on, blocking only if all buffers are
+ * still being written. aio_flags is passed to cprt_aio_create(). Not
+ * thread-safe. Errors are fatal. */
+cprt_aio_sink_t *cprt_aio_sink_create(int fd, size_t buf_size, int num_bufs, int aio_flags)
+{
+  cprt_aio_sink_t *sink;
+  int i;
+
+  CPRT_ASSERT(buf_size > 0 && num_bufs >= 2);
+  CPRT_ENULL(sink = (cprt_aio_sink_t *)calloc(1, sizeof(cprt_aio_sink_t)));
+  sink->fd = fd;
+  sink->buf_size = buf_size;
+  sink->num_bufs = num_bufs;
+#if defined(_WIN32)
+  sink->offset = (uint64_t)_lseeki64(fd, 0, SEEK_CUR);
+#else
+  sink->offset = (uint64_t)lseek(fd, 0, SEEK_CUR);
+#endif
+  CPRT_ENULL(sink->bufs = (char **)malloc(num_bufs * sizeof(char *)));
+  CPRT_ENULL(sink->write_len = (size_t *)calloc(num_bufs, sizeof(size_t)));
+  for (i = 0; i < num_bufs; i++) {
+    CPRT_ENULL(sink->bufs[i] = (char *)malloc(buf_size));
+  }
+  sink->aio = cprt_aio_create(num_bufs, aio_flags);
+  {
+    size_t *sizes;
+    CPRT_ENULL(sizes = (size_t *)malloc(num_bufs * sizeof(size_t)));
+    for (i = 0; i < num_bufs; i++) {
+      sizes[i] = buf_size;
+    }
+    /* Registration is an optimization; do without if it fails. */
+    sink->use_fixed = (cprt_aio_register_buffers(sink->aio, (void **)sink->bufs, sizes, num_bufs) == 0);
+    free(sizes);
+  }
+
+  return sink;
+}  /* cprt_aio_sink_create */
+
+
+/* Append len bytes. Return 0 on success, -1 if an earlier write failed
+ * (sets errno). */
+int cprt_aio_sink_write(cprt_aio_sink_t *sink, const void *data, size_t len)
+{
+  const char *src = (const char *)data;
+  size_t chunk;
+
+  while (len > 0) {
+    chunk = sink->buf_size - sink->cur_len;
+    if (chunk > len) {
+      chunk = len;
+    }
+    memcpy(sink->bufs[sink->cur] + sink->cur_len, src, chunk);
+    sink->cur_len += chunk;
+    src += chunk;
+    len -= chunk;
+    if (sink->cur_len == sink->buf_size) {
+      cprt_aio_sink_issue(sink);
+    }
+  }
+
+  if (sink->err != 0) {
+    errno = sink->err;
+    return -1;
+  }
+  return 0;
+}  /* cprt_aio_sink_write */
+
+
+/* Start writing whatever is buffered (does not wait for it). */
+int cprt_aio_sink_flush(cprt_aio_sink_t *sink)
+{
+  if (sink->cur_len > 0) {
+    cprt_aio_sink_issue(sink);
+  }
+
+  if (sink->err != 0) {
+    errno = sink->err;
+    return -1;
+  }
+  return 0;
+}  /* cprt_aio_sink_flush */
+
+
+/* Flush, wait for all writes, and free the sink (fd is left open).
+ * Return 0 on success, -1 if any write failed (sets errno). */
+int cprt_aio_sink_close(cprt_aio_sink_t *sink)
+{
+  int err, i;
+
+  cprt_aio_sink_flush(sink);
+  while (cprt_aio_inflight(sink->aio) > 0) {
+    cprt_aio_sink_reap(sink, 1);
+  }
+  err = sink->err;
+
+  cprt_aio_delete(sink->aio);
+  for (i = 0; i < sink->num_bufs; i++) {
+    free(sink->bufs[i]);
+  }
+  free(sink->bufs);
+  free(sink->write_len);
+  free(sink);
+
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}  /* cprt_aio_sink_close */
+
+
+void cprt_aio_sink_get_stats(const cprt_aio_sink_t *sink, struct cprt_aio_sink_stats *stats)
+{
+  *stats = sink->stats;
+}  /* cprt_aio_sink_get_stats */
+
+
+/* Integer parsing. Decimal digits are converted 8 at a time where the
+ * byte order allows it (SWAR: treat 8 chars as one uint64_t). */
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  #define CPRT_PARSE_SWAR
+#endif
+
+#if defined(CPRT_PARSE_SWAR)
+/* True if all 8 bytes are '0'..'9'. */
+#define CPRT_SWAR_ALL_DIGITS(_c) \
+  (((((_c) & 0xF0F0F0F0F0F0F0F0ull) \
+      | ((((_c) + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4))) \
+   == 0x3333333333333333ull)
+
+/* Value of 8 ASCII digits, first digit in the low byte. */
+static uint64_t cprt_swar_8_digits(uint64_t chunk)
+{
+  chunk -= 0x3030303030303030ull;
+  chunk = (chunk * 10) + (chunk >> 8);  /* Pairs of digits. */
+  chunk = (((chunk & 0x000000FF000000FFull) * 0x000F424000000064ull)  /* 100 + (1000000 << 32) */
+      + (((chunk >> 16) & 0x000000FF000000FFull) * 0x0000271000000001ull)) >> 32;  /* 1 + (10000 << 32) */
+  return chunk;
+}  /* cprt_swar_8_digits */
+#endif
+
+
+/* Parse an unsigned magnitude at [p, end): decimal, or hex after "0x".
+ * Sets *stop to the first byte not used. Returns 0, or an errno value
+ * (EINVAL: no digits; ERANGE: more than 64 bits). */
+static int cprt_parse_mag(const char *p, const char *end, uint64_t *result, const char **stop)
+{
+  uint64_t val = 0;
+  unsigned int d;
+  int num_digits = 0;
+  int sig_digits = 0;
+
+  if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    p += 2;
+    for (; p < end; p++, num_digits++) {
+      d = (unsigned char)*p;
+      if (d - '0' <= 9) {
+        d -= '0';
+      }
+      else if ((d | 0x20) - 'a' <= 5) {
+        d = (d | 0x20) - 'a' + 10;
+      }
+      else {
+        break;
+      }
+      if (val >> 60) {
+        return ERANGE;
+      }
+      val = (val << 4) | d;
+    }
+  }
+  else {
+    while (p < end && *p == '0') {
+      p++;
+      num_digits++;
+    }
+#if defined(CPRT_PARSE_SWAR)
+    /* Up to 19 digits can't overflow. */
+    while (end - p >= 8 && sig_digits <= 11) {
+      uint64_t chunk;
+      memcpy(&chunk, p, 8);
+      if (! CPRT_SWAR_ALL_DIGITS(chunk)) {
+        break;
+      }
+      val = (val * 100000000) + cprt_swar_8_digits(chunk);
+      p += 8;
+      sig_digits += 8;
+    }
+#endif
+    for (; p < end && (unsigned int)((unsigned char)*p - '0') <= 9; p++, sig_digits++) {
+      d = (unsigned char)*p - '0';
+      if (sig_digits >= 19 && val > (0xffffffffffffffffull - d) / 10) {
+        return ERANGE;
+      }
+      val = (val * 10) + d;
+    }
+    num_digits += sig_digits;
+  }
+
+  *stop = p;
+  if (num_digits == 0) {
+    return EINVAL;
+  }
+  *result = val;
+  return 0;
+}  /* cprt_parse_mag */
+
+
+/* Optional '+' (or '-', if the value is 0), then a magnitude. */
+static int cprt_parse_unsigned(const char *p, const char *end, uint64_t *result, const char **stop)
+{
+  int neg = 0;
+  int err;
+
+  if (p < end && (*p == '+' || *p == '-')) {
+    neg = (*p == '-');
+    p++;
+  }
+  err = cprt_parse_mag(p, end, result, stop);
+  if (err == 0 && neg && *result != 0) {
+    err = ERANGE;
+  }
+  return err;
+}  /* cprt_parse_unsigned */
+
+
+/* Optional '+' or '-', then a magnitude. */
+static int cprt_parse_signed(const char *p, const char *end, int64_t *result, const char **stop)
+{
+  uint64_t mag;
+  int neg = 0;
+  int err;
+
+  if (p < end && (*p == '+' || *p == '-')) {
+    neg = (*p == '-');
+    p++;
+  }
+  err = cprt_parse_mag(p, end, &mag, stop);
+  if (err != 0) {
+    return err;
+  }
+  if (neg) {
+    if (mag > 0x8000000000000000ull) {
+      return ERANGE;
+    }
+    *result = (mag == 0) ? 0 : -(int64_t)(mag - 1) - 1;
+  }
+  else {
+    if (mag > 0x7fffffffffffffffull) {
+      return ERANGE;
+    }
+    *result = (int64_t)mag;
+  }
+  return 0;
+}  /* cprt_parse_signed */
+
+
+/* Parse all len bytes of buf (no NUL needed) as an unsigned integer:
+ * decimal, or hex with a "0x" prefix. No white space. *result is only
+ * written on success. Return 0 on success, -1 on error (sets errno:
+ * EINVAL for a malformed number, ERANGE if it doesn't fit). */
+int cprt_parse_u64_n(const char *buf, size_t len, uint64_t *result)
+{
+  const char *stop;
+  uint64_t val;
+  int err;
+
+  err = cprt_parse_unsigned(buf, buf + len, &val, &stop);
+  if (err == 0 && stop != buf + len) {
+    err = EINVAL;
+  }
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  *result = val;
+  return 0;
+}  /* cprt_parse_u64_n */
+
+
+/* Like cprt_parse_u64_n(), but signed (optional '-'). */
+int cprt_parse_i64_n(const char *buf, size_t len, int64_t *result)
+{
+  const char *stop;
+  int64_t val;
+  int err;
+
+  err = cprt_parse_signed(buf, buf + len, &val, &stop);
+  if (err == 0 && stop != buf + len) {
+    err = EINVAL;
+  }
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  *result = val;
+  return 0;
+}  /* cprt_parse_i64_n */
+
+
+/* NUL-terminated versions. */
+int cprt_parse_u64(const char *str, uint64_t *result)
+{
+  return cprt_parse_u64_n(str, strlen(str), result);
+}  /* cprt_parse_u64 */
+
+
+int cprt_parse_i64(const char *str, int64_t *result)
+{
+  return cprt_parse_i64_n(str, strlen(str), result);
+}  /* cprt_parse_i64 */
+
+
+int cprt_parse_u32(const char *str, uint32_t *result)
+{
+  uint64_t val;
+
+  if (cprt_parse_u64(str, &val) == -1) {
+    return -1;
+  }
+  if (val > 0xffffffffull) {
+    errno = ERANGE;
+    return -1;
+  }
+  *result = (uint32_t)val;
+  return 0;
+}  /* cprt_parse_u32 */
+
+
+int cprt_parse_i32(const char *str, int32_t *result)
+{
+  int64_t val;
+
+  if (cprt_parse_i64(str, &val) == -1) {
+    return -1;
+  }
+  if (val > 0x7fffffff || val < -0x7fffffff - 1) {
+    errno = ERANGE;
+    return -1;
+  }
+  *result = (int32_t)val;
+  return 0;
+}  /* cprt_parse_i32 */
+
+
+/* Parse up to max_values delim-separated numbers from buf in place (a
+ * trailing delim is allowed). *consumed (if not NULL) is set to the
+ * offset where parsing stopped: the start of the bad field on error.
+ * Return the number of values parsed, or -1 on error (sets errno). */
+int cprt_parse_u64_fields(const char *buf, size_t len, char delim, uint64_t *values, int max_values,
+    size_t *consumed)
+{
+  const char *p = buf;
+  const char *end = buf + len;
+  const char *stop;
+  int n = 0;
+  int err;
+
+  while (n < max_values && p < end) {
+    err = cprt_parse_unsigned(p, end, &values[n], &stop);
+    if (err == 0 && stop < end && *stop != delim) {
+      err = EINVAL;
+    }
+    if (err != 0) {
+      if (consumed != NULL) {
+        *consumed = (size_t)(p - buf);
+      }
+      errno = err;
+      return -1;
+    }
+    n++;
+    p = (stop < end) ? stop + 1 : stop;  /* Skip delim. */
+  }
+
+  if (consumed != NULL) {
+    *consumed = (size_t)(p - buf);
+  }
+  return n;
+}  /* cprt_parse_u64_fields */
+
+
+/* Like cprt_parse_u64_fields(), but signed. */
+int cprt_parse_i64_fields(const char *buf, size_t len, char delim, int64_t *values, int max_values,
+    size_t *consumed)
+{
+  const char *p = buf;
+  const char *end = buf + len;
+  const char *stop;
+  int n = 0;
+  int err;
+
+  while (n < max_values && p < end) {
+    err = cprt_parse_signed(p, end, &values[n], &stop);
+    if (err == 0 && stop < end && *stop != delim) {
+      err = EINVAL;
+    }
+    if (err != 0) {
+      if (consumed != NULL) {
+        *consumed = (size_t)(p - buf);
+      }
+      errno = err;
+      return -1;
+    }
+    n++;
+    p = (stop < end) ? stop + 1 : stop;  /* Skip delim. */
+  }
+
+  if (consumed != NULL) {
+    *consumed = (size_t)(p - buf);
+  }
+  return n;
+}  /* cprt_parse_i64_fields */
+
+
+/* Out-of-line body of CPRT_ATOI for signed variables of size bytes.
+ * Like strtoll(), leading white space is skipped. Prints a message and
+ * returns an errno value on error, 0 on success. */
+int cprt_atoi_signed(const char *str, int64_t *result, size_t size, const char *name,
+    const char *file, int line)
+{
+  int64_t max;
+
+  while (isspace((unsigned char)*str)) {
+    str++;
+  }
+  if (cprt_parse_i64(str, result) == -1) {
+    if (errno == ERANGE) {
+      fprintf(stderr, "%s:%d, %s over/under flow: '%s'\n", CPRT_BASENAME(file), line, name, str);
+    }
+    else {
+      fprintf(stderr, "%s:%d, Error, invalid number for %s: '%s'\n", CPRT_BASENAME(file), line, name, str);
+    }
+    return errno;
+  }
+  if (size < 8) {
+    max = ((int64_t)1 << (size * 8 - 1)) - 1;
+    if (*result > max || *result < -max - 1) {
+      fprintf(stderr, "%s:%d, %s over/under flow: '%s'\n", CPRT_BASENAME(file), line, name, str);
+      return ERANGE;
+    }
+  }
+  return 0;
+}  /* cprt_atoi_signed */
+
+
+/* Out-of-line body of CPRT_ATOI for unsigned variables. */
+int cprt_atoi_unsigned(const char *str, uint64_t *result, size_t size, const char *name,
+    const char *file, int line)
+{
+  while (isspace((unsigned char)*str)) {
+    str++;
+  }
+  if (cprt_parse_u64(str, result) == -1) {
+    if (errno == ERANGE) {
+      fprintf(stderr, "%s:%d, %s over/under flow: '%s'\n", CPRT_BASENAME(file), line, name, str);
+    }
+    else {
+      fprintf(stderr, "%s:%d, Error, invalid number for %s: '%s'\n", CPRT_BASENAME(file), line, name, str);
+    }
+    return errno;
+  }
+  if (size < 8 && (*result >> (size * 8)) != 0) {
+    fprintf(stderr, "%s:%d, %s over/under flow: '%s'\n", CPRT_BASENAME(file), line, name, str);
+    return ERANGE;
+  }
+  return 0;
+}  /* cprt_atoi_unsigned */
+
+
+/* Log-linear histogram (as in HdrHistogram). Values below 2^p (p =
+ * precision_bits) each get their own bucket. Above that, each power of 2
+ * is split into 2^p equal buckets, so a bucket is never wider than
+ * 1/2^p of the values in it. */
+struct cprt_hist_s {
+  int precision_bits;
+  uint64_t max_value;  /* Larger values are counted in the top bucket. */
+  int num_buckets;
+  uint64_t *buckets;
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  double sum;
+};
+
+
+/* Index of the highest set bit (v must not be 0). */
+static int cprt_hist_msb(uint64_t v)
+{
+#if defined(_WIN32) && defined(_M_X64)
+  unsigned long idx;
+  _BitScanReverse64(&idx, v);
+  return (int)idx;
+#elif defined(__GNUC__)
+  return 63 - __builtin_clzll(v);
+#else
+  int idx = 0;
+  while (v >>= 1) {
+    idx++;
+  }
+  return idx;
+#endif
+}  /* cprt_hist_msb */
+
+
+static int cprt_hist_index(int precision_bits, uint64_t value)
+{
+  int shift;
+
+  if (value < ((uint64_t)1 << precision_bits)) {
+    return (int)value;
+  }
+  shift = cprt_hist_msb(value) - precision_bits;
+  return ((shift + 1) << precision_bits) + (int)((value >> shift) - ((uint64_t)1 << precision_bits));
+}  /* cprt_hist_index */
+
+
+/* Smallest value that lands in bucket idx. */
+static uint64_t cprt_hist_bucket_low(int precision_bits, int idx)
+{
+  int shift;
+
+  if (idx < (1 << precision_bits)) {
+    return (uint64_t)idx;
+  }
+  shift = (idx >> precision_bits) - 1;
+  return (((uint64_t)1 << precision_bits) + (idx & ((1 << precision_bits) - 1))) << shift;
+}  /* cprt_hist_bucket_low */
+
+
+/* Largest value that lands in bucket idx. */
+static uint64_t cprt_hist_bucket_high(int precision_bits, int idx)
+{
+  int shift;
+
+  if (idx < (1 << precision_bits)) {
+    return (uint64_t)idx;
+  }
+  shift = (idx >> precision_bits) - 1;
+  return cprt_hist_bucket_low(precision_bits, idx) + (((uint64_t)1 << shift) - 1);
+}  /* cprt_hist_bucket_high */
+
+
+/* Values up to max_value are recorded with a relative error of at most
+ * 1/2^precision_bits (1-16; e.g. 7 is better than 1%). Recording never
+ * allocates. */
+cprt_hist_t *cprt_hist_create(uint64_t max_value, int precision_bits)
+{
+  cprt_hist_t *hist;
+
+  CPRT_ASSERT(precision_bits >= 1 && precision_bits <= 16);
+  CPRT_ENULL(hist = (cprt_hist_t *)calloc(1, sizeof(cprt_hist_t)));
+  hist->precision_bits = precision_bits;
+  hist->max_value = max_value;
+  hist->num_buckets = cprt_hist_index(precision_bits, max_value) + 1;
+  CPRT_ENULL(hist->buckets = (uint64_t *)calloc(hist->num_buckets, sizeof(uint64_t)));
+  hist->min = (uint64_t)-1;
+
+  return hist;
+}  /* cprt_hist_create */
+
+
+void cprt_hist_delete(cprt_hist_t *hist)
+{
+  free(hist->buckets);
+  free(hist);
+}  /* cprt_hist_delete */
+
+
+void cprt_hist_reset(cprt_hist_t *hist)
+{
+  memset(hist->buckets, 0, hist->num_buckets * sizeof(uint64_t));
+  hist->count = 0;
+  hist->min = (uint64_t)-1;
+  hist->max = 0;
+  hist->sum = 0;
+}  /* cprt_hist_reset */
+
+
+void cprt_hist_record_n(cprt_hist_t *hist, uint64_t value, uint64_t count)
+{
+  int idx;
+
+  if (CPRT_UNLIKELY(value > hist->max_value)) {
+    idx = hist->num_buckets - 1;
+  } else {
+    idx = cprt_hist_index(hist->precision_bits, value);
+  }
+  hist->buckets[idx] += count;
+  hist->count += count;
+  hist->sum += (double)value * count;
+  if (value < hist->min) hist->min = value;
+  if (value > hist->max) hist->max = value;
+}  /* cprt_hist_record_n */
+
+
+void cprt_hist_record(cprt_hist_t *hist, uint64_t value)
+{
+  cprt_hist_record_n(hist, value, 1);
+}  /* cprt_hist_record */
+
+
+/* Add from's counts to into. The two may have different max_value and
+ * precision_bits, but then from's values are re-bucketed at their
+ * bucket's lower bound. */
+void cprt_hist_merge(cprt_hist_t *into, const cprt_hist_t *from)
+{
+  int i;
+
+  if (from->count == 0) {
+    return;
+  }
+  if (into->precision_bits == from->precision_bits && into->num_buckets >= from->num_buckets) {
+    for (i = 0; i < from->num_buckets; i++) {
+      into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+  } else {
+    double sum = into->sum;
+    uint64_t min = into->min, max = into->max;
+    for (i = 0; i < from->num_buckets; i++) {
+      if (from->buckets[i] > 0) {
+        cprt_hist_record_n(into, cprt_hist_bucket_low(from->precision_bits, i), from->buckets[i]);
+      }
+    }
+    into->sum = sum + from->sum;
+    into->min = min;
+    into->max = max;
+  }
+  if (from->min < into->min) into->min = from->min;
+  if (from->max > into->max) into->max = from->max;
+}  /* cprt_hist_merge */
+
+
+uint64_t cprt_hist_count(const cprt_hist_t *hist)
+{
+  return hist->count;
+}  /* cprt_hist_count */
+
+
+/* Exact (not bucketed); 0 if empty. */
+uint64_t cprt_hist_min(const cprt_hist_t *hist)
+{
+  return (hist->count > 0) ? hist->min : 0;
+}  /* cprt_hist_min */
+
+
+/* Exact (not bucketed), even beyond max_value. */
+uint64_t cprt_hist_max(const cprt_hist_t *hist)
+{
+  return hist->max;
+}  /* cprt_hist_max */
+
+
+double cprt_hist_mean(const cprt_hist_t *hist)
+{
+  return (hist->count > 0) ? hist->sum / hist->count : 0;
+}  /* cprt_hist_mean */
+
+
+/* Value that pct percent (0-100) of the recorded values are at or below,
+ * reported as the top of its bucket (never more than the max). */
+uint64_t cprt_hist_percentile(const cprt_hist_t *hist, double pct)
+{
+  uint64_t rank, seen = 0, val;
+  double exact_rank;
+  int i;
+
+  if (hist->count == 0) {
+    return 0;
+  }
+  if (pct >= 100) {
+    return hist->max;
+  }
+  exact_rank = pct / 100 * hist->count;
+  rank = (uint64_t)exact_rank;
+  if (rank < exact_rank || rank < 1) rank++;
+  for (i = 0; i < hist->num_buckets; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank) {
+      break;
+    }
+  }
+  val = cprt_hist_bucket_high(hist->precision_bits, i);
+  if (val > hist->max) val = hist->max;
+  if (val < hist->min) val = hist->min;
+  return val;
+}  /* cprt_hist_percentile */
+
+
+/* One summary line: "name: count=... min=... mean=... p50=... ... max=...". */
+void cprt_hist_print(const cprt_hist_t *hist, FILE *fp, const char *name)
+{
+  fprintf(fp, "%s: count=%"PRIu64" min=%"PRIu64" mean=%.1f p50=%"PRIu64" p90=%"PRIu64" p99=%"PRIu64
+      " p99.9=%"PRIu64" p99.99=%"PRIu64" max=%"PRIu64"\n", name, hist->count, cprt_hist_min(hist),
+      cprt_hist_mean(hist), cprt_hist_percentile(hist, 50), cprt_hist_percentile(hist, 90),
+      cprt_hist_percentile(hist, 99), cprt_hist_percentile(hist, 99.9), cprt_hist_percentile(hist, 99.99),
+      hist->max);
+}  /* cprt_hist_print */
+
+
+/* One row per non-empty bucket, for plotting. */
+void cprt_hist_print_csv(const cprt_hist_t *hist, FILE *fp)
+{
+  uint64_t seen = 0;
+  int i;
+
+  fprintf(fp, "low,high,count,cumulative_pct\n");
+  for (i = 0; i < hist->num_buckets; i++) {
+    if (hist->buckets[i] > 0) {
+      seen += hist->buckets[i];
+      fprintf(fp, "%"PRIu64",%"PRIu64",%"PRIu64",%.4f\n", cprt_hist_bucket_low(hist->precision_bits, i),
+          cprt_hist_bucket_high(hist->precision_bits, i), hist->buckets[i], (double)seen * 100 / hist->count);
+    }
+  }
+}  /* cprt_hist_print_csv */
+
+
+/* Thread-safe histogram: each recording thread gets its own cprt_hist_t
+ * (found through a small thread-local cache), and readers merge them. */
+struct cprt_hist_mt_s {
+  long id;  /* Unique, so stale thread-local cache entries never match. */
+  uint64_t max_value;
+  int precision_bits;
+  CPRT_MUTEX_T lock;  /* Protects the thread list. */
+  const void **thread_keys;
+  cprt_hist_t **hists;
+  int num_threads;
+  int max_threads;
+};
+
+#define CPRT_HIST_MT_CACHE 8
+static CPRT_TLS struct {
+  long id;
+  cprt_hist_t *hist;
+} cprt_hist_mt_cache[CPRT_HIST_MT_CACHE];
+static CPRT_TLS char cprt_hist_mt_thread_key;  /* Its address identifies the thread. */
+static volatile long cprt_hist_mt_next_id = 0;
+
+
+cprt_hist_mt_t *cprt_hist_mt_create(uint64_t max_value, int precision_bits)
+{
+  cprt_hist_mt_t *mt;
+
+  CPRT_ASSERT(precision_bits >= 1 && precision_bits <= 16);
+  CPRT_ENULL(mt = (cprt_hist_mt_t *)calloc(1, sizeof(cprt_hist_mt_t)));
+  mt->id = CPRT_ATOMIC_INC_VAL(&cprt_hist_mt_next_id);
+  mt->max_value = max_value;
+  mt->precision_bits = precision_bits;
+  CPRT_MUTEX_INIT(mt->lock);
+
+  return mt;
+}  /* cprt_hist_mt_create */
+
+
+/* No thread may be recording. */
+void cprt_hist_mt_delete(cprt_hist_mt_t *mt)
+{
+  int i;
+
+  for (i = 0; i < mt->num_threads; i++) {
+    cprt_hist_delete(mt->hists[i]);
+  }
+  free(mt->hists);
+  free(mt->thread_keys);
+  CPRT_MUTEX_DELETE(mt->lock);
+  free(mt);
+}  /* cprt_hist_mt_delete */
+
+
+/* First record by this thread (or a cache miss): find or add its hist.
+ * A new thread that reuses an exited thread's TLS address continues that
+ * thread's histogram, which is harmless. */
+static cprt_hist_t *cprt_hist_mt_thread_hist(cprt_hist_mt_t *mt)
+{
+  cprt_hist_t *hist = NULL;
+  int i;
+
+  CPRT_MUTEX_LOCK(mt->lock);
+  for (i = 0; i < mt->num_threads; i++) {
+    if (mt->thread_keys[i] == &cprt_hist_mt_thread_key) {
+      hist = mt->hists[i];
+      break;
+    }
+  }
+  if (hist == NULL) {
+    if (mt->num_threads == mt->max_threads) {
+      mt->max_threads = (mt->max_threads == 0) ? 8 : mt->max_threads * 2;
+      CPRT_ENULL(mt->thread_keys = (const void **)realloc((void *)mt->thread_keys, mt->max_threads * sizeof(void *)));
+      CPRT_ENULL(mt->hists = (cprt_hist_t **)realloc(mt->hists, mt->max_threads * sizeof(cprt_hist_t *)));
+    }
+    hist = cprt_hist_create(mt->max_value, mt->precision_bits);
+    mt->thread_keys[mt->num_threads] = &cprt_hist_mt_thread_key;
+    mt->hists[mt->num_threads] = hist;
+    mt->num_threads++;
+  }
+  CPRT_MUTEX_UNLOCK(mt->lock);
+
+  return hist;
+}  /* cprt_hist_mt_thread_hist */
+
+
+/* Lock-free except for a thread's first record into this mt. */
+void cprt_hist_mt_record(cprt_hist_mt_t *mt, uint64_t value)
+{
+  int slot = (int)(mt->id % CPRT_HIST_MT_CACHE);
+
+  if (CPRT_UNLIKELY(cprt_hist_mt_cache[slot].id != mt->id)) {
+    cprt_hist_mt_cache[slot].hist = cprt_hist_mt_thread_hist(mt);
+    cprt_hist_mt_cache[slot].id = mt->id;
+  }
+  cprt_hist_record(cprt_hist_mt_cache[slot].hist, value);
+}  /* cprt_hist_mt_record */
+
+
+/* Merge all threads' histograms into a new one (caller deletes it). Done
+ * while threads keep recording, so it may miss their latest values. */
+cprt_hist_t *cprt_hist_mt_snapshot(cprt_hist_mt_t *mt)
+{
+  cprt_hist_t *snap = cprt_hist_create(mt->max_value, mt->precision_bits);
+  int i;
+
+  CPRT_MUTEX_LOCK(mt->lock);
+  for (i = 0; i < mt->num_threads; i++) {
+    cprt_hist_merge(snap, mt->hists[i]);
+  }
+  CPRT_MUTEX_UNLOCK(mt->lock);
+
+  return snap;
+}  /* cprt_hist_mt_snapshot */
+
+
+/* Counter regions. On Linux, the calling thread's counters are one
+ * perf_event_open() group, so they are scheduled (and multiplexed)
+ * together. Elsewhere, only time is measured. */
+struct cprt_perf_region {
+  char *name;
+  uint64_t start_ns;
+  uint64_t start[CPRT_PERF_MAX_COUNTERS];
+  uint64_t start_enabled, start_running;
+  struct cprt_perf_stats stats;
+};
+
+struct cprt_perf_s {
+  int mode;  /* CPRT_PERF_MODE_*. */
+  int num_counters;
+  const char *names[CPRT_PERF_MAX_COUNTERS];
+#if defined(__linux__)
+  int fds[CPRT_PERF_MAX_COUNTERS];  /* fds[0] is the group leader. */
+  struct perf_event_mmap_page *pages[CPRT_PERF_MAX_COUNTERS];  /* For rdpmc. */
+  int use_rdpmc;
+#endif
+  struct cprt_perf_region *regions;
+  int num_regions;
+  int max_regions;
+};
+
+
+#if defined(__linux__)
+/* Open and enable one group of counters on the calling thread. Return 0,
+ * or -1 and errno (and nothing left open). */
+static int cprt_perf_open_group(cprt_perf_t *perf, uint32_t type, const uint64_t *configs,
+    const char **names, int num)
+{
+  struct perf_event_attr attr;
+  int i, j, save_errno, exclude_kernel;
+
+  for (exclude_kernel = 0; exclude_kernel <= 1; exclude_kernel++) {
+    for (i = 0; i < num; i++) {
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = type;
+      attr.config = configs[i];
+      attr.disabled = (i == 0);
+      attr.exclude_hv = 1;
+      attr.exclude_kernel = exclude_kernel;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      perf->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, (i == 0) ? -1 : perf->fds[0], 0);
+      if (perf->fds[i] == -1) {
+        break;
+      }
+      perf->names[i] = names[i];
+    }
+    if (i == num) {
+      perf->num_counters = num;
+      CPRT_EM1(ioctl(perf->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP));
+      CPRT_EM1(ioctl(perf->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP));
+      return 0;
+    }
+    save_errno = errno;
+    for (j = 0; j < i; j++) {
+      close(perf->fds[j]);
+    }
+    errno = save_errno;
+    /* perf_event_paranoid >= 2 only allows counting user space. Reopen
+     * the whole group that way, so all its members count the same. */
+    if (errno != EACCES && errno != EPERM) {
+      break;
+    }
+  }
+  return -1;
+}  /* cprt_perf_open_group */
+
+
+/* A group that can never fit on the PMU (e.g. the NMI watchdog holds a
+ * counter it needs) opens fine but counts nothing. Give it a couple of
+ * multiplexing intervals (4 ms by default) of this thread's time to get
+ * scheduled. */
+static int cprt_perf_group_runs(cprt_perf_t *perf)
+{
+  uint64_t buf[3 + CPRT_PERF_MAX_COUNTERS];  /* nr, time_enabled, time_running, values. */
+
+  do {
+    CPRT_EM1(read(perf->fds[0], buf, sizeof(buf)));
+    if (buf[2] > 0) {
+      return 1;
+    }
+  } while (buf[1] < 10000000);
+
+  return 0;
+}  /* cprt_perf_group_runs */
+#endif
+
+
+/* Counters for the calling thread only: create one per thread, and use
+ * it only from that thread. Never fails; see cprt_perf_mode() for what
+ * it could open. */
+cprt_perf_t *cprt_perf_create(int flags)
+{
+  cprt_perf_t *perf;
+#if defined(__linux__)
+  static const uint64_t hw_configs[] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+  static const char *hw_names[] = { "cycles", "instructions", "cache_misses", "branch_misses" };
+  static const uint64_t sw_configs[] = { PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_SW_CONTEXT_SWITCHES,
+    PERF_COUNT_SW_PAGE_FAULTS };
+  static const char *sw_names[] = { "task_clock_ns", "context_switches", "page_faults" };
+  long page_size;
+  int i;
+#endif
+
+  CPRT_ENULL(perf = (cprt_perf_t *)calloc(1, sizeof(cprt_perf_t)));
+  perf->mode = CPRT_PERF_MODE_NONE;
+
+#if defined(__linux__)
+  /* Hardware counters are often unavailable (VMs, containers,
+   * perf_event_paranoid); software counters still say something. */
+  if (! (flags & CPRT_PERF_NO_HW) && cprt_perf_open_group(perf, PERF_TYPE_HARDWARE, hw_configs, hw_names, 4) == 0) {
+    if (cprt_perf_group_runs(perf)) {
+      perf->mode = CPRT_PERF_MODE_HW;
+    } else {
+      for (i = 0; i < perf->num_counters; i++) {
+        close(perf->fds[i]);
+      }
+      perf->num_counters = 0;
+    }
+  }
+  if (perf->mode == CPRT_PERF_MODE_NONE &&
+      cprt_perf_open_group(perf, PERF_TYPE_SOFTWARE, sw_configs, sw_names, 3) == 0) {
+    perf->mode = CPRT_PERF_MODE_SW;
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  /* Read hardware counters with rdpmc (no system call) if allowed. */
+  if (perf->mode == CPRT_PERF_MODE_HW) {
+    page_size = sysconf(_SC_PAGESIZE);
+    perf->use_rdpmc = 1;
+    for (i = 0; i < perf->num_counters; i++) {
+      void *page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, perf->fds[i], 0);
+      if (page == MAP_FAILED) {
+        perf->use_rdpmc = 0;
+        break;
+      }
+      perf->pages[i] = (struct perf_event_mmap_page *)page;
+      if (! perf->pages[i]->cap_user_rdpmc) {
+        perf->use_rdpmc = 0;
+      }
+    }
+    /* The leader's page gives the group's enabled and running times. */
+    if (perf->use_rdpmc && ! perf->pages[0]->cap_user_time) {
+      perf->use_rdpmc = 0;
+    }
+  }
+#endif
+#else
+  (void)flags;
+#endif
+
+  return perf;
+}  /* cprt_perf_create */
+
+
+void cprt_perf_delete(cprt_perf_t *perf)
+{
+  int i;
+
+#if defined(__linux__)
+  for (i = 0; i < perf->num_counters; i++) {
+    if (perf->pages[i] != NULL) {
+      munmap(perf->pages[i], sysconf(_SC_PAGESIZE));
+    }
+    close(perf->fds[i]);
+  }
+#endif
+  for (i = 0; i < perf->num_regions; i++) {
+    free(perf->regions[i].name);
+  }
+  free(perf->regions);
+  free(perf);
+}  /* cprt_perf_delete */
+
+
+int cprt_perf_mode(const cprt_perf_t *perf)
+{
+  return perf->mode;
+}  /* cprt_perf_mode */
+
+
+int cprt_perf_num_counters(const cprt_perf_t *perf)
+{
+  return perf->num_counters;
+}  /* cprt_perf_num_counters */
+
+
+/* E.g. "cycles", or "task_clock_ns" in software mode. */
+const char *cprt_perf_counter_name(const cprt_perf_t *perf, int counter)
+{
+  CPRT_ASSERT(counter >= 0 && counter < perf->num_counters);
+  return perf->names[counter];
+}  /* cprt_perf_counter_name */
+
+
+/* Read the counters and the group's enabled and running times (ns). */
+static void cprt_perf_read(cprt_perf_t *perf, uint64_t *values, uint64_t *enabled, uint64_t *running)
+{
+#if defined(__linux__)
+  uint64_t buf[3 + CPRT_PERF_MAX_COUNTERS];  /* nr, time_enabled, time_running, values. */
+  int i;
+
+#if defined(__x86_64__) || defined(__i386__)
+  if (perf->use_rdpmc) {
+    for (i = 0; i < perf->num_counters; i++) {
+      struct perf_event_mmap_page *pc = perf->pages[i];
+      uint32_t seq, idx, lo, hi;
+      int64_t count;
+      uint64_t cyc, quot, delta;
+      do {
+        seq = pc->lock;
+        CPRT_MEMORY_FENCE();
+        idx = pc->index;
+        count = pc->offset;
+        if (idx != 0) {
+          __asm__ __volatile__("rdpmc" : "=a" (lo), "=d" (hi) : "c" (idx - 1));
+          /* Sign-extend the pmc_width-bit counter. */
+          count += (int64_t)(((uint64_t)hi << 32 | lo) << (64 - pc->pmc_width)) >> (64 - pc->pmc_width);
+        }
+        if (i == 0) {
+          /* The page's times are as of the last schedule in; add the
+           * TSC time since then, as in linux/perf_event.h. (The x86 TSC
+           * is 64 bits, so cap_user_time_short never applies.) */
+          *enabled = pc->time_enabled;
+          *running = pc->time_running;
+          __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+          cyc = (uint64_t)hi << 32 | lo;
+          quot = cyc >> pc->time_shift;
+          delta = pc->time_offset + quot * pc->time_mult +
+              (((cyc & (((uint64_t)1 << pc->time_shift) - 1)) * pc->time_mult) >> pc->time_shift);
+          *enabled += delta;
+          *running += delta;
+        }
+        CPRT_MEMORY_FENCE();
+      } while (pc->lock != seq);
+      if (idx == 0) {
+        break;  /* Not on the PMU right now (e.g. multiplexed); read() it. */
+      }
+      values[i] = (uint64_t)count;
+    }
+    if (i == perf->num_counters) {
+      return;
+    }
+  }
+#endif
+
+  if (perf->mode != CPRT_PERF_MODE_NONE) {
+    CPRT_EM1(read(perf->fds[0], buf, sizeof(buf)));
+    *enabled = buf[1];
+    *running = buf[2];
+    for (i = 0; i < perf->num_counters; i++) {
+      values[i] = buf[3 + i];
+    }
+    return;
+  }
+#else
+  (void)perf;
+  (void)values;
+#endif
+  *enabled = 0;
+  *running = 0;
+}  /* cprt_perf_read */
+
+
+/* Find or add a named region; returns its id for begin/end. */
+int cprt_perf_region(cprt_perf_t *perf, const char *name)
+{
+  struct cprt_perf_region *region;
+  int i;
+
+  for (i = 0; i < perf->num_regions; i++) {
+    if (strcmp(perf->regions[i].name, name) == 0) {
+      return i;
+    }
+  }
+  if (perf->num_regions == perf->max_regions) {
+    perf->max_regions = (perf->max_regions == 0) ? 8 : perf->max_regions * 2;
+    CPRT_ENULL(perf->regions = (struct cprt_perf_region *)realloc(perf->regions,
+        perf->max_regions * sizeof(struct cprt_perf_region)));
+  }
+  region = &perf->regions[perf->num_regions];
+  memset(region, 0, sizeof(*region));
+  CPRT_ENULL(region->name = CPRT_STRDUP(name));
+  region->stats.num_counters = perf->num_counters;
+
+  return perf->num_regions++;
+}  /* cprt_perf_region */
+
+
+void cprt_perf_begin(cprt_perf_t *perf, int region_id)
+{
+  struct cprt_perf_region *region = &perf->regions[region_id];
+  struct cprt_timespec ts;
+
+  CPRT_GETTIME(&ts);
+  region->start_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  cprt_perf_read(perf, region->start, &region->start_enabled, &region->start_running);
+}  /* cprt_perf_begin */
+
+
+/* Add the counts since the region's cprt_perf_begin() to its totals.
+ * Regions may nest or overlap, but each region must not. */
+void cprt_perf_end(cprt_perf_t *perf, int region_id)
+{
+  struct cprt_perf_region *region = &perf->regions[region_id];
+  uint64_t values[CPRT_PERF_MAX_COUNTERS];
+  uint64_t enabled, running;
+  struct cprt_timespec ts;
+  int i;
+
+  cprt_perf_read(perf, values, &enabled, &running);
+  CPRT_GETTIME(&ts);
+  region->stats.time_ns += ((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec) - region->start_ns;
+  region->stats.time_enabled_ns += enabled - region->start_enabled;
+  region->stats.time_running_ns += running - region->start_running;
+  for (i = 0; i < perf->num_counters; i++) {
+    region->stats.counters[i] += values[i] - region->start[i];
+  }
+  region->stats.calls++;
+}  /* cprt_perf_end */
+
+
+void cprt_perf_get_stats(const cprt_perf_t *perf, int region_id, struct cprt_perf_stats *stats)
+{
+  CPRT_ASSERT(region_id >= 0 && region_id < perf->num_regions);
+  *stats = perf->regions[region_id].stats;
+}  /* cprt_perf_get_stats */
+
+
+/* One line per region: calls, then time and each counter per call.
+ * Multiplexed counters are scaled up to the time they were enabled. */
+void cprt_perf_print(const cprt_perf_t *perf, FILE *fp)
+{
+  const struct cprt_perf_stats *stats;
+  double scale;
+  int r, i;
+
+  for (r = 0; r < perf->num_regions; r++) {
+    stats = &perf->regions[r].stats;
+    scale = (stats->time_running_ns > 0) ? (double)stats->time_enabled_ns / stats->time_running_ns : 1.0;
+    fprintf(fp, "%s: calls=%"PRIu64" ns=%.1f", perf->regions[r].name, stats->calls,
+        (stats->calls > 0) ? (double)stats->time_ns / stats->calls : 0.0);
+    for (i = 0; i < perf->num_counters; i++) {
+      fprintf(fp, " %s=%.1f", perf->names[i], (stats->calls > 0) ? scale * stats->counters[i] / stats->calls : 0.0);
+    }
+    if (perf->mode == CPRT_PERF_MODE_HW && stats->counters[0] > 0) {
+      fprintf(fp, " ipc=%.2f", (double)stats->counters[1] / stats->counters[0]);
+    }
+    fprintf(fp, "\n");
+  }
+}  /* cprt_perf_print */
 
 
 #define CPRT_MAX_EVENTS 1024
@@ -382,12 +5938,20 @@ void cprt_event(int event)
 
 void cprt_dump_events(FILE *fd)
 {
+  char line[64];
+  size_t len;
   int i, n;
   n = cprt_num_events;
   printf("cprt_num_events=%d\n", n);
   for (i = 1; i <= CPRT_MAX_EVENTS; i++) {
-    fprintf(fd, "  cprt_event[%d] = %09d\n",
-        (n - i), cprt_events[(n - i) % CPRT_MAX_EVENTS]);
+    memcpy(line, "  cprt_event[", 13);
+    len = 13;
+    len += cprt_fmt_i64(&line[len], n - i, 0);
+    memcpy(&line[len], "] = ", 4);
+    len += 4;
+    len += cprt_fmt_i64(&line[len], cprt_events[(n - i) % CPRT_MAX_EVENTS], 9);
+    line[len++] = '\n';
+    fwrite(line, 1, len, fd);
     if (n == i) {
       break;  /* There were less than CPRT_MAX_EVENTS events. */
     }
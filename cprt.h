@@ -26,12 +26,17 @@
   #include <ws2tcpip.h>
   #include <mswsock.h>
   #include <mstcpip.h>
+  #include <errno.h>
   #pragma comment(lib, "Ws2_32.lib")
   #pragma warning(disable : 4996)
   typedef unsigned __int8 uint8_t;
   typedef unsigned __int16 uint16_t;
   typedef unsigned __int32 uint32_t;
   typedef unsigned __int64 uint64_t;
+  typedef __int8 int8_t;
+  typedef __int16 int16_t;
+  typedef __int32 int32_t;
+  typedef __int64 int64_t;
   /* C99 printf format macros missing from VC. */
   #define PRId8 "d"
   #define PRId16 "d"
@@ -63,6 +68,8 @@
   #define strtoull _strtoui64
 
 #else  /* Unix */
+  #include <sys/socket.h>
+  #include <netinet/in.h>
   #include <arpa/inet.h>
   #include <unistd.h>
   #include <errno.h>
@@ -110,7 +117,7 @@ extern "C" {
 /* Get usec diff between two struct timeval (used by gettimeofday). */
 #define CPRT_DIFF_TV(diff_tv_result_us_, diff_tv_end_us_, diff_tv_start_us_) do { \
   (diff_tv_result_us_) = (((uint64_t)diff_tv_end_us_.tv_sec \
-                           - (uint64_t)diff_tv_start_us_.tv_sec) * 1000000000ull \
+                           - (uint64_t)diff_tv_start_us_.tv_sec) * 1000000ull \
                           + (uint64_t)diff_tv_end_us_.tv_usec) \
                          - (uint64_t)diff_tv_start_us_.tv_usec; \
 } while (0)  /* CPRT_DIFF_TV */
@@ -119,10 +126,28 @@ extern "C" {
 #if defined(_WIN32)
   #define CPRT_ATOMIC_INC_VAL(_p) InterlockedIncrement(_p)
   #define CPRT_ATOMIC_DEC_VAL(_p) InterlockedDecrement(_p)
+  #define CPRT_ATOMIC_ADD_VAL(_p, _v) (InterlockedExchangeAdd(_p, _v) + (_v))
+  #define CPRT_ATOMIC_EXCHANGE(_p, _v) InterlockedExchange(_p, _v)
+  #define CPRT_ATOMIC_CAS(_p, _old, _new) (InterlockedCompareExchange(_p, _new, _old) == (_old))
+  #define CPRT_MEMORY_FENCE() MemoryBarrier()
+  #define CPRT_CPU_PAUSE() YieldProcessor()
 #else  /* Unix */
   /* GCC supports multiple types. For portability, please limit to "long" (signed or unsigned). */
   #define CPRT_ATOMIC_INC_VAL(_p) __sync_add_and_fetch(_p, 1)
   #define CPRT_ATOMIC_DEC_VAL(_p) __sync_sub_and_fetch(_p, 1)
+  #define CPRT_ATOMIC_ADD_VAL(_p, _v) __sync_add_and_fetch(_p, _v)
+  #define CPRT_ATOMIC_EXCHANGE(_p, _v) __atomic_exchange_n(_p, _v, __ATOMIC_SEQ_CST)
+  /* Evaluates to non-zero if *_p was _old and was replaced by _new. */
+  #define CPRT_ATOMIC_CAS(_p, _old, _new) __sync_bool_compare_and_swap(_p, _old, _new)
+  #define CPRT_MEMORY_FENCE() __sync_synchronize()
+  /* Spin-wait hint to the CPU (x86 "pause", ARM "yield"). */
+  #if defined(__i386__) || defined(__x86_64__)
+    #define CPRT_CPU_PAUSE() __builtin_ia32_pause()
+  #elif defined(__aarch64__) || defined(__arm__)
+    #define CPRT_CPU_PAUSE() __asm__ __volatile__("yield" ::: "memory")
+  #else
+    #define CPRT_CPU_PAUSE() do { } while (0)
+  #endif
 #endif
 
 /* Macro to approximate the basename() function. */
@@ -137,61 +162,57 @@ extern "C" {
   cprt_perrno(cprt_perrno_in_str, __FILE__, __LINE__); \
 } while (0)
 
+/* Branch hints and attributes for the error checks below: the check is
+ * one compare-and-branch, and the failure handling is out of line in
+ * cold cprt_fail_*() functions. */
+#if defined(__GNUC__) || defined(__clang__)
+  #define CPRT_LIKELY(_x) __builtin_expect(!!(_x), 1)
+  #define CPRT_UNLIKELY(_x) __builtin_expect(!!(_x), 0)
+  #define CPRT_COLD __attribute__((cold, noinline))
+  #define CPRT_NORETURN __attribute__((noreturn))
+#elif defined(_MSC_VER)
+  #define CPRT_LIKELY(_x) (_x)
+  #define CPRT_UNLIKELY(_x) (_x)
+  #define CPRT_COLD __declspec(noinline)
+  #define CPRT_NORETURN __declspec(noreturn)
+#else
+  #define CPRT_LIKELY(_x) (_x)
+  #define CPRT_UNLIKELY(_x) (_x)
+  #define CPRT_COLD
+  #define CPRT_NORETURN
+#endif
+
 /* Use when non-zero means error. */
 #define CPRT_EOK0(cprt_eok0_expr) do { \
-  if ((cprt_eok0_expr) != 0) { \
-    int cprt_eok0_errno = errno; \
-    char cprt_eok0_errstr[1024]; \
-    CPRT_SNPRINTF(cprt_eok0_errstr, sizeof(cprt_eok0_errstr), "'%s' is not 0", #cprt_eok0_expr); \
-    errno = cprt_eok0_errno; \
-    CPRT_PERRNO(cprt_eok0_errstr); \
-    CPRT_ERR_EXIT; \
+  if (CPRT_UNLIKELY((cprt_eok0_expr) != 0)) { \
+    cprt_fail_errno(#cprt_eok0_expr, "is not 0", __FILE__, __LINE__); \
   } \
 } while (0)
 
 /* Use when non-zero means error. */
 #define CPRT_EOK1(cprt_eok1_expr) do { \
-  if ((cprt_eok1_expr) != 1) { \
-    int cprt_eok1_errno = errno; \
-    char cprt_eok1_errstr[1024]; \
-    CPRT_SNPRINTF(cprt_eok1_errstr, sizeof(cprt_eok1_errstr), "'%s' is not 1", #cprt_eok1_expr); \
-    errno = cprt_eok1_errno; \
-    CPRT_PERRNO(cprt_eok1_errstr); \
-    CPRT_ERR_EXIT; \
+  if (CPRT_UNLIKELY((cprt_eok1_expr) != 1)) { \
+    cprt_fail_errno(#cprt_eok1_expr, "is not 1", __FILE__, __LINE__); \
   } \
 } while (0)
 
 /* Use when NULL means error. */
 #define CPRT_ENULL(cprt_enull_expr) do { \
-  if ((cprt_enull_expr) == NULL) { \
-    int cprt_enull_errno = errno; \
-    char cprt_enull_errstr[1024]; \
-    CPRT_SNPRINTF(cprt_enull_errstr, sizeof(cprt_enull_errstr), "'%s' is NULL", #cprt_enull_expr); \
-    errno = cprt_enull_errno; \
-    CPRT_PERRNO(cprt_enull_errstr); \
-    CPRT_ERR_EXIT; \
+  if (CPRT_UNLIKELY((cprt_enull_expr) == NULL)) { \
+    cprt_fail_errno(#cprt_enull_expr, "is NULL", __FILE__, __LINE__); \
   } \
 } while (0)
 
 /* Use when -1 means error. */
 #define CPRT_EM1(cprt_em1_expr) do { \
-  if ((long)(cprt_em1_expr) == -1) { \
-    int cprt_em1_errno = errno; \
-    char cprt_em1_errstr[1024]; \
-    CPRT_SNPRINTF(cprt_em1_errstr, sizeof(cprt_em1_errstr), "'%s' is -1", #cprt_em1_expr); \
-    errno = cprt_em1_errno; \
-    CPRT_PERRNO(cprt_em1_errstr); \
-    CPRT_ERR_EXIT; \
+  if (CPRT_UNLIKELY((long)(cprt_em1_expr) == -1)) { \
+    cprt_fail_errno(#cprt_em1_expr, "is -1", __FILE__, __LINE__); \
   } \
 } while (0)
 
 #define CPRT_ASSERT(cprt_assert_cond) do { \
-  if (! (cprt_assert_cond)) { \
-    cprt_ts_eprintf("ERROR (%s:%d): ERROR: '%s' not true\n", \
-      CPRT_BASENAME(__FILE__), __LINE__, #cprt_assert_cond); \
-    if (cprt_num_events > 0) { cprt_dump_events(stderr); } \
-    fflush(stderr); \
-    CPRT_ERR_EXIT; \
+  if (CPRT_UNLIKELY(! (cprt_assert_cond))) { \
+    cprt_fail_assert(#cprt_assert_cond, __FILE__, __LINE__); \
   } \
 } while (0)
 
@@ -215,68 +236,24 @@ extern "C" {
 #define CPRT_VOL32(cprt_vol32_ptr) (*(volatile uint32_t *)&(cprt_vol32_ptr))
 
 
-/* See https://github.com/fordsfords/safe_atoi */
+/* See https://github.com/fordsfords/safe_atoi
+ * Accepts decimal or "0x" hex; the parsing itself is out of line in
+ * cprt_atoi_signed() / cprt_atoi_unsigned() (see cprt_parse_i64()).
+ * Errors are fatal. */
 #define CPRT_ATOI(a_,r_) do { \
-  char *in_a_ = (a_); \
-  int new_errno_; \
-  unsigned long long fs_[9] = {  /* All '1's by variable size. */ \
-    0, 0xff, 0xffff, 0, 0xffffffff, 0, 0, 0, 0xffffffffffffffff }; \
-  (r_) = fs_[sizeof(r_)]; \
-  if ((r_) < 0) { /* Is result a signed value? */ \
-    char *temp_ = NULL;  long long llresult_; \
-    if (strlen(in_a_) > 2 && in_a_[0] == '0' && (in_a_[1] == 'x' || in_a_[1] == 'X')) { \
-      in_a_ += 2;  /* Skip past '0x'. */ \
-      errno = 0; \
-      llresult_ = strtoll(in_a_, &temp_, 16); \
-      new_errno_ = errno; \
-    } else { \
-      errno = 0; \
-      llresult_ = strtoll(in_a_, &temp_, 10); \
-      new_errno_ = errno; \
-    } \
-    if (new_errno_ != 0 || temp_ == in_a_ || temp_ == NULL || *temp_ != '\0') { \
-      if (new_errno_ == 0) { \
-        new_errno_ = EINVAL; \
-      } \
-      fprintf(stderr, "%s:%d, Error, invalid number for %s: '%s'\n", \
-         CPRT_BASENAME(__FILE__), __LINE__, #r_, in_a_); \
-    } else { /* strtol thinks success; check for overflow. */ \
-      (r_) = llresult_; /* "return" value of macro */ \
-      if ((r_) != llresult_) { \
-        fprintf(stderr, "%s:%d, %s over/under flow: '%s'\n", \
-           CPRT_BASENAME(__FILE__), __LINE__, #r_, in_a_); \
-        new_errno_ = ERANGE; \
-      } \
-    } \
+  (r_) = 0; \
+  (r_)--;  /* All '1's; only negative if r_ is signed. */ \
+  if ((r_) < 0) { \
+    int64_t cprt_atoi_s_; \
+    errno = cprt_atoi_signed((a_), &cprt_atoi_s_, sizeof(r_), #r_, __FILE__, __LINE__); \
+    CPRT_EOK0(errno); /* Omit this line if you want errors to return. */ \
+    if (errno == 0) { (r_) = cprt_atoi_s_; }  /* Else r_ stays all '1's. */ \
   } else { \
-    char *temp_ = NULL;  unsigned long long llresult_; \
-    if (strlen(in_a_) > 2 && in_a_[0] == '0' && (in_a_[1] == 'x' || in_a_[1] == 'X')) { \
-      in_a_ += 2;  /* Skip past '0x'. */ \
-      errno = 0; \
-      llresult_ = strtoull(in_a_, &temp_, 16); \
-      new_errno_ = errno; \
-    } else { \
-      errno = 0; \
-      llresult_ = strtoull(in_a_, &temp_, 10); \
-      new_errno_ = errno; \
-    } \
-    if (new_errno_ != 0 || temp_ == in_a_ || temp_ == NULL || *temp_ != '\0') { \
-      if (new_errno_ == 0) { \
-        new_errno_ = EINVAL; \
-      } \
-      fprintf(stderr, "%s:%d, Error, invalid number for %s: '%s'\n", \
-         CPRT_BASENAME(__FILE__), __LINE__, #r_, in_a_); \
-    } else { /* strtol thinks success; check for overflow. */ \
-      (r_) = llresult_; /* "return" value of macro */ \
-      if ((r_) != llresult_) { \
-        fprintf(stderr, "%s:%d, %s over/under flow: '%s'\n", \
-           CPRT_BASENAME(__FILE__), __LINE__, #r_, in_a_); \
-        new_errno_ = ERANGE; \
-      } \
-    } \
+    uint64_t cprt_atoi_u_; \
+    errno = cprt_atoi_unsigned((a_), &cprt_atoi_u_, sizeof(r_), #r_, __FILE__, __LINE__); \
+    CPRT_EOK0(errno); /* Omit this line if you want errors to return. */ \
+    if (errno == 0) { (r_) = cprt_atoi_u_; }  /* Else r_ stays all '1's. */ \
   } \
-  errno = new_errno_; \
-  CPRT_EOK0(errno); /* Omit this line if you want errors to return. */ \
 } while (0)
 
 
@@ -448,6 +425,8 @@ extern "C" {
   #define CPRT_SEM_WAIT(_s) do { \
     WaitForSingleObject(_s, INFINITE); \
   } while (0)
+  #define CPRT_SEM_TRYWAIT(_got_it, _s) \
+    (_got_it) = (WaitForSingleObject(_s, 0) == WAIT_OBJECT_0)
 
 #elif defined(__APPLE__)
   #define CPRT_SEM_T dispatch_semaphore_t
@@ -455,6 +434,8 @@ extern "C" {
   #define CPRT_SEM_DELETE(_s) dispatch_release(_s)
   #define CPRT_SEM_POST(_s) dispatch_semaphore_signal(_s)
   #define CPRT_SEM_WAIT(_s) dispatch_semaphore_wait(_s, DISPATCH_TIME_FOREVER)
+  #define CPRT_SEM_TRYWAIT(_got_it, _s) \
+    (_got_it) = (dispatch_semaphore_wait(_s, DISPATCH_TIME_NOW) == 0)
 
 #else  /* Non-Apple Unixes */
   #define CPRT_SEM_T sem_t
@@ -462,8 +443,70 @@ extern "C" {
   #define CPRT_SEM_DELETE(_s) CPRT_EOK0(sem_destroy(&(_s)))
   #define CPRT_SEM_POST(_s) CPRT_EOK0(sem_post(&(_s)))
   #define CPRT_SEM_WAIT(_s) CPRT_EOK0(sem_wait(&(_s)))
+  #define CPRT_SEM_TRYWAIT(_got_it, _s) do { \
+    if (sem_trywait(&(_s)) == 0) { \
+      (_got_it) = 1; \
+    } else if (errno == EAGAIN || errno == EINTR) { \
+      (_got_it) = 0; \
+    } else { \
+      CPRT_PERRNO("sem_trywait"); \
+      CPRT_ERR_EXIT; \
+    } \
+  } while (0)
 #endif
 
+/* Wait strategies: how a thread passes time while blocked. Trades CPU for
+ * wake-up latency; see cprt_wait_idle(). */
+#define CPRT_WAIT_SPIN 0  /* Busy spin; lowest latency, burns a core. */
+#define CPRT_WAIT_PAUSE 1  /* Spin with a CPU pause (kinder to SMT sibling). */
+#define CPRT_WAIT_YIELD 2  /* Pause-spin "spin_limit" times, then yield. */
+#define CPRT_WAIT_BACKOFF 3  /* Exponentially more pauses, then yield. */
+#define CPRT_WAIT_PARK 4  /* Pause-spin "spin_limit" times, then sleep. */
+struct cprt_wait {
+  int strategy;
+  uint32_t spin_limit;  /* For YIELD and PARK. */
+  uint32_t max_backoff;  /* Max pauses per idle for BACKOFF. */
+  uint32_t count;  /* Idles since last cprt_wait_reset(). */
+};
+
+/* Block with a wait strategy. PARK uses the OS's blocking wait; the others
+ * poll the "try" form, calling cprt_wait_idle() between tries. */
+#define CPRT_SEM_WAIT_STRATEGY(_s, _wait) do { \
+  int _got_it; \
+  if ((_wait)->strategy == CPRT_WAIT_PARK) { \
+    CPRT_SEM_WAIT(_s); \
+  } else { \
+    cprt_wait_reset(_wait); \
+    CPRT_SEM_TRYWAIT(_got_it, _s); \
+    while (! _got_it) { \
+      cprt_wait_idle(_wait); \
+      CPRT_SEM_TRYWAIT(_got_it, _s); \
+    } \
+  } \
+} while (0)
+#define CPRT_MUTEX_LOCK_STRATEGY(_m, _wait) do { \
+  int _got_it; \
+  if ((_wait)->strategy == CPRT_WAIT_PARK) { \
+    CPRT_MUTEX_LOCK(_m); \
+  } else { \
+    cprt_wait_reset(_wait); \
+    CPRT_MUTEX_TRYLOCK(_got_it, _m); \
+    while (! _got_it) { \
+      cprt_wait_idle(_wait); \
+      CPRT_MUTEX_TRYLOCK(_got_it, _m); \
+    } \
+  } \
+} while (0)
+#define CPRT_SPIN_LOCK_STRATEGY(_m, _wait) do { \
+  int _got_it; \
+  cprt_wait_reset(_wait); \
+  CPRT_SPIN_TRYLOCK(_got_it, _m); \
+  while (! _got_it) { \
+    cprt_wait_idle(_wait); \
+    CPRT_SPIN_TRYLOCK(_got_it, _m); \
+  } \
+} while (0)
+
 
 #if defined(_WIN32)
   #define CPRT_THREAD_T HANDLE
@@ -478,8 +521,11 @@ extern "C" {
       CPRT_ERR_EXIT; \
     }\
   } while (0)
+  #define CPRT_THREAD_CREATE_EX(_tid, _tstrt, _targ, _attr) \
+    CPRT_EM1(cprt_thread_create_ex(&(_tid), _tstrt, _targ, _attr))
   #define CPRT_THREAD_EXIT do { ExitThread(0); } while (0)
   #define CPRT_THREAD_JOIN(_tid) WaitForSingleObject(_tid, INFINITE)
+  #define CPRT_THREAD_YIELD() SwitchToThread()
   #define CPRT_GET_THREAD_ID() ((CPRT_THREAD_ID_T)GetCurrentThreadId())
 
 #else  /* Unix */
@@ -488,9 +534,12 @@ extern "C" {
   #define CPRT_THREAD_ENTRYPOINT void *
   #define CPRT_THREAD_CREATE(_tid, _tstrt, _targ) \
     CPRT_EOK0(errno = pthread_create(&(_tid), NULL, _tstrt, _targ))
+  #define CPRT_THREAD_CREATE_EX(_tid, _tstrt, _targ, _attr) \
+    CPRT_EM1(cprt_thread_create_ex(&(_tid), _tstrt, _targ, _attr))
   #define CPRT_THREAD_EXIT pthread_exit(NULL)
   #define CPRT_THREAD_JOIN(_tid) \
     CPRT_EOK0(errno = pthread_join(_tid, NULL))
+  #define CPRT_THREAD_YIELD() sched_yield()
   #define CPRT_GET_THREAD_ID() ((CPRT_THREAD_ID_T)pthread_self())
 #endif
 
@@ -499,15 +548,21 @@ extern "C" {
   *_cprt_cpuset_p = 0; \
 } while (0)
 
+/* Only for CPUs 0-63; use cprt_cpuset_t for more. */
 #define CPRT_CPU_SET(_cprt_cpunum, _cprt_cpuset) do { \
   uint64_t *_cprt_cpuset_p = (_cprt_cpuset); \
-  if ((_cprt_cpunum) == 0) { \
-    *_cprt_cpuset_p |= 1; \
-  } else { \
-    *_cprt_cpuset_p |= (1ull << (_cprt_cpunum)); \
+  if ((_cprt_cpunum) < 0 || (_cprt_cpunum) > 63) { \
+    errno = EINVAL; \
+    CPRT_PERRNO("CPRT_CPU_SET: CPU number out of range for uint64_t mask"); \
+    CPRT_ERR_EXIT; \
   } \
+  *_cprt_cpuset_p |= (1ull << (_cprt_cpunum)); \
 } while (0)
 
+/* Variable-size CPU set, for hosts with more than 64 CPUs. On Windows,
+ * CPU numbers are (processor_group * 64) + number_within_group. */
+typedef struct cprt_cpuset_s cprt_cpuset_t;
+
 
 #define CPRT_INITTIME cprt_inittime
 #if defined(_WIN32)
@@ -541,10 +596,342 @@ extern "C" {
                          - (uint64_t)diff_ts_start_ns_.tv_nsec; \
 } while (0)  /* CPRT_DIFF_TS */
 
+/* Flags for cprt_alloc_large(). Each is tried in order; normal pages are
+ * always the last resort. */
+#define CPRT_ALLOC_HUGE_EXPLICIT 0x01  /* MAP_HUGETLB / MEM_LARGE_PAGES. */
+#define CPRT_ALLOC_HUGE_THP 0x02  /* Transparent huge pages (madvise). */
+#define CPRT_ALLOC_HUGE (CPRT_ALLOC_HUGE_EXPLICIT | CPRT_ALLOC_HUGE_THP)
+
+/* Special numa_node values for cprt_alloc_large(). */
+#define CPRT_NUMA_NODE_ANY (-1)  /* Don't bind. */
+#define CPRT_NUMA_NODE_CURRENT (-2)  /* Node of the CPU the caller is on. */
+
+/* What cprt_alloc_large() actually got; needed by cprt_free_large(). */
+struct cprt_alloc_info {
+  size_t size;  /* Mapped size (rounded up to a multiple of page_size). */
+  size_t page_size;
+  int got_flags;  /* Which CPRT_ALLOC_HUGE_* succeeded (0 = normal pages). */
+  int numa_node;  /* Node the memory is bound to, or -1 if not bound. */
+};
+
+/* Page fault counters, see cprt_fault_counts(). */
+struct cprt_fault_counts {
+  uint64_t minor_faults;
+  uint64_t major_faults;
+};
+
+/* Per-thread resource usage, see cprt_thread_stats(). */
+struct cprt_thread_stats {
+  uint64_t user_ns;  /* CPU time. */
+  uint64_t sys_ns;
+  uint64_t vol_ctx_switches;  /* Blocked (sleep, I/O, lock wait). */
+  uint64_t invol_ctx_switches;  /* Preempted. */
+  struct cprt_fault_counts faults;  /* As from cprt_fault_counts(). */
+};
+
+/* CPU topology, see cprt_topology_load(). */
+#define CPRT_TOPO_MAX_CACHES 8
+struct cprt_topo_cache {
+  int level;  /* 1, 2, 3... */
+  char type;  /* 'D'ata, 'I'nstruction or 'U'nified. */
+  int line_size;
+  uint64_t size;  /* Bytes. */
+  int id;  /* CPUs with the same level, type and id share the cache. */
+};
+struct cprt_topo_cpu {
+  int online;  /* If 0, the rest of the fields are not valid. */
+  int package;  /* Physical socket. */
+  int core;  /* Host-wide core id (lowest CPU number in the core). */
+  int smt_rank;  /* 0 for the lowest-numbered hardware thread of a core. */
+  int numa_node;  /* -1 if not known. */
+  int num_caches;
+  struct cprt_topo_cache caches[CPRT_TOPO_MAX_CACHES];
+};
+struct cprt_topology {
+  int max_cpus;  /* Number of entries in cpus[]. */
+  int num_online;
+  int num_cores;
+  int num_packages;
+  int num_nodes;
+  struct cprt_topo_cpu *cpus;  /* Indexed by CPU number. */
+};
+
+/* "package" values for cprt_topology_pick_cores(). */
+#define CPRT_TOPO_ONE_PACKAGE (-1)  /* Any single package with enough cores. */
+#define CPRT_TOPO_ANY_PACKAGE (-2)  /* Cores may span packages. */
+
+/* Work-stealing thread pool, see cprt_pool_create(). */
+typedef struct cprt_pool_s cprt_pool_t;
+typedef void (*cprt_pool_fn_t)(void *arg);
+struct cprt_pool_wg {  /* Wait group: counts submitted tasks not yet done. */
+  volatile long pending;
+};
+struct cprt_pool_stats {  /* Per-worker. */
+  uint64_t tasks_run;
+  uint64_t steals;  /* Tasks taken from other workers' deques. */
+  uint64_t parks;  /* Times the worker went to sleep. */
+  uint64_t idle_ns;  /* Time spent spinning or parked with no work. */
+};
+
+/* Loop bodies for cprt_parallel_for() and cprt_parallel_reduce(); each call
+ * processes indexes [begin, end). */
+typedef void (*cprt_parallel_fn_t)(uint64_t begin, uint64_t end, void *ctx);
+typedef void (*cprt_reduce_fn_t)(uint64_t begin, uint64_t end, void *partial, void *ctx);
+typedef void (*cprt_combine_fn_t)(void *into, const void *from, void *ctx);
+
+/* Thread creation attributes, see cprt_thread_create_ex(). Zero fields
+ * (cprt_thread_attr_init()) mean "default". */
+#if defined(_WIN32)
+  typedef LPTHREAD_START_ROUTINE cprt_thread_fn_t;
+#else
+  typedef void *(*cprt_thread_fn_t)(void *arg);
+#endif
+struct cprt_thread_attr {
+  size_t stack_size;
+  const char *name;  /* Shows up in top, gdb, perf; Linux truncates to 15 chars. */
+  int priority;  /* >0: SCHED_FIFO priority (Windows: TIME_CRITICAL); needs privilege. */
+  const cprt_cpuset_t *cpuset;  /* Affinity applied before the thread runs. */
+};
+
+/* One datagram for cprt_udp_recv_batch() / cprt_udp_send_batch(). The
+ * caller owns (and usually preallocates and reuses) the buffers. */
+struct cprt_udp_pkt {
+  void *buf;
+  size_t buf_size;  /* Recv: capacity of buf. */
+  size_t len;  /* Recv: bytes received; send: bytes to send. */
+  struct sockaddr_storage addr;  /* Recv: source; send: destination. */
+  socklen_t addr_len;  /* Send: 0 = use connected peer. */
+  int truncated;  /* Recv: datagram was bigger than buf_size. */
+  uint64_t rx_ts_ns;  /* Recv: kernel arrival time (realtime), or 0. */
+};
+#define CPRT_RX_TS_SOFTWARE 0x01  /* Flags for cprt_rx_timestamp_enable(). */
+#define CPRT_RX_TS_HARDWARE 0x02
+
+/* Readiness event loop, see cprt_evloop_create(). */
+typedef struct cprt_evloop_s cprt_evloop_t;
+#define CPRT_EV_READ 0x01
+#define CPRT_EV_WRITE 0x02
+#define CPRT_EV_ERROR 0x04  /* Error or hang-up; always reported. */
+#define CPRT_EVLOOP_FOREVER ((uint64_t)-1)  /* cprt_evloop_run_once() max wait. */
+typedef void (*cprt_evloop_sock_fn_t)(cprt_evloop_t *loop, CPRT_SOCKET sock, int events, void *arg);
+typedef void (*cprt_evloop_timer_fn_t)(cprt_evloop_t *loop, int timer_id, void *arg);
+struct cprt_evloop_stats {
+  uint64_t wakeups;  /* Returns from epoll_wait() / poll(). */
+  uint64_t empty_wakeups;  /* ... that had no socket events. */
+  uint64_t events;  /* Socket callbacks made. */
+  uint64_t max_events_per_wakeup;
+  uint64_t timers_fired;
+};
+
+/* Zero-copy TCP send state for one socket, see cprt_zc_init(). */
+struct cprt_zc {
+  CPRT_SOCKET sock;
+  int zerocopy;  /* MSG_ZEROCOPY enabled. */
+  size_t min_zc_size;  /* Smaller sends are copied. */
+  uint32_t next_seq;  /* Kernel's id for the next zero-copy send. */
+  uint32_t done_seq;  /* Sends before this are complete. */
+  uint64_t zc_sends;
+  uint64_t copy_sends;
+  uint64_t kernel_copied;  /* Completions where the kernel copied anyway. */
+};
+
+/* Asynchronous file I/O, see cprt_aio_create(). */
+typedef struct cprt_aio_s cprt_aio_t;
+#define CPRT_AIO_NO_URING 0x01  /* cprt_aio_create() flag: always use I/O threads. */
+#define CPRT_AIO_BACKEND_URING 1  /* cprt_aio_backend() values. */
+#define CPRT_AIO_BACKEND_THREADS 2
+#define CPRT_AIO_OP_READ 1
+#define CPRT_AIO_OP_WRITE 2
+#define CPRT_AIO_NO_BUF (-1)  /* buf_index for buffers not registered. */
+struct cprt_aio_completion {
+  void *user_data;
+  int op;  /* CPRT_AIO_OP_*. */
+  int err;  /* 0 or errno value. */
+  size_t len;  /* Bytes transferred; short reads mean end of file. */
+};
+
+/* Buffered write-behind file sink, see cprt_aio_sink_create(). */
+typedef struct cprt_aio_sink_s cprt_aio_sink_t;
+struct cprt_aio_sink_stats {
+  uint64_t bytes;
+  uint64_t writes;  /* Buffers handed to cprt_aio. */
+  uint64_t stalls;  /* Times the writer waited for a buffer to come back. */
+};
+
+/* Buffer sizes for the cprt_fmt_* functions. */
+#define CPRT_FMT_INT_SZ 24  /* Any 64-bit integer, sign and NUL. */
+#define CPRT_FMT_TIME_SZ 40  /* Any cprt_fmt_tm() / cprt_fmt_epoch_ns() output. */
+
+/* Log-linear latency histogram, see cprt_hist_create(). */
+typedef struct cprt_hist_s cprt_hist_t;
+typedef struct cprt_hist_mt_s cprt_hist_mt_t;  /* Thread-safe (per-thread) variant. */
+
+/* Performance counter regions, see cprt_perf_create(). */
+typedef struct cprt_perf_s cprt_perf_t;
+#define CPRT_PERF_NO_HW 0x01  /* cprt_perf_create() flag: software counters only. */
+#define CPRT_PERF_MODE_NONE 0  /* cprt_perf_mode() values; NONE: time only. */
+#define CPRT_PERF_MODE_HW 1
+#define CPRT_PERF_MODE_SW 2
+#define CPRT_PERF_MAX_COUNTERS 4
+struct cprt_perf_stats {
+  uint64_t calls;
+  uint64_t time_ns;  /* Totals over all calls. */
+  int num_counters;
+  uint64_t counters[CPRT_PERF_MAX_COUNTERS];  /* See cprt_perf_counter_name(). */
+  /* The counters were enabled for time_enabled_ns but only counted for
+   * time_running_ns when multiplexed; scale them by enabled / running. */
+  uint64_t time_enabled_ns;
+  uint64_t time_running_ns;
+};
+
 /* externals in cprt.c. */
 char *cprt_strerror(int errnum, char *buffer, size_t buf_sz);
 void cprt_set_affinity(uint64_t in_mask);
 int cprt_try_affinity(uint64_t in_mask);
+cprt_cpuset_t *cprt_cpuset_create();
+void cprt_cpuset_delete(cprt_cpuset_t *cpuset);
+int cprt_cpuset_max_cpus(const cprt_cpuset_t *cpuset);
+void cprt_cpuset_zero(cprt_cpuset_t *cpuset);
+int cprt_cpuset_set(cprt_cpuset_t *cpuset, int cpu);
+int cprt_cpuset_clear(cprt_cpuset_t *cpuset, int cpu);
+int cprt_cpuset_test(const cprt_cpuset_t *cpuset, int cpu);
+int cprt_cpuset_count(const cprt_cpuset_t *cpuset);
+int cprt_cpuset_next(const cprt_cpuset_t *cpuset, int cpu);
+int cprt_cpuset_parse(cprt_cpuset_t *cpuset, const char *list_str);
+char *cprt_cpuset_format(const cprt_cpuset_t *cpuset, char *buf, size_t buf_sz);
+void cprt_set_affinity_cpuset(const cprt_cpuset_t *cpuset);
+int cprt_try_affinity_cpuset(const cprt_cpuset_t *cpuset);
+int cprt_get_affinity_cpuset(cprt_cpuset_t *cpuset);
+struct cprt_topology *cprt_topology_load();
+void cprt_topology_delete(struct cprt_topology *topo);
+void cprt_topology_print(const struct cprt_topology *topo, FILE *fp);
+int cprt_topology_siblings(const struct cprt_topology *topo, int cpu, cprt_cpuset_t *result);
+int cprt_topology_cache_sharers(const struct cprt_topology *topo, int cpu, int level, cprt_cpuset_t *result);
+int cprt_topology_package_cpus(const struct cprt_topology *topo, int package, cprt_cpuset_t *result);
+int cprt_topology_node_cpus(const struct cprt_topology *topo, int node, cprt_cpuset_t *result);
+int cprt_topology_pick_cores(const struct cprt_topology *topo, int num_cores, int package,
+    const cprt_cpuset_t *allowed, cprt_cpuset_t *result);
+cprt_pool_t *cprt_pool_create(int num_workers, const cprt_cpuset_t *pin_cpus, uint64_t spin_ns);
+void cprt_pool_delete(cprt_pool_t *pool);
+int cprt_pool_num_workers(const cprt_pool_t *pool);
+int cprt_pool_worker_index(const cprt_pool_t *pool);
+void cprt_pool_wg_init(struct cprt_pool_wg *wg);
+void cprt_pool_submit(cprt_pool_t *pool, struct cprt_pool_wg *wg, cprt_pool_fn_t fn, void *arg);
+void cprt_pool_wait(cprt_pool_t *pool, struct cprt_pool_wg *wg);
+void cprt_pool_get_stats(const cprt_pool_t *pool, int worker, struct cprt_pool_stats *stats);
+void cprt_parallel_init(int num_threads);
+void cprt_parallel_set_pool(cprt_pool_t *pool);
+cprt_pool_t *cprt_parallel_pool();
+void cprt_parallel_for(uint64_t begin, uint64_t end, uint64_t grain, cprt_parallel_fn_t fn, void *ctx);
+void cprt_parallel_reduce(uint64_t begin, uint64_t end, uint64_t grain,
+    void *result, size_t result_size, cprt_reduce_fn_t reduce_fn, cprt_combine_fn_t combine_fn, void *ctx);
+void cprt_thread_attr_init(struct cprt_thread_attr *attr);
+int cprt_thread_create_ex(CPRT_THREAD_T *tid, cprt_thread_fn_t start_fn, void *arg,
+    const struct cprt_thread_attr *attr);
+int cprt_cpu_numa_node(int cpu);
+int cprt_current_numa_node();
+void *cprt_alloc_large(size_t size, int flags, int numa_node, struct cprt_alloc_info *info);
+int cprt_free_large(void *ptr, struct cprt_alloc_info *info);
+int cprt_prefault(void *buf, size_t size);
+int cprt_lock_all();
+int cprt_lock_region(void *buf, size_t size);
+void cprt_stack_pretouch(size_t size);
+int cprt_fault_counts(struct cprt_fault_counts *counts);
+int cprt_fault_delta(const struct cprt_fault_counts *start, struct cprt_fault_counts *delta);
+uint64_t cprt_thread_os_tid();
+int cprt_thread_stats(struct cprt_thread_stats *stats);
+int cprt_thread_stats_tid(uint64_t os_tid, struct cprt_thread_stats *stats);
+int cprt_thread_stats_delta(const struct cprt_thread_stats *start, struct cprt_thread_stats *delta);
+void cprt_wait_init(struct cprt_wait *wait, int strategy);
+int cprt_wait_parse(struct cprt_wait *wait, const char *str);
+void cprt_wait_reset(struct cprt_wait *wait);
+void cprt_wait_idle(struct cprt_wait *wait);
+void cprt_sleep_ns_strategy(uint64_t duration_ns, struct cprt_wait *wait);
+int cprt_udp_recv_batch(CPRT_SOCKET sock, struct cprt_udp_pkt *pkts, int num_pkts);
+int cprt_udp_send_batch(CPRT_SOCKET sock, struct cprt_udp_pkt *pkts, int num_pkts);
+cprt_evloop_t *cprt_evloop_create(int busy_poll);
+void cprt_evloop_delete(cprt_evloop_t *loop);
+int cprt_evloop_add(cprt_evloop_t *loop, CPRT_SOCKET sock, int events, cprt_evloop_sock_fn_t fn, void *arg);
+int cprt_evloop_modify(cprt_evloop_t *loop, CPRT_SOCKET sock, int events);
+int cprt_evloop_remove(cprt_evloop_t *loop, CPRT_SOCKET sock);
+int cprt_evloop_timer_add(cprt_evloop_t *loop, uint64_t delay_ns, uint64_t period_ns,
+    cprt_evloop_timer_fn_t fn, void *arg);
+int cprt_evloop_timer_cancel(cprt_evloop_t *loop, int timer_id);
+int cprt_evloop_run_once(cprt_evloop_t *loop, uint64_t max_wait_ns);
+int cprt_evloop_run(cprt_evloop_t *loop);
+void cprt_evloop_stop(cprt_evloop_t *loop);
+void cprt_evloop_get_stats(const cprt_evloop_t *loop, struct cprt_evloop_stats *stats);
+int cprt_zc_init(struct cprt_zc *zc, CPRT_SOCKET sock, size_t min_zc_size);
+int cprt_zc_send(struct cprt_zc *zc, const void *buf, size_t len, size_t *sent, uint32_t *seq);
+int cprt_zc_reap(struct cprt_zc *zc);
+int cprt_zc_done(const struct cprt_zc *zc, uint32_t seq);
+int cprt_zc_wait(struct cprt_zc *zc, uint32_t seq);
+int cprt_sendfile(CPRT_SOCKET sock, int file_fd, uint64_t *offset, size_t count, size_t *sent);
+int cprt_rx_timestamp_enable(CPRT_SOCKET sock, int flags);
+uint64_t cprt_realtime_ns();
+uint64_t cprt_mono_ns();
+uint64_t cprt_clock_offset_ns();
+uint64_t cprt_realtime_to_mono_ns(uint64_t realtime_ns);
+uint64_t cprt_mono_to_realtime_ns(uint64_t mono_ns);
+cprt_aio_t *cprt_aio_create(int queue_depth, int flags);
+void cprt_aio_delete(cprt_aio_t *aio);
+int cprt_aio_backend(const cprt_aio_t *aio);
+int cprt_aio_register_buffers(cprt_aio_t *aio, void **bufs, const size_t *sizes, int num_bufs);
+int cprt_aio_read(cprt_aio_t *aio, int fd, void *buf, size_t len, uint64_t offset,
+    int buf_index, void *user_data);
+int cprt_aio_write(cprt_aio_t *aio, int fd, const void *buf, size_t len, uint64_t offset,
+    int buf_index, void *user_data);
+int cprt_aio_submit(cprt_aio_t *aio);
+int cprt_aio_poll(cprt_aio_t *aio, struct cprt_aio_completion *comps, int max_comps);
+int cprt_aio_wait(cprt_aio_t *aio, struct cprt_aio_completion *comps, int max_comps, int min_comps);
+int cprt_aio_inflight(const cprt_aio_t *aio);
+int cprt_aio_open(const char *path, int for_write, int direct);
+cprt_aio_sink_t *cprt_aio_sink_create(int fd, size_t buf_size, int num_bufs, int aio_flags);
+int cprt_aio_sink_write(cprt_aio_sink_t *sink, const void *data, size_t len);
+int cprt_aio_sink_flush(cprt_aio_sink_t *sink);
+int cprt_aio_sink_close(cprt_aio_sink_t *sink);
+void cprt_aio_sink_get_stats(const cprt_aio_sink_t *sink, struct cprt_aio_sink_stats *stats);
+int cprt_parse_u64(const char *str, uint64_t *result);
+int cprt_parse_i64(const char *str, int64_t *result);
+int cprt_parse_u32(const char *str, uint32_t *result);
+int cprt_parse_i32(const char *str, int32_t *result);
+int cprt_parse_u64_n(const char *buf, size_t len, uint64_t *result);
+int cprt_parse_i64_n(const char *buf, size_t len, int64_t *result);
+int cprt_parse_u64_fields(const char *buf, size_t len, char delim, uint64_t *values, int max_values,
+    size_t *consumed);
+int cprt_parse_i64_fields(const char *buf, size_t len, char delim, int64_t *values, int max_values,
+    size_t *consumed);
+int cprt_atoi_signed(const char *str, int64_t *result, size_t size, const char *name,
+    const char *file, int line);
+int cprt_atoi_unsigned(const char *str, uint64_t *result, size_t size, const char *name,
+    const char *file, int line);
+cprt_hist_t *cprt_hist_create(uint64_t max_value, int precision_bits);
+void cprt_hist_delete(cprt_hist_t *hist);
+void cprt_hist_reset(cprt_hist_t *hist);
+void cprt_hist_record(cprt_hist_t *hist, uint64_t value);
+void cprt_hist_record_n(cprt_hist_t *hist, uint64_t value, uint64_t count);
+void cprt_hist_merge(cprt_hist_t *into, const cprt_hist_t *from);
+uint64_t cprt_hist_count(const cprt_hist_t *hist);
+uint64_t cprt_hist_min(const cprt_hist_t *hist);
+uint64_t cprt_hist_max(const cprt_hist_t *hist);
+double cprt_hist_mean(const cprt_hist_t *hist);
+uint64_t cprt_hist_percentile(const cprt_hist_t *hist, double pct);
+void cprt_hist_print(const cprt_hist_t *hist, FILE *fp, const char *name);
+void cprt_hist_print_csv(const cprt_hist_t *hist, FILE *fp);
+cprt_hist_mt_t *cprt_hist_mt_create(uint64_t max_value, int precision_bits);
+void cprt_hist_mt_delete(cprt_hist_mt_t *mt);
+void cprt_hist_mt_record(cprt_hist_mt_t *mt, uint64_t value);
+cprt_hist_t *cprt_hist_mt_snapshot(cprt_hist_mt_t *mt);
+cprt_perf_t *cprt_perf_create(int flags);
+void cprt_perf_delete(cprt_perf_t *perf);
+int cprt_perf_mode(const cprt_perf_t *perf);
+int cprt_perf_num_counters(const cprt_perf_t *perf);
+const char *cprt_perf_counter_name(const cprt_perf_t *perf, int counter);
+int cprt_perf_region(cprt_perf_t *perf, const char *name);
+void cprt_perf_begin(cprt_perf_t *perf, int region_id);
+void cprt_perf_end(cprt_perf_t *perf, int region_id);
+void cprt_perf_get_stats(const cprt_perf_t *perf, int region_id, struct cprt_perf_stats *stats);
+void cprt_perf_print(const cprt_perf_t *perf, FILE *fp);
 void cprt_inittime();
 void cprt_sleep_ns(uint64_t duration_ns);
 void cprt_localtime_r(time_t *timep, struct tm *result);
@@ -560,10 +947,20 @@ extern int cprt_events[1024];
 void cprt_event(int e);
 void cprt_dump_events();
 void cprt_perrno(char *msg_str, char *file, int line);
+CPRT_COLD CPRT_NORETURN void cprt_fail_errno(const char *expr_str, const char *what,
+    const char *file, int line);
+CPRT_COLD CPRT_NORETURN void cprt_fail_assert(const char *cond_str, const char *file, int line);
+size_t cprt_fmt_u64(char *buf, uint64_t val, int width);
+size_t cprt_fmt_i64(char *buf, int64_t val, int width);
+size_t cprt_fmt_hex(char *buf, uint64_t val, int width);
+size_t cprt_fmt_tm(char *buf, const struct tm *tm, uint32_t nsec, int precision, int do_date);
+size_t cprt_fmt_epoch_ns(char *buf, uint64_t epoch_ns, int precision);
 char *cprt_timestamp(char *str, int bufsz, int do_date, int precision);
 void cprt_vts_fprintf(FILE *fp, const char *format, va_list argp);
 void cprt_ts_printf(const char *format, ...);
 void cprt_ts_eprintf(const char *format, ...);
+void cprt_vts_sink_printf(cprt_aio_sink_t *sink, const char *format, va_list argp);
+void cprt_ts_sink_printf(cprt_aio_sink_t *sink, const char *format, ...);
 uint64_t cprt_get_ms_time();
 void cprt_vms_fprintf(FILE *fp, uint64_t start_ms, const char *format, va_list argp);
 void cprt_ms_printf(uint64_t start_ms, const char *format, ...);
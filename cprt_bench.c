@@ -0,0 +1,478 @@
+/* cprt_bench.c - Microbenchmarks of the cprt primitives.
+ * This tries to be portable between Mac, Linux, and Windows.
+ * See https://github.com/fordsfords/cprt */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/cprt
+ */
+
+#if ! defined(_WIN32)
+/* Unix */
+#define _GNU_SOURCE
+#endif
+
+#include "cprt.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <stdarg.h>
+
+
+/* Options and their defaults */
+int o_threads = 2;
+char *o_cpus = NULL;
+int o_samples = 10000;
+int o_batch = 100;
+int o_warmup = 100;
+char *o_benches = NULL;
+char *o_json_file = NULL;
+
+
+char usage_str[] = "Usage: cprt_bench [-h] [-t threads] [-c cpu_list] [-s samples] [-B batch] [-w warmup] [-b bench,...] [-j json_file]";
+
+void usage(char *msg) {
+  if (msg) fprintf(stderr, "%s\n", msg);
+  fprintf(stderr, "%s\n", usage_str);
+  exit(1);
+}
+
+void help() {
+  fprintf(stderr, "%s\n", usage_str);
+  fprintf(stderr, "where:\n"
+      "  -h : print help\n"
+      "  -t threads : threads for the *_contended benchmarks [2]\n"
+      "  -c cpu_list : pin benchmark thread i to the i'th CPU of the list,\n"
+      "                e.g. \"2-5\" [not pinned]\n"
+      "  -s samples : samples per thread [10000]\n"
+      "  -B batch : operations timed together per sample; results are\n"
+      "             per operation [100]\n"
+      "  -w warmup : samples to run and discard first [100]\n"
+      "  -b bench,... : benchmarks to run [all]:\n"
+      "       gettime, timeofday, get_ms_time, mutex, mutex_contended,\n"
+      "       spin, spin_contended, atomic_inc, atomic_inc_contended,\n"
+      "       sem_handoff, cond_handoff, event, ts_fprintf, fmt_u64,\n"
+      "       snprintf_u64\n"
+      "  -j json_file : also write results as JSON (\"-\": to stdout,\n"
+      "                instead of the table)\n"
+      "Handoff benchmarks time a round trip between two threads (one sample\n"
+      "each, not batched). The others include 1/batch of a CPRT_GETTIME.\n");
+  exit(0);
+}
+
+
+/* One benchmark thread. */
+struct worker {
+  int index;
+  int pin_cpu;  /* -1 = not pinned. */
+  int num_threads;
+  double *samples;  /* ns per operation. */
+  int num_samples;
+  void (*fn)(struct worker *w);
+  CPRT_THREAD_T thread_id;
+};
+
+/* Shared state the benchmarks operate on. */
+CPRT_MUTEX_T g_mutex;
+CPRT_SPIN_T g_spin;
+CPRT_SEM_T g_ping_sem;
+CPRT_SEM_T g_pong_sem;
+CPRT_MUTEX_T g_cond_mutex;
+CPRT_COND_T g_ping_cond;
+CPRT_COND_T g_pong_cond;
+volatile int g_turn;
+volatile long g_atomic;
+volatile long g_ready;
+volatile uint64_t g_sink;
+uint64_t g_counter;
+FILE *g_null_fp;
+
+FILE *json_fp = NULL;
+int json_results = 0;
+
+
+/* Time o_batch runs of _op per sample, after o_warmup discarded samples. */
+#define TIME_BATCH(_w, _op) do { \
+  struct cprt_timespec t0_, t1_; \
+  uint64_t ns_; \
+  int s_, b_; \
+  for (s_ = -o_warmup; s_ < o_samples; s_++) { \
+    CPRT_GETTIME(&t0_); \
+    for (b_ = 0; b_ < o_batch; b_++) { \
+      _op; \
+    } \
+    CPRT_GETTIME(&t1_); \
+    CPRT_DIFF_TS(ns_, t1_, t0_); \
+    if (s_ >= 0) { \
+      (_w)->samples[(_w)->num_samples++] = (double)ns_ / o_batch; \
+    } \
+  } \
+} while (0)
+
+
+void bench_gettime(struct worker *w)
+{
+  struct cprt_timespec ts;
+  TIME_BATCH(w, CPRT_GETTIME(&ts));
+}  /* bench_gettime */
+
+
+void bench_timeofday(struct worker *w)
+{
+  struct cprt_timeval tv;
+  TIME_BATCH(w, CPRT_TIMEOFDAY(&tv, NULL));
+}  /* bench_timeofday */
+
+
+void bench_get_ms_time(struct worker *w)
+{
+  TIME_BATCH(w, g_sink = cprt_get_ms_time());
+}  /* bench_get_ms_time */
+
+
+void bench_mutex(struct worker *w)
+{
+  TIME_BATCH(w, CPRT_MUTEX_LOCK(g_mutex); g_counter++; CPRT_MUTEX_UNLOCK(g_mutex));
+}  /* bench_mutex */
+
+
+void bench_spin(struct worker *w)
+{
+  TIME_BATCH(w, CPRT_SPIN_LOCK(g_spin); g_counter++; CPRT_SPIN_UNLOCK(g_spin));
+}  /* bench_spin */
+
+
+void bench_atomic_inc(struct worker *w)
+{
+  TIME_BATCH(w, CPRT_ATOMIC_INC_VAL(&g_atomic));
+}  /* bench_atomic_inc */
+
+
+void bench_event(struct worker *w)
+{
+  TIME_BATCH(w, cprt_event(b_));
+}  /* bench_event */
+
+
+void ts_fprintf(FILE *fp, const char *format, ...)
+{
+  va_list argp;
+  va_start(argp, format);
+  cprt_vts_fprintf(fp, format, argp);
+  va_end(argp);
+}  /* ts_fprintf */
+
+
+void bench_ts_fprintf(struct worker *w)
+{
+  TIME_BATCH(w, ts_fprintf(g_null_fp, "sample %d, op %d\n", s_, b_));
+}  /* bench_ts_fprintf */
+
+
+void bench_fmt_u64(struct worker *w)
+{
+  char buf[CPRT_FMT_INT_SZ];
+  TIME_BATCH(w, cprt_fmt_u64(buf, (uint64_t)b_ * 1000003, 0); g_sink = buf[0]);
+}  /* bench_fmt_u64 */
+
+
+void bench_snprintf_u64(struct worker *w)
+{
+  char buf[CPRT_FMT_INT_SZ];
+  TIME_BATCH(w, snprintf(buf, sizeof(buf), "%"PRIu64, (uint64_t)b_ * 1000003); g_sink = buf[0]);
+}  /* bench_snprintf_u64 */
+
+
+/* Worker 0 pings, worker 1 pongs; worker 0 records round trips. */
+void bench_sem_handoff(struct worker *w)
+{
+  struct cprt_timespec t0, t1;
+  uint64_t ns;
+  int s;
+
+  for (s = -o_warmup; s < o_samples; s++) {
+    if (w->index == 0) {
+      CPRT_GETTIME(&t0);
+      CPRT_SEM_POST(g_ping_sem);
+      CPRT_SEM_WAIT(g_pong_sem);
+      CPRT_GETTIME(&t1);
+      CPRT_DIFF_TS(ns, t1, t0);
+      if (s >= 0) {
+        w->samples[w->num_samples++] = (double)ns;
+      }
+    }
+    else {
+      CPRT_SEM_WAIT(g_ping_sem);
+      CPRT_SEM_POST(g_pong_sem);
+    }
+  }
+}  /* bench_sem_handoff */
+
+
+void bench_cond_handoff(struct worker *w)
+{
+  struct cprt_timespec t0, t1;
+  uint64_t ns;
+  int s;
+
+  for (s = -o_warmup; s < o_samples; s++) {
+    if (w->index == 0) {
+      CPRT_GETTIME(&t0);
+      CPRT_MUTEX_LOCK(g_cond_mutex);
+      g_turn = 1;
+      CPRT_COND_SIGNAL(g_ping_cond);
+      while (g_turn != 0) {
+        CPRT_COND_WAIT(g_pong_cond, g_cond_mutex);
+      }
+      CPRT_MUTEX_UNLOCK(g_cond_mutex);
+      CPRT_GETTIME(&t1);
+      CPRT_DIFF_TS(ns, t1, t0);
+      if (s >= 0) {
+        w->samples[w->num_samples++] = (double)ns;
+      }
+    }
+    else {
+      CPRT_MUTEX_LOCK(g_cond_mutex);
+      while (g_turn != 1) {
+        CPRT_COND_WAIT(g_ping_cond, g_cond_mutex);
+      }
+      g_turn = 0;
+      CPRT_COND_SIGNAL(g_pong_cond);
+      CPRT_MUTEX_UNLOCK(g_cond_mutex);
+    }
+  }
+}  /* bench_cond_handoff */
+
+
+CPRT_THREAD_ENTRYPOINT worker_thread(void *in_arg)
+{
+  struct worker *w = (struct worker *)in_arg;
+
+  /* Start together, so contended runs really overlap. */
+  CPRT_ATOMIC_INC_VAL(&g_ready);
+  while (g_ready < w->num_threads) {
+    CPRT_THREAD_YIELD();
+  }
+  w->fn(w);
+
+  CPRT_THREAD_EXIT;
+  return 0;
+}  /* worker_thread */
+
+
+int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}  /* cmp_double */
+
+
+int bench_selected(const char *name)
+{
+  const char *p;
+  size_t len = strlen(name);
+
+  if (o_benches == NULL) {
+    return 1;
+  }
+  for (p = o_benches; p != NULL; p = strchr(p, ',')) {
+    if (*p == ',') {
+      p++;
+    }
+    if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0')) {
+      return 1;
+    }
+  }
+  return 0;
+}  /* bench_selected */
+
+
+/* Run fn on num_threads pinned threads; print the merged percentiles. */
+void run_bench(const char *name, int num_threads, void (*fn)(struct worker *w), cprt_cpuset_t *cpus)
+{
+  struct worker *workers;
+  struct cprt_thread_attr attr;
+  cprt_cpuset_t *pin_set;
+  double *all;
+  double sum = 0;
+  int i, n = 0, cpu = -1;
+
+  if (! bench_selected(name)) {
+    return;
+  }
+  CPRT_ENULL(workers = (struct worker *)calloc(num_threads, sizeof(struct worker)));
+  pin_set = cprt_cpuset_create();
+  g_ready = 0;
+  for (i = 0; i < num_threads; i++) {
+    workers[i].index = i;
+    workers[i].num_threads = num_threads;
+    workers[i].fn = fn;
+    workers[i].pin_cpu = -1;
+    if (cpus != NULL) {
+      cpu = cprt_cpuset_next(cpus, cpu + 1);
+      if (cpu < 0) {
+        cpu = cprt_cpuset_next(cpus, 0);  /* Wrap. */
+      }
+      workers[i].pin_cpu = cpu;
+    }
+    CPRT_ENULL(workers[i].samples = (double *)malloc(o_samples * sizeof(double)));
+  }
+  for (i = 0; i < num_threads; i++) {
+    cprt_thread_attr_init(&attr);
+    attr.name = "cprt_bench";
+    if (workers[i].pin_cpu >= 0) {
+      cprt_cpuset_zero(pin_set);
+      cprt_cpuset_set(pin_set, workers[i].pin_cpu);
+      attr.cpuset = pin_set;  /* Applied before create returns. */
+    }
+    CPRT_THREAD_CREATE_EX(workers[i].thread_id, worker_thread, &workers[i], &attr);
+  }
+  for (i = 0; i < num_threads; i++) {
+    CPRT_THREAD_JOIN(workers[i].thread_id);
+  }
+
+  CPRT_ENULL(all = (double *)malloc((size_t)num_threads * o_samples * sizeof(double)));
+  for (i = 0; i < num_threads; i++) {
+    memcpy(&all[n], workers[i].samples, workers[i].num_samples * sizeof(double));
+    n += workers[i].num_samples;
+    free(workers[i].samples);
+  }
+  CPRT_ASSERT(n > 0);
+  qsort(all, n, sizeof(double), cmp_double);
+  for (i = 0; i < n; i++) {
+    sum += all[i];
+  }
+
+  if (json_fp != stdout) {
+    printf("%-22s %7d %8d %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+        name, num_threads, n, all[0], sum / n, all[n / 2], all[(int64_t)n * 90 / 100],
+        all[(int64_t)n * 99 / 100], all[(int64_t)n * 999 / 1000], all[n - 1]);
+    fflush(stdout);
+  }
+  if (json_fp != NULL) {
+    fprintf(json_fp, "%s\n    {\"name\": \"%s\", \"threads\": %d, \"unit\": \"ns\", \"samples\": %d, "
+        "\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}",
+        (json_results > 0) ? "," : "", name, num_threads, n, all[0], sum / n, all[n / 2],
+        all[(int64_t)n * 90 / 100], all[(int64_t)n * 99 / 100], all[(int64_t)n * 999 / 1000], all[n - 1]);
+    json_results++;
+  }
+
+  free(all);
+  cprt_cpuset_delete(pin_set);
+  free(workers);
+}  /* run_bench */
+
+
+void get_my_options(int argc, char **argv)
+{
+  int opt;
+
+  while ((opt = cprt_getopt(argc, argv, "ht:c:s:B:w:b:j:")) != EOF) {
+    switch (opt) {
+      case 'h': help(); break;
+      case 't': CPRT_ATOI(cprt_optarg, o_threads); break;
+      case 'c': o_cpus = cprt_optarg; break;
+      case 's': CPRT_ATOI(cprt_optarg, o_samples); break;
+      case 'B': CPRT_ATOI(cprt_optarg, o_batch); break;
+      case 'w': CPRT_ATOI(cprt_optarg, o_warmup); break;
+      case 'b': o_benches = cprt_optarg; break;
+      case 'j': o_json_file = cprt_optarg; break;
+      default: usage(NULL);
+    }
+  }
+  if (o_threads < 1 || o_samples < 1 || o_batch < 1 || o_warmup < 0) {
+    usage("Error, -t, -s and -B must be positive; -w must not be negative");
+  }
+  if (cprt_optind != argc) {
+    usage("Error, unexpected positional parameter");
+  }
+}  /* get_my_options */
+
+
+int main(int argc, char **argv)
+{
+  cprt_cpuset_t *cpus = NULL;
+  char cpu_str[256];
+
+  get_my_options(argc, argv);
+  CPRT_INITTIME();
+
+  if (o_cpus != NULL) {
+    cpus = cprt_cpuset_create();
+    if (cprt_cpuset_parse(cpus, o_cpus) == -1 || cprt_cpuset_count(cpus) == 0) {
+      usage("Error, bad -c cpu_list");
+    }
+  }
+  if (o_json_file != NULL) {
+    if (strcmp(o_json_file, "-") == 0) {
+      json_fp = stdout;
+    } else {
+      CPRT_ENULL(json_fp = fopen(o_json_file, "w"));
+    }
+  }
+#if defined(_WIN32)
+  CPRT_ENULL(g_null_fp = fopen("NUL", "w"));
+#else
+  CPRT_ENULL(g_null_fp = fopen("/dev/null", "w"));
+#endif
+  CPRT_MUTEX_INIT(g_mutex);
+  CPRT_SPIN_INIT(g_spin);
+  CPRT_SEM_INIT(g_ping_sem, 0);
+  CPRT_SEM_INIT(g_pong_sem, 0);
+  CPRT_MUTEX_INIT(g_cond_mutex);
+  CPRT_COND_INIT(g_ping_cond);
+  CPRT_COND_INIT(g_pong_cond);
+
+  if (json_fp != stdout) {
+    printf("%-22s %7s %8s %9s %9s %9s %9s %9s %9s %9s\n", "bench (ns per op)", "threads", "samples",
+        "min", "mean", "p50", "p90", "p99", "p99.9", "max");
+  }
+  if (json_fp != NULL) {
+    fprintf(json_fp, "{\"tool\": \"cprt_bench\", \"batch\": %d, \"samples\": %d, \"cpus\": \"%s\", \"results\": [",
+        o_batch, o_samples, (cpus != NULL) ? cprt_cpuset_format(cpus, cpu_str, sizeof(cpu_str)) : "");
+  }
+
+  run_bench("gettime", 1, bench_gettime, cpus);
+  run_bench("timeofday", 1, bench_timeofday, cpus);
+  run_bench("get_ms_time", 1, bench_get_ms_time, cpus);
+  run_bench("mutex", 1, bench_mutex, cpus);
+  run_bench("mutex_contended", o_threads, bench_mutex, cpus);
+  run_bench("spin", 1, bench_spin, cpus);
+  run_bench("spin_contended", o_threads, bench_spin, cpus);
+  run_bench("atomic_inc", 1, bench_atomic_inc, cpus);
+  run_bench("atomic_inc_contended", o_threads, bench_atomic_inc, cpus);
+  run_bench("sem_handoff", 2, bench_sem_handoff, cpus);
+  run_bench("cond_handoff", 2, bench_cond_handoff, cpus);
+  run_bench("event", 1, bench_event, cpus);
+  run_bench("ts_fprintf", 1, bench_ts_fprintf, cpus);
+  run_bench("fmt_u64", 1, bench_fmt_u64, cpus);
+  run_bench("snprintf_u64", 1, bench_snprintf_u64, cpus);
+
+  if (json_fp != NULL) {
+    fprintf(json_fp, "\n]}\n");
+    if (json_fp != stdout) {
+      fclose(json_fp);
+    }
+  }
+
+  fclose(g_null_fp);
+  CPRT_COND_DELETE(g_ping_cond);
+  CPRT_COND_DELETE(g_pong_cond);
+  CPRT_MUTEX_DELETE(g_cond_mutex);
+  CPRT_SEM_DELETE(g_ping_sem);
+  CPRT_SEM_DELETE(g_pong_sem);
+  CPRT_SPIN_DELETE(g_spin);
+  CPRT_MUTEX_DELETE(g_mutex);
+  if (cpus != NULL) {
+    cprt_cpuset_delete(cpus);
+  }
+  return 0;
+}  /* main */
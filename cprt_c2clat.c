@@ -0,0 +1,309 @@
+/* cprt_c2clat.c - Core-to-core cache line round trip latency matrix.
+ * This tries to be portable between Mac, Linux, and Windows.
+ * See https://github.com/fordsfords/cprt */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/cprt
+ */
+
+#if ! defined(_WIN32)
+/* Unix */
+#define _GNU_SOURCE
+#endif
+
+#include "cprt.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+
+/* Options and their defaults */
+char *o_cpus = NULL;
+int o_samples = 10000;
+int o_batch = 1;
+int o_warmup = 1000;
+int o_diagonal = 0;
+char *o_csv_file = NULL;
+
+
+char usage_str[] = "Usage: cprt_c2clat [-h] [-c cpu_list] [-s samples] [-B batch] [-w warmup] [-d] [-o csv_file]";
+
+void usage(char *msg) {
+  if (msg) fprintf(stderr, "%s\n", msg);
+  fprintf(stderr, "%s\n", usage_str);
+  exit(1);
+}
+
+void help() {
+  fprintf(stderr, "%s\n", usage_str);
+  fprintf(stderr, "where:\n"
+      "  -h : print help\n"
+      "  -c cpu_list : CPUs to measure, e.g. \"0-7\" [all CPUs this\n"
+      "                process may run on]\n"
+      "  -s samples : samples per CPU pair [10000]\n"
+      "  -B batch : round trips timed together per sample [1]\n"
+      "  -w warmup : samples to run and discard first [1000]\n"
+      "  -d : also pair each CPU with itself (two threads handing off\n"
+      "       by yielding; measures a same-CPU thread switch)\n"
+      "  -o csv_file : also write one row per CPU pair:\n"
+      "                cpu_a,cpu_b,min_ns,p50_ns,p99_ns\n"
+      "Prints the median and p99 round trip matrices, in ns. A round trip\n"
+      "is the cache line going from cpu_a to cpu_b and back. Each pair is\n"
+      "measured once; the matrices are symmetric. The idle CPUs must\n"
+      "really be idle, so don't run this alongside other work.\n");
+  exit(0);
+}
+
+
+/* The cache line that bounces between the two threads, on a line of its
+ * own so nothing else shares it. Odd values are pings, even are pongs. */
+char g_line_buf[3 * 64];
+volatile long *g_seq;
+volatile long g_ready;
+
+/* One CPU pair being measured. */
+struct pair {
+  int cpu;  /* Ping thread: cpu_a; pong thread: cpu_b. */
+  int same_cpu;  /* Yield while waiting instead of spinning. */
+  long round_trips;
+  double *samples;  /* ns per round trip. */
+};
+
+
+/* Sets affinity to exactly one CPU. */
+void pin_to(int cpu)
+{
+  cprt_cpuset_t *set = cprt_cpuset_create();
+  CPRT_EM1(cprt_cpuset_set(set, cpu));
+  CPRT_EM1(cprt_try_affinity_cpuset(set));  /* An unpinned pair measures nothing. */
+  cprt_cpuset_delete(set);
+}  /* pin_to */
+
+
+#define WAIT_FOR(_p, _val) do { \
+  while (*g_seq != (_val)) { \
+    if ((_p)->same_cpu) { \
+      CPRT_THREAD_YIELD(); \
+    } else { \
+      CPRT_CPU_PAUSE(); \
+    } \
+  } \
+} while (0)
+
+
+CPRT_THREAD_ENTRYPOINT pong_thread(void *in_arg)
+{
+  struct pair *p = (struct pair *)in_arg;
+  long i;
+
+  pin_to(p->cpu);
+  CPRT_ATOMIC_INC_VAL(&g_ready);
+
+  for (i = 0; i < p->round_trips; i++) {
+    WAIT_FOR(p, 2 * i + 1);
+    *g_seq = 2 * i + 2;
+  }
+
+  CPRT_THREAD_EXIT;
+  return 0;
+}  /* pong_thread */
+
+
+CPRT_THREAD_ENTRYPOINT ping_thread(void *in_arg)
+{
+  struct pair *p = (struct pair *)in_arg;
+  struct cprt_timespec t0, t1;
+  uint64_t ns;
+  long seq = 0;
+  int s, b;
+
+  pin_to(p->cpu);
+  CPRT_ATOMIC_INC_VAL(&g_ready);
+  while (g_ready < 2) {
+    CPRT_THREAD_YIELD();
+  }
+
+  for (s = -o_warmup; s < o_samples; s++) {
+    CPRT_GETTIME(&t0);
+    for (b = 0; b < o_batch; b++) {
+      *g_seq = seq + 1;
+      WAIT_FOR(p, seq + 2);
+      seq += 2;
+    }
+    CPRT_GETTIME(&t1);
+    CPRT_DIFF_TS(ns, t1, t0);
+    if (s >= 0) {
+      p->samples[s] = (double)ns / o_batch;
+    }
+  }
+
+  CPRT_THREAD_EXIT;
+  return 0;
+}  /* ping_thread */
+
+
+int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}  /* cmp_double */
+
+
+/* Bounce the line between cpu_a and cpu_b; return sorted samples. */
+void measure_pair(int cpu_a, int cpu_b, double *samples)
+{
+  struct pair ping, pong;
+  CPRT_THREAD_T ping_id, pong_id;
+
+  *g_seq = 0;
+  g_ready = 0;
+  ping.cpu = cpu_a;
+  pong.cpu = cpu_b;
+  ping.same_cpu = pong.same_cpu = (cpu_a == cpu_b);
+  ping.round_trips = pong.round_trips = (long)(o_warmup + o_samples) * o_batch;
+  ping.samples = samples;
+  pong.samples = NULL;
+
+  CPRT_THREAD_CREATE(pong_id, pong_thread, &pong);
+  CPRT_THREAD_CREATE(ping_id, ping_thread, &ping);
+  CPRT_THREAD_JOIN(ping_id);
+  CPRT_THREAD_JOIN(pong_id);
+
+  qsort(samples, o_samples, sizeof(double), cmp_double);
+}  /* measure_pair */
+
+
+void print_matrix(const char *title, int *cpu_list, int num_cpus, double *matrix)
+{
+  int a, b;
+
+  printf("%s\n%6s", title, "cpu");
+  for (b = 0; b < num_cpus; b++) {
+    printf(" %7d", cpu_list[b]);
+  }
+  printf("\n");
+  for (a = 0; a < num_cpus; a++) {
+    printf("%6d", cpu_list[a]);
+    for (b = 0; b < num_cpus; b++) {
+      if (matrix[a * num_cpus + b] < 0) {
+        printf(" %7s", "-");
+      } else {
+        printf(" %7.1f", matrix[a * num_cpus + b]);
+      }
+    }
+    printf("\n");
+  }
+}  /* print_matrix */
+
+
+void get_my_options(int argc, char **argv)
+{
+  int opt;
+
+  while ((opt = cprt_getopt(argc, argv, "hc:s:B:w:do:")) != EOF) {
+    switch (opt) {
+      case 'h': help(); break;
+      case 'c': o_cpus = cprt_optarg; break;
+      case 's': CPRT_ATOI(cprt_optarg, o_samples); break;
+      case 'B': CPRT_ATOI(cprt_optarg, o_batch); break;
+      case 'w': CPRT_ATOI(cprt_optarg, o_warmup); break;
+      case 'd': o_diagonal = 1; break;
+      case 'o': o_csv_file = cprt_optarg; break;
+      default: usage(NULL);
+    }
+  }
+  if (o_samples < 1 || o_batch < 1 || o_warmup < 0) {
+    usage("Error, -s and -B must be positive; -w must not be negative");
+  }
+  if (cprt_optind != argc) {
+    usage("Error, unexpected positional parameter");
+  }
+}  /* get_my_options */
+
+
+int main(int argc, char **argv)
+{
+  cprt_cpuset_t *cpus, *allowed;
+  int *cpu_list;
+  double *p50, *p99, *samples;
+  FILE *csv_fp = NULL;
+  int num_cpus, cpu, a, b;
+
+  get_my_options(argc, argv);
+  CPRT_INITTIME();
+
+  cpus = cprt_cpuset_create();
+  allowed = cprt_cpuset_create();
+  CPRT_EM1(cprt_get_affinity_cpuset(allowed));
+  if (o_cpus != NULL) {
+    if (cprt_cpuset_parse(cpus, o_cpus) == -1 || cprt_cpuset_count(cpus) == 0) {
+      usage("Error, bad -c cpu_list");
+    }
+    for (cpu = cprt_cpuset_next(cpus, 0); cpu >= 0; cpu = cprt_cpuset_next(cpus, cpu + 1)) {
+      if (! cprt_cpuset_test(allowed, cpu)) {
+        usage("Error, -c cpu_list has a CPU this process may not run on");
+      }
+    }
+  } else {
+    CPRT_EM1(cprt_get_affinity_cpuset(cpus));
+  }
+  cprt_cpuset_delete(allowed);
+  num_cpus = cprt_cpuset_count(cpus);
+  if (num_cpus < 2 && ! o_diagonal) {
+    usage("Error, need at least 2 CPUs (or -d)");
+  }
+
+  CPRT_ENULL(cpu_list = (int *)malloc(num_cpus * sizeof(int)));
+  a = 0;
+  for (cpu = cprt_cpuset_next(cpus, 0); cpu >= 0; cpu = cprt_cpuset_next(cpus, cpu + 1)) {
+    cpu_list[a++] = cpu;
+  }
+  CPRT_ENULL(p50 = (double *)malloc((size_t)num_cpus * num_cpus * sizeof(double)));
+  CPRT_ENULL(p99 = (double *)malloc((size_t)num_cpus * num_cpus * sizeof(double)));
+  CPRT_ENULL(samples = (double *)malloc(o_samples * sizeof(double)));
+  g_seq = (volatile long *)(g_line_buf + 64 - ((size_t)g_line_buf % 64));
+
+  if (o_csv_file != NULL) {
+    CPRT_ENULL(csv_fp = fopen(o_csv_file, "w"));
+    fprintf(csv_fp, "cpu_a,cpu_b,min_ns,p50_ns,p99_ns\n");
+  }
+
+  for (a = 0; a < num_cpus; a++) {
+    p50[a * num_cpus + a] = p99[a * num_cpus + a] = -1;
+    for (b = o_diagonal ? a : (a + 1); b < num_cpus; b++) {
+      measure_pair(cpu_list[a], cpu_list[b], samples);
+      p50[a * num_cpus + b] = p50[b * num_cpus + a] = samples[o_samples / 2];
+      p99[a * num_cpus + b] = p99[b * num_cpus + a] = samples[(int64_t)o_samples * 99 / 100];
+      if (csv_fp != NULL) {
+        fprintf(csv_fp, "%d,%d,%.1f,%.1f,%.1f\n", cpu_list[a], cpu_list[b],
+            samples[0], samples[o_samples / 2], samples[(int64_t)o_samples * 99 / 100]);
+        if (b != a) {
+          fprintf(csv_fp, "%d,%d,%.1f,%.1f,%.1f\n", cpu_list[b], cpu_list[a],
+              samples[0], samples[o_samples / 2], samples[(int64_t)o_samples * 99 / 100]);
+        }
+      }
+    }
+  }
+
+  print_matrix("p50 round trip (ns)", cpu_list, num_cpus, p50);
+  print_matrix("p99 round trip (ns)", cpu_list, num_cpus, p99);
+
+  if (csv_fp != NULL) {
+    fclose(csv_fp);
+  }
+  free(samples);
+  free(p99);
+  free(p50);
+  free(cpu_list);
+  cprt_cpuset_delete(cpus);
+  return 0;
+}  /* main */
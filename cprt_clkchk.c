@@ -0,0 +1,416 @@
+/* cprt_clkchk.c - Check whether this host's clocks are good enough.
+ * This tries to be portable between Mac, Linux, and Windows.
+ * See https://github.com/fordsfords/cprt */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/cprt
+ */
+
+#if ! defined(_WIN32)
+/* Unix */
+#define _GNU_SOURCE
+#endif
+
+#include "cprt.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+
+/* Options and their defaults */
+char *o_cpus = NULL;
+int o_reads = 1000000;
+int o_handoffs = 10000;
+int o_drift_ms = 1000;
+double o_max_res_ns = 0;
+double o_max_cost_ns = 0;
+double o_max_drift_ppm = 0;
+char *o_clocksource = NULL;
+
+
+char usage_str[] = "Usage: cprt_clkchk [-h] [-c cpu_list] [-n reads] [-H handoffs] [-d drift_ms] [-R max_res_ns] [-C max_cost_ns] [-D max_drift_ppm] [-S clocksource]";
+
+void usage(char *msg) {
+  if (msg) fprintf(stderr, "%s\n", msg);
+  fprintf(stderr, "%s\n", usage_str);
+  exit(1);
+}
+
+void help() {
+  fprintf(stderr, "%s\n", usage_str);
+  fprintf(stderr, "where:\n"
+      "  -h : print help\n"
+      "  -c cpu_list : CPUs to check, e.g. \"0-7\" [all CPUs this process\n"
+      "                may run on]\n"
+      "  -n reads : clock reads per CPU for cost and monotonicity [1000000]\n"
+      "  -H handoffs : handoffs per CPU pair for cross-CPU monotonicity\n"
+      "                [10000]\n"
+      "  -d drift_ms : interval for measuring CPRT_GETTIME vs CPRT_TIMEOFDAY\n"
+      "                drift [1000]\n"
+      "  -R max_res_ns : fail if CPRT_GETTIME's resolution is coarser\n"
+      "  -C max_cost_ns : fail if a CPRT_GETTIME call costs more\n"
+      "  -D max_drift_ppm : fail if the drift is larger (either sign)\n"
+      "  -S clocksource : fail if the kernel's clocksource differs (Linux)\n"
+      "A clock going backwards (on one CPU or between two) always fails.\n"
+      "Exit status is 0 for PASS, 1 for FAIL.\n");
+  exit(0);
+}
+
+
+int failures = 0;
+
+void check_failed(const char *what, double val, double limit)
+{
+  printf("FAIL: %s %.1f exceeds %g\n", what, val, limit);
+  failures++;
+}  /* check_failed */
+
+
+uint64_t timeofday_ns()
+{
+  struct cprt_timeval tv;
+  CPRT_EOK0(CPRT_TIMEOFDAY(&tv, NULL));
+  return (uint64_t)tv.tv_sec * 1000000000ull + (uint64_t)tv.tv_usec * 1000;
+}  /* timeofday_ns */
+
+
+/* Report the kernel's clock source and whether the TSC can be trusted. */
+void report_clocksource()
+{
+#if defined(_WIN32)
+  LARGE_INTEGER freq;
+  QueryPerformanceFrequency(&freq);
+  printf("clocksource: QueryPerformanceCounter (%"PRIu64" Hz)\n", (uint64_t)freq.QuadPart);
+  if (o_clocksource != NULL) {
+    printf("FAIL: -S clocksource only works on Linux\n");
+    failures++;
+  }
+#elif defined(__linux__)
+  char cur[64], avail[256], line[4096];
+  FILE *fp;
+
+  cur[0] = '\0';
+  avail[0] = '\0';
+  fp = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+  if (fp != NULL) {
+    if (fgets(cur, sizeof(cur), fp) == NULL) cur[0] = '\0';
+    fclose(fp);
+  }
+  fp = fopen("/sys/devices/system/clocksource/clocksource0/available_clocksource", "r");
+  if (fp != NULL) {
+    if (fgets(avail, sizeof(avail), fp) == NULL) avail[0] = '\0';
+    fclose(fp);
+  }
+  cur[strcspn(cur, " \n")] = '\0';
+  avail[strcspn(avail, "\n")] = '\0';
+  printf("clocksource: %s (available: %s)\n", (cur[0] != '\0') ? cur : "unknown", avail);
+  if (o_clocksource != NULL && strcmp(o_clocksource, cur) != 0) {
+    printf("FAIL: clocksource %s is not %s\n", (cur[0] != '\0') ? cur : "unknown", o_clocksource);
+    failures++;
+  }
+
+  /* On x86, the TSC is only a good clock source if it is invariant. */
+  fp = fopen("/proc/cpuinfo", "r");
+  if (fp != NULL) {
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      if (strncmp(line, "flags", 5) == 0) {
+        printf("tsc_flags:%s%s%s%s\n",
+            strstr(line, " constant_tsc") ? " constant_tsc" : "",
+            strstr(line, " nonstop_tsc") ? " nonstop_tsc" : "",
+            strstr(line, " tsc_reliable") ? " tsc_reliable" : "",
+            strstr(line, " tsc_known_freq") ? " tsc_known_freq" : "");
+        break;
+      }
+    }
+    fclose(fp);
+  }
+#else
+  printf("clocksource: unknown\n");
+  if (o_clocksource != NULL) {
+    printf("FAIL: -S clocksource only works on Linux\n");
+    failures++;
+  }
+#endif
+}  /* report_clocksource */
+
+
+/* One clock checking thread. */
+struct checker {
+  int cpu;
+  int peer;  /* Index (0/1) in a cross-CPU pair. */
+  uint64_t reads;
+  uint64_t backward;
+  uint64_t max_backward_ns;
+  uint64_t min_step_ns;  /* Smallest nonzero step seen. */
+  uint64_t elapsed_ns;
+  uint64_t tod_elapsed_ns;  /* For o_reads / 10 CPRT_TIMEOFDAY calls. */
+  CPRT_THREAD_T thread_id;
+};
+
+/* Shared by the two threads of a cross-CPU pair, on its own cache line. */
+char g_line_buf[3 * 64];
+struct handoff {
+  volatile long turn;
+  volatile uint64_t last_ns;
+} *g_handoff;
+
+
+/* Pins the calling thread to exactly one CPU, or exits. Where there's no
+ * affinity (non-Linux Unix), setting it is a no-op, so read it back. */
+void pin_to(int cpu)
+{
+  cprt_cpuset_t *set = cprt_cpuset_create();
+  CPRT_EM1(cprt_cpuset_set(set, cpu));
+  CPRT_EM1(cprt_try_affinity_cpuset(set));  /* Unpinned, "cpu N" results mean nothing. */
+  CPRT_EM1(cprt_get_affinity_cpuset(set));
+  CPRT_ASSERT(cprt_cpuset_count(set) == 1 && cprt_cpuset_test(set, cpu));
+  cprt_cpuset_delete(set);
+}  /* pin_to */
+
+
+/* Read the clock back to back; check it never steps backward. */
+CPRT_THREAD_ENTRYPOINT local_thread(void *in_arg)
+{
+  struct checker *c = (struct checker *)in_arg;
+  uint64_t start_ns, prev_ns, now_ns;
+  int i;
+
+  pin_to(c->cpu);
+  c->min_step_ns = (uint64_t)-1;
+  start_ns = prev_ns = cprt_mono_ns();
+  for (i = 0; i < o_reads; i++) {
+    now_ns = cprt_mono_ns();
+    if (now_ns < prev_ns) {
+      c->backward++;
+      if (prev_ns - now_ns > c->max_backward_ns) c->max_backward_ns = prev_ns - now_ns;
+    } else if (now_ns > prev_ns && now_ns - prev_ns < c->min_step_ns) {
+      c->min_step_ns = now_ns - prev_ns;
+    }
+    prev_ns = now_ns;
+  }
+  c->elapsed_ns = prev_ns - start_ns;
+  c->reads = o_reads;
+
+  /* For comparison (not checked). */
+  for (i = 0; i < o_reads / 10; i++) {
+    timeofday_ns();
+  }
+  c->tod_elapsed_ns = cprt_mono_ns() - prev_ns;
+
+  CPRT_THREAD_EXIT;
+  return 0;
+}  /* local_thread */
+
+
+/* Take turns with the peer: each read must not be before the peer's
+ * previous read, which causally happened first. */
+CPRT_THREAD_ENTRYPOINT cross_thread(void *in_arg)
+{
+  struct checker *c = (struct checker *)in_arg;
+  uint64_t prev_ns, now_ns;
+  int i;
+
+  pin_to(c->cpu);
+  c->min_step_ns = (uint64_t)-1;
+  for (i = 0; i < o_handoffs; i++) {
+    while (g_handoff->turn != c->peer) {
+      CPRT_CPU_PAUSE();
+    }
+    CPRT_MEMORY_FENCE();
+    prev_ns = g_handoff->last_ns;
+    now_ns = cprt_mono_ns();
+    if (i > 0 || c->peer == 1) {
+      if (now_ns < prev_ns) {
+        c->backward++;
+        if (prev_ns - now_ns > c->max_backward_ns) c->max_backward_ns = prev_ns - now_ns;
+      } else if (now_ns - prev_ns < c->min_step_ns) {
+        c->min_step_ns = now_ns - prev_ns;
+      }
+      c->reads++;
+    }
+    g_handoff->last_ns = now_ns;
+    CPRT_MEMORY_FENCE();
+    g_handoff->turn = 1 - c->peer;
+  }
+
+  CPRT_THREAD_EXIT;
+  return 0;
+}  /* cross_thread */
+
+
+void start_checker(struct checker *c, int cpu, cprt_thread_fn_t fn)
+{
+  struct cprt_thread_attr attr;
+  cprt_cpuset_t *pin_set = cprt_cpuset_create();
+
+  c->cpu = cpu;
+  CPRT_EM1(cprt_cpuset_set(pin_set, cpu));
+  cprt_thread_attr_init(&attr);
+  attr.name = "cprt_clkchk";
+  attr.cpuset = pin_set;  /* Starts it there (where supported); it checks with pin_to(). */
+  CPRT_THREAD_CREATE_EX(c->thread_id, fn, c, &attr);
+  cprt_cpuset_delete(pin_set);
+}  /* start_checker */
+
+
+void check_cost_and_resolution(int cpu)
+{
+  struct checker c;
+
+  memset(&c, 0, sizeof(c));
+  start_checker(&c, cpu, local_thread);
+  CPRT_THREAD_JOIN(c.thread_id);
+
+  printf("cpu %d: reads=%"PRIu64" backward=%"PRIu64" max_backward_ns=%"PRIu64" resolution_ns=%"PRIu64" cost_ns=%.1f timeofday_cost_ns=%.1f\n",
+      cpu, c.reads, c.backward, c.max_backward_ns, c.min_step_ns, (double)c.elapsed_ns / c.reads,
+      (double)c.tod_elapsed_ns / (o_reads / 10));
+  if (c.backward > 0) {
+    printf("FAIL: CPRT_GETTIME went backward on cpu %d\n", cpu);
+    failures++;
+  }
+  if (o_max_res_ns > 0 && c.min_step_ns > o_max_res_ns) {
+    check_failed("resolution_ns", (double)c.min_step_ns, o_max_res_ns);
+  }
+  if (o_max_cost_ns > 0 && (double)c.elapsed_ns / c.reads > o_max_cost_ns) {
+    check_failed("cost_ns", (double)c.elapsed_ns / c.reads, o_max_cost_ns);
+  }
+}  /* check_cost_and_resolution */
+
+
+void check_cross(int cpu_a, int cpu_b)
+{
+  struct checker c[2];
+
+  memset(c, 0, sizeof(c));
+  g_handoff->turn = 0;
+  g_handoff->last_ns = 0;
+  c[0].peer = 0;
+  c[1].peer = 1;
+  start_checker(&c[0], cpu_a, cross_thread);
+  start_checker(&c[1], cpu_b, cross_thread);
+  CPRT_THREAD_JOIN(c[0].thread_id);
+  CPRT_THREAD_JOIN(c[1].thread_id);
+
+  printf("cpus %d,%d: handoffs=%"PRIu64" backward=%"PRIu64" max_backward_ns=%"PRIu64" min_delta_ns=%"PRIu64",%"PRIu64"\n",
+      cpu_a, cpu_b, c[0].reads + c[1].reads, c[0].backward + c[1].backward,
+      (c[0].max_backward_ns > c[1].max_backward_ns) ? c[0].max_backward_ns : c[1].max_backward_ns,
+      c[1].min_step_ns, c[0].min_step_ns);
+  if (c[0].backward + c[1].backward > 0) {
+    printf("FAIL: CPRT_GETTIME went backward between cpus %d and %d\n", cpu_a, cpu_b);
+    failures++;
+  }
+}  /* check_cross */
+
+
+/* Read CPRT_TIMEOFDAY bracketed by CPRT_GETTIME; keep the tightest of
+ * several tries. Returns the bracket width. */
+uint64_t sample_clocks(uint64_t *mono_ns, uint64_t *tod_ns)
+{
+  uint64_t m0, m1, tod, best = (uint64_t)-1;
+  int i;
+
+  for (i = 0; i < 100; i++) {
+    m0 = cprt_mono_ns();
+    tod = timeofday_ns();
+    m1 = cprt_mono_ns();
+    if (m1 - m0 < best) {
+      best = m1 - m0;
+      *mono_ns = m0 + (m1 - m0) / 2;
+      *tod_ns = tod;
+    }
+  }
+  return best;
+}  /* sample_clocks */
+
+
+void check_drift()
+{
+  uint64_t mono_a, tod_a, mono_b, tod_b, width;
+  double mono_elapsed, drift_ppm, err_ppm;
+
+  width = sample_clocks(&mono_a, &tod_a);
+  CPRT_SLEEP_MS(o_drift_ms);
+  width += sample_clocks(&mono_b, &tod_b);
+
+  mono_elapsed = (double)(mono_b - mono_a);
+  drift_ppm = ((double)(int64_t)((tod_b - tod_a) - (mono_b - mono_a))) * 1e6 / mono_elapsed;
+  /* CPRT_TIMEOFDAY has 1 us resolution at each end, plus the brackets. */
+  err_ppm = (2000.0 + width / 2) * 1e6 / mono_elapsed;
+  printf("drift: timeofday_vs_gettime_ppm=%.2f (+-%.2f over %.0f ms)\n", drift_ppm, err_ppm, mono_elapsed / 1e6);
+  if (o_max_drift_ppm > 0 && (drift_ppm > o_max_drift_ppm || -drift_ppm > o_max_drift_ppm)) {
+    check_failed("drift_ppm", (drift_ppm < 0) ? -drift_ppm : drift_ppm, o_max_drift_ppm);
+  }
+}  /* check_drift */
+
+
+void get_my_options(int argc, char **argv)
+{
+  int opt;
+
+  while ((opt = cprt_getopt(argc, argv, "hc:n:H:d:R:C:D:S:")) != EOF) {
+    switch (opt) {
+      case 'h': help(); break;
+      case 'c': o_cpus = cprt_optarg; break;
+      case 'n': CPRT_ATOI(cprt_optarg, o_reads); break;
+      case 'H': CPRT_ATOI(cprt_optarg, o_handoffs); break;
+      case 'd': CPRT_ATOI(cprt_optarg, o_drift_ms); break;
+      case 'R': o_max_res_ns = atof(cprt_optarg); break;
+      case 'C': o_max_cost_ns = atof(cprt_optarg); break;
+      case 'D': o_max_drift_ppm = atof(cprt_optarg); break;
+      case 'S': o_clocksource = cprt_optarg; break;
+      default: usage(NULL);
+    }
+  }
+  if (o_reads < 10 || o_handoffs < 1 || o_drift_ms < 1) {
+    usage("Error, -n must be at least 10; -H and -d must be positive");
+  }
+  if (cprt_optind != argc) {
+    usage("Error, unexpected positional parameter");
+  }
+}  /* get_my_options */
+
+
+int main(int argc, char **argv)
+{
+  cprt_cpuset_t *cpus;
+  int a, b;
+
+  get_my_options(argc, argv);
+  CPRT_INITTIME();
+
+  cpus = cprt_cpuset_create();
+  if (o_cpus != NULL) {
+    if (cprt_cpuset_parse(cpus, o_cpus) == -1 || cprt_cpuset_count(cpus) == 0) {
+      usage("Error, bad -c cpu_list");
+    }
+  } else {
+    CPRT_EM1(cprt_get_affinity_cpuset(cpus));
+  }
+  g_handoff = (struct handoff *)(g_line_buf + 64 - ((size_t)g_line_buf % 64));
+
+  report_clocksource();
+  for (a = cprt_cpuset_next(cpus, 0); a >= 0; a = cprt_cpuset_next(cpus, a + 1)) {
+    check_cost_and_resolution(a);
+  }
+  if (cprt_cpuset_count(cpus) < 2) {
+    printf("cpus: cross-CPU check skipped (only one CPU)\n");
+  }
+  for (a = cprt_cpuset_next(cpus, 0); a >= 0; a = cprt_cpuset_next(cpus, a + 1)) {
+    for (b = cprt_cpuset_next(cpus, a + 1); b >= 0; b = cprt_cpuset_next(cpus, b + 1)) {
+      check_cross(a, b);
+    }
+  }
+  check_drift();
+
+  printf("result: %s\n", (failures > 0) ? "FAIL" : "PASS");
+  cprt_cpuset_delete(cpus);
+  return (failures > 0) ? 1 : 0;
+}  /* main */
@@ -0,0 +1,279 @@
+/* cprt_jitter.c - Find CPUs that get interrupted (OS jitter).
+ * This tries to be portable between Mac, Linux, and Windows.
+ * See https://github.com/fordsfords/cprt */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/cprt
+ */
+
+#if ! defined(_WIN32)
+/* Unix */
+#define _GNU_SOURCE
+#endif
+
+#include "cprt.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+
+/* Options and their defaults */
+char *o_cpus = NULL;
+int o_duration_ms = 10000;
+int o_threshold_ns = 1000;
+int o_top = 10;
+double o_max_lost_pct = 0;
+int o_max_gap_us = 0;
+
+
+char usage_str[] = "Usage: cprt_jitter [-h] [-c cpu_list] [-d duration_ms] [-T threshold_ns] [-k top] [-L max_lost_pct] [-M max_gap_us]";
+
+void usage(char *msg) {
+  if (msg) fprintf(stderr, "%s\n", msg);
+  fprintf(stderr, "%s\n", usage_str);
+  exit(1);
+}
+
+void help() {
+  fprintf(stderr, "%s\n", usage_str);
+  fprintf(stderr, "where:\n"
+      "  -h : print help\n"
+      "  -c cpu_list : CPUs to watch, e.g. \"2-5\" [all CPUs this process\n"
+      "                may run on]\n"
+      "  -d duration_ms : how long to spin [10000]\n"
+      "  -T threshold_ns : record gaps between clock reads longer than\n"
+      "                    this [1000]\n"
+      "  -k top : longest gaps to list per CPU [10]\n"
+      "  -L max_lost_pct : fail if any CPU lost more of its time\n"
+      "  -M max_gap_us : fail if any CPU had a longer gap\n"
+      "A thread pinned to each CPU spins reading CPRT_GETTIME. A gap between\n"
+      "two reads means something else ran: an interrupt, the kernel, or\n"
+      "another thread. Exit status is 0 unless -L or -M is exceeded.\n");
+  exit(0);
+}
+
+
+#define NUM_BUCKETS 40  /* Bucket b: gaps of [2^b, 2^(b+1)) ns. */
+
+struct gap {
+  uint64_t start_ns;  /* cprt_mono_ns() of the read before the gap. */
+  uint64_t len_ns;
+};
+
+/* One spinning thread. */
+struct spinner {
+  int cpu;
+  uint64_t loops;
+  uint64_t min_loop_ns;
+  uint64_t gaps;
+  uint64_t lost_ns;
+  uint64_t max_gap_ns;
+  uint64_t elapsed_ns;
+  uint64_t buckets[NUM_BUCKETS];
+  struct gap *top;  /* o_top longest gaps, unsorted. */
+  int num_top;
+  CPRT_THREAD_T thread_id;
+};
+
+volatile long g_ready;
+int g_num_spinners;
+
+
+void record_gap(struct spinner *s, uint64_t start_ns, uint64_t len_ns)
+{
+  int b = 0, i, min_i;
+
+  s->gaps++;
+  s->lost_ns += len_ns;
+  if (len_ns > s->max_gap_ns) s->max_gap_ns = len_ns;
+  while (b < NUM_BUCKETS - 1 && (len_ns >> (b + 1)) != 0) {
+    b++;
+  }
+  s->buckets[b]++;
+
+  if (s->num_top < o_top) {
+    i = s->num_top++;
+  } else {
+    /* Replace the shortest of the top gaps, if this one is longer. */
+    min_i = 0;
+    for (i = 1; i < s->num_top; i++) {
+      if (s->top[i].len_ns < s->top[min_i].len_ns) min_i = i;
+    }
+    if (o_top == 0 || len_ns <= s->top[min_i].len_ns) {
+      return;
+    }
+    i = min_i;
+  }
+  s->top[i].start_ns = start_ns;
+  s->top[i].len_ns = len_ns;
+}  /* record_gap */
+
+
+/* Pins the calling thread to exactly one CPU, or exits. Where there's no
+ * affinity (non-Linux Unix), setting it is a no-op, so read it back. */
+void pin_to(int cpu)
+{
+  cprt_cpuset_t *set = cprt_cpuset_create();
+  CPRT_EM1(cprt_cpuset_set(set, cpu));
+  CPRT_EM1(cprt_try_affinity_cpuset(set));  /* An unpinned spinner measures the scheduler. */
+  CPRT_EM1(cprt_get_affinity_cpuset(set));
+  CPRT_ASSERT(cprt_cpuset_count(set) == 1 && cprt_cpuset_test(set, cpu));
+  cprt_cpuset_delete(set);
+}  /* pin_to */
+
+
+CPRT_THREAD_ENTRYPOINT spin_thread(void *in_arg)
+{
+  struct spinner *s = (struct spinner *)in_arg;
+  uint64_t start_ns, end_ns, prev_ns, now_ns;
+
+  pin_to(s->cpu);
+
+  /* Start together, so one CPU's spinner isn't another's jitter. */
+  CPRT_ATOMIC_INC_VAL(&g_ready);
+  while (g_ready < g_num_spinners) {
+    CPRT_THREAD_YIELD();
+  }
+
+  s->min_loop_ns = (uint64_t)-1;
+  start_ns = prev_ns = cprt_mono_ns();
+  end_ns = start_ns + (uint64_t)o_duration_ms * 1000000;
+  while (prev_ns < end_ns) {
+    now_ns = cprt_mono_ns();
+    if (now_ns - prev_ns > (uint64_t)o_threshold_ns) {
+      record_gap(s, prev_ns, now_ns - prev_ns);
+    } else if (now_ns - prev_ns < s->min_loop_ns) {
+      s->min_loop_ns = now_ns - prev_ns;
+    }
+    s->loops++;
+    prev_ns = now_ns;
+  }
+  s->elapsed_ns = prev_ns - start_ns;
+
+  CPRT_THREAD_EXIT;
+  return 0;
+}  /* spin_thread */
+
+
+int cmp_gap_desc(const void *a, const void *b)
+{
+  const struct gap *x = (const struct gap *)a;
+  const struct gap *y = (const struct gap *)b;
+  return (x->len_ns > y->len_ns) ? -1 : ((x->len_ns < y->len_ns) ? 1 : 0);
+}  /* cmp_gap_desc */
+
+
+/* Print one CPU's results; return 1 if it exceeded -L or -M. */
+int report(struct spinner *s)
+{
+  char ts_str[CPRT_FMT_TIME_SZ];
+  double lost_pct = (double)s->lost_ns * 100 / s->elapsed_ns;
+  int b, i, failed = 0;
+
+  qsort(s->top, s->num_top, sizeof(struct gap), cmp_gap_desc);
+  printf("cpu %d: elapsed_ms=%"PRIu64" loops=%"PRIu64" min_loop_ns=%"PRIu64" gaps=%"PRIu64" lost_ns=%"PRIu64" lost_pct=%.4f max_gap_ns=%"PRIu64"\n",
+      s->cpu, s->elapsed_ns / 1000000, s->loops, s->min_loop_ns, s->gaps, s->lost_ns, lost_pct, s->max_gap_ns);
+  for (b = 0; b < NUM_BUCKETS; b++) {
+    if (s->buckets[b] > 0) {
+      printf("cpu %d: gap_ns %"PRIu64"-%"PRIu64": %"PRIu64"\n", s->cpu, (uint64_t)1 << b, ((uint64_t)2 << b) - 1, s->buckets[b]);
+    }
+  }
+  for (i = 0; i < s->num_top; i++) {
+    cprt_fmt_epoch_ns(ts_str, cprt_mono_to_realtime_ns(s->top[i].start_ns), 6);
+    printf("cpu %d: top %s gap_ns=%"PRIu64"\n", s->cpu, ts_str, s->top[i].len_ns);
+  }
+
+  if (o_max_lost_pct > 0 && lost_pct > o_max_lost_pct) {
+    printf("FAIL: cpu %d lost_pct %.4f exceeds %g\n", s->cpu, lost_pct, o_max_lost_pct);
+    failed = 1;
+  }
+  if (o_max_gap_us > 0 && s->max_gap_ns > (uint64_t)o_max_gap_us * 1000) {
+    printf("FAIL: cpu %d max_gap_ns %"PRIu64" exceeds %d us\n", s->cpu, s->max_gap_ns, o_max_gap_us);
+    failed = 1;
+  }
+  return failed;
+}  /* report */
+
+
+void get_my_options(int argc, char **argv)
+{
+  int opt;
+
+  while ((opt = cprt_getopt(argc, argv, "hc:d:T:k:L:M:")) != EOF) {
+    switch (opt) {
+      case 'h': help(); break;
+      case 'c': o_cpus = cprt_optarg; break;
+      case 'd': CPRT_ATOI(cprt_optarg, o_duration_ms); break;
+      case 'T': CPRT_ATOI(cprt_optarg, o_threshold_ns); break;
+      case 'k': CPRT_ATOI(cprt_optarg, o_top); break;
+      case 'L': o_max_lost_pct = atof(cprt_optarg); break;
+      case 'M': CPRT_ATOI(cprt_optarg, o_max_gap_us); break;
+      default: usage(NULL);
+    }
+  }
+  if (o_duration_ms < 1 || o_threshold_ns < 1 || o_top < 0 || o_max_gap_us < 0) {
+    usage("Error, -d and -T must be positive; -k and -M must not be negative");
+  }
+  if (cprt_optind != argc) {
+    usage("Error, unexpected positional parameter");
+  }
+}  /* get_my_options */
+
+
+int main(int argc, char **argv)
+{
+  cprt_cpuset_t *cpus, *pin_set;
+  struct spinner *spinners;
+  struct cprt_thread_attr attr;
+  int cpu, i, failures = 0;
+
+  get_my_options(argc, argv);
+  CPRT_INITTIME();
+
+  cpus = cprt_cpuset_create();
+  if (o_cpus != NULL) {
+    if (cprt_cpuset_parse(cpus, o_cpus) == -1 || cprt_cpuset_count(cpus) == 0) {
+      usage("Error, bad -c cpu_list");
+    }
+  } else {
+    CPRT_EM1(cprt_get_affinity_cpuset(cpus));
+  }
+  g_num_spinners = cprt_cpuset_count(cpus);
+  CPRT_ENULL(spinners = (struct spinner *)calloc(g_num_spinners, sizeof(struct spinner)));
+
+  pin_set = cprt_cpuset_create();
+  g_ready = 0;
+  i = 0;
+  for (cpu = cprt_cpuset_next(cpus, 0); cpu >= 0; cpu = cprt_cpuset_next(cpus, cpu + 1)) {
+    spinners[i].cpu = cpu;
+    CPRT_ENULL(spinners[i].top = (struct gap *)malloc((o_top + 1) * sizeof(struct gap)));
+    cprt_cpuset_zero(pin_set);
+    CPRT_EM1(cprt_cpuset_set(pin_set, cpu));
+    cprt_thread_attr_init(&attr);
+    attr.name = "cprt_jitter";
+    attr.cpuset = pin_set;  /* Starts it there (where supported); it checks with pin_to(). */
+    CPRT_THREAD_CREATE_EX(spinners[i].thread_id, spin_thread, &spinners[i], &attr);
+    i++;
+  }
+  for (i = 0; i < g_num_spinners; i++) {
+    CPRT_THREAD_JOIN(spinners[i].thread_id);
+  }
+
+  for (i = 0; i < g_num_spinners; i++) {
+    failures += report(&spinners[i]);
+    free(spinners[i].top);
+  }
+
+  free(spinners);
+  cprt_cpuset_delete(pin_set);
+  cprt_cpuset_delete(cpus);
+  return (failures > 0) ? 1 : 0;
+}  /* main */
@@ -0,0 +1,486 @@
+/* cprt_netbench.c - Loopback UDP/TCP ping-pong latency benchmark.
+ * This tries to be portable between Mac, Linux, and Windows.
+ * See https://github.com/fordsfords/cprt */
+
+/* This work is dedicated to the public domain under CC0 1.0 Universal:
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * To the extent possible under law, Steven Ford has waived all copyright
+ * and related or neighboring rights to this work. In other words, you can
+ * use this code for any purpose without any restrictions.
+ * This work is published from: United States.
+ * Project home: https://github.com/fordsfords/cprt
+ */
+
+#if ! defined(_WIN32)
+/* Unix */
+#define _GNU_SOURCE
+#endif
+
+#include "cprt.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#if ! defined(_WIN32)
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#endif
+
+
+/* Options and their defaults */
+int o_tcp = 0;
+int o_msg_size = 64;
+int o_num_msgs = 100000;
+int o_warmup = 1000;
+int o_rate = 0;  /* Rounds per sec; 0 = closed loop. */
+int o_batch = 1;
+int o_busy_poll = 0;
+int o_client_cpu = -1;
+int o_server_cpu = -1;
+int o_timeout_ms = 1000;
+
+
+char usage_str[] = "Usage: cprt_netbench [-h] [-p udp|tcp] [-s msg_size] [-n num_msgs] [-w warmup] [-r rate] [-b batch] [-B] [-c client_cpu] [-S server_cpu] [-t timeout_ms]";
+
+void usage(char *msg) {
+  if (msg) fprintf(stderr, "%s\n", msg);
+  fprintf(stderr, "%s\n", usage_str);
+  exit(1);
+}
+
+void help() {
+  fprintf(stderr, "%s\n", usage_str);
+  fprintf(stderr, "where:\n"
+      "  -h : print help\n"
+      "  -p udp|tcp : protocol [udp]\n"
+      "  -s msg_size : bytes per message, min 16 [64]\n"
+      "  -n num_msgs : messages to measure [100000]\n"
+      "  -w warmup : messages to send before measuring [1000]\n"
+      "  -r rate : send rounds per second (paced); 0 = next round as soon\n"
+      "            as the previous one returns [0]\n"
+      "  -b batch : messages sent per round before waiting for the echoes [1]\n"
+      "  -B : busy-poll (non-blocking receive in a spin loop) [blocking];\n"
+      "       client and server should be pinned to different cores\n"
+      "  -c client_cpu : pin client thread to CPU [not pinned]\n"
+      "  -S server_cpu : pin server (echo) thread to CPU [not pinned]\n"
+      "  -t timeout_ms : UDP only; stop waiting for a round's missing echoes\n"
+      "                  after this long and count them as lost [1000]\n");
+  exit(0);
+}
+
+
+/* Start of every message. */
+struct msg_hdr {
+  uint64_t send_ns;  /* Intended send time (see pacing below). */
+  uint64_t seq;
+};
+#define QUIT_SEQ ((uint64_t)-1)
+#define MAX_BATCH 256  /* Loopback UDP drops (counted as lost) if the socket buffer fills. */
+/* TCP echoes the client has not read yet. If a round had more in flight
+ * than the socket buffers hold, the server would block sending echoes
+ * while the client blocks sending the rest of the round. */
+#define TCP_MAX_INFLIGHT 65536
+
+CPRT_SOCKET listen_sock;
+struct sockaddr_in server_addr;
+volatile int g_stop;  /* Set by the client after it sends QUIT_SEQ, which may be lost. */
+
+
+void set_nonblock(CPRT_SOCKET sock)
+{
+#if defined(_WIN32)
+  u_long mode = 1;
+  CPRT_EOK0(ioctlsocket(sock, FIONBIO, &mode));
+#else
+  int flags = fcntl(sock, F_GETFL, 0);
+  CPRT_EOK0(fcntl(sock, F_SETFL, flags | O_NONBLOCK));
+#endif
+}  /* set_nonblock */
+
+
+int would_block()
+{
+#if defined(_WIN32)
+  return (WSAGetLastError() == WSAEWOULDBLOCK);
+#else
+  return (errno == EAGAIN || errno == EWOULDBLOCK);
+#endif
+}  /* would_block */
+
+
+/* Make blocking receives give up after ms. */
+void set_rcv_timeout(CPRT_SOCKET sock, int ms)
+{
+#if defined(_WIN32)
+  DWORD tv = (DWORD)ms;
+#else
+  struct timeval tv;
+  tv.tv_sec = ms / 1000;
+  tv.tv_usec = (ms % 1000) * 1000;
+#endif
+  CPRT_EOK0(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof(tv)));
+}  /* set_rcv_timeout */
+
+
+/* Receive UDP datagrams, treating an SO_RCVTIMEO timeout (an error on
+ * Windows) like a non-blocking socket with nothing queued. */
+int udp_recv(CPRT_SOCKET sock, struct cprt_udp_pkt *pkts, int num_pkts)
+{
+  int num_rcvd = cprt_udp_recv_batch(sock, pkts, num_pkts);
+#if defined(_WIN32)
+  if (num_rcvd < 0 && WSAGetLastError() == WSAETIMEDOUT) {
+    num_rcvd = 0;
+  }
+#endif
+  CPRT_ASSERT(num_rcvd >= 0);
+  return num_rcvd;
+}  /* udp_recv */
+
+
+/* Read exactly len bytes (spinning if non-blocking). */
+void tcp_read_full(CPRT_SOCKET sock, char *buf, int len)
+{
+  int got = 0;
+  int rc;
+
+  while (got < len) {
+    rc = recv(sock, buf + got, len - got, 0);
+    if (rc < 0 && would_block()) {
+      continue;
+    }
+    CPRT_ASSERT(rc > 0);
+    got += rc;
+  }
+}  /* tcp_read_full */
+
+
+void tcp_write_full(CPRT_SOCKET sock, const char *buf, int len)
+{
+  int sent = 0;
+  int rc;
+
+  while (sent < len) {
+    rc = send(sock, buf + sent, len - sent, 0);
+    if (rc < 0 && would_block()) {
+      continue;
+    }
+    CPRT_ASSERT(rc > 0);
+    sent += rc;
+  }
+}  /* tcp_write_full */
+
+
+/* Echo messages back until QUIT_SEQ. */
+CPRT_THREAD_ENTRYPOINT server_thread(void *in_arg)
+{
+  char *buf;
+  struct msg_hdr *hdr;
+  CPRT_SOCKET sock;
+
+  CPRT_ENULL(buf = (char *)malloc(o_msg_size * MAX_BATCH));
+
+  if (o_tcp) {
+    int one = 1;
+    sock = accept(listen_sock, NULL, NULL);
+    CPRT_ASSERT(sock != (CPRT_SOCKET)-1);
+    CPRT_EOK0(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one)));
+    if (o_busy_poll) {
+      set_nonblock(sock);
+    }
+    do {
+      tcp_read_full(sock, buf, o_msg_size);
+      tcp_write_full(sock, buf, o_msg_size);
+      hdr = (struct msg_hdr *)buf;
+    } while (hdr->seq != QUIT_SEQ);
+    CPRT_SOCKET_CLOSE(sock);
+  }
+  else {
+    struct cprt_udp_pkt pkts[MAX_BATCH];
+    int i, num_rcvd, quit = 0;
+    sock = listen_sock;
+    for (i = 0; i < MAX_BATCH; i++) {
+      pkts[i].buf = buf + i * o_msg_size;
+      pkts[i].buf_size = o_msg_size;
+    }
+    while (! quit) {
+      num_rcvd = udp_recv(sock, pkts, MAX_BATCH);
+      if (num_rcvd == 0 && g_stop) {
+        break;  /* QUIT_SEQ was lost. */
+      }
+      for (i = 0; i < num_rcvd; i++) {
+        hdr = (struct msg_hdr *)pkts[i].buf;
+        if (hdr->seq == QUIT_SEQ) {
+          quit = 1;
+        }
+        /* Echo to sender (addr and len are already set by the receive). */
+      }
+      if (num_rcvd > 0) {
+        CPRT_ASSERT(cprt_udp_send_batch(sock, pkts, num_rcvd) == num_rcvd);
+      }
+    }
+  }
+
+  free(buf);
+  CPRT_THREAD_EXIT;
+  return 0;
+}  /* server_thread */
+
+
+/* Read one TCP echo into buf and record its RTT if it is measured. */
+void tcp_read_echo(CPRT_SOCKET sock, char *buf, uint64_t total, uint64_t *rtts, uint64_t *num_rtts)
+{
+  struct msg_hdr *hdr = (struct msg_hdr *)buf;
+  uint64_t now_ns;
+
+  tcp_read_full(sock, buf, o_msg_size);
+  now_ns = cprt_mono_ns();
+  if (hdr->seq >= (uint64_t)o_warmup && hdr->seq < total) {
+    rtts[(*num_rtts)++] = now_ns - hdr->send_ns;
+  }
+}  /* tcp_read_echo */
+
+
+int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}  /* cmp_u64 */
+
+
+void get_my_options(int argc, char **argv)
+{
+  int opt;
+
+  while ((opt = cprt_getopt(argc, argv, "hp:s:n:w:r:b:Bc:S:t:")) != EOF) {
+    switch (opt) {
+      case 'h': help(); break;
+      case 'p':
+        if (strcmp(cprt_optarg, "tcp") == 0) {
+          o_tcp = 1;
+        } else if (strcmp(cprt_optarg, "udp") == 0) {
+          o_tcp = 0;
+        } else {
+          usage("Error, -p must be udp or tcp");
+        }
+        break;
+      case 's': CPRT_ATOI(cprt_optarg, o_msg_size); break;
+      case 'n': CPRT_ATOI(cprt_optarg, o_num_msgs); break;
+      case 'w': CPRT_ATOI(cprt_optarg, o_warmup); break;
+      case 'r': CPRT_ATOI(cprt_optarg, o_rate); break;
+      case 'b': CPRT_ATOI(cprt_optarg, o_batch); break;
+      case 'B': o_busy_poll = 1; break;
+      case 'c': CPRT_ATOI(cprt_optarg, o_client_cpu); break;
+      case 'S': CPRT_ATOI(cprt_optarg, o_server_cpu); break;
+      case 't': CPRT_ATOI(cprt_optarg, o_timeout_ms); break;
+      default: usage(NULL);
+    }
+  }
+  if (o_msg_size < (int)sizeof(struct msg_hdr) || o_msg_size > 65000) {
+    usage("Error, -s must be 16..65000");
+  }
+  if (o_batch < 1 || o_batch > MAX_BATCH) {
+    usage("Error, -b must be 1..256");
+  }
+  if (o_num_msgs < 1 || o_timeout_ms < 1 || o_warmup < 0 || o_rate < 0) {
+    usage("Error, -n and -t must be positive; -w and -r must not be negative");
+  }
+  if (cprt_optind != argc) {
+    usage("Error, unexpected positional parameter");
+  }
+}  /* get_my_options */
+
+
+int main(int argc, char **argv)
+{
+  CPRT_SOCKET sock;
+  socklen_t addr_len;
+  CPRT_THREAD_T server_id;
+  struct cprt_thread_attr attr;
+  cprt_cpuset_t *cpuset;
+  struct cprt_udp_pkt pkts[MAX_BATCH];
+  struct msg_hdr *hdr;
+  struct cprt_wait wait;
+  uint64_t *rtts;
+  uint64_t total, num_rtts = 0, lost_msgs = 0, late_msgs = 0;
+  uint64_t seq, send_ns, now_ns, start_ns = 0, end_ns, period_ns, next_ns, deadline_ns;
+  char *buf;
+  int i, b, n, rd, num_rcvd, got, tcp_window;
+
+  CPRT_NET_START;
+  get_my_options(argc, argv);
+  total = (uint64_t)o_warmup + (uint64_t)o_num_msgs;
+  tcp_window = TCP_MAX_INFLIGHT / o_msg_size;  /* At least 1 (-s max is 65000). */
+
+  CPRT_ENULL(rtts = (uint64_t *)malloc(o_num_msgs * sizeof(uint64_t)));
+  CPRT_ENULL(buf = (char *)calloc(MAX_BATCH, o_msg_size));
+  cpuset = cprt_cpuset_create();
+
+  /* Server socket on an ephemeral loopback port. */
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  listen_sock = socket(AF_INET, o_tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+  CPRT_ASSERT(listen_sock != (CPRT_SOCKET)-1);
+  CPRT_EOK0(bind(listen_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)));
+  addr_len = sizeof(server_addr);
+  CPRT_EOK0(getsockname(listen_sock, (struct sockaddr *)&server_addr, &addr_len));
+  if (o_tcp) {
+    CPRT_EOK0(listen(listen_sock, 1));
+  } else if (o_busy_poll) {
+    set_nonblock(listen_sock);
+  } else {
+    set_rcv_timeout(listen_sock, o_timeout_ms);
+  }
+
+  cprt_thread_attr_init(&attr);
+  attr.name = "netbench_srv";
+  if (o_server_cpu >= 0) {
+    CPRT_EM1(cprt_cpuset_set(cpuset, o_server_cpu));
+    attr.cpuset = cpuset;
+  }
+  CPRT_THREAD_CREATE_EX(server_id, server_thread, NULL, &attr);
+
+  if (o_client_cpu >= 0) {
+    cprt_cpuset_zero(cpuset);
+    CPRT_EM1(cprt_cpuset_set(cpuset, o_client_cpu));
+    cprt_set_affinity_cpuset(cpuset);
+  }
+
+  sock = socket(AF_INET, o_tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+  CPRT_ASSERT(sock != (CPRT_SOCKET)-1);
+  CPRT_EOK0(connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)));
+  if (o_tcp) {
+    int one = 1;
+    CPRT_EOK0(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one)));
+  }
+  if (o_busy_poll) {
+    set_nonblock(sock);
+  } else if (! o_tcp) {
+    set_rcv_timeout(sock, o_timeout_ms);
+  }
+  for (i = 0; i < MAX_BATCH; i++) {
+    pkts[i].buf = buf + i * o_msg_size;
+    pkts[i].buf_size = o_msg_size;
+    pkts[i].len = o_msg_size;
+    pkts[i].addr_len = 0;  /* Connected. */
+  }
+
+  /* Paced rounds are scheduled at fixed times, and latency is measured
+   * from the scheduled time, so a slow round also charges the rounds it
+   * delayed (no coordinated omission). */
+  cprt_wait_init(&wait, o_busy_poll ? CPRT_WAIT_PAUSE : CPRT_WAIT_PARK);
+  period_ns = (o_rate > 0) ? (UINT64_C(1000000000) / o_rate) : 0;
+  next_ns = cprt_mono_ns();
+  for (seq = 0; seq < total; seq += o_batch) {
+    if (seq <= (uint64_t)o_warmup && seq + o_batch > (uint64_t)o_warmup) {
+      start_ns = cprt_mono_ns();
+      next_ns = start_ns;
+    }
+    if (period_ns > 0) {
+      now_ns = cprt_mono_ns();
+      if (now_ns < next_ns) {
+        cprt_sleep_ns_strategy(next_ns - now_ns, &wait);
+      }
+      send_ns = next_ns;
+      next_ns += period_ns;
+    } else {
+      send_ns = cprt_mono_ns();
+    }
+
+    for (b = 0; b < o_batch; b++) {
+      hdr = (struct msg_hdr *)pkts[b].buf;
+      hdr->send_ns = send_ns;
+      hdr->seq = seq + b;
+    }
+    if (o_tcp) {
+      /* Send the round in chunks of up to tcp_window messages, reading
+       * echoes (into already-sent slots) to keep at most that many unread. */
+      rd = 0;
+      for (b = 0; b < o_batch; b += n) {
+        n = (o_batch - b < tcp_window) ? (o_batch - b) : tcp_window;
+        while (b + n - rd > tcp_window) {
+          tcp_read_echo(sock, pkts[rd++].buf, total, rtts, &num_rtts);
+        }
+        tcp_write_full(sock, pkts[b].buf, o_msg_size * n);
+      }
+      while (rd < o_batch) {
+        tcp_read_echo(sock, pkts[rd++].buf, total, rtts, &num_rtts);
+      }
+    }
+    else {
+      /* Echoes land in pkts[0..]; the headers are rewritten next round. A
+       * round's missing echoes are lost after -t; if they turn up in a
+       * later round they are late and ignored. */
+      CPRT_ASSERT(cprt_udp_send_batch(sock, pkts, o_batch) == o_batch);
+      deadline_ns = cprt_mono_ns() + (uint64_t)o_timeout_ms * 1000000;
+      got = 0;
+      while (got < o_batch) {
+        num_rcvd = udp_recv(sock, pkts, o_batch - got);  /* 0 if busy-polling or timed out. */
+        now_ns = cprt_mono_ns();
+        for (i = 0; i < num_rcvd; i++) {
+          hdr = (struct msg_hdr *)pkts[i].buf;
+          pkts[i].len = o_msg_size;
+          pkts[i].addr_len = 0;  /* Receive set it; a send to a connected socket must not. */
+          if (hdr->seq < seq) {
+            late_msgs++;
+            continue;
+          }
+          got++;
+          if (hdr->seq >= (uint64_t)o_warmup && hdr->seq < total) {
+            rtts[num_rtts++] = now_ns - hdr->send_ns;
+          }
+        }
+        if (num_rcvd == 0 && now_ns >= deadline_ns) {
+          lost_msgs += o_batch - got;
+          break;
+        }
+      }
+    }
+  }
+  end_ns = cprt_mono_ns();
+
+  /* Stop server. */
+  hdr = (struct msg_hdr *)pkts[0].buf;
+  hdr->seq = QUIT_SEQ;
+  if (o_tcp) {
+    tcp_write_full(sock, buf, o_msg_size);
+    tcp_read_full(sock, buf, o_msg_size);
+  } else {
+    /* If QUIT_SEQ is lost, the server sees g_stop at its next timeout. */
+    g_stop = 1;
+    pkts[0].len = o_msg_size;
+    CPRT_ASSERT(cprt_udp_send_batch(sock, pkts, 1) == 1);
+  }
+  CPRT_THREAD_JOIN(server_id);
+
+  /* The last round can run past num_msgs; only the first num_msgs count.
+   * Lost messages have no RTT. */
+  printf("proto=%s, msg_size=%d, batch=%d, rate=%d, busy_poll=%d, msgs=%d\n",
+      o_tcp ? "tcp" : "udp", o_msg_size, o_batch, o_rate, o_busy_poll, o_num_msgs);
+  if (! o_tcp) {
+    printf("loss: lost_msgs=%"PRIu64", late_msgs=%"PRIu64"\n", lost_msgs, late_msgs);
+  }
+  if (num_rtts == 0) {
+    fprintf(stderr, "Error, no messages were echoed\n");
+    exit(1);
+  }
+  qsort(rtts, (size_t)num_rtts, sizeof(uint64_t), cmp_u64);
+  printf("rtt_ns: min=%"PRIu64", p50=%"PRIu64", p90=%"PRIu64", p99=%"PRIu64", p99.9=%"PRIu64", p99.99=%"PRIu64", max=%"PRIu64"\n",
+      rtts[0], rtts[num_rtts / 2], rtts[num_rtts * 90 / 100],
+      rtts[num_rtts * 99 / 100], rtts[num_rtts * 999 / 1000],
+      rtts[num_rtts * 9999 / 10000], rtts[num_rtts - 1]);
+  printf("throughput: msgs_per_sec=%.0f, MB_per_sec=%.2f\n",
+      (double)num_rtts * 1e9 / (double)(end_ns - start_ns),
+      (double)num_rtts * o_msg_size * 1e3 / (double)(end_ns - start_ns));
+
+  CPRT_SOCKET_CLOSE(sock);
+  CPRT_SOCKET_CLOSE(listen_sock);
+  cprt_cpuset_delete(cpuset);
+  free(buf);
+  free(rtts);
+  CPRT_NET_CLEANUP;
+  return 0;
+}  /* main */
@@ -12,12 +12,20 @@
  * Project home: https://github.com/fordsfords/cprt
  */
 
+#if ! defined(_WIN32)
+/* Unix */
+#define _GNU_SOURCE
+#endif
+
 #include "cprt.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#if ! defined(_WIN32)
+#include <fcntl.h>
+#endif
 
 
 /* Options and their defaults */
@@ -56,6 +64,24 @@ CPRT_MUTEX_T my_cond_mutex;
 CPRT_COND_T my_cond_var;
 int my_cond_state;
 
+/* The threading tests' main thread sleeps or blocks; check that it really
+ * gave up the CPU and, if max_cpu_ns is non-zero, didn't spin while
+ * waiting. */
+void check_blocked_8(const struct cprt_thread_stats *start, uint64_t max_cpu_ns)
+{
+  struct cprt_thread_stats delta;
+
+  CPRT_EM1(cprt_thread_stats_delta(start, &delta));
+#if defined(__linux__)
+  CPRT_ASSERT(delta.vol_ctx_switches > 0);
+#endif
+#if defined(__linux__) || defined(_WIN32)
+  if (max_cpu_ns > 0) {
+    CPRT_ASSERT(delta.user_ns + delta.sys_ns < max_cpu_ns);
+  }
+#endif
+}  /* check_blocked_8 */
+
 CPRT_THREAD_ENTRYPOINT thread_test_8(void *in_arg)
 {
   int *int_arg = (int *)in_arg;
@@ -231,6 +257,305 @@ CPRT_THREAD_ENTRYPOINT thread_test_9(void *in_arg)
 #endif
 
 
+/* Pool tasks for test 15. */
+cprt_pool_t *test_pool;
+volatile long test_pool_count;
+
+volatile long test_pool_ext_count;  /* Tasks run by non-workers. */
+
+void pool_leaf_15(void *arg)
+{
+  CPRT_ATOMIC_INC_VAL(&test_pool_count);
+  if (cprt_pool_worker_index(test_pool) < 0) {
+    CPRT_ATOMIC_INC_VAL(&test_pool_ext_count);
+  }
+}  /* pool_leaf_15 */
+
+void pool_parent_15(void *arg)
+{
+  struct cprt_pool_wg wg;
+  int i;
+
+  /* On a worker these go on its deque and can be stolen. (The main thread
+   * can also run this while it waits, in which case they are injected.) */
+  cprt_pool_wg_init(&wg);
+  for (i = 0; i < 100; i++) {
+    cprt_pool_submit(test_pool, &wg, pool_leaf_15, NULL);
+  }
+  cprt_pool_wait(test_pool, &wg);
+  CPRT_ATOMIC_INC_VAL(&test_pool_count);
+  if (cprt_pool_worker_index(test_pool) < 0) {
+    CPRT_ATOMIC_INC_VAL(&test_pool_ext_count);
+  }
+}  /* pool_parent_15 */
+
+void pool_busy_15(void *arg)
+{
+  uint64_t end_ns = cprt_mono_ns() + 20000;
+
+  while (cprt_mono_ns() < end_ns) {
+    CPRT_CPU_PAUSE();
+  }
+  CPRT_ATOMIC_INC_VAL(&test_pool_count);
+}  /* pool_busy_15 */
+
+volatile int test_pool_sleeping;
+
+void pool_sleep_15(void *arg)
+{
+  test_pool_sleeping = 1;
+  CPRT_SLEEP_MS(100);
+  CPRT_ATOMIC_INC_VAL(&test_pool_count);
+}  /* pool_sleep_15 */
+
+/* Fan-out from a single worker: the other workers can only get these
+ * children by stealing them from its deque. */
+void pool_fanout_15(void *arg)
+{
+  struct cprt_pool_wg wg;
+  int i;
+
+  CPRT_ASSERT(cprt_pool_worker_index(test_pool) >= 0);
+  cprt_pool_wg_init(&wg);
+  for (i = 0; i < 1000; i++) {
+    cprt_pool_submit(test_pool, &wg, pool_busy_15, NULL);
+  }
+  cprt_pool_wait(test_pool, &wg);
+  CPRT_ATOMIC_INC_VAL(&test_pool_count);
+}  /* pool_fanout_15 */
+
+
+/* Parallel-for / reduce test callbacks. */
+void fill_16(uint64_t begin, uint64_t end, void *ctx)
+{
+  uint64_t *array = (uint64_t *)ctx;
+  uint64_t i;
+  for (i = begin; i < end; i++) {
+    array[i] = i * 3;
+  }
+}  /* fill_16 */
+
+void sum_16(uint64_t begin, uint64_t end, void *partial, void *ctx)
+{
+  uint64_t *array = (uint64_t *)ctx;
+  uint64_t i;
+  for (i = begin; i < end; i++) {
+    *(uint64_t *)partial += array[i];
+  }
+}  /* sum_16 */
+
+void add_16(void *into, const void *from, void *ctx)
+{
+  (void)ctx;
+  *(uint64_t *)into += *(const uint64_t *)from;
+}  /* add_16 */
+
+
+/* Uses a lot of stack so that a pre-touched stack can be checked. */
+void use_stack_12(int depth)
+{
+  volatile char buf[16*1024];
+  buf[0] = (char)depth;
+  buf[sizeof(buf) - 1] = (char)depth;
+  if (depth > 0) {
+    use_stack_12(depth - 1);
+  }
+}  /* use_stack_12 */
+
+CPRT_THREAD_ENTRYPOINT thread_test_12(void *in_arg)
+{
+  struct cprt_fault_counts start, delta;
+
+  cprt_stack_pretouch(512*1024);
+
+  CPRT_EM1(cprt_fault_counts(&start));
+  use_stack_12(16);  /* About 256K of stack. */
+  CPRT_EM1(cprt_fault_delta(&start, &delta));
+  printf("stack faults: minor=%"PRIu64", major=%"PRIu64"\n",
+      delta.minor_faults, delta.major_faults);
+  CPRT_ASSERT(delta.minor_faults == 0 && delta.major_faults == 0);
+
+  CPRT_THREAD_EXIT;
+  return 0;
+}  /* thread_test_12 */
+
+
+/* Checks its own attributes for test 17. */
+char test_thread_cpus[64];
+
+CPRT_THREAD_ENTRYPOINT thread_test_17(void *in_arg)
+{
+  cprt_cpuset_t *cpuset = cprt_cpuset_create();
+  char cpus[64];
+#if defined(__linux__)
+  char name[16];
+  pthread_attr_t pattr;
+  size_t stack_size;
+  int policy;
+  struct sched_param sched;
+#endif
+
+  CPRT_EM1(cprt_get_affinity_cpuset(cpuset));
+  cprt_cpuset_format(cpuset, cpus, sizeof(cpus));
+  CPRT_ASSERT(strcmp(cpus, test_thread_cpus) == 0);
+  cprt_cpuset_delete(cpuset);
+
+#if defined(__linux__)
+  CPRT_EOK0(pthread_getname_np(pthread_self(), name, sizeof(name)));
+  CPRT_ASSERT(strcmp(name, "cprt_test_17_lo") == 0);  /* Truncated to 15. */
+  CPRT_EOK0(pthread_getattr_np(pthread_self(), &pattr));
+  CPRT_EOK0(pthread_attr_getstacksize(&pattr, &stack_size));
+  CPRT_ASSERT(stack_size >= 1024*1024);
+  pthread_attr_destroy(&pattr);
+  CPRT_EOK0(pthread_getschedparam(pthread_self(), &policy, &sched));
+  printf("thread: cpus=%s, name=%s, stack_size=%d, policy=%s, priority=%d\n",
+      cpus, name, (int)stack_size, (policy == SCHED_FIFO) ? "fifo" : "other",
+      sched.sched_priority);
+  if (in_arg != NULL) {
+    CPRT_ASSERT(policy == SCHED_FIFO && sched.sched_priority == 1);
+  }
+#endif
+
+  CPRT_THREAD_EXIT;
+  return 0;
+}  /* thread_test_17 */
+
+
+/* Burns CPU and sleeps so test 18 can check its stats. */
+volatile uint64_t test_stats_tid;
+volatile int test_stats_state;  /* 1=ready to be sampled, 2=sampled. */
+
+CPRT_THREAD_ENTRYPOINT thread_test_18(void *in_arg)
+{
+  struct cprt_thread_stats start, delta;
+  struct cprt_timespec start_ts, now_ts;
+  uint64_t diff_ns;
+  int i;
+
+  test_stats_tid = cprt_thread_os_tid();
+  CPRT_EM1(cprt_thread_stats(&start));
+
+  CPRT_GETTIME(&start_ts);
+  do {
+    CPRT_GETTIME(&now_ts);
+    CPRT_DIFF_TS(diff_ns, now_ts, start_ts);
+  } while (diff_ns < 100000000);  /* 100 ms of CPU. */
+  for (i = 0; i < 5; i++) {
+    CPRT_SLEEP_MS(1);
+  }
+
+  CPRT_EM1(cprt_thread_stats_delta(&start, &delta));
+  printf("delta: user_ns=%"PRIu64", sys_ns=%"PRIu64", vol=%"PRIu64", invol=%"PRIu64", minflt=%"PRIu64", majflt=%"PRIu64"\n",
+      delta.user_ns, delta.sys_ns, delta.vol_ctx_switches, delta.invol_ctx_switches,
+      delta.faults.minor_faults, delta.faults.major_faults);
+  CPRT_ASSERT(delta.user_ns + delta.sys_ns >= 50000000);
+#if defined(__linux__)
+  CPRT_ASSERT(delta.vol_ctx_switches >= 5);
+#endif
+
+  /* Let the main thread sample us from outside. */
+  test_stats_state = 1;
+  while (test_stats_state != 2) {
+    CPRT_SLEEP_MS(1);
+  }
+
+  CPRT_THREAD_EXIT;
+  return 0;
+}  /* thread_test_18 */
+
+
+/* Posts the semaphore a few times for test 19. */
+CPRT_THREAD_ENTRYPOINT thread_test_19(void *in_arg)
+{
+  int i;
+
+  for (i = 0; i < 5; i++) {
+    CPRT_SLEEP_MS(2);
+    CPRT_SEM_POST(my_test_wake_sem);
+  }
+  CPRT_THREAD_EXIT;
+  return 0;
+}  /* thread_test_19 */
+
+
+/* Event loop callbacks for test 21. */
+int test_ev_pkts;
+int test_ev_ticks;
+CPRT_SOCKET test_ev_remove_sock;
+
+void sock_cb_21(cprt_evloop_t *loop, CPRT_SOCKET sock, int events, void *arg)
+{
+  char buf[64];
+
+  CPRT_ASSERT(events & CPRT_EV_READ);
+  /* Drain (required for edge-triggered epoll). */
+  while (recv(sock, buf, sizeof(buf), 0) > 0) {
+    test_ev_pkts++;
+  }
+  if (sock == test_ev_remove_sock) {
+    CPRT_EM1(cprt_evloop_remove(loop, sock));
+  }
+}  /* sock_cb_21 */
+
+void tick_cb_21(cprt_evloop_t *loop, int timer_id, void *arg)
+{
+  test_ev_ticks++;
+}  /* tick_cb_21 */
+
+void stop_cb_21(cprt_evloop_t *loop, int timer_id, void *arg)
+{
+  cprt_evloop_stop(loop);
+}  /* stop_cb_21 */
+
+void set_nonblock_21(CPRT_SOCKET sock)
+{
+#if defined(_WIN32)
+  u_long mode = 1;
+  CPRT_EOK0(ioctlsocket(sock, FIONBIO, &mode));
+#else
+  int flags = fcntl(sock, F_GETFL, 0);
+  CPRT_EOK0(fcntl(sock, F_SETFL, flags | O_NONBLOCK));
+#endif
+}  /* set_nonblock_21 */
+
+
+/* Reads test_zc_expect bytes from the socket for test 22. */
+CPRT_SOCKET test_zc_sock;
+char *test_zc_rx_buf;
+size_t test_zc_expect;
+
+CPRT_THREAD_ENTRYPOINT thread_test_22(void *in_arg)
+{
+  size_t got = 0;
+  int rc;
+
+  while (got < test_zc_expect) {
+    rc = recv(test_zc_sock, test_zc_rx_buf + got, (int)(test_zc_expect - got), 0);
+    CPRT_ASSERT(rc > 0);
+    got += (size_t)rc;
+  }
+  CPRT_THREAD_EXIT;
+  return 0;
+}  /* thread_test_22 */
+
+
+/* Records 1..100000 into both test 27 histograms. */
+cprt_hist_mt_t *test_hist_mt;
+cprt_hist_mt_t *test_hist_mt2;
+
+CPRT_THREAD_ENTRYPOINT thread_test_27(void *in_arg)
+{
+  uint64_t v;
+
+  for (v = 1; v <= 100000; v++) {
+    cprt_hist_mt_record(test_hist_mt, v);
+    cprt_hist_mt_record(test_hist_mt2, v * 10);
+  }
+  CPRT_THREAD_EXIT;
+  return 0;
+}  /* thread_test_27 */
+
+
 int main(int argc, char **argv)
 {
   int opt;
@@ -344,11 +669,14 @@ int main(int argc, char **argv)
 
     case 8:
     {
+      struct cprt_thread_stats start_stats;
       CPRT_THREAD_T my_thread_id;
+      struct cprt_wait wait;
       int got_lock;
       fprintf(stderr, "test %d: CPRT_THREAD_CREATE, CPRT_MUTEX_INIT\n", o_testnum);
       fflush(stderr);
 
+      CPRT_EM1(cprt_thread_stats(&start_stats));
       CPRT_MUTEX_INIT(my_thread_arg_mutex);
       CPRT_MUTEX_LOCK(my_thread_arg_mutex);
       my_thread_arg = o_testnum;
@@ -363,9 +691,8 @@ int main(int argc, char **argv)
       CPRT_SLEEP_MS(10);
       CPRT_MUTEX_TRYLOCK(got_lock, my_thread_arg_mutex);
       CPRT_ASSERT(! got_lock);
-      while (! got_lock) {
-        CPRT_MUTEX_TRYLOCK(got_lock, my_thread_arg_mutex);
-      }
+      cprt_wait_init(&wait, CPRT_WAIT_YIELD);  /* Don't starve the other thread. */
+      CPRT_MUTEX_LOCK_STRATEGY(my_thread_arg_mutex, &wait);
       CPRT_ASSERT(my_thread_arg == o_testnum+2);
 
       my_thread_arg++;  /* Becomes o_testnum+3 */
@@ -374,6 +701,7 @@ int main(int argc, char **argv)
 
       CPRT_THREAD_JOIN(my_thread_id);
       CPRT_ASSERT(my_thread_arg == o_testnum+4);
+      check_blocked_8(&start_stats, 0);
 
       CPRT_MUTEX_DELETE(my_thread_arg_mutex);
 
@@ -382,11 +710,14 @@ int main(int argc, char **argv)
 
     case 81:
     {
+      struct cprt_thread_stats start_stats;
       CPRT_THREAD_T my_thread_id;
+      struct cprt_wait wait;
       int got_lock;
       fprintf(stderr, "test %d: CPRT_THREAD_CREATE, CPRT_SPIN_INIT\n", o_testnum);
       fflush(stderr);
 
+      CPRT_EM1(cprt_thread_stats(&start_stats));
       CPRT_SPIN_INIT(my_thread_arg_spinlock);
       CPRT_SPIN_LOCK(my_thread_arg_spinlock);
       my_thread_arg = o_testnum;
@@ -401,9 +732,8 @@ int main(int argc, char **argv)
       CPRT_SLEEP_MS(10);
       CPRT_SPIN_TRYLOCK(got_lock, my_thread_arg_spinlock);
       CPRT_ASSERT(! got_lock);
-      while (! got_lock) {
-        CPRT_SPIN_TRYLOCK(got_lock, my_thread_arg_spinlock);
-      }
+      cprt_wait_init(&wait, CPRT_WAIT_YIELD);  /* Don't starve the other thread. */
+      CPRT_SPIN_LOCK_STRATEGY(my_thread_arg_spinlock, &wait);
       CPRT_ASSERT(my_thread_arg == o_testnum+2);
 
       my_thread_arg++;  /* Becomes o_testnum+3 */
@@ -412,6 +742,7 @@ int main(int argc, char **argv)
 
       CPRT_THREAD_JOIN(my_thread_id);
       CPRT_ASSERT(my_thread_arg == o_testnum+4);
+      check_blocked_8(&start_stats, 0);
 
       CPRT_SPIN_DELETE(my_thread_arg_spinlock);
       break;
@@ -419,10 +750,12 @@ int main(int argc, char **argv)
 
     case 82:
     {
+      struct cprt_thread_stats start_stats;
       CPRT_THREAD_T my_thread_id;
       fprintf(stderr, "test %d: CPRT_THREAD_CREATE, CPRT_SEM_INIT\n", o_testnum);
       fflush(stderr);
 
+      CPRT_EM1(cprt_thread_stats(&start_stats));
       CPRT_SEM_INIT(my_thread_wake_sem, 0);
       CPRT_SEM_INIT(my_test_wake_sem, 0);
       my_thread_arg = o_testnum;
@@ -438,6 +771,7 @@ int main(int argc, char **argv)
 
       CPRT_THREAD_JOIN(my_thread_id);
       CPRT_ASSERT(my_thread_arg == o_testnum+3);
+      check_blocked_8(&start_stats, 20000000);
 
       CPRT_SEM_DELETE(my_thread_wake_sem);
       CPRT_SEM_DELETE(my_test_wake_sem);
@@ -447,12 +781,14 @@ int main(int argc, char **argv)
 
     case 83:
     {
+      struct cprt_thread_stats start_stats;
       struct cprt_timespec ts1, ts2;
       uint64_t ts_diff_ns;
       CPRT_THREAD_T my_thread_id;
       fprintf(stderr, "test %d: CPRT_THREAD_CREATE, CPRT_COND_INIT\n", o_testnum);
       fflush(stderr);
 
+      CPRT_EM1(cprt_thread_stats(&start_stats));
       CPRT_MUTEX_INIT(my_cond_mutex);
       CPRT_COND_INIT(my_cond_var);
       my_cond_state = 0;
@@ -473,6 +809,7 @@ int main(int argc, char **argv)
       CPRT_ASSERT(ts_diff_ns > 40000000 && ts_diff_ns < 69000000);
 
       CPRT_THREAD_JOIN(my_thread_id);
+      check_blocked_8(&start_stats, 20000000);
 
       CPRT_MUTEX_DELETE(my_cond_mutex);
       CPRT_COND_DELETE(my_cond_var);
@@ -517,6 +854,1310 @@ int main(int argc, char **argv)
       break;
     }
 
+    case 11:
+    {
+      struct cprt_alloc_info info;
+      char *buf;
+      size_t i;
+      fprintf(stderr, "test %d: cprt_alloc_large\n", o_testnum);
+      fflush(stderr);
+
+      CPRT_ENULL(buf = cprt_alloc_large(5000000, CPRT_ALLOC_HUGE,
+          CPRT_NUMA_NODE_CURRENT, &info));
+      CPRT_ASSERT(info.size >= 5000000);
+      CPRT_ASSERT((info.size % info.page_size) == 0);
+      CPRT_ASSERT(((uintptr_t)buf % info.page_size) == 0);
+      for (i = 0; i < info.size; i += info.page_size) {
+        CPRT_ASSERT(buf[i] == 0);
+        buf[i] = 1;
+      }
+      printf("alloc_large: size=%"PRIu64", page_size=%"PRIu64", got_flags=%d, numa_node=%d\n",
+          (uint64_t)info.size, (uint64_t)info.page_size, info.got_flags, info.numa_node);
+      CPRT_EM1(cprt_free_large(buf, &info));
+
+      CPRT_ENULL(buf = cprt_alloc_large(100, 0, CPRT_NUMA_NODE_ANY, &info));
+      CPRT_ASSERT(info.got_flags == 0 && info.numa_node == -1);
+      buf[99] = 1;
+      CPRT_EM1(cprt_free_large(buf, &info));
+
+      break;
+    }
+
+    case 12:
+    {
+      CPRT_THREAD_T my_thread_id;
+      struct cprt_fault_counts start, delta;
+      char *buf;
+      size_t buf_sz = 4*1024*1024;
+      size_t i;
+      fprintf(stderr, "test %d: cprt_prefault, cprt_lock_all, cprt_fault_counts\n", o_testnum);
+      fflush(stderr);
+
+      /* Untouched memory should fault. */
+      CPRT_ENULL(buf = malloc(buf_sz));
+      CPRT_EM1(cprt_fault_counts(&start));
+      for (i = 0; i < buf_sz; i += 1024) {
+        CPRT_VOL32(buf[i]) = 0;
+      }
+      CPRT_EM1(cprt_fault_delta(&start, &delta));
+      printf("cold faults: minor=%"PRIu64", major=%"PRIu64"\n",
+          delta.minor_faults, delta.major_faults);
+      CPRT_ASSERT(delta.minor_faults > 0);
+      free(buf);
+
+      /* Pre-faulted memory should not. */
+      CPRT_ENULL(buf = malloc(buf_sz));
+      CPRT_EM1(cprt_prefault(buf, buf_sz));
+      CPRT_EM1(cprt_fault_counts(&start));
+      for (i = 0; i < buf_sz; i += 1024) {
+        CPRT_VOL32(buf[i]) = 1;
+      }
+      CPRT_EM1(cprt_fault_delta(&start, &delta));
+      printf("warm faults: minor=%"PRIu64", major=%"PRIu64"\n",
+          delta.minor_faults, delta.major_faults);
+      CPRT_ASSERT(delta.minor_faults == 0 && delta.major_faults == 0);
+      free(buf);
+
+      CPRT_THREAD_CREATE(my_thread_id, thread_test_12, NULL);
+      CPRT_THREAD_JOIN(my_thread_id);
+
+      /* Last, since locked memory is populated up front and would hide
+       * whether the checks above work. New memory should not fault. */
+      if (cprt_lock_all() != 0) {
+        printf("cprt_lock_all failed (errno=%d), continuing\n", errno);
+      } else {
+        CPRT_ENULL(buf = malloc(buf_sz));
+        CPRT_EM1(cprt_fault_counts(&start));
+        for (i = 0; i < buf_sz; i += 1024) {
+          CPRT_VOL32(buf[i]) = 2;
+        }
+        CPRT_EM1(cprt_fault_delta(&start, &delta));
+        printf("locked faults: minor=%"PRIu64", major=%"PRIu64"\n",
+            delta.minor_faults, delta.major_faults);
+        CPRT_ASSERT(delta.minor_faults == 0 && delta.major_faults == 0);
+        free(buf);
+      }
+
+      break;
+    }
+
+    case 13:
+    {
+      cprt_cpuset_t *cpuset;
+      char list_str[256];
+      int cpu, first_cpu;
+      fprintf(stderr, "test %d: cprt_cpuset_t\n", o_testnum);
+      fflush(stderr);
+
+      cpuset = cprt_cpuset_create();
+      CPRT_ASSERT(cprt_cpuset_max_cpus(cpuset) >= 64);
+      CPRT_ASSERT(cprt_cpuset_count(cpuset) == 0);
+      CPRT_ASSERT(cprt_cpuset_next(cpuset, 0) == -1);
+      CPRT_EM1(cprt_cpuset_set(cpuset, 63));
+      CPRT_ASSERT(cprt_cpuset_test(cpuset, 63) && ! cprt_cpuset_test(cpuset, 62));
+      CPRT_ASSERT(cprt_cpuset_set(cpuset, cprt_cpuset_max_cpus(cpuset)) == -1 && errno == EINVAL);
+      CPRT_ASSERT(cprt_cpuset_set(cpuset, -1) == -1 && errno == EINVAL);
+      CPRT_EM1(cprt_cpuset_clear(cpuset, 63));
+      CPRT_ASSERT(cprt_cpuset_count(cpuset) == 0);
+
+      CPRT_EM1(cprt_cpuset_parse(cpuset, "0-3, 5,8-14:3"));
+      CPRT_ASSERT(cprt_cpuset_count(cpuset) == 8);
+      CPRT_ASSERT(strcmp(cprt_cpuset_format(cpuset, list_str, sizeof(list_str)),
+          "0-3,5,8,11,14") == 0);
+      /* Truncation keeps whole entries; a zero-size buffer is untouched. */
+      CPRT_ASSERT(strcmp(cprt_cpuset_format(cpuset, list_str, 8), "0-3,5,8") == 0);
+      CPRT_ASSERT(strcmp(cprt_cpuset_format(cpuset, list_str, 7), "0-3,5") == 0);
+      CPRT_ASSERT(strcmp(cprt_cpuset_format(cpuset, list_str, 4), "0-3") == 0);
+      CPRT_ASSERT(strcmp(cprt_cpuset_format(cpuset, list_str, 3), "") == 0);
+      list_str[0] = 'x';
+      cprt_cpuset_format(cpuset, list_str, 0);
+      CPRT_ASSERT(list_str[0] == 'x');
+      CPRT_ASSERT(cprt_cpuset_parse(cpuset, "0-") == -1 && errno == EINVAL);
+      CPRT_ASSERT(cprt_cpuset_parse(cpuset, "3-1") == -1 && errno == EINVAL);
+      CPRT_ASSERT(cprt_cpuset_parse(cpuset, "1;2") == -1 && errno == EINVAL);
+      CPRT_ASSERT(cprt_cpuset_parse(cpuset, "99999") == -1 && errno == EINVAL);
+
+      /* Pin to the first CPU we are allowed on, and confirm it. */
+      CPRT_EM1(cprt_get_affinity_cpuset(cpuset));
+      printf("affinity: %s\n", cprt_cpuset_format(cpuset, list_str, sizeof(list_str)));
+      CPRT_ASSERT(cprt_cpuset_count(cpuset) > 0);
+      first_cpu = cprt_cpuset_next(cpuset, 0);
+      for (cpu = cprt_cpuset_next(cpuset, first_cpu + 1); cpu >= 0;
+          cpu = cprt_cpuset_next(cpuset, cpu + 1)) {
+        CPRT_EM1(cprt_cpuset_clear(cpuset, cpu));
+      }
+      CPRT_ASSERT(cprt_cpuset_count(cpuset) == 1);
+#if ! defined(__APPLE__)
+      cprt_set_affinity_cpuset(cpuset);
+      cprt_cpuset_zero(cpuset);
+      CPRT_EM1(cprt_get_affinity_cpuset(cpuset));
+      CPRT_ASSERT(cprt_cpuset_count(cpuset) == 1 && cprt_cpuset_test(cpuset, first_cpu));
+#endif
+
+      cprt_cpuset_delete(cpuset);
+      break;
+    }
+
+    case 14:
+    {
+      struct cprt_topology *topo;
+      struct cprt_topology fake_topo;
+      struct cprt_topo_cpu fake_cpus[8];
+      cprt_cpuset_t *cpuset;
+      char list_str[256];
+      int cpu;
+      fprintf(stderr, "test %d: cprt_topology_load\n", o_testnum);
+      fflush(stderr);
+
+      cpuset = cprt_cpuset_create();
+      CPRT_ENULL(topo = cprt_topology_load());
+      cprt_topology_print(topo, stdout);
+      CPRT_ASSERT(topo->num_online > 0 && topo->num_cores > 0 && topo->num_packages > 0);
+      for (cpu = 0; cpu < topo->max_cpus; cpu++) {
+        if (topo->cpus[cpu].online) {
+          CPRT_EM1(cprt_topology_siblings(topo, cpu, cpuset));
+          CPRT_ASSERT(cprt_cpuset_test(cpuset, cpu));
+          CPRT_ASSERT(cprt_cpuset_next(cpuset, 0) == topo->cpus[cpu].core);
+        }
+      }
+      CPRT_EM1(cprt_topology_pick_cores(topo, 1, CPRT_TOPO_ONE_PACKAGE, NULL, cpuset));
+      CPRT_ASSERT(cprt_cpuset_count(cpuset) == 1);
+      CPRT_ASSERT(cprt_topology_pick_cores(topo, topo->num_cores + 1,
+          CPRT_TOPO_ANY_PACKAGE, NULL, cpuset) == -1);
+      cprt_topology_delete(topo);
+
+      /* 2 packages x 2 cores x 2 threads, numbered like Linux on x86:
+       * CPU n and n+4 are siblings. */
+      memset(fake_cpus, 0, sizeof(fake_cpus));
+      for (cpu = 0; cpu < 8; cpu++) {
+        fake_cpus[cpu].online = 1;
+        fake_cpus[cpu].package = (cpu % 4) / 2;
+        fake_cpus[cpu].core = cpu % 4;
+        fake_cpus[cpu].smt_rank = cpu / 4;
+        fake_cpus[cpu].numa_node = fake_cpus[cpu].package;
+      }
+      fake_topo.max_cpus = 8;
+      fake_topo.cpus = fake_cpus;
+      CPRT_EM1(cprt_topology_siblings(&fake_topo, 5, cpuset));
+      CPRT_ASSERT(strcmp(cprt_cpuset_format(cpuset, list_str, sizeof(list_str)), "1,5") == 0);
+      CPRT_EM1(cprt_topology_node_cpus(&fake_topo, 1, cpuset));
+      CPRT_ASSERT(strcmp(cprt_cpuset_format(cpuset, list_str, sizeof(list_str)), "2-3,6-7") == 0);
+      CPRT_EM1(cprt_topology_pick_cores(&fake_topo, 2, CPRT_TOPO_ONE_PACKAGE, NULL, cpuset));
+      CPRT_ASSERT(strcmp(cprt_cpuset_format(cpuset, list_str, sizeof(list_str)), "0-1") == 0);
+      CPRT_EM1(cprt_topology_pick_cores(&fake_topo, 2, 1, NULL, cpuset));
+      CPRT_ASSERT(strcmp(cprt_cpuset_format(cpuset, list_str, sizeof(list_str)), "2-3") == 0);
+      CPRT_ASSERT(cprt_topology_pick_cores(&fake_topo, 3, CPRT_TOPO_ONE_PACKAGE, NULL, cpuset) == -1);
+      CPRT_EM1(cprt_topology_pick_cores(&fake_topo, 3, CPRT_TOPO_ANY_PACKAGE, NULL, cpuset));
+      CPRT_ASSERT(strcmp(cprt_cpuset_format(cpuset, list_str, sizeof(list_str)), "0-2") == 0);
+      /* If CPU 0 isn't allowed, its sibling 4 stands in for the core. */
+      {
+        cprt_cpuset_t *allowed = cprt_cpuset_create();
+        CPRT_EM1(cprt_cpuset_parse(allowed, "1-7"));
+        CPRT_EM1(cprt_topology_pick_cores(&fake_topo, 2, 0, allowed, cpuset));
+        CPRT_ASSERT(strcmp(cprt_cpuset_format(cpuset, list_str, sizeof(list_str)), "1,4") == 0);
+        cprt_cpuset_delete(allowed);
+      }
+
+      cprt_cpuset_delete(cpuset);
+      break;
+    }
+
+    case 15:
+    {
+      cprt_cpuset_t *cpuset;
+      struct cprt_pool_wg wg;
+      struct cprt_pool_stats stats;
+      struct cprt_thread_stats start_stats, wait_stats;
+      uint64_t total_run = 0, total_steals = 0, base_steals, total_parks = 0;
+      int i, fanouts = 0;
+      fprintf(stderr, "test %d: cprt_pool_create\n", o_testnum);
+      fflush(stderr);
+
+      cpuset = cprt_cpuset_create();
+      CPRT_EM1(cprt_get_affinity_cpuset(cpuset));
+      test_pool = cprt_pool_create(4, cpuset, 50000);
+      CPRT_ASSERT(cprt_pool_num_workers(test_pool) == 4);
+      CPRT_ASSERT(cprt_pool_worker_index(test_pool) == -1);
+
+      /* External submits (injection queue). */
+      test_pool_count = 0;
+      test_pool_ext_count = 0;
+      cprt_pool_wg_init(&wg);
+      for (i = 0; i < 10000; i++) {
+        cprt_pool_submit(test_pool, &wg, pool_leaf_15, NULL);
+      }
+      cprt_pool_wait(test_pool, &wg);
+      CPRT_ASSERT(wg.pending == 0 && test_pool_count == 10000);
+
+      /* Nested submits and waits from workers (deques and stealing). */
+      test_pool_count = 0;
+      for (i = 0; i < 50; i++) {
+        cprt_pool_submit(test_pool, &wg, pool_parent_15, NULL);
+      }
+      cprt_pool_wait(test_pool, &wg);
+      CPRT_ASSERT(test_pool_count == 50 * 101);
+
+      /* A non-worker waiting on a long task parks instead of spinning. */
+      test_pool_count = 0;
+      test_pool_sleeping = 0;
+      cprt_pool_submit(test_pool, &wg, pool_sleep_15, NULL);
+      while (! test_pool_sleeping) {  /* A worker has it; nothing left to help with. */
+        CPRT_SLEEP_MS(1);
+      }
+      CPRT_EM1(cprt_thread_stats(&start_stats));
+      cprt_pool_wait(test_pool, &wg);
+      CPRT_EM1(cprt_thread_stats_delta(&start_stats, &wait_stats));
+      CPRT_ASSERT(test_pool_count == 1);
+#if defined(__linux__) || defined(_WIN32)
+      CPRT_ASSERT(wait_stats.user_ns + wait_stats.sys_ns < 50000000);
+#endif
+
+      /* Let workers park, then wake them. */
+      CPRT_SLEEP_MS(10);
+      test_pool_count = 0;
+      cprt_pool_submit(test_pool, &wg, pool_leaf_15, NULL);
+      cprt_pool_wait(test_pool, &wg);
+      CPRT_ASSERT(test_pool_count == 1);
+
+      /* Fan-out from one worker. The main thread waits without running
+       * tasks, so the parent must go to a worker. Stealing needs the other
+       * workers to get a CPU while the children are queued, so on a
+       * loaded (or single CPU) host it can take more than one try. */
+      base_steals = 0;  /* Earlier phases may have stolen too; count only these. */
+      for (i = 0; i < cprt_pool_num_workers(test_pool); i++) {
+        cprt_pool_get_stats(test_pool, i, &stats);
+        base_steals += stats.steals;
+      }
+      do {
+        test_pool_count = 0;
+        cprt_pool_submit(test_pool, &wg, pool_fanout_15, NULL);
+        while (wg.pending > 0) {
+          CPRT_SLEEP_MS(1);
+        }
+        CPRT_MEMORY_FENCE();
+        CPRT_ASSERT(test_pool_count == 1001);
+        fanouts++;
+        total_steals = 0;
+        for (i = 0; i < cprt_pool_num_workers(test_pool); i++) {
+          cprt_pool_get_stats(test_pool, i, &stats);
+          total_steals += stats.steals;
+        }
+      } while (total_steals == base_steals && fanouts < 10);
+
+      for (i = 0; i < cprt_pool_num_workers(test_pool); i++) {
+        cprt_pool_get_stats(test_pool, i, &stats);
+        printf("worker %d: tasks_run=%"PRIu64", steals=%"PRIu64", parks=%"PRIu64", idle_ns=%"PRIu64"\n",
+            i, stats.tasks_run, stats.steals, stats.parks, stats.idle_ns);
+        total_run += stats.tasks_run;
+        total_parks += stats.parks;
+      }
+      /* Every task ran exactly once, on a worker or on the main thread
+       * while it waited. */
+      CPRT_ASSERT(total_run + test_pool_ext_count == 10000 + 50 * 101 + 1 + 1 + fanouts * 1001);
+      CPRT_ASSERT(total_parks > 0);
+      if (cprt_pool_num_workers(test_pool) > 1) {
+        CPRT_ASSERT(total_steals > base_steals);
+      }
+
+      cprt_pool_delete(test_pool);
+      cprt_cpuset_delete(cpuset);
+      break;
+    }
+
+    case 16:
+    {
+      uint64_t *array;
+      uint64_t sum;
+      uint64_t n = 100000;
+      uint64_t expect = 3 * (n * (n - 1) / 2);
+      int i;
+      fprintf(stderr, "test %d: cprt_parallel_for\n", o_testnum);
+      fflush(stderr);
+
+      CPRT_ENULL(array = (uint64_t *)calloc(n, sizeof(uint64_t)));
+      cprt_parallel_init(4);
+      CPRT_ASSERT(cprt_pool_num_workers(cprt_parallel_pool()) == 4);
+      cprt_parallel_init(0);  /* Already started; no-op. */
+      CPRT_ASSERT(cprt_pool_num_workers(cprt_parallel_pool()) == 4);
+
+      for (i = 0; i < 10; i++) {
+        memset(array, 0, n * sizeof(uint64_t));
+        cprt_parallel_for(0, n, (i & 1) ? 1000 : 0, fill_16, array);  /* Dynamic and static. */
+        CPRT_ASSERT(array[0] == 0 && array[n - 1] == (n - 1) * 3);
+
+        sum = 0;
+        cprt_parallel_reduce(0, n, (i & 1) ? 0 : 777, &sum, sizeof(sum), sum_16, add_16, array);
+        CPRT_ASSERT(sum == expect);
+      }
+
+      /* Sub-ranges and ranges too small to split. */
+      sum = 0;
+      cprt_parallel_reduce(10, 13, 0, &sum, sizeof(sum), sum_16, add_16, array);
+      CPRT_ASSERT(sum == 3 * (10 + 11 + 12));
+      sum = 0;
+      cprt_parallel_reduce(10, 13, 100, &sum, sizeof(sum), sum_16, add_16, array);
+      CPRT_ASSERT(sum == 3 * (10 + 11 + 12));
+      sum = 0;
+      cprt_parallel_reduce(5, 5, 0, &sum, sizeof(sum), sum_16, add_16, array);
+      CPRT_ASSERT(sum == 0);
+
+      free(array);
+      break;
+    }
+
+    case 17:
+    {
+      cprt_cpuset_t *cpuset = cprt_cpuset_create();
+      struct cprt_thread_attr attr;
+      CPRT_THREAD_T thread_id;
+      int cpu;
+      fprintf(stderr, "test %d: CPRT_THREAD_CREATE_EX\n", o_testnum);
+      fflush(stderr);
+
+      /* Pin to the last allowed CPU. */
+      CPRT_EM1(cprt_get_affinity_cpuset(cpuset));
+      cpu = cprt_cpuset_next(cpuset, 0);
+      while (cprt_cpuset_next(cpuset, cpu + 1) >= 0) {
+        cpu = cprt_cpuset_next(cpuset, cpu + 1);
+      }
+      cprt_cpuset_zero(cpuset);
+      cprt_cpuset_set(cpuset, cpu);
+      cprt_cpuset_format(cpuset, test_thread_cpus, sizeof(test_thread_cpus));
+
+      cprt_thread_attr_init(&attr);
+      attr.stack_size = 1024*1024;
+      attr.name = "cprt_test_17_long_name";
+      attr.cpuset = cpuset;
+      CPRT_THREAD_CREATE_EX(thread_id, thread_test_17, NULL, &attr);
+      CPRT_THREAD_JOIN(thread_id);
+
+      /* Real-time priority needs privilege. */
+      attr.priority = 1;
+      if (cprt_thread_create_ex(&thread_id, thread_test_17, &attr, &attr) == 0) {
+        CPRT_THREAD_JOIN(thread_id);
+      } else {
+        CPRT_ASSERT(errno == EPERM);
+        printf("thread: SCHED_FIFO not permitted\n");
+      }
+
+      /* Defaults. */
+      CPRT_EM1(cprt_thread_create_ex(&thread_id, thread_test_12, NULL, NULL));
+      CPRT_THREAD_JOIN(thread_id);
+
+      cprt_cpuset_delete(cpuset);
+      break;
+    }
+
+    case 18:
+    {
+      struct cprt_thread_stats stats;
+      CPRT_THREAD_T thread_id;
+      fprintf(stderr, "test %d: cprt_thread_stats\n", o_testnum);
+      fflush(stderr);
+
+      CPRT_EM1(cprt_thread_stats(&stats));
+      CPRT_ASSERT(cprt_thread_os_tid() != 0);
+
+      test_stats_state = 0;
+      CPRT_THREAD_CREATE(thread_id, thread_test_18, NULL);
+      while (test_stats_state != 1) {
+        CPRT_SLEEP_MS(1);
+      }
+#if defined(__linux__) || defined(_WIN32)
+      CPRT_EM1(cprt_thread_stats_tid(test_stats_tid, &stats));
+      printf("tid: user_ns=%"PRIu64", sys_ns=%"PRIu64", vol=%"PRIu64", invol=%"PRIu64", minflt=%"PRIu64", majflt=%"PRIu64"\n",
+          stats.user_ns, stats.sys_ns, stats.vol_ctx_switches, stats.invol_ctx_switches,
+          stats.faults.minor_faults, stats.faults.major_faults);
+      CPRT_ASSERT(stats.user_ns + stats.sys_ns >= 50000000);
+#endif
+#if defined(__linux__)
+      CPRT_ASSERT(stats.vol_ctx_switches >= 5);
+#endif
+      test_stats_state = 2;
+      CPRT_THREAD_JOIN(thread_id);
+
+      /* Thread is gone. */
+      CPRT_ASSERT(cprt_thread_stats_tid(test_stats_tid, &stats) == -1);
+      break;
+    }
+
+    case 19:
+    {
+      static const char *names[] = {"spin", "pause", "yield", "backoff", "park"};
+      CPRT_THREAD_T thread_id;
+      struct cprt_wait wait;
+      struct cprt_timespec start_ts, end_ts;
+      uint64_t diff_ns;
+      int s, i;
+      fprintf(stderr, "test %d: cprt_wait_idle\n", o_testnum);
+      fflush(stderr);
+
+      CPRT_ASSERT(cprt_wait_parse(&wait, "bogus") == -1 && errno == EINVAL);
+
+      for (s = 0; s < 5; s++) {
+        CPRT_EM1(cprt_wait_parse(&wait, names[s]));
+        CPRT_ASSERT(wait.strategy == s);
+
+        CPRT_SEM_INIT(my_test_wake_sem, 0);
+        CPRT_THREAD_CREATE(thread_id, thread_test_19, NULL);
+        for (i = 0; i < 5; i++) {
+          CPRT_SEM_WAIT_STRATEGY(my_test_wake_sem, &wait);
+        }
+        CPRT_THREAD_JOIN(thread_id);
+        CPRT_SEM_DELETE(my_test_wake_sem);
+
+        CPRT_GETTIME(&start_ts);
+        cprt_sleep_ns_strategy(2000000, &wait);
+        CPRT_GETTIME(&end_ts);
+        CPRT_DIFF_TS(diff_ns, end_ts, start_ts);
+        printf("wait %s: sleep 2 ms took %"PRIu64" ns, idles=%u\n",
+            names[s], diff_ns, (unsigned)wait.count);
+        CPRT_ASSERT(diff_ns >= 2000000);
+      }
+      break;
+    }
+
+    case 20:
+    {
+      CPRT_SOCKET rx_sock, tx_sock;
+      struct sockaddr_in rx_addr, tx_addr;
+      socklen_t addr_len;
+      struct cprt_udp_pkt pkts[100];
+      char bufs[100][64];
+      int num_rcvd, i, rc;
+      fprintf(stderr, "test %d: cprt_udp_recv_batch\n", o_testnum);
+      fflush(stderr);
+
+      /* Two loopback sockets on ephemeral ports. */
+      rx_sock = socket(AF_INET, SOCK_DGRAM, 0);
+      CPRT_ASSERT(rx_sock != (CPRT_SOCKET)-1);
+      tx_sock = socket(AF_INET, SOCK_DGRAM, 0);
+      CPRT_ASSERT(tx_sock != (CPRT_SOCKET)-1);
+      memset(&rx_addr, 0, sizeof(rx_addr));
+      rx_addr.sin_family = AF_INET;
+      rx_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      tx_addr = rx_addr;
+      CPRT_EOK0(bind(rx_sock, (struct sockaddr *)&rx_addr, sizeof(rx_addr)));
+      CPRT_EOK0(bind(tx_sock, (struct sockaddr *)&tx_addr, sizeof(tx_addr)));
+      addr_len = sizeof(rx_addr);
+      CPRT_EOK0(getsockname(rx_sock, (struct sockaddr *)&rx_addr, &addr_len));
+      addr_len = sizeof(tx_addr);
+      CPRT_EOK0(getsockname(tx_sock, (struct sockaddr *)&tx_addr, &addr_len));
+
+      /* Varying lengths; the last one is too big for the receiver. */
+      for (i = 0; i < 100; i++) {
+        memset(bufs[i], i, sizeof(bufs[i]));
+        pkts[i].buf = bufs[i];
+        pkts[i].len = (i == 99) ? sizeof(bufs[i]) : (size_t)(1 + (i % 40));
+        memcpy(&pkts[i].addr, &rx_addr, sizeof(rx_addr));
+        pkts[i].addr_len = sizeof(rx_addr);
+      }
+      rc = cprt_udp_send_batch(tx_sock, pkts, 100);
+      CPRT_ASSERT(rc == 100);
+
+      memset(bufs, 0xff, sizeof(bufs));
+      for (i = 0; i < 100; i++) {
+        pkts[i].buf = bufs[i];
+        pkts[i].buf_size = (i == 99) ? 50 : sizeof(bufs[i]);
+      }
+      num_rcvd = 0;
+      while (num_rcvd < 100) {
+        /* Blocks for the first, then takes what is queued. */
+        rc = cprt_udp_recv_batch(rx_sock, &pkts[num_rcvd], 100 - num_rcvd);
+        CPRT_ASSERT(rc > 0);
+        num_rcvd += rc;
+      }
+      for (i = 0; i < 100; i++) {
+        CPRT_ASSERT(pkts[i].addr_len == sizeof(tx_addr));
+        CPRT_ASSERT(((struct sockaddr_in *)&pkts[i].addr)->sin_port == tx_addr.sin_port);
+        CPRT_ASSERT((unsigned char)bufs[i][0] == i);
+        if (i == 99) {
+          CPRT_ASSERT(pkts[i].truncated && pkts[i].len == 50);
+        } else {
+          CPRT_ASSERT(! pkts[i].truncated && pkts[i].len == (size_t)(1 + (i % 40)));
+          CPRT_ASSERT((unsigned char)bufs[i][pkts[i].len - 1] == i);
+          CPRT_ASSERT((unsigned char)bufs[i][pkts[i].len] == 0xff);
+        }
+      }
+
+      CPRT_SOCKET_CLOSE(rx_sock);
+      CPRT_SOCKET_CLOSE(tx_sock);
+      break;
+    }
+
+    case 21:
+    {
+      cprt_evloop_t *loop;
+      struct cprt_evloop_stats stats;
+      CPRT_SOCKET rx_socks[3], tx_sock;
+      struct sockaddr_in rx_addrs[3], addr;
+      socklen_t addr_len;
+      struct cprt_udp_pkt pkts[30];
+      char buf[8];
+      int tick_id, i;
+      fprintf(stderr, "test %d: cprt_evloop\n", o_testnum);
+      fflush(stderr);
+
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      tx_sock = socket(AF_INET, SOCK_DGRAM, 0);
+      CPRT_ASSERT(tx_sock != (CPRT_SOCKET)-1);
+
+      CPRT_ENULL(loop = cprt_evloop_create(0));
+      for (i = 0; i < 3; i++) {
+        rx_socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        CPRT_ASSERT(rx_socks[i] != (CPRT_SOCKET)-1);
+        CPRT_EOK0(bind(rx_socks[i], (struct sockaddr *)&addr, sizeof(addr)));
+        addr_len = sizeof(rx_addrs[i]);
+        CPRT_EOK0(getsockname(rx_socks[i], (struct sockaddr *)&rx_addrs[i], &addr_len));
+        set_nonblock_21(rx_socks[i]);
+        CPRT_EM1(cprt_evloop_add(loop, rx_socks[i], CPRT_EV_READ, sock_cb_21, NULL));
+      }
+      CPRT_ASSERT(cprt_evloop_add(loop, rx_socks[0], CPRT_EV_READ, sock_cb_21, NULL) == -1 && errno == EEXIST);
+      test_ev_remove_sock = rx_socks[2];
+
+      /* 10 datagrams to each socket. */
+      memset(buf, 'x', sizeof(buf));
+      for (i = 0; i < 30; i++) {
+        pkts[i].buf = buf;
+        pkts[i].len = sizeof(buf);
+        memcpy(&pkts[i].addr, &rx_addrs[i % 3], sizeof(rx_addrs[i % 3]));
+        pkts[i].addr_len = sizeof(rx_addrs[i % 3]);
+      }
+      CPRT_ASSERT(cprt_udp_send_batch(tx_sock, pkts, 30) == 30);
+
+      test_ev_pkts = 0;
+      test_ev_ticks = 0;
+      tick_id = cprt_evloop_timer_add(loop, 5000000, 5000000, tick_cb_21, NULL);
+      cprt_evloop_timer_add(loop, 50000000, 0, stop_cb_21, NULL);
+      CPRT_EM1(cprt_evloop_run(loop));
+      cprt_evloop_get_stats(loop, &stats);
+      printf("evloop: pkts=%d, ticks=%d, wakeups=%"PRIu64", empty=%"PRIu64", events=%"PRIu64", max_per_wakeup=%"PRIu64", timers=%"PRIu64"\n",
+          test_ev_pkts, test_ev_ticks, stats.wakeups, stats.empty_wakeups, stats.events,
+          stats.max_events_per_wakeup, stats.timers_fired);
+      CPRT_ASSERT(test_ev_pkts == 30);
+      CPRT_ASSERT(test_ev_ticks >= 5 && test_ev_ticks <= 10);
+      CPRT_ASSERT(stats.events >= 3 && stats.timers_fired == (uint64_t)test_ev_ticks + 1);
+
+      /* rx_socks[2] removed itself; cancel the ticker. */
+      CPRT_ASSERT(cprt_evloop_remove(loop, rx_socks[2]) == -1 && errno == ENOENT);
+      CPRT_EM1(cprt_evloop_timer_cancel(loop, tick_id));
+      CPRT_ASSERT(cprt_evloop_timer_cancel(loop, tick_id) == -1);
+      CPRT_ASSERT(cprt_evloop_run_once(loop, 1000000) == 0);
+      cprt_evloop_delete(loop);
+
+      /* Busy poll: never sleeps. */
+      CPRT_ENULL(loop = cprt_evloop_create(1));
+      CPRT_EM1(cprt_evloop_add(loop, rx_socks[0], CPRT_EV_READ, sock_cb_21, NULL));
+      CPRT_ASSERT(cprt_evloop_run_once(loop, CPRT_EVLOOP_FOREVER) == 0);
+      test_ev_pkts = 0;
+      CPRT_ASSERT(cprt_udp_send_batch(tx_sock, pkts, 3) == 3);
+      while (test_ev_pkts < 1) {
+        CPRT_EM1(cprt_evloop_run_once(loop, CPRT_EVLOOP_FOREVER));
+      }
+      CPRT_ASSERT(test_ev_pkts == 1);  /* Only 1 of the 3 went to rx_socks[0]. */
+      cprt_evloop_delete(loop);
+
+      for (i = 0; i < 3; i++) {
+        CPRT_SOCKET_CLOSE(rx_socks[i]);
+      }
+      CPRT_SOCKET_CLOSE(tx_sock);
+      break;
+    }
+
+    case 22:
+    {
+      CPRT_SOCKET listen_sock, tx_sock;
+      struct sockaddr_in addr;
+      socklen_t addr_len;
+      CPRT_THREAD_T thread_id;
+      struct cprt_zc zc;
+      size_t buf_size = 4*1024*1024;
+      size_t sent, total;
+      uint32_t seq = 0;
+      uint64_t offset;
+      char *tx_buf;
+      FILE *fp;
+      size_t i;
+      fprintf(stderr, "test %d: cprt_zc_send\n", o_testnum);
+      fflush(stderr);
+
+      /* Loopback TCP connection. */
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+      CPRT_ASSERT(listen_sock != (CPRT_SOCKET)-1);
+      CPRT_EOK0(bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)));
+      CPRT_EOK0(listen(listen_sock, 1));
+      addr_len = sizeof(addr);
+      CPRT_EOK0(getsockname(listen_sock, (struct sockaddr *)&addr, &addr_len));
+      tx_sock = socket(AF_INET, SOCK_STREAM, 0);
+      CPRT_ASSERT(tx_sock != (CPRT_SOCKET)-1);
+      CPRT_EOK0(connect(tx_sock, (struct sockaddr *)&addr, sizeof(addr)));
+      test_zc_sock = accept(listen_sock, NULL, NULL);
+      CPRT_ASSERT(test_zc_sock != (CPRT_SOCKET)-1);
+
+      CPRT_ENULL(tx_buf = (char *)malloc(buf_size));
+      CPRT_ENULL(test_zc_rx_buf = (char *)malloc(buf_size));
+      for (i = 0; i < buf_size; i++) {
+        tx_buf[i] = (char)(i * 7);
+      }
+
+      /* Zero-copy sends in 256K pieces. */
+      CPRT_EM1(cprt_zc_init(&zc, tx_sock, 0));
+      memset(test_zc_rx_buf, 0, buf_size);
+      test_zc_expect = buf_size;
+      CPRT_THREAD_CREATE(thread_id, thread_test_22, NULL);
+      for (total = 0; total < buf_size; total += sent) {
+        size_t len = buf_size - total;
+        if (len > 256*1024) {
+          len = 256*1024;
+        }
+        CPRT_EM1(cprt_zc_send(&zc, tx_buf + total, len, &sent, &seq));
+      }
+      CPRT_EM1(cprt_zc_wait(&zc, seq));
+      CPRT_ASSERT(cprt_zc_done(&zc, seq));
+      CPRT_THREAD_JOIN(thread_id);
+      CPRT_ASSERT(memcmp(tx_buf, test_zc_rx_buf, buf_size) == 0);
+      printf("zc: zerocopy=%d, zc_sends=%"PRIu64", copy_sends=%"PRIu64", kernel_copied=%"PRIu64"\n",
+          zc.zerocopy, zc.zc_sends, zc.copy_sends, zc.kernel_copied);
+
+      /* Small sends are copied and done at once. */
+      test_zc_expect = 100;
+      CPRT_THREAD_CREATE(thread_id, thread_test_22, NULL);
+      CPRT_EM1(cprt_zc_send(&zc, tx_buf, 100, &sent, &seq));
+      CPRT_ASSERT(sent == 100 && cprt_zc_done(&zc, seq));
+      CPRT_THREAD_JOIN(thread_id);
+
+      /* sendfile from a 1M temp file, starting at offset 1000. */
+      CPRT_ENULL(fp = tmpfile());
+      CPRT_ASSERT(fwrite(tx_buf, 1, 1024*1024, fp) == 1024*1024);
+      CPRT_EOK0(fflush(fp));
+      memset(test_zc_rx_buf, 0, buf_size);
+      test_zc_expect = 1024*1024 - 1000;
+      CPRT_THREAD_CREATE(thread_id, thread_test_22, NULL);
+      offset = 1000;
+      CPRT_EM1(cprt_sendfile(tx_sock, fileno(fp), &offset, 2*1024*1024, &sent));  /* Past EOF. */
+      CPRT_THREAD_JOIN(thread_id);
+      CPRT_ASSERT(sent == 1024*1024 - 1000 && offset == 1024*1024);
+      CPRT_ASSERT(memcmp(tx_buf + 1000, test_zc_rx_buf, sent) == 0);
+      fclose(fp);
+
+      free(tx_buf);
+      free(test_zc_rx_buf);
+      CPRT_SOCKET_CLOSE(tx_sock);
+      CPRT_SOCKET_CLOSE(test_zc_sock);
+      CPRT_SOCKET_CLOSE(listen_sock);
+      break;
+    }
+
+    case 23:
+    {
+      CPRT_SOCKET rx_sock, tx_sock;
+      struct sockaddr_in addr;
+      socklen_t addr_len;
+      struct cprt_udp_pkt pkt;
+      char buf[64];
+      uint64_t offset_ns, mono_ns, real_ns, send_ns, rx_mono_ns, now_ns;
+      fprintf(stderr, "test %d: cprt_rx_timestamp_enable\n", o_testnum);
+      fflush(stderr);
+
+      /* Clock conversions round-trip and agree with "now". */
+      offset_ns = cprt_clock_offset_ns();
+      mono_ns = cprt_mono_ns();
+      real_ns = cprt_realtime_ns();
+      CPRT_ASSERT(cprt_mono_to_realtime_ns(cprt_realtime_to_mono_ns(real_ns)) - real_ns + 1000000 < 2000000);
+      CPRT_ASSERT(cprt_realtime_to_mono_ns(real_ns) - mono_ns + 1000000 < 2000000);
+      CPRT_ASSERT(cprt_clock_offset_ns() - offset_ns + 1000000 < 2000000);
+
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      rx_sock = socket(AF_INET, SOCK_DGRAM, 0);
+      CPRT_ASSERT(rx_sock != (CPRT_SOCKET)-1);
+      tx_sock = socket(AF_INET, SOCK_DGRAM, 0);
+      CPRT_ASSERT(tx_sock != (CPRT_SOCKET)-1);
+      CPRT_EOK0(bind(rx_sock, (struct sockaddr *)&addr, sizeof(addr)));
+      addr_len = sizeof(addr);
+      CPRT_EOK0(getsockname(rx_sock, (struct sockaddr *)&addr, &addr_len));
+
+      pkt.buf = buf;
+      pkt.buf_size = sizeof(buf);
+      pkt.len = 10;
+      memcpy(&pkt.addr, &addr, sizeof(addr));
+      pkt.addr_len = sizeof(addr);
+      if (cprt_rx_timestamp_enable(rx_sock, CPRT_RX_TS_SOFTWARE) == -1) {
+        CPRT_ASSERT(errno == ENOSYS);
+        printf("rx_ts: not supported\n");
+      }
+      else {
+        /* Datagram waits in the kernel for 20 ms before we read it. The
+         * stamp must fall between the send and the receive (loopback
+         * delivery can be deferred to ksoftirqd on a busy single-CPU
+         * host, so it isn't always 20 ms old). */
+        send_ns = cprt_mono_ns();
+        CPRT_ASSERT(cprt_udp_send_batch(tx_sock, &pkt, 1) == 1);
+        CPRT_SLEEP_MS(20);
+        CPRT_ASSERT(cprt_udp_recv_batch(rx_sock, &pkt, 1) == 1);
+        now_ns = cprt_mono_ns();
+        CPRT_ASSERT(pkt.rx_ts_ns != 0);
+        rx_mono_ns = cprt_realtime_to_mono_ns(pkt.rx_ts_ns);
+        printf("rx_ts: kernel queue + app time = %"PRIu64" ns\n", now_ns - rx_mono_ns);
+        CPRT_ASSERT(rx_mono_ns + 1000000 >= send_ns && now_ns + 1000000 >= rx_mono_ns);
+      }
+
+      /* Without timestamps enabled, rx_ts_ns is 0. */
+      CPRT_SOCKET_CLOSE(rx_sock);
+      rx_sock = socket(AF_INET, SOCK_DGRAM, 0);
+      CPRT_ASSERT(rx_sock != (CPRT_SOCKET)-1);
+      addr.sin_port = 0;
+      CPRT_EOK0(bind(rx_sock, (struct sockaddr *)&addr, sizeof(addr)));
+      addr_len = sizeof(addr);
+      CPRT_EOK0(getsockname(rx_sock, (struct sockaddr *)&addr, &addr_len));
+      memcpy(&pkt.addr, &addr, sizeof(addr));
+      pkt.len = 10;
+      CPRT_ASSERT(cprt_udp_send_batch(tx_sock, &pkt, 1) == 1);
+      CPRT_ASSERT(cprt_udp_recv_batch(rx_sock, &pkt, 1) == 1);
+      CPRT_ASSERT(pkt.rx_ts_ns == 0);
+
+      CPRT_SOCKET_CLOSE(rx_sock);
+      CPRT_SOCKET_CLOSE(tx_sock);
+      break;
+    }
+
+    case 24:
+    {
+      cprt_aio_t *aio;
+      cprt_aio_sink_t *sink;
+      struct cprt_aio_completion comps[8];
+      struct cprt_aio_sink_stats sink_stats;
+      struct cprt_alloc_info info;
+      char *bufs[4];
+      size_t sizes[4];
+      char *dbuf;
+      char line[128];
+      FILE *fp;
+      int pass, registered, fd, i, n, got, done_mask, line_num;
+      fprintf(stderr, "test %d: cprt_aio\n", o_testnum);
+      fflush(stderr);
+
+      for (i = 0; i < 4; i++) {
+        CPRT_ENULL(bufs[i] = (char *)malloc(4096));
+        sizes[i] = 4096;
+      }
+      /* Pass 0: io_uring if available; pass 1: thread backend. */
+      for (pass = 0; pass < 2; pass++) {
+        aio = cprt_aio_create(8, (pass == 0) ? 0 : CPRT_AIO_NO_URING);
+        printf("aio: backend=%s\n",
+            (cprt_aio_backend(aio) == CPRT_AIO_BACKEND_URING) ? "io_uring" : "threads");
+        if (pass == 1) {
+          CPRT_ASSERT(cprt_aio_backend(aio) == CPRT_AIO_BACKEND_THREADS);
+        }
+        registered = (cprt_aio_register_buffers(aio, (void **)bufs, sizes, 4) == 0);
+        CPRT_ASSERT(cprt_aio_register_buffers(aio, (void **)bufs, sizes, 4) == -1);
+
+        /* Blocks 0-3 from registered buffers, 4-7 the same data unregistered. */
+        for (i = 0; i < 4; i++) {
+          memset(bufs[i], 'a' + i, 4096);
+        }
+        CPRT_EM1(fd = cprt_aio_open("tst.aio", 1, 0));
+        for (i = 0; i < 8; i++) {
+          CPRT_EOK0(cprt_aio_write(aio, fd, bufs[i % 4], 4096, (uint64_t)i * 4096,
+              (i < 4 && registered) ? i : CPRT_AIO_NO_BUF, (void *)(uintptr_t)(i + 1)));
+        }
+        CPRT_ASSERT(cprt_aio_write(aio, fd, bufs[0], 4096, 0, CPRT_AIO_NO_BUF, NULL) == -1);
+        CPRT_ASSERT(errno == EAGAIN);
+        CPRT_ASSERT(cprt_aio_inflight(aio) == 8);
+        CPRT_EOK0(cprt_aio_submit(aio));
+        done_mask = 0;
+        for (n = 0; n < 8; n += got) {
+          CPRT_EM1(got = cprt_aio_wait(aio, comps, 8, 1));
+          CPRT_ASSERT(got >= 1);
+          for (i = 0; i < got; i++) {
+            CPRT_ASSERT(comps[i].op == CPRT_AIO_OP_WRITE);
+            CPRT_ASSERT(comps[i].err == 0 && comps[i].len == 4096);
+            done_mask |= 1 << ((int)(uintptr_t)comps[i].user_data - 1);
+          }
+        }
+        CPRT_ASSERT(done_mask == 0xff);
+        CPRT_ASSERT(cprt_aio_inflight(aio) == 0);
+        CPRT_ASSERT(cprt_aio_poll(aio, comps, 8) == 0);
+        close(fd);
+
+        /* Read blocks 4-7 back, plus one read past end of file. */
+        for (i = 0; i < 4; i++) {
+          memset(bufs[i], 0, 4096);
+        }
+        CPRT_EM1(fd = cprt_aio_open("tst.aio", 0, 0));
+        for (i = 0; i < 4; i++) {
+          CPRT_EOK0(cprt_aio_read(aio, fd, bufs[i], 4096, (uint64_t)(4 + i) * 4096,
+              registered ? i : CPRT_AIO_NO_BUF, (void *)(uintptr_t)i));
+        }
+        CPRT_EOK0(cprt_aio_read(aio, fd, line, sizeof(line), 8 * 4096, CPRT_AIO_NO_BUF, line));
+        CPRT_ASSERT(cprt_aio_wait(aio, comps, 8, 8) == 5);  /* min is limited to in-flight. */
+        for (i = 0; i < 5; i++) {
+          CPRT_ASSERT(comps[i].op == CPRT_AIO_OP_READ && comps[i].err == 0);
+          if (comps[i].user_data == line) {
+            CPRT_ASSERT(comps[i].len == 0);
+          }
+          else {
+            CPRT_ASSERT(comps[i].len == 4096);
+          }
+        }
+        for (i = 0; i < 4; i++) {
+          CPRT_ASSERT(bufs[i][0] == 'a' + i && bufs[i][4095] == 'a' + i);
+        }
+        close(fd);
+        cprt_aio_delete(aio);
+      }
+      for (i = 0; i < 4; i++) {
+        free(bufs[i]);
+      }
+
+      /* O_DIRECT read (not every file system supports it). */
+      fd = cprt_aio_open("tst.aio", 0, 1);
+      if (fd == -1) {
+        CPRT_ASSERT(errno == EINVAL || errno == ENOSYS);
+        printf("aio: direct not supported\n");
+      }
+      else {
+        aio = cprt_aio_create(2, 0);
+        CPRT_ENULL(dbuf = (char *)cprt_alloc_large(4096, 0, CPRT_NUMA_NODE_ANY, &info));
+        CPRT_EOK0(cprt_aio_read(aio, fd, dbuf, 4096, 2 * 4096, CPRT_AIO_NO_BUF, NULL));
+        CPRT_ASSERT(cprt_aio_wait(aio, comps, 1, 1) == 1);
+        CPRT_ASSERT(comps[0].err == 0 && comps[0].len == 4096);
+        CPRT_ASSERT(dbuf[0] == 'c' && dbuf[4095] == 'c');
+        CPRT_EOK0(cprt_free_large(dbuf, &info));
+        cprt_aio_delete(aio);
+        close(fd);
+      }
+
+      /* Small sink buffers so that the writer wraps around them. */
+      CPRT_EM1(fd = cprt_aio_open("tst.aio", 1, 0));
+      sink = cprt_aio_sink_create(fd, 256, 2, 0);
+      for (i = 0; i < 1000; i++) {
+        cprt_ts_sink_printf(sink, "line %d\n", i);
+      }
+      cprt_aio_sink_get_stats(sink, &sink_stats);
+      CPRT_EOK0(cprt_aio_sink_close(sink));
+      close(fd);
+      printf("aio: sink writes=%"PRIu64", stalls=%"PRIu64"\n", sink_stats.writes, sink_stats.stalls);
+      CPRT_ASSERT(sink_stats.writes > 2);
+
+      CPRT_ENULL(fp = fopen("tst.aio", "r"));
+      for (i = 0; fgets(line, sizeof(line), fp) != NULL; i++) {
+        CPRT_ENULL(strstr(line, ": line "));
+        CPRT_ASSERT(sscanf(strstr(line, ": line "), ": line %d", &line_num) == 1);
+        CPRT_ASSERT(line_num == i);
+      }
+      CPRT_ASSERT(i == 1000);
+      fclose(fp);
+      remove("tst.aio");
+      break;
+    }
+
+    case 25:
+    {
+      static const struct { const char *str; int err; uint64_t u; int64_t i; } cases[] = {
+        { "0", 0, 0, 0 },
+        { "7", 0, 7, 7 },
+        { "+42", 0, 42, 42 },
+        { "00000000000000000000000123", 0, 123, 123 },
+        { "12345678", 0, 12345678, 12345678 },
+        { "1234567890123456", 0, 1234567890123456ull, 1234567890123456ll },
+        { "9223372036854775807", 0, 9223372036854775807ull, 9223372036854775807ll },
+        { "9223372036854775808", ERANGE, 9223372036854775808ull, 0 },
+        { "18446744073709551615", ERANGE, 18446744073709551615ull, 0 },
+        { "18446744073709551616", ERANGE, 0, 0 },
+        { "99999999999999999999", ERANGE, 0, 0 },
+        { "0x0", 0, 0, 0 },
+        { "0xfF", 0, 255, 255 },
+        { "0xffffffffffffffff", ERANGE, 0xffffffffffffffffull, 0 },
+        { "0x10000000000000000", ERANGE, 0, 0 },
+        { "", EINVAL, 0, 0 },
+        { "+", EINVAL, 0, 0 },
+        { "0x", EINVAL, 0, 0 },
+        { "0xg", EINVAL, 0, 0 },
+        { "12a", EINVAL, 0, 0 },
+        { "1234567a9", EINVAL, 0, 0 },
+        { " 1", EINVAL, 0, 0 },
+        { "1 ", EINVAL, 0, 0 },
+        { "1/2", EINVAL, 0, 0 },
+      };
+      static const struct { const char *str; int64_t i; } neg_cases[] = {
+        { "-1", -1 },
+        { "-0", 0 },
+        { "-0x10", -16 },
+        { "-9223372036854775808", -9223372036854775807ll - 1 },
+      };
+      char str[64];
+      const char *fields;
+      uint64_t u64, u_vals[8], r;
+      int64_t i64, i_vals[8];
+      uint32_t u32;
+      int32_t i32;
+      uint8_t u8;
+      int8_t s8;
+      int i, j, len, err, u_err, i_err;
+      size_t consumed;
+      char *end_ptr;
+      fprintf(stderr, "test %d: cprt_parse\n", o_testnum);
+      fflush(stderr);
+
+      for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++) {
+        u_err = (cprt_parse_u64(cases[i].str, &u64) == -1) ? errno : 0;
+        i_err = (cprt_parse_i64(cases[i].str, &i64) == -1) ? errno : 0;
+        if (cases[i].err == ERANGE && cases[i].u != 0) {
+          CPRT_ASSERT(u_err == 0 && u64 == cases[i].u);  /* Fits unsigned only. */
+        }
+        else {
+          CPRT_ASSERT(u_err == cases[i].err);
+          CPRT_ASSERT(u_err != 0 || u64 == cases[i].u);
+        }
+        CPRT_ASSERT(i_err == cases[i].err);
+        CPRT_ASSERT(i_err != 0 || i64 == cases[i].i);
+      }
+      for (i = 0; i < (int)(sizeof(neg_cases) / sizeof(neg_cases[0])); i++) {
+        CPRT_EOK0(cprt_parse_i64(neg_cases[i].str, &i64));
+        CPRT_ASSERT(i64 == neg_cases[i].i);
+      }
+      CPRT_ASSERT(cprt_parse_i64("-9223372036854775809", &i64) == -1 && errno == ERANGE);
+      CPRT_ASSERT(cprt_parse_u64("-1", &u64) == -1 && errno == ERANGE);
+      CPRT_EOK0(cprt_parse_u64("-0", &u64));
+      CPRT_EOK0(cprt_parse_u32("4294967295", &u32));
+      CPRT_ASSERT(u32 == 4294967295u);
+      CPRT_ASSERT(cprt_parse_u32("4294967296", &u32) == -1 && errno == ERANGE);
+      CPRT_EOK0(cprt_parse_i32("-2147483648", &i32));
+      CPRT_ASSERT(i32 == -2147483647 - 1);
+      CPRT_ASSERT(cprt_parse_i32("2147483648", &i32) == -1 && errno == ERANGE);
+      CPRT_EOK0(cprt_parse_u64_n("123456789012", 5, &u64));  /* No NUL needed. */
+      CPRT_ASSERT(u64 == 12345);
+
+      /* Compare with strtoull() on random digit strings of every length. */
+      r = 0x2545F4914F6CDD1Dull;
+      for (i = 0; i < 20000; i++) {
+        r ^= r << 13;
+        r ^= r >> 7;
+        r ^= r << 17;
+        len = 1 + (int)(r % 22);
+        for (j = 0; j < len; j++) {
+          str[j] = '0' + (char)((r >> (j * 2 % 60)) % 10);
+        }
+        if (i % 7 == 0 && len > 2) {
+          str[2 + (r >> 40) % (len - 2)] = 'x';  /* Sometimes malformed (but not "0x"). */
+        }
+        str[len] = '\0';
+        err = (cprt_parse_u64(str, &u64) == -1) ? errno : 0;
+        errno = 0;
+        u_vals[0] = strtoull(str, &end_ptr, 10);
+        if (*end_ptr != '\0') {
+          CPRT_ASSERT(err == EINVAL || (err == ERANGE && errno == ERANGE));
+        }
+        else if (errno == ERANGE) {
+          CPRT_ASSERT(err == ERANGE);
+        }
+        else {
+          CPRT_ASSERT(err == 0 && u64 == u_vals[0]);
+        }
+      }
+
+      /* Delimited fields, parsed in place. */
+      fields = "101,-2,0x1F,,4";
+      CPRT_ASSERT(cprt_parse_i64_fields(fields, strlen(fields), ',', i_vals, 8, &consumed) == -1);
+      CPRT_ASSERT(errno == EINVAL && consumed == 12);  /* The empty field. */
+      CPRT_ASSERT(cprt_parse_i64_fields(fields, 11, ',', i_vals, 8, &consumed) == 3);
+      CPRT_ASSERT(i_vals[0] == 101 && i_vals[1] == -2 && i_vals[2] == 31 && consumed == 11);
+      fields = "8|16|32|64|";
+      CPRT_ASSERT(cprt_parse_u64_fields(fields, strlen(fields), '|', u_vals, 2, &consumed) == 2);
+      CPRT_ASSERT(u_vals[0] == 8 && u_vals[1] == 16 && consumed == 5);
+      CPRT_ASSERT(cprt_parse_u64_fields(fields + consumed, strlen(fields) - consumed, '|',
+          u_vals, 8, &consumed) == 2);
+      CPRT_ASSERT(u_vals[0] == 32 && u_vals[1] == 64 && consumed == 6);
+
+      /* CPRT_ATOI sizes and signedness from the variable. */
+      CPRT_ATOI("-128", s8);
+      CPRT_ASSERT(s8 == -128);
+      CPRT_ATOI("0xff", u8);
+      CPRT_ASSERT(u8 == 255);
+      CPRT_ATOI(" -2147483648", i32);
+      CPRT_ASSERT(i32 == -2147483647 - 1);
+      CPRT_ATOI("18446744073709551615", u64);
+      CPRT_ASSERT(u64 == 18446744073709551615ull);
+      break;
+    }
+
+    case 26:
+    {
+      static const int64_t edge_vals[] = { 0, 1, 9, 10, 99, 100, 12345, -1, -10,
+        2147483647, -2147483647 - 1, 9223372036854775807ll, -9223372036854775807ll - 1 };
+      char buf[CPRT_FMT_TIME_SZ];
+      char ref[128];
+      char dump[128];
+      FILE *fp;
+      struct cprt_timespec start_ts, end_ts;
+      struct tm *tm;
+      time_t secs;
+      uint64_t r, ns, fmt_ns, snprintf_ns;
+      size_t len;
+      int i, width;
+      fprintf(stderr, "test %d: cprt_fmt\n", o_testnum);
+      fflush(stderr);
+
+      for (i = 0; i < (int)(sizeof(edge_vals) / sizeof(edge_vals[0])); i++) {
+        for (width = 0; width <= 22; width += 11) {
+          len = cprt_fmt_i64(buf, edge_vals[i], width);
+          snprintf(ref, sizeof(ref), "%0*"PRId64, width, edge_vals[i]);
+          CPRT_ASSERT(len == strlen(ref) && strcmp(buf, ref) == 0);
+          len = cprt_fmt_u64(buf, (uint64_t)edge_vals[i], width);
+          snprintf(ref, sizeof(ref), "%0*"PRIu64, width, (uint64_t)edge_vals[i]);
+          CPRT_ASSERT(len == strlen(ref) && strcmp(buf, ref) == 0);
+          len = cprt_fmt_hex(buf, (uint64_t)edge_vals[i], width);
+          snprintf(ref, sizeof(ref), "%0*"PRIx64, width, (uint64_t)edge_vals[i]);
+          CPRT_ASSERT(len == strlen(ref) && strcmp(buf, ref) == 0);
+        }
+      }
+
+      /* Random values of every magnitude, and random times. */
+      r = 0x2545F4914F6CDD1Dull;
+      for (i = 0; i < 20000; i++) {
+        r ^= r << 13;
+        r ^= r >> 7;
+        r ^= r << 17;
+        width = (int)(r % 24);
+        len = cprt_fmt_u64(buf, r >> (r % 64), width);
+        snprintf(ref, sizeof(ref), "%0*"PRIu64, width, r >> (r % 64));
+        CPRT_ASSERT(len == strlen(ref) && strcmp(buf, ref) == 0);
+
+        secs = (time_t)(r % 4102444800ull);  /* 1970 through 2099. */
+        tm = gmtime(&secs);
+        len = cprt_fmt_epoch_ns(buf, (uint64_t)secs * 1000000000 + 123456789, 6);
+        snprintf(ref, sizeof(ref), "%04d-%02d-%02dT%02d:%02d:%02d.123456Z", tm->tm_year + 1900, tm->tm_mon + 1,
+            tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
+        CPRT_ASSERT(len == strlen(ref) && strcmp(buf, ref) == 0);
+        len = cprt_fmt_tm(buf, tm, 5000000, (int)(r % 4), (int)(r & 1));
+        CPRT_ASSERT(len == strlen(buf));
+        CPRT_ASSERT(strncmp(buf, (r & 1) ? ref : &ref[11], 8) == 0);
+      }
+      len = cprt_fmt_epoch_ns(buf, 0, 0);
+      CPRT_ASSERT(strcmp(buf, "1970-01-01T00:00:00Z") == 0);
+      len = cprt_fmt_epoch_ns(buf, 951782400999999999ull, 9);  /* Leap day 2000. */
+      CPRT_ASSERT(strcmp(buf, "2000-02-29T00:00:00.999999999Z") == 0);
+      cprt_timestamp(buf, sizeof(buf), 1, 3);
+      CPRT_ASSERT(strlen(buf) == 23 && buf[4] == '-' && buf[10] == ' ' && buf[19] == '.');
+      cprt_timestamp(buf, 6, 0, 0);
+      CPRT_ASSERT(strlen(buf) == 5 && buf[2] == ':');  /* Truncated to bufsz. */
+
+      /* Compare speed with snprintf(). */
+      CPRT_GETTIME(&start_ts);
+      for (i = 0; i < 1000000; i++) {
+        cprt_fmt_u64(buf, (uint64_t)i * 1000003, 0);
+      }
+      CPRT_GETTIME(&end_ts);
+      CPRT_DIFF_TS(ns, end_ts, start_ts);
+      fmt_ns = ns;
+      CPRT_GETTIME(&start_ts);
+      for (i = 0; i < 1000000; i++) {
+        snprintf(buf, sizeof(buf), "%"PRIu64, (uint64_t)i * 1000003);
+      }
+      CPRT_GETTIME(&end_ts);
+      CPRT_DIFF_TS(ns, end_ts, start_ts);
+      snprintf_ns = ns;
+      printf("fmt: u64 %"PRIu64" ns/1000 calls, snprintf %"PRIu64" ns/1000 calls\n",
+          fmt_ns / 1000, snprintf_ns / 1000);
+
+      /* Newest event first, each with the original "%09d" formatting. */
+      cprt_num_events = 0;
+      cprt_event(-5);
+      cprt_event(42);
+      CPRT_ENULL(fp = tmpfile());
+      cprt_dump_events(fp);
+      rewind(fp);
+      len = fread(dump, 1, sizeof(dump) - 1, fp);
+      dump[len] = '\0';
+      fclose(fp);
+      snprintf(ref, sizeof(ref), "  cprt_event[%d] = %09d\n  cprt_event[%d] = %09d\n", 1, 42, 0, -5);
+      CPRT_ASSERT(strcmp(dump, ref) == 0);
+      CPRT_ASSERT(strcmp(dump, "  cprt_event[1] = 000000042\n  cprt_event[0] = -00000005\n") == 0);
+      break;
+    }
+
+    case 27:
+    {
+      cprt_hist_t *hist, *hist2, *whole;
+      CPRT_THREAD_T tids[4];
+      struct cprt_timespec start_ts, end_ts;
+      uint64_t r, v, p, ns;
+      int i;
+      fprintf(stderr, "test %d: cprt_hist\n", o_testnum);
+      fflush(stderr);
+
+      /* Every value lands in a bucket no wider than 1/2^precision of it. */
+      hist = cprt_hist_create(1000000000, 7);
+      r = 0x2545F4914F6CDD1Dull;
+      for (i = 0; i < 100000; i++) {
+        r ^= r << 13;
+        r ^= r >> 7;
+        r ^= r << 17;
+        v = (r >> (r % 64)) % 1000000001;
+        cprt_hist_reset(hist);
+        cprt_hist_record(hist, v);
+        p = cprt_hist_percentile(hist, 50);
+        CPRT_ASSERT(p == v);  /* Clamped to the exact min and max. */
+        cprt_hist_record(hist, v + 1);
+        p = cprt_hist_percentile(hist, 1);
+        CPRT_ASSERT(p >= v && p - v <= v / 128);
+      }
+
+      /* Percentiles of 1..100000. */
+      cprt_hist_reset(hist);
+      for (v = 1; v <= 100000; v++) {
+        cprt_hist_record(hist, v);
+      }
+      CPRT_ASSERT(cprt_hist_count(hist) == 100000);
+      CPRT_ASSERT(cprt_hist_min(hist) == 1 && cprt_hist_max(hist) == 100000);
+      CPRT_ASSERT(cprt_hist_mean(hist) == 50000.5);
+      p = cprt_hist_percentile(hist, 50);
+      CPRT_ASSERT(p >= 50000 && p <= 50000 + 50000 / 128);
+      p = cprt_hist_percentile(hist, 99);
+      CPRT_ASSERT(p >= 99000 && p <= 99000 + 99000 / 128);
+      CPRT_ASSERT(cprt_hist_percentile(hist, 100) == 100000);
+      CPRT_ASSERT(cprt_hist_percentile(hist, 0) == 1);
+
+      /* Values below 2^precision are exact. */
+      hist2 = cprt_hist_create(1000, 7);
+      for (v = 0; v < 100; v++) {
+        cprt_hist_record(hist2, v);
+      }
+      CPRT_ASSERT(cprt_hist_percentile(hist2, 50) == 49);
+      CPRT_ASSERT(cprt_hist_percentile(hist2, 90) == 89);
+      /* Beyond max_value: counted in the top bucket; max stays exact. */
+      cprt_hist_record(hist2, 5000);
+      CPRT_ASSERT(cprt_hist_count(hist2) == 101 && cprt_hist_max(hist2) == 5000);
+      CPRT_ASSERT(cprt_hist_percentile(hist2, 100) == 5000);
+      cprt_hist_delete(hist2);
+
+      /* Merging halves gives the whole; also across precisions. */
+      whole = cprt_hist_create(1000000000, 7);
+      hist2 = cprt_hist_create(1000000000, 7);
+      for (v = 1; v <= 100000; v++) {
+        cprt_hist_record((v & 1) ? whole : hist2, v);
+      }
+      cprt_hist_merge(whole, hist2);
+      CPRT_ASSERT(cprt_hist_count(whole) == 100000 && cprt_hist_mean(whole) == 50000.5);
+      CPRT_ASSERT(cprt_hist_percentile(whole, 99) == cprt_hist_percentile(hist, 99));
+      cprt_hist_delete(hist2);
+      hist2 = cprt_hist_create(1000000, 10);
+      cprt_hist_merge(hist2, whole);
+      CPRT_ASSERT(cprt_hist_count(hist2) == 100000);
+      CPRT_ASSERT(cprt_hist_min(hist2) == 1 && cprt_hist_max(hist2) == 100000);
+      p = cprt_hist_percentile(hist2, 99);
+      CPRT_ASSERT(p >= 99000 - 99000 / 128 && p <= 99000 + 99000 / 128);
+      cprt_hist_delete(hist2);
+      cprt_hist_delete(whole);
+      cprt_hist_print(hist, stdout, "hist: 1..100000");
+      cprt_hist_print_csv(hist, stdout);
+
+      /* Per-thread histograms, two at a time, merged on read. */
+      test_hist_mt = cprt_hist_mt_create(1000000000, 7);
+      test_hist_mt2 = cprt_hist_mt_create(1000000000, 7);
+      for (i = 0; i < 4; i++) {
+        CPRT_THREAD_CREATE(tids[i], thread_test_27, NULL);
+      }
+      for (i = 0; i < 4; i++) {
+        CPRT_THREAD_JOIN(tids[i]);
+      }
+      hist2 = cprt_hist_mt_snapshot(test_hist_mt);
+      CPRT_ASSERT(cprt_hist_count(hist2) == 400000 && cprt_hist_mean(hist2) == 50000.5);
+      CPRT_ASSERT(cprt_hist_percentile(hist2, 99) == cprt_hist_percentile(hist, 99));
+      cprt_hist_delete(hist2);
+      hist2 = cprt_hist_mt_snapshot(test_hist_mt2);
+      CPRT_ASSERT(cprt_hist_count(hist2) == 400000 && cprt_hist_max(hist2) == 1000000);
+      cprt_hist_delete(hist2);
+      cprt_hist_mt_delete(test_hist_mt);
+      cprt_hist_mt_delete(test_hist_mt2);
+
+      CPRT_GETTIME(&start_ts);
+      for (i = 0; i < 1000000; i++) {
+        cprt_hist_record(hist, (uint64_t)i * 1009);
+      }
+      CPRT_GETTIME(&end_ts);
+      CPRT_DIFF_TS(ns, end_ts, start_ts);
+      printf("hist: record %"PRIu64" ns/1000 calls\n", ns / 1000);
+      cprt_hist_delete(hist);
+      break;
+    }
+
+    case 28:
+    {
+      cprt_perf_t *perf;
+      struct cprt_perf_stats stats;
+      int loop_id, sleep_id, touch_id, i;
+      volatile uint64_t sum = 0;
+      char *mem;
+      fprintf(stderr, "test %d: cprt_perf\n", o_testnum);
+      fflush(stderr);
+
+      perf = cprt_perf_create(0);
+      /* Mode 0 (time only) is fine: perf_event_open() can be blocked
+       * entirely (seccomp in containers, perf_event_paranoid 3). */
+      printf("perf: mode=%d counters=%d\n", cprt_perf_mode(perf), cprt_perf_num_counters(perf));
+      if (cprt_perf_mode(perf) == CPRT_PERF_MODE_NONE) {
+        CPRT_ASSERT(cprt_perf_num_counters(perf) == 0);
+      }
+      loop_id = cprt_perf_region(perf, "loop");
+      sleep_id = cprt_perf_region(perf, "sleep");
+      touch_id = cprt_perf_region(perf, "touch");
+      CPRT_ASSERT(cprt_perf_region(perf, "loop") == loop_id);  /* Found, not added. */
+
+      for (i = 0; i < 100; i++) {
+        cprt_perf_begin(perf, loop_id);
+        for (sum = 0; sum < 10000; sum++) {
+        }
+        cprt_perf_end(perf, loop_id);
+      }
+      cprt_perf_begin(perf, sleep_id);
+      CPRT_SLEEP_MS(10);
+      cprt_perf_end(perf, sleep_id);
+      cprt_perf_begin(perf, touch_id);
+      CPRT_ENULL(mem = (char *)malloc(16 * 1024 * 1024));
+      memset(mem, 1, 16 * 1024 * 1024);
+      cprt_perf_end(perf, touch_id);
+      free(mem);
+      cprt_perf_print(perf, stdout);
+
+      cprt_perf_get_stats(perf, loop_id, &stats);
+      CPRT_ASSERT(stats.calls == 100 && stats.time_ns > 0);
+      CPRT_ASSERT(stats.num_counters == cprt_perf_num_counters(perf));
+      if (cprt_perf_mode(perf) != CPRT_PERF_MODE_NONE) {
+        /* A group that never got on the PMU falls back to software. */
+        CPRT_ASSERT(stats.time_running_ns > 0 && stats.time_running_ns <= stats.time_enabled_ns);
+      }
+      if (cprt_perf_mode(perf) == CPRT_PERF_MODE_HW) {
+        CPRT_ASSERT(strcmp(cprt_perf_counter_name(perf, 1), "instructions") == 0);
+        CPRT_ASSERT(stats.counters[1] >= 100 * 10000);  /* At least 1 per iteration. */
+      }
+      cprt_perf_get_stats(perf, sleep_id, &stats);
+      CPRT_ASSERT(stats.calls == 1 && stats.time_ns >= 9000000);
+      if (cprt_perf_mode(perf) == CPRT_PERF_MODE_SW) {
+        /* Sleeping switches out, but context_switches reads 0 when only
+         * user space may be counted (perf_event_paranoid >= 2), so only
+         * page faults are checked. */
+        cprt_perf_get_stats(perf, touch_id, &stats);
+        CPRT_ASSERT(stats.counters[2] >= 16 * 1024 * 1024 / (2 * 1024 * 1024));  /* Even with huge pages. */
+      }
+      cprt_perf_delete(perf);
+
+      perf = cprt_perf_create(CPRT_PERF_NO_HW);
+      CPRT_ASSERT(cprt_perf_mode(perf) != CPRT_PERF_MODE_HW);
+      if (cprt_perf_mode(perf) == CPRT_PERF_MODE_SW) {
+        CPRT_ASSERT(strcmp(cprt_perf_counter_name(perf, 0), "task_clock_ns") == 0);
+      }
+      cprt_perf_delete(perf);
+      break;
+    }
+
     default: /* CPRT_ABORT */
       fprintf(stderr, "Bad test number: %d\n", o_testnum);
       fflush(stderr);
@@ -12,9 +12,196 @@ ok() {
 }
 
 
+# Performance regression mode (-p): run cprt_bench several times, take the
+# median of each metric, and compare against this host's baseline.
+usage() {
+  echo "Usage: tst.sh [-p [-r runs] [-T threshold_pct] [-N min_ns] [-b baseline_file] [-o bench_opts] [-u]]" >&2
+  echo "  -p : performance regression mode instead of the functional tests" >&2
+  echo "  -r runs : cprt_bench runs to take the median of [5]" >&2
+  echo "  -T threshold_pct : fail when a metric gets this much slower [10]" >&2
+  echo "  -N min_ns : ... and at least this many ns slower [1]" >&2
+  echo "  -b baseline_file : [perf_baseline.\`hostname\`.json]" >&2
+  echo "  -o bench_opts : extra cprt_bench options, e.g. \"-c 2-3\"" >&2
+  echo "  -u : write the baseline from this run instead of comparing" >&2
+  exit 1
+}
+
+# awk function returning a field's value from a one-object-per-line JSON line.
+AWK_FIELD='
+    function field(line, key,   i, re, s) {
+      re = "\"" key "\": "
+      i = index(line, re)
+      if (i == 0) return ""
+      s = substr(line, i + length(re))
+      sub(/[,}].*/, "", s)
+      gsub(/"/, "", s)
+      return s
+    }
+    function str_field(line, key,   i, re, s, out, c) {  # String that may hold "," or \".
+      re = "\"" key "\": \""
+      i = index(line, re)
+      if (i == 0) return ""
+      s = substr(line, i + length(re))
+      out = ""
+      for (i = 1; i <= length(s); i++) {
+        c = substr(s, i, 1)
+        if (c == "\\") { out = out substr(s, i, 2); i++; continue }
+        if (c == "\"") break
+        out = out c
+      }
+      return out
+    }'
+
+# Reads cprt_bench JSON files; writes one line per benchmark and metric
+# with the median across runs and the spread ((max-min)/median).
+perf_summarize() {
+  PERF_BENCH_OPTS="$PERF_BENCH_OPTS" awk -v runs="$PERF_RUNS" -v host="$PERF_HOST" "$AWK_FIELD"'
+    BEGIN { num_metrics = split("p50 p99", metrics_1); for (m = 0; m < num_metrics; m++) metrics[m] = metrics_1[m + 1] }
+    /"name": / {
+      name = field($0, "name")
+      if (! (name in seen)) { seen[name] = 1; order[num_names++] = name }
+      for (m = 0; m < num_metrics; m++) {
+        k = name SUBSEP metrics[m]
+        vals[k, cnt[k]++] = field($0, metrics[m]) + 0
+      }
+    }
+    END {
+      opts = ENVIRON["PERF_BENCH_OPTS"]  # Not -v, which would eat backslashes.
+      gsub(/\\/, "\\\\\\\\", opts); gsub(/"/, "\\\"", opts)
+      printf("{\"tool\": \"tst.sh -p\", \"host\": \"%s\", \"runs\": %d, \"bench_opts\": \"%s\", \"results\": [", host, runs, opts)
+      sep = ""
+      for (i = 0; i < num_names; i++) {
+        for (m = 0; m < num_metrics; m++) {
+          k = order[i] SUBSEP metrics[m]
+          n = cnt[k]
+          for (a = 1; a < n; a++) {  # Insertion sort.
+            v = vals[k, a]
+            for (b = a - 1; b >= 0 && vals[k, b] > v; b--) vals[k, b + 1] = vals[k, b]
+            vals[k, b + 1] = v
+          }
+          med = (n % 2) ? vals[k, int(n / 2)] : (vals[k, n / 2 - 1] + vals[k, n / 2]) / 2
+          spread = (med > 0) ? (vals[k, n - 1] - vals[k, 0]) * 100 / med : 0
+          printf("%s\n    {\"name\": \"%s\", \"metric\": \"%s\", \"median\": %.1f, \"spread_pct\": %.1f}", sep, order[i], metrics[m], med, spread)
+          sep = ","
+        }
+      }
+      printf("\n]}\n")
+    }' "$@"
+}
+
+# Compares a summary against the baseline; prints a report, exits 1 on
+# regression or a missing metric, 2 if the cprt_bench options differ.
+# A change beyond the threshold but within the spread (the larger of the
+# baseline's and this run's) is reported as noisy and doesn't fail.
+perf_compare() {
+  awk -v thresh="$PERF_THRESH" -v min_ns="$PERF_MIN_NS" "$AWK_FIELD"'
+    FNR == 1 { file_num++ }
+    file_num == 1 && /"tool": / {
+      if (index($0, "\"bench_opts\": ") == 0) {
+        print "Baseline has no bench_opts (older tst.sh); rewrite it with -u"; bad_opts = 1; exit 2
+      }
+      base_opts = str_field($0, "bench_opts")
+    }
+    file_num == 1 && /"name": / {
+      k = field($0, "name") SUBSEP field($0, "metric")
+      base[k] = field($0, "median") + 0
+      base_spread[k] = field($0, "spread_pct") + 0
+      base_order[num_base++] = k
+    }
+    file_num == 2 && /"tool": / {
+      cur_opts = str_field($0, "bench_opts")
+      if (cur_opts != base_opts) {
+        printf("cprt_bench options differ: baseline \"%s\", this run \"%s\"; use the same -o or rewrite the baseline with -u\n", base_opts, cur_opts)
+        bad_opts = 1; exit 2
+      }
+      printf("%-22s %-6s %10s %10s %8s %8s  %s\n", "bench", "metric", "base_ns", "cur_ns", "delta%", "spread%", "status")
+    }
+    file_num == 2 && /"name": / {
+      name = field($0, "name"); metric = field($0, "metric")
+      cur = field($0, "median") + 0
+      spread = field($0, "spread_pct") + 0
+      if (! ((name, metric) in base)) {
+        printf("%-22s %-6s %10s %10.1f %8s %8.1f  %s\n", name, metric, "-", cur, "-", spread, "new")
+        next
+      }
+      seen[name, metric] = 1
+      b = base[name, metric]
+      if (base_spread[name, metric] > spread) spread = base_spread[name, metric]
+      delta = (b > 0) ? (cur - b) * 100 / b : 0
+      status = "ok"
+      if ((delta > thresh && cur - b >= min_ns) || (-delta > thresh && b - cur >= min_ns)) {
+        if ((delta < 0 ? -delta : delta) <= spread) { status = "noisy"; noisy++ }
+        else if (delta > 0) { status = "REGRESSED"; regressed++ }
+        else { status = "improved" }
+      }
+      printf("%-22s %-6s %10.1f %10.1f %+8.1f %8.1f  %s\n", name, metric, b, cur, delta, spread, status)
+    }
+    END {
+      if (bad_opts) exit 2
+      for (i = 0; i < num_base; i++) {
+        if (! (base_order[i] in seen)) {
+          split(base_order[i], nm, SUBSEP)
+          printf("%-22s %-6s %10.1f %10s %8s %8s  %s\n", nm[1], nm[2], base[base_order[i]], "-", "-", "-", "MISSING")
+          missing++
+        }
+      }
+      if (noisy > 0) printf("%d metric(s) changed more than %s%% but within their spread (noisy)\n", noisy, thresh)
+      if (missing > 0) printf("%d baseline metric(s) missing from this run\n", missing)
+      if (regressed > 0) printf("%d metric(s) regressed more than %s%%\n", regressed, thresh)
+      if (regressed > 0 || missing > 0) exit 1
+    }' "$1" "$2"
+}
+
+perf_mode() {
+  PERF_HOST=`hostname`
+  if [ -z "$PERF_BASELINE" ]; then PERF_BASELINE="perf_baseline.$PERF_HOST.json"; fi
+  if [ ! -x ./cprt_bench ]; then echo "cprt_bench not built; run bld.sh" >&2; exit 1; fi
+
+  I=1
+  while [ $I -le $PERF_RUNS ]; do
+    echo "cprt_bench run $I of $PERF_RUNS"
+    ./cprt_bench $PERF_BENCH_OPTS -j tst_perf.$I.json >/dev/null
+    if [ $? -ne 0 ]; then echo "FAIL: cprt_bench"; exit 1; fi
+    I=`expr $I + 1`
+  done
+  perf_summarize tst_perf.*.json >tst_perf.json
+  rm -f tst_perf.[0-9]*.json
+
+  if [ "$PERF_UPDATE" -eq 1 -o ! -f "$PERF_BASELINE" ]; then
+    mv tst_perf.json "$PERF_BASELINE"
+    echo "Wrote baseline $PERF_BASELINE"
+    exit 0
+  fi
+  echo "Comparing against $PERF_BASELINE (threshold $PERF_THRESH%, min $PERF_MIN_NS ns)"
+  perf_compare "$PERF_BASELINE" tst_perf.json
+  STATUS=$?
+  rm -f tst_perf.json
+  if [ $STATUS -eq 2 ]; then echo "FAIL: baseline not comparable"; exit 1; fi
+  if [ $STATUS -ne 0 ]; then echo "FAIL: performance regression"; exit 1; fi
+  echo "OK: no performance regression"
+  exit 0
+}
+
+PERF=0; PERF_RUNS=5; PERF_THRESH=10; PERF_MIN_NS=1; PERF_BASELINE=""; PERF_BENCH_OPTS=""; PERF_UPDATE=0
+while getopts "pr:T:N:b:o:u" OPT; do
+  case $OPT in
+    p) PERF=1 ;;
+    r) PERF_RUNS=$OPTARG ;;
+    T) PERF_THRESH=$OPTARG ;;
+    N) PERF_MIN_NS=$OPTARG ;;
+    b) PERF_BASELINE=$OPTARG ;;
+    o) PERF_BENCH_OPTS=$OPTARG ;;
+    u) PERF_UPDATE=1 ;;
+    *) usage ;;
+  esac
+done
+
+
 # Disable core files
 ulimit -c 0
 
+if [ $PERF -eq 1 ]; then perf_mode; fi
+
 
 ./cprt_test -t 0 >tst.tmp 2>&1
 if [ $? -ne 0 ]; then fail; fi
@@ -202,3 +389,160 @@ if egrep "^cprt_optopt='x', Use '-h' for help$" tst.tmp >/dev/null; then :; else
 egrep -v "cprt_optopt='x', Use '-h' for help|Error, 'x' not a defined option." tst.tmp >tst.tmp1
 if [ -s tst.tmp1 ]; then fail; fi
 ok
+
+./cprt_test -t 11 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test |^alloc_large: " tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+egrep "^alloc_large: " tst.tmp
+ok
+
+./cprt_test -t 12 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test |^cold faults: |^warm faults: |^stack faults: |^locked faults: |^cprt_lock_all failed" tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 13 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test |^affinity: " tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 14 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test |^online=|^cpu [0-9]*: " tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 15 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test |^worker [0-9]*: " tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 16 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test " tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 17 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test |^thread: |^stack faults: " tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 18 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test |^delta: |^tid: " tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 19 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test |^wait [a-z]*: " tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 20 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test " tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 21 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test |^evloop: " tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 22 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test |^zc: " tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 23 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test |^rx_ts: " tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 24 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test |^aio: " tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 25 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test " tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 26 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test |^fmt: |^cprt_num_events=2$" tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 27 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test |^hist: |^low,high,count,cumulative_pct$|^[0-9]+,[0-9]+,[0-9]+,[0-9.]+$" tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+./cprt_test -t 28 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^test |^perf: |^(loop|sleep|touch): calls=" tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+ok
+
+# Smoke test the network benchmark tool.
+for NB_OPTS in "-n 2000" "-p tcp -n 2000" "-b 16 -s 1000 -n 2000" "-r 20000 -n 2000" "-B -n 100 -w 10" "-b 256 -s 60000 -n 600 -w 0 -t 20" "-p tcp -b 256 -s 60000 -n 600 -w 0"; do
+  ./cprt_netbench $NB_OPTS >tst.tmp 2>&1
+  if [ $? -ne 0 ]; then fail; fi
+  egrep -v "^proto=|^loss: |^rtt_ns: |^throughput: " tst.tmp >tst.tmp1
+  if [ -s tst.tmp1 ]; then fail; fi
+  echo "OK: cprt_netbench $NB_OPTS"
+done
+
+# Smoke test the microbenchmark tool (table and JSON).
+./cprt_bench -s 200 -w 10 -j tst.json >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^bench |^[a-z_0-9]+ +[0-9]+ +[0-9]+ " tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+if [ `egrep -c '^    \{"name": ' tst.json` -ne 15 ]; then fail; fi
+rm -f tst.json
+echo "OK: cprt_bench"
+
+# Smoke test the core-to-core latency tool (same-CPU pair works anywhere).
+./cprt_c2clat -c 0 -d -s 200 -w 10 -o tst.csv >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^p50 round trip |^p99 round trip |^ +cpu +0$|^ +0 +[0-9.]+$" tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+if [ `egrep -c '^0,0,[0-9.]+,[0-9.]+,[0-9.]+$' tst.csv` -ne 1 ]; then fail; fi
+rm -f tst.csv
+echo "OK: cprt_c2clat"
+
+# Smoke test the clock checker; a limit it can't meet must fail.
+./cprt_clkchk -c 0 -n 10000 -d 50 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^clocksource: |^tsc_flags:|^cpu 0: reads=10000 backward=0 |^cpus: |^drift: |^result: PASS$" tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+./cprt_clkchk -c 0 -n 10000 -d 50 -C 0.001 >tst.tmp 2>&1
+if [ $? -ne 1 ]; then fail; fi
+if egrep -v "^FAIL: cost_ns " tst.tmp | egrep "^FAIL" >/dev/null; then fail; fi
+egrep "^result: FAIL$" tst.tmp >/dev/null || fail
+echo "OK: cprt_clkchk"
+
+# Smoke test the jitter detector; a 1 us gap limit must fail on any host.
+./cprt_jitter -c 0 -d 100 -k 3 >tst.tmp 2>&1
+if [ $? -ne 0 ]; then fail; fi
+egrep -v "^cpu 0: elapsed_ms=|^cpu 0: gap_ns [0-9]+-[0-9]+: [0-9]+$|^cpu 0: top [-0-9T:.]+Z gap_ns=[0-9]+$" tst.tmp >tst.tmp1
+if [ -s tst.tmp1 ]; then fail; fi
+./cprt_jitter -c 0 -d 100 -T 100 -M 1 >tst.tmp 2>&1
+if [ $? -ne 1 ]; then fail; fi
+egrep "^FAIL: cpu 0 max_gap_ns " tst.tmp >/dev/null || fail
+echo "OK: cprt_jitter"